@@ -0,0 +1,491 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Admission control --------------------------------------------------------------------------------------------- */
+
+/*
+* The main process admits the accepted clients before it forks them. -C caps the client processes and those of them
+* which are still connecting or handshaking. A client over the caps waits in the FIFO of -Q sockets for -Q seconds;
+* those who find the queue full or wait for too long are rejected at once without reading the request: Socks5 clients
+* get "no acceptable methods", HTTP ones "503 Service Unavailable", transparent ones are closed.
+*
+* Load is shed before the system limits are hit: a client is rejected when its descriptor gets close to RLIMIT_NOFILE
+* or the relay buffers of all the clients reach the -m limit, and waits while the client processes are close to
+* RLIMIT_NPROC. A failed accept() never stops the main process; out of descriptors, a reserved one is freed to accept
+* and reject the client, or the listener would stay readable forever.
+*
+* Sections cap their connecting and served clients with proxy_max_pending and proxy_max_clients. The counters live in
+* a shared table found by the section name, which INI-file reloads keep: the clients forked before a reload count on
+* in the entries of their sections. A client over the section caps takes a ticket and waits up to proxy_queue_timeout
+* seconds in a queue of proxy_queue clients; the tickets closest to the head compete for the free slots. A refused
+* client fails over to the next matching section, the last one replies Socks5 "general failure" or HTTP 503.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "utility.h"
+#include "network.h"
+#include "socks.h"
+#include "http.h"
+#include "health.h"
+#include "inifile.h"
+#include "bufpool.h"
+#include "logfile.h"
+#include "admit.h"
+
+
+typedef struct admit_entry {                                        /* A queued client */
+    int sock;
+    int lsock;                                                      /* The listener, to reject in its protocol */
+    struct sockaddr_storage caddr;
+    time_t until;                                                   /* Rejected after this time */
+} admit_entry;
+
+extern int Ssock, Hsock;
+
+static struct admit_state {                                         /* Main process */
+    unsigned int tunnels;                                           /* -C: client processes, 0: unlimited */
+    unsigned int pending;                                           /* -C: of them before the relay, 0: unlimited */
+    unsigned int queue;                                             /* -Q: waiting clients, 0: reject at once */
+    unsigned int wait;                                              /* -Q: seconds to wait */
+    long nofile;                                                    /* Descriptors less the reserve, 0: unlimited */
+    long nproc;                                                     /* Processes less the reserve, 0: unlimited */
+    int spare;                                                      /* Reserved descriptor for accept() failures */
+
+    admit_entry *q;                                                 /* The queue ring */
+    unsigned int head;
+    unsigned int queued;
+    unsigned int peak;
+
+    unsigned long waited;                                           /* Clients served from the queue */
+    unsigned long rejected;                                         /* The queue was full */
+    unsigned long expired;                                          /* Waited for too long */
+    unsigned long shed_fd;                                          /* Close to RLIMIT_NOFILE */
+    unsigned long shed_mem;                                         /* The relay buffers limit reached */
+    unsigned long failed;                                           /* accept() errors */
+} adm = {.spare = -1};
+
+static unsigned int *adm_pending = NULL;        /* Shared: clients before their relay, decremented by the clients */
+static section_load *adm_load = NULL;           /* Shared: ADMIT_SECTIONS client counters of the sections by name */
+
+static pid_t adm_pid;                                               /* Client: the process counted in adm_pending */
+static int adm_counted;                                             /* ...until its relay starts */
+static section_load *adm_held;                                      /* Client: the section connecting slot */
+static section_load *adm_waiting;                                   /* Client: the section queue ticket */
+
+/* -- Main process -------------------------------------------------------------------------------------------------- */
+void admit_init(unsigned int tunnels, unsigned int pending, unsigned int queue, unsigned int wait) {
+    /* Set the limits less the reserves, allocate the queue and map the shared counters; called once by the main
+    process */
+
+    struct rlimit rl;
+
+    adm.tunnels = tunnels;
+    adm.pending = pending;
+    adm.queue = queue;
+    adm.wait = wait;
+
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY)
+        adm.nofile = rl.rlim_cur > 2 * ADMIT_FD_RESERVE ? rl.rlim_cur - ADMIT_FD_RESERVE : rl.rlim_cur / 2;
+    if (!getrlimit(RLIMIT_NPROC, &rl) && rl.rlim_cur != RLIM_INFINITY)
+        adm.nproc = rl.rlim_cur > 2 * ADMIT_PROC_RESERVE ? rl.rlim_cur - ADMIT_PROC_RESERVE : rl.rlim_cur / 2;
+
+    if ((adm.spare = open("/dev/null", O_RDONLY)) == -1)
+        printl(LOG_WARN, "Unable to reserve a descriptor for accept() failures");
+
+    if (adm.queue && !(adm.q = calloc(adm.queue, sizeof(admit_entry)))) {
+        printl(LOG_WARN, "Unable to allocate the admission queue, clients over the limits will be rejected");
+        adm.queue = 0;
+    }
+
+    adm_pending = mmap(NULL, sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (adm_pending == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map the handshakes counter, they will not be limited");
+        adm_pending = NULL;
+    }
+
+    /* Mapped for good: INI-file reloads bind the sections to the entries by their names */
+    adm_load = mmap(NULL, ADMIT_SECTIONS * sizeof(section_load), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (adm_load == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map the section client counters, section limits will not be applied");
+        adm_load = NULL;
+    }
+
+    printl(LOG_INFO, "Admission limits: Clients: [%u] Pending: [%u] Queue: [%u] Wait: [%u] s "
+        "Descriptors: [%ld] Processes: [%ld]", adm.tunnels, adm.pending, adm.queue, adm.wait, adm.nofile, adm.nproc);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_bind(struct ini_section *ini) {
+    /* Bind the sections to their client counters by the section names, after each INI-file (re)load. A section keeps
+    the entry of its name, so the clients forked before a reload count in the same one. The entries of the removed
+    sections are reused when their clients are gone */
+
+    struct ini_section *s;
+    section_load *l, *f;
+    int i;
+
+    if (!adm_load) return;
+
+    for (i = 0; i < ADMIT_SECTIONS; i++) adm_load[i].bound = 0;
+
+    for (s = ini; s; s = s->next) {
+        s->load = NULL;
+        for (f = NULL, i = 0; i < ADMIT_SECTIONS; i++) {
+            l = &adm_load[i];
+            if (l->name[0] && !strcmp(l->name, s->section_name)) break;
+            if (!f && (!l->name[0] || (!l->bound && !__atomic_load_n(&l->active, __ATOMIC_RELAXED) &&
+                !__atomic_load_n(&l->pending, __ATOMIC_RELAXED) && !__atomic_load_n(&l->queued, __ATOMIC_RELAXED))))
+                f = l;
+        }
+
+        if (i == ADMIT_SECTIONS) {
+            if (!(l = f)) {
+                printl(LOG_WARN, "Section: [%s] has no client counters left, its limits will not be applied",
+                    s->section_name);
+                continue;
+            }
+            memset(l, 0, sizeof(section_load));
+            strncpy(l->name, s->section_name, sizeof(l->name) - 1);
+        }
+
+        l->bound = 1;
+        s->load = l;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int admit_free(int clients) {
+    /* Return 1 if a new client process may start now */
+
+    return (!adm.tunnels || clients < adm.tunnels) && (!adm.nproc || clients < adm.nproc) &&
+        (!adm.pending || !adm_pending || __atomic_load_n(adm_pending, __ATOMIC_RELAXED) < adm.pending);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_reject(int sock, int lsock) {
+    /* Reject the client in the protocol of its listener and close it; the request is not read */
+
+    s5_reply_hello rep = {PROXY_PROTO_SOCKS_V5 - '0', AUTH_METHOD_NOACCEPT};
+    char buf[BUF_SIZE_1KB];
+
+    if (lsock == Ssock)
+        send(sock, &rep, sizeof rep, MSG_DONTWAIT);
+    else if (lsock == Hsock)
+        http_server_reply(sock, HTTP_RESPONSE_503);
+
+    /* Unread data makes close() reset the connection, the client may lose the reply */
+    recv(sock, buf, sizeof buf, MSG_DONTWAIT);
+    close(sock);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int admit_client(int sock, int lsock, struct sockaddr_storage *caddr, int clients) {
+    /* Admit the accepted client; Return 0 to serve it now, 1 if it is queued or -1 if it is rejected and closed */
+
+    char buf[STR_SIZE];
+    admit_entry *e;
+
+    /* Shed the load before the main process runs out of descriptors or the clients out of relay memory */
+    if (adm.nofile && sock >= adm.nofile) {
+        adm.shed_fd++;
+        printl(LOG_WARN, "Client: [%s] rejected, descriptor: [%d] is close to the limit", inet2str(caddr, buf), sock);
+        admit_reject(sock, lsock);
+        return -1;
+    }
+
+    if (bpool_full()) {
+        adm.shed_mem++;
+        printl(LOG_WARN, "Client: [%s] rejected, relay buffers reached the memory limit", inet2str(caddr, buf));
+        admit_reject(sock, lsock);
+        return -1;
+    }
+
+    if (!adm.queued && admit_free(clients)) return 0;
+
+    if (adm.queued == adm.queue) {
+        adm.rejected++;
+        printl(LOG_WARN, "Client: [%s] rejected, the admission queue is full", inet2str(caddr, buf));
+        admit_reject(sock, lsock);
+        return -1;
+    }
+
+    e = &adm.q[(adm.head + adm.queued++) % adm.queue];
+    e->sock = sock;
+    e->lsock = lsock;
+    e->caddr = *caddr;
+    e->until = time(NULL) + adm.wait;
+    adm.peak = MAX(adm.peak, adm.queued);
+    printl(LOG_INFO, "Client: [%s] queued for admission, waiting: [%u]", inet2str(caddr, buf), adm.queued);
+
+    return 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int admit_next(int clients, int *lsock, struct sockaddr_storage *caddr) {
+    /* Reject the queued clients that waited for too long and take the queue head if a slot is free; Return its socket
+    or -1 */
+
+    char buf[STR_SIZE];
+    admit_entry *e;
+    time_t now;
+
+    if (!adm.queued) return -1;
+
+    /* All the clients wait the same time, the head expires first */
+    now = time(NULL);
+    while (adm.queued && now > (e = &adm.q[adm.head])->until) {
+        adm.expired++;
+        printl(LOG_WARN, "Client: [%s] rejected after waiting: [%u] seconds for admission",
+            inet2str(&e->caddr, buf), adm.wait);
+        admit_reject(e->sock, e->lsock);
+        adm.head = (adm.head + 1) % adm.queue;
+        adm.queued--;
+    }
+
+    if (!adm.queued || !admit_free(clients)) return -1;
+
+    e = &adm.q[adm.head];
+    adm.head = (adm.head + 1) % adm.queue;
+    adm.queued--;
+    adm.waited++;
+    *lsock = e->lsock;
+    *caddr = e->caddr;
+
+    return e->sock;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_accept_failed(int lsock, int err) {
+    /* Keep serving after a failed accept(). Out of descriptors, the reserved one is freed to accept and reject the
+    client; on other errors back off a little, the listener stays readable */
+
+    int sock;
+
+    if (err == EAGAIN || err == EWOULDBLOCK || err == EINTR || err == ECONNABORTED) return;   /* The client is gone */
+
+    adm.failed++;
+    printl(LOG_WARN, "Error accepting incoming connection: [%s]", strerror(err));
+
+    if ((err == EMFILE || err == ENFILE) && adm.spare != -1) {
+        close(adm.spare);
+        if ((sock = accept(lsock, NULL, NULL)) != -1) admit_reject(sock, lsock);
+        adm.spare = open("/dev/null", O_RDONLY);
+    } else
+        usleep(ADMIT_POLL_MS * 1000);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_pending(int delta) {
+    /* Count a client process before its relay starts: +1 before fork(), -1 if it failed */
+
+    if (adm_pending) __atomic_add_fetch(adm_pending, delta, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_idle(int clients) {
+    /* With no client processes left nobody connects or is served: reset the counters which clients killed without
+    exit() could not give back */
+
+    section_load *l;
+
+    if (clients) return;
+
+    if (adm_pending) __atomic_store_n(adm_pending, 0, __ATOMIC_RELAXED);
+    if (adm_load)
+        for (l = adm_load; l < adm_load + ADMIT_SECTIONS; l++) {
+            __atomic_store_n(&l->active, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&l->pending, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&l->queued, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&l->served, __atomic_load_n(&l->ticket, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_close(void) {
+    /* Close the queued clients in a process forked by the main one: the main process serves or rejects them */
+
+    unsigned int i;
+
+    for (i = 0; i < adm.queued; i++) close(adm.q[(adm.head + i) % adm.queue].sock);
+    adm.queued = 0;
+    if (adm.spare != -1) close(adm.spare);
+    adm.spare = -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_show(int loglvl) {
+    /* Display the admission limits and counters of the main process */
+
+    printl(loglvl, "SHOW Admission: Clients limit: [%u] Pending: [%u] of [%u] Queue: [%u] of [%u] peak: [%u] Wait: [%u] s",
+        adm.tunnels, adm_pending ? *adm_pending : 0, adm.pending, adm.queued, adm.queue, adm.peak, adm.wait);
+    printl(loglvl, "SHOW Admission: Waited: [%lu] Rejected: [%lu] Expired: [%lu] Shed on descriptors: [%lu] "
+        "memory: [%lu] Accept errors: [%lu]", adm.waited, adm.rejected, adm.expired, adm.shed_fd, adm.shed_mem,
+        adm.failed);
+}
+
+/* -- Clients ------------------------------------------------------------------------------------------------------- */
+static void admit_exit(void) {
+    /* atexit() processor: give back what the client process holds. Forked racers inherit it, they hold nothing */
+
+    if (getpid() != adm_pid) return;
+
+    if (adm_waiting) {
+        __atomic_add_fetch(&adm_waiting->served, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&adm_waiting->queued, 1, __ATOMIC_RELAXED);
+        adm_waiting = NULL;
+    }
+    admit_release();
+    admit_ready();
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_child(void) {
+    /* The client process starts: close the queue of the main process and count the client before its relay until
+    admit_ready() or the exit */
+
+    admit_close();
+    adm_pid = getpid();
+    adm_counted = 1;                                                /* By the main process before fork() */
+    atexit(admit_exit);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_ready(void) {
+    /* The client relay starts, it is not pending any more. Signal-safe */
+
+    if (!adm_counted || getpid() != adm_pid) return;
+
+    admit_pending(-1);
+    adm_counted = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int admit_slots(struct ini_section *s) {
+    /* Return how many more clients the section limits let through now */
+
+    section_load *l = s->load;
+    unsigned int p = __atomic_load_n(&l->pending, __ATOMIC_RELAXED);
+    int n = INT_MAX;
+
+    if (s->proxy_max_pending) n = MIN(n, (int)s->proxy_max_pending - (int)p);
+    if (s->proxy_max_clients)
+        n = MIN(n, (int)s->proxy_max_clients - (int)(p + __atomic_load_n(&l->active, __ATOMIC_RELAXED)));
+
+    return n;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int admit_claim(struct ini_section *s) {
+    /* Take a connecting slot of the section if its limits let the client through; Return 1 if it is taken */
+
+    section_load *l = s->load;
+    unsigned int p = __atomic_load_n(&l->pending, __ATOMIC_RELAXED);
+
+    do {
+        if ((s->proxy_max_pending && p >= s->proxy_max_pending) ||
+            (s->proxy_max_clients && p + __atomic_load_n(&l->active, __ATOMIC_RELAXED) >= s->proxy_max_clients))
+            return 0;
+    } while (!__atomic_compare_exchange_n(&l->pending, &p, p + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    adm_held = l;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static long long admit_now(void) {
+    /* Return monotonic milliseconds */
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int admit_section(struct ini_section *s) {
+    /* Claim a connecting slot of the section for the client, waiting in the section queue if the limits are reached;
+    Return 0 or -1 if the client is refused */
+
+    section_load *l = s->load;
+    unsigned int t;
+    long long until;
+
+    admit_release();                                                /* The slot of a failed section */
+    if (!l || (!s->proxy_max_clients && !s->proxy_max_pending)) return 0;
+
+    /* Nobody waits: take a free slot at once */
+    if (!__atomic_load_n(&l->queued, __ATOMIC_RELAXED) && admit_claim(s)) return 0;
+
+    if (__atomic_add_fetch(&l->queued, 1, __ATOMIC_RELAXED) > s->proxy_queue) {
+        __atomic_sub_fetch(&l->queued, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&l->refused, 1, __ATOMIC_RELAXED);
+        printl(LOG_WARN, "Section: [%s] refused the client, its limits are reached", s->section_name);
+        return -1;
+    }
+
+    adm_waiting = l;
+    t = __atomic_fetch_add(&l->ticket, 1, __ATOMIC_RELAXED);
+    until = admit_now() + s->proxy_queue_timeout * 1000LL;
+    printl(LOG_INFO, "Section: [%s] limits are reached, the client waits in the queue", s->section_name);
+
+    /* Tickets given up move the head too, so a waiter may count fewer clients before it than there are: the claim
+    still never exceeds the limits */
+    while ((int)(t - __atomic_load_n(&l->served, __ATOMIC_RELAXED)) >= admit_slots(s) || !admit_claim(s)) {
+        if (admit_now() >= until) {
+            __atomic_add_fetch(&l->refused, 1, __ATOMIC_RELAXED);
+            printl(LOG_WARN, "Section: [%s] refused the client after: [%u] seconds in the queue",
+                s->section_name, s->proxy_queue_timeout);
+            break;
+        }
+        usleep(ADMIT_POLL_MS * 1000);
+    }
+
+    __atomic_add_fetch(&l->served, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&l->queued, 1, __ATOMIC_RELAXED);
+    adm_waiting = NULL;
+
+    return adm_held ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void admit_release(void) {
+    /* Give back the connecting slot: the client is served by the section now or it failed. Signal-safe */
+
+    if (!adm_held || getpid() != adm_pid) return;
+
+    __atomic_sub_fetch(&adm_held->pending, 1, __ATOMIC_RELAXED);
+    adm_held = NULL;
+}
@@ -0,0 +1,69 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <sys/socket.h>
+
+/* -- Admission control: concurrency limits, the queue and load shedding -------------------------------------------- */
+#define ADMIT_QUEUE_DEFAULT     128                 /* -Q: accepted clients waiting for a free slot */
+#define ADMIT_QUEUE_MAX         4096
+#define ADMIT_WAIT_DEFAULT      5                   /* Seconds a queued client waits before it is rejected */
+#define ADMIT_FD_RESERVE        64                  /* Descriptors below RLIMIT_NOFILE kept for the main process */
+#define ADMIT_PROC_RESERVE      16                  /* Processes below RLIMIT_NPROC kept for brokers and racers */
+#define ADMIT_POLL_MS           10                  /* Section queue polls and accept() error back-off */
+#define ADMIT_SECTIONS          1024                /* Sections whose clients are counted, removed ones included */
+
+typedef struct section_load {                       /* Shared memory: clients of a section found by its name */
+    char name[STR_SIZE];                            /* Empty: a free entry */
+    int bound;                                      /* Main process: a section of the current INI-file uses it */
+
+    /* Updated by the clients with __atomic builtins */
+    unsigned int active;                            /* Clients served by the section now */
+    unsigned int pending;                           /* Clients connecting or handshaking with the section now */
+    unsigned int queued;                            /* Clients waiting for the section limits now */
+    unsigned int ticket;                            /* Queue: the next ticket to take */
+    unsigned int served;                            /* Queue: tickets admitted or given up */
+    unsigned long refused;                          /* Clients refused by the section limits */
+} section_load;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+struct ini_section;
+
+void admit_init(unsigned int tunnels, unsigned int pending, unsigned int queue, unsigned int wait);
+void admit_bind(struct ini_section *ini);
+int admit_client(int sock, int lsock, struct sockaddr_storage *caddr, int clients);
+int admit_next(int clients, int *lsock, struct sockaddr_storage *caddr);
+void admit_accept_failed(int lsock, int err);
+void admit_reject(int sock, int lsock);
+void admit_pending(int delta);
+void admit_idle(int clients);
+void admit_close(void);
+void admit_show(int loglvl);
+
+void admit_child(void);
+void admit_ready(void);
+int admit_section(struct ini_section *s);
+void admit_release(void);
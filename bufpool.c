@@ -0,0 +1,258 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Relay buffer pool --------------------------------------------------------------------------------------------- */
+
+/*
+* Relay buffers come in power of two size classes. A tunnel starts with the smallest one and grows while its reads
+* fill the buffer, idle tunnels give the buffers back. A client process keeps BPOOL_KEEP released buffers per class
+* to grow and shrink without malloc() churn; anything else returns to the allocator.
+*
+* A fresh client process has nothing kept yet, so the main process allocates BPOOL_KEEP smallest buffers before the
+* first fork(): every client inherits them and starts its tunnel without malloc(). Inherited buffers are accounted by
+* the client taking them.
+*
+* Bytes held by all the clients are accounted in shared memory mapped by the main process. Above the limit only the
+* smallest class is granted, so every tunnel still works, but none of them grows. Socket buffers the relay raises
+* above the kernel defaults are accounted against the same limit.
+*/
+
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "logfile.h"
+#include "bufpool.h"
+
+
+struct bpool_stats {
+    size_t limit;                                                   /* Bytes all the clients may hold */
+    size_t used;                                                    /* Bytes held, including kept buffers */
+    size_t peak;
+    unsigned long denied;                                           /* Grows refused by the limit */
+    unsigned long buffers[BPOOL_CLASSES + 1];                       /* Held per class, the last one: larger */
+    size_t sock;                                                    /* Socket buffer bytes raised by the relays */
+    unsigned long sock_denied;                                      /* Socket buffer raises refused */
+    unsigned long allocs;                                           /* Buffers got by the clients */
+    unsigned long inherited;                                        /* of them kept by the main process */
+    unsigned long mallocs;                                          /* and allocated */
+};
+
+static struct bpool_stats *bp_stats = NULL;                         /* Shared by the clients */
+static char *bp_kept[BPOOL_CLASSES][BPOOL_KEEP];                    /* Per process released buffers */
+static int bp_nkept[BPOOL_CLASSES];
+static int bp_inherited;                                            /* The first kept smallest ones came by fork() */
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void bpool_init(size_t limit) {
+    /* Map the shared accounting; called once by the main process */
+
+    if (bp_stats) return;
+
+    bp_stats = mmap(NULL, sizeof(struct bpool_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (bp_stats == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map relay buffer pool accounting, buffers will not be limited");
+        bp_stats = NULL;
+        return;
+    }
+    bp_stats->limit = limit;
+
+    /* Not accounted here: the main process never relays */
+    while (bp_nkept[0] < BPOOL_KEEP && (bp_kept[0][bp_nkept[0]] = malloc(BPOOL_CLASS_MIN))) bp_nkept[0]++;
+    bp_inherited = bp_nkept[0];
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int bpool_class(size_t *size) {
+    /* Round the size up to its class; Return the class index or BPOOL_CLASSES for larger sizes */
+
+    int c = 0;
+    size_t s = BPOOL_CLASS_MIN;
+
+    if (*size > BPOOL_CLASS_MAX) return BPOOL_CLASSES;
+
+    while (s < *size) {
+        s <<= 1;
+        c++;
+    }
+    *size = s;
+    return c;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+char *bpool_get(size_t size) {
+    /* Get a buffer of at least size bytes; Return NULL when the limit refuses a buffer above the smallest class or
+    on allocation failure */
+
+    char *b;
+    size_t u, p;
+    int c = bpool_class(&size);
+
+    if (c < BPOOL_CLASSES && bp_nkept[c]) {
+        b = bp_kept[c][--bp_nkept[c]];
+        if (!bp_stats) return b;
+
+        __atomic_add_fetch(&bp_stats->allocs, 1, __ATOMIC_RELAXED);
+        if (c || bp_nkept[c] >= bp_inherited) return b;             /* Accounted while kept */
+
+        bp_inherited--;
+        __atomic_add_fetch(&bp_stats->inherited, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bp_stats->buffers[c], 1, __ATOMIC_RELAXED);
+        u = __atomic_add_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+        p = __atomic_load_n(&bp_stats->peak, __ATOMIC_RELAXED);
+        while (u > p && !__atomic_compare_exchange_n(&bp_stats->peak, &p, u, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+        return b;
+    }
+
+    if (bp_stats) {
+        u = __atomic_add_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+        /* Raised socket buffers share the limit */
+        if (u + __atomic_load_n(&bp_stats->sock, __ATOMIC_RELAXED) > bp_stats->limit && size > BPOOL_CLASS_MIN) {
+            __atomic_sub_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&bp_stats->denied, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        p = __atomic_load_n(&bp_stats->peak, __ATOMIC_RELAXED);
+        while (u > p && !__atomic_compare_exchange_n(&bp_stats->peak, &p, u, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+    }
+
+    if (!(b = malloc(size))) {
+        printl(LOG_CRIT, "Unable to allocate a relay buffer: [%zu] bytes", size);
+        if (bp_stats) __atomic_sub_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    if (bp_stats) {
+        __atomic_add_fetch(&bp_stats->buffers[c], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bp_stats->allocs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bp_stats->mallocs, 1, __ATOMIC_RELAXED);
+    }
+    return b;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void bpool_put(char *buf, size_t size) {
+    /* Release a buffer got for the size: keep it for reuse by the process or free it */
+
+    int c;
+
+    if (!buf) return;
+
+    if ((c = bpool_class(&size)) < BPOOL_CLASSES && bp_nkept[c] < BPOOL_KEEP) {
+        bp_kept[c][bp_nkept[c]++] = buf;                            /* Stays accounted */
+        return;
+    }
+
+    if (bp_stats) {
+        __atomic_sub_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&bp_stats->buffers[c], 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void bpool_leave(char *buf, size_t size) {
+    /* Stop accounting a buffer the kernel may still read, e.g. by a zero-copy send: freeing it would let malloc()
+    write into the data in flight, so the memory is left to the process exit */
+
+    int c;
+
+    if (!buf) return;
+
+    c = bpool_class(&size);
+    if (bp_stats) {
+        __atomic_sub_fetch(&bp_stats->used, size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&bp_stats->buffers[c], 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void bpool_drain(void) {
+    /* Free the buffers kept by the process, e.g. when its tunnel is finished */
+
+    int c;
+
+    for (c = 0; c < BPOOL_CLASSES; c++)
+        while (bp_nkept[c]) {
+            free(bp_kept[c][--bp_nkept[c]]);
+            if (!c && bp_nkept[c] < bp_inherited) {                     /* Never taken, never accounted */
+                bp_inherited--;
+                continue;
+            }
+            if (bp_stats) {
+                __atomic_sub_fetch(&bp_stats->used, BPOOL_CLASS_MIN << c, __ATOMIC_RELAXED);
+                __atomic_sub_fetch(&bp_stats->buffers[c], 1, __ATOMIC_RELAXED);
+            }
+        }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void bpool_show(int loglvl) {
+    /* Display the relay buffer memory of all the clients */
+
+    if (!bp_stats) return;
+
+    printl(loglvl, "SHOW Relay buffers: [%zu] of [%zu] bytes, peak: [%zu], grows denied: [%lu]",
+        bp_stats->used, bp_stats->limit, bp_stats->peak, bp_stats->denied);
+    printl(loglvl, "SHOW Relay buffers per class: 4K: [%lu] 8K: [%lu] 16K: [%lu] 32K: [%lu] 64K: [%lu] 128K: [%lu] "
+        "256K: [%lu] Larger: [%lu]", bp_stats->buffers[0], bp_stats->buffers[1], bp_stats->buffers[2],
+        bp_stats->buffers[3], bp_stats->buffers[4], bp_stats->buffers[5], bp_stats->buffers[6], bp_stats->buffers[7]);
+    printl(loglvl, "SHOW Socket buffers raised: [%zu] bytes, raises denied: [%lu]",
+        bp_stats->sock, bp_stats->sock_denied);
+    printl(loglvl, "SHOW Relay buffers allocations: [%lu], inherited: [%lu], mallocs: [%lu]",
+        bp_stats->allocs, bp_stats->inherited, bp_stats->mallocs);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int bpool_full(void) {
+    /* Return 1 if the relay and raised socket buffers of all the clients reached the limit */
+
+    return bp_stats && __atomic_load_n(&bp_stats->used, __ATOMIC_RELAXED) +
+        __atomic_load_n(&bp_stats->sock, __ATOMIC_RELAXED) >= bp_stats->limit;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int bpool_sock(long delta) {
+    /* Account socket buffer bytes raised (delta > 0) or given back (delta < 0) by a relay; Return 0 or -1 if the
+    limit refuses the raise */
+
+    if (!bp_stats || !delta) return 0;
+
+    if (delta < 0) {
+        __atomic_sub_fetch(&bp_stats->sock, -delta, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (__atomic_add_fetch(&bp_stats->sock, delta, __ATOMIC_RELAXED) +
+        __atomic_load_n(&bp_stats->used, __ATOMIC_RELAXED) > bp_stats->limit) {
+
+        __atomic_sub_fetch(&bp_stats->sock, delta, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&bp_stats->sock_denied, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,47 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stddef.h>
+
+/* -- Relay buffer pool --------------------------------------------------------------------------------------------- */
+#define BPOOL_CLASS_MIN         4096                /* Size classes: 4K, 8K ... 256K */
+#define BPOOL_CLASS_MAX         (256 * 1024)        /* Larger buffers are allocated as is and never kept */
+#define BPOOL_CLASSES           7
+#define BPOOL_KEEP              1                   /* Released buffers a process keeps per class for reuse */
+
+#define BPOOL_LIMIT_DEFAULT     (256 * 1024 * 1024) /* Relay buffers of all the clients, bytes */
+#define BPOOL_LIMIT_MIN         (1024 * 1024)
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+void bpool_init(size_t limit);
+char *bpool_get(size_t size);
+void bpool_put(char *buf, size_t size);
+void bpool_leave(char *buf, size_t size);
+void bpool_drain(void);
+void bpool_show(int loglvl);
+int bpool_full(void);
+int bpool_sock(long delta);
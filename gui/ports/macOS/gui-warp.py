@@ -204,9 +204,9 @@ class App:
         self.act_after_id = None
         btn_act['command'] = lambda: self.toggle_act_refresh(btn_act, tree_act)
 
-        cols_act = ('Time', 'PID', 'Status', 'Section', 'Client', 'Client bytes', 'Target', 'Target bytes')
+        cols_act = ('Time', 'PID', 'Status', 'Section', 'Client', 'Client bytes', 'Target', 'Target bytes', 'MPTCP')
         tree_act = ttk.Treeview(tab_act, columns=cols_act, show='headings')
-        self.tree_rows = [tree_act.insert('', 'end', values=('', '', '', '', '', '', '', '')) for _ in range(1000)]
+        self.tree_rows = [tree_act.insert('', 'end', values=('', '', '', '', '', '', '', '', '')) for _ in range(1000)]
 
         for col in cols_act:
             tree_act.heading(col, text=col)
@@ -328,7 +328,7 @@ It is a free and open-source software, but if you want to support it, please do'
                 if i < len(new_rows):
                     t_widget.item(self.tree_rows[i], values=tuple(new_rows[i]))
                 else:
-                    t_widget.item(self.tree_rows[i], values=('', '', '', '', '', '', '', ''))
+                    t_widget.item(self.tree_rows[i], values=('', '', '', '', '', '', '', '', ''))
 
         if refresh and not self.pause_act:
             self.act_after_id = self.root.after(5000, self.read_file_tree, t_widget, True)
@@ -0,0 +1,1229 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2024-2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- HTTP/2 CONNECT multiplexing: many tunnels over a few upstream proxy connections ------------------------------- */
+
+/*
+* Each opt-in proxy section gets a broker process forked by the main daemon. Client processes pass one end of a socket
+* pair to the broker through the section control socket, together with the destination authority. The broker maps the
+* socket pair to a CONNECT stream (RFC 9113, 8.5) on one of its upstream connections, writes a single byte reply:
+* H2_REPLY_OK or H2_REPLY_KO and then relays the stream, so the client process sees a plain connected socket.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if (WITH_LIBSSL)
+    #include <openssl/err.h>
+#endif
+
+#include "utility.h"
+#include "network.h"
+#include "http.h"
+#include "tls.h"
+#include "h2.h"
+#include "admit.h"
+#include "inifile.h"
+
+#include "logfile.h"
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+extern pid_t pid, mpid;
+extern int Tsock, Ssock, Hsock;
+
+static struct ini_section *h2_proxy;                                    /* Broker: the section it serves */
+static h2_conn *h2_conns;                                               /* Broker: upstream connections */
+static h2_stream *h2_streams;                                           /* Broker: streams in the arrival order */
+static volatile sig_atomic_t h2_drain, h2_quit;
+
+static unsigned char h2_hauth[BUF_SIZE_1KB * 2];                       /* Broker: precompiled proxy-authorization */
+static size_t h2_hauth_len;
+
+static pid_t h2_drained[64];                                            /* Master: brokers left after SIGHUP */
+
+static const int h2_static_status[] = {200, 204, 206, 304, 400, 404, 500};  /* HPACK static table: 8 - 14 */
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int h2_client_request(struct ini_section *proxy, struct sockaddr_storage *daddr, char *dname) {
+    /* Ask the section broker for a CONNECT stream to dname or daddr; Return a socket connected to the stream or -1 */
+
+    int sv[2];
+    char authority[H2_AUTHORITY_MAX] = {0};
+    char ip[INET6_ADDRSTRLEN] = {0};
+    char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    struct timeval tv = {H2_CONNECT_TIMEOUT + 1, 0};
+    unsigned char reply = H2_REPLY_KO;
+
+
+    if (dname && dname[0])
+        snprintf(authority, sizeof(authority), "%s:%d", dname, ntohs(SIN4_PORT(*daddr)));  /* Same offset for IPv6 */
+    else if (daddr->ss_family == AF_INET6)
+        snprintf(authority, sizeof(authority), "[%s]:%d",
+            inet_ntop(AF_INET6, &SIN6_ADDR(*daddr), ip, sizeof(ip)), ntohs(SIN6_PORT(*daddr)));
+    else
+        snprintf(authority, sizeof(authority), "%s:%d",
+            inet_ntop(AF_INET, &SIN4_ADDR(*daddr), ip, sizeof(ip)), ntohs(SIN4_PORT(*daddr)));
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        printl(LOG_WARN, "Unable to create a socket pair for HTTP/2 stream");
+        return -1;
+    }
+
+    iov.iov_base = authority;
+    iov.iov_len = strlen(authority) + 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sv[1], sizeof(int));
+
+    printl(LOG_VERB, "Requesting HTTP/2 stream: [%s] from the broker: [%d]", authority, proxy->h2_pid);
+    if (sendmsg(proxy->h2_ctl, &msg, 0) == -1) {
+        printl(LOG_WARN, "Unable to pass the stream request to HTTP/2 broker: [%d]", proxy->h2_pid);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    close(sv[1]);
+
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (recv(sv[0], &reply, 1, 0) != 1 || reply != H2_REPLY_OK) {
+        printl(LOG_WARN, "HTTP/2 proxy server rejected the stream: [%s]", authority);
+        close(sv[0]);
+        return -1;
+    }
+
+    tv.tv_sec = 0;
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return sv[0];
+}
+
+/* -- Master side --------------------------------------------------------------------------------------------------- */
+static void h2_broker(struct ini_section *proxy, int ctl);
+
+void h2_broker_start(struct ini_section *ini) {
+    /* Fork brokers for HTTP/2 sections which do not have a running one */
+
+    struct ini_section *s, *o;
+    int sv[2];
+    pid_t bpid;
+
+    for (s = ini; s; s = s->next) {
+        if (s->proxy_h2 != 'Y' || s->h2_pid) continue;
+
+        if (s->p_chain || (s->proxy_type != PROXY_PROTO_HTTP && s->proxy_type != PROXY_PROTO_HTTPS) ||
+            (s->proxy_type == PROXY_PROTO_HTTPS && !WITH_LIBSSL)) {
+
+            printl(LOG_WARN, "HTTP/2 is supported for HTTP/HTTPS proxy servers without chains, section: [%s]",
+                s->section_name);
+            s->h2_pid = -1;                                             /* Do not try again until reload */
+            continue;
+        }
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1) {
+            printl(LOG_WARN, "Unable to create HTTP/2 broker control socket, section: [%s]", s->section_name);
+            continue;
+        }
+
+        if ((bpid = fork()) == -1) {
+            printl(LOG_WARN, "Fork failed for HTTP/2 broker, section: [%s]", s->section_name);
+            close(sv[0]);
+            close(sv[1]);
+            continue;
+        }
+
+        if (bpid == 0) {
+            close(sv[0]);
+            for (o = ini; o; o = o->next)
+                if (o->h2_ctl != -1) close(o->h2_ctl);
+            h2_broker(s, sv[1]);                                        /* Never returns */
+        }
+
+        setpgid(bpid, mpid);
+        close(sv[1]);
+        if (s->h2_ctl != -1) close(s->h2_ctl);
+        s->h2_ctl = sv[0];
+        s->h2_pid = bpid;
+        printl(LOG_INFO, "HTTP/2 broker: [%d] started, section: [%s]", bpid, s->section_name);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void h2_broker_stop(struct ini_section *ini) {
+    /* Let brokers finish their streams and exit, e.g. before the INI-file reload */
+
+    struct ini_section *s;
+    unsigned int i;
+
+    for (s = ini; s; s = s->next) {
+        if (s->h2_pid > 0) {
+            kill(s->h2_pid, SIGHUP);
+            for (i = 0; i < sizeof(h2_drained) / sizeof(h2_drained[0]); i++)
+                if (!h2_drained[i]) {
+                    h2_drained[i] = s->h2_pid;
+                    break;
+                }
+        }
+        if (s->h2_ctl != -1) close(s->h2_ctl);
+        s->h2_ctl = -1;
+        s->h2_pid = 0;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int h2_broker_reaped(struct ini_section *ini, pid_t bpid) {
+    /* SIGCHLD: forget the exited broker, the main loop restarts it. Return 1 if bpid was a broker. Signal-safe */
+
+    struct ini_section *s;
+    unsigned int i;
+
+    for (s = ini; s; s = s->next)
+        if (s->h2_pid == bpid) {
+            if (s->h2_ctl != -1) close(s->h2_ctl);
+            s->h2_ctl = -1;
+            s->h2_pid = 0;
+            return 1;
+        }
+
+    for (i = 0; i < sizeof(h2_drained) / sizeof(h2_drained[0]); i++)
+        if (h2_drained[i] == bpid) {
+            h2_drained[i] = 0;
+            return 1;
+        }
+
+    return 0;
+}
+
+/* -- Broker: framing ----------------------------------------------------------------------------------------------- */
+static void h2_put32(unsigned char *b, uint32_t v) {
+    b[0] = v >> 24; b[1] = v >> 16; b[2] = v >> 8; b[3] = v;
+}
+
+static uint32_t h2_get32(const unsigned char *b) {
+    return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_out(h2_conn *c, const void *data, size_t len) {
+    /* Queue bytes to the connection output buffer */
+
+    unsigned char *b;
+    size_t sz;
+
+    if (c->olen + len > c->osize && c->ooff) {                          /* Reclaim the sent part first */
+        memmove(c->obuf, c->obuf + c->ooff, c->olen - c->ooff);
+        c->olen -= c->ooff;
+        c->ooff = 0;
+    }
+
+    if (c->olen + len > c->osize) {
+        for (sz = c->osize ? c->osize : BUF_SIZE_1KB * 16; sz < c->olen + len; sz *= 2) ;
+        if (!(b = realloc(c->obuf, sz))) return -1;
+        c->obuf = b;
+        c->osize = sz;
+    }
+
+    memcpy(c->obuf + c->olen, data, len);
+    c->olen += len;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_frame(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, const void *payload, size_t len) {
+    /* Queue a frame */
+
+    unsigned char h[9];
+
+    h[0] = len >> 16; h[1] = len >> 8; h[2] = len;
+    h[3] = type;
+    h[4] = flags;
+    h2_put32(h + 5, sid & 0x7FFFFFFF);
+
+    if (h2_out(c, h, sizeof(h)) || (len && h2_out(c, payload, len))) return -1;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_frame32(h2_conn *c, uint8_t type, uint32_t sid, uint32_t v) {
+    /* Queue a frame with a single 32-bit payload: WINDOW_UPDATE, RST_STREAM */
+
+    unsigned char p[4];
+
+    h2_put32(p, v);
+    return h2_frame(c, type, 0, sid, p, sizeof(p));
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_goaway(h2_conn *c, uint32_t code) {
+    /* Queue GOAWAY: we have never accepted a stream from the proxy, so the Last-Stream-ID is 0 */
+
+    unsigned char p[8] = {0};
+
+    h2_put32(p + 4, code);
+    return h2_frame(c, H2_GOAWAY, 0, 0, p, sizeof(p));
+}
+
+/* -- Broker: HPACK (RFC 7541), just what CONNECT needs ------------------------------------------------------------- */
+static size_t hpack_int(unsigned char *b, uint8_t flags, int prefix, uint32_t v) {
+    /* Encode an integer with N-bit prefix; Return the number of bytes */
+
+    uint32_t max = (1 << prefix) - 1;
+    size_t n = 0;
+
+    if (v < max) {
+        b[n++] = flags | v;
+        return n;
+    }
+
+    b[n++] = flags | max;
+    for (v -= max; v >= 128; v >>= 7) b[n++] = (v & 0x7F) | 0x80;
+    b[n++] = v;
+    return n;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static size_t hpack_literal(unsigned char *b, uint8_t flags, int prefix, uint32_t idx, const char *val, size_t l) {
+    /* Encode a literal header field with an indexed name and a plain (not Huffman) value */
+
+    size_t n;
+
+    n = hpack_int(b, flags, prefix, idx);
+    n += hpack_int(b + n, 0, 7, l);
+    memcpy(b + n, val, l);
+    return n + l;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int hpack_getint(const unsigned char **p, const unsigned char *end, int prefix, uint32_t *v) {
+    /* Decode an integer with N-bit prefix; Return 0 or -1 on malformed input */
+
+    uint32_t max = (1 << prefix) - 1;
+    int shift = 0;
+
+    if (*p >= end) return -1;
+    if ((*v = *(*p)++ & max) < max) return 0;
+
+    do {
+        if (*p >= end || shift > 21) return -1;
+        *v += (uint32_t)(**p & 0x7F) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int hpack_getstr(const unsigned char **p, const unsigned char *end, char *out, size_t osz) {
+    /* Decode a string literal into out (if not NULL). Huffman coded strings are decoded only if they consist of
+    digits, which is enough for :status values. Return 0, 1 if skipped as undecodable or -1 on malformed input */
+
+    const unsigned char *s;
+    uint32_t l, acc = 0, c;
+    size_t i, n = 0;
+    int nb = 0, huff;
+
+    if (*p >= end) return -1;
+    huff = **p & 0x80;
+    if (hpack_getint(p, end, 7, &l) || l > (size_t)(end - *p)) return -1;
+    s = *p;
+    *p += l;
+
+    if (!out) return 0;
+    if (!huff) {
+        if (l >= osz) return 1;
+        memcpy(out, s, l);
+        out[l] = 0;
+        return 0;
+    }
+
+    /* Digits are 5-bit codes: '0' - '2': 0x0 - 0x2 and 6-bit codes: '3' - '9': 0x19 - 0x1F; padding is all ones */
+    for (i = 0; i < l; i++) {
+        acc = acc << 8 | s[i];
+        nb += 8;
+        while (nb >= 5) {
+            if ((c = acc >> (nb - 5) & 0x1F) < 3) {
+                if (n + 1 >= osz) return 1;
+                out[n++] = '0' + c;
+                nb -= 5;
+                continue;
+            }
+            if (nb < 6) break;
+            if ((c = acc >> (nb - 6) & 0x3F) >= 0x19 && c <= 0x1F) {
+                if (n + 1 >= osz) return 1;
+                out[n++] = '3' + c - 0x19;
+                nb -= 6;
+                continue;
+            }
+            if (i == l - 1 && nb < 8 && (acc & ((1 << nb) - 1)) == (uint32_t)(1 << nb) - 1) nb = 0;  /* Padding */
+            else return 1;
+        }
+    }
+
+    if (nb && (acc & ((1 << nb) - 1)) != (uint32_t)(1 << nb) - 1) return 1;
+    out[n] = 0;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int hpack_status(const unsigned char *p, size_t len) {
+    /* Find :status in the response header block; Return the status code, 0 if absent or -1 on malformed input */
+
+    const unsigned char *end = p + len;
+    uint32_t idx;
+    char name[8], val[8];
+    int prefix;
+
+    while (p < end) {
+        if (*p & 0x80) {                                                /* Indexed header field */
+            if (hpack_getint(&p, end, 7, &idx)) return -1;
+            if (idx >= 8 && idx <= 14) return h2_static_status[idx - 8];
+            continue;
+        }
+
+        if ((*p & 0xE0) == 0x20) {                                      /* Dynamic table size update */
+            if (hpack_getint(&p, end, 5, &idx)) return -1;
+            continue;
+        }
+
+        prefix = *p & 0x40 ? 6 : 4;                                     /* Literal: with / without / never indexing */
+        if (hpack_getint(&p, end, prefix, &idx)) return -1;
+        name[0] = 0;
+        if (!idx && hpack_getstr(&p, end, name, sizeof(name)) < 0) return -1;
+
+        if ((idx >= 8 && idx <= 14) || !strcmp(name, ":status"))
+            return hpack_getstr(&p, end, val, sizeof(val)) ? -1 : atoi(val);
+
+        if (hpack_getstr(&p, end, NULL, 0)) return -1;
+    }
+
+    return 0;
+}
+
+/* -- Broker: streams ----------------------------------------------------------------------------------------------- */
+static void h2_reply(h2_stream *st, unsigned char reply) {
+    /* Tell the client process whether the tunnel is open */
+
+    if (send(st->fd, &reply, 1, 0) != 1)
+        printl(LOG_VERB, "HTTP/2 stream: [%s] client has gone", st->authority);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_stream_close(h2_stream *st, int rst) {
+    /* Finish the stream: reject a pending client, reset the stream upstream if asked, mark it to be freed */
+
+    if (st->state == H2S_CLOSED) return;
+
+    if (st->state != H2S_OPEN) h2_reply(st, H2_REPLY_KO);
+    if (rst && st->id && st->conn && st->conn->state < H2C_CLOSED)
+        h2_frame32(st->conn, H2_RST_STREAM, st->id, H2_CANCEL);
+
+    if (st->conn && --st->conn->nstreams == 0) st->conn->stamp = time(NULL);
+
+    printl(LOG_VERB, "HTTP/2 stream: [%u] to: [%s] closed", st->id, st->authority);
+    close(st->fd);
+    st->state = H2S_CLOSED;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_stream_start(h2_stream *st) {
+    /* Send CONNECT HEADERS for the stream */
+
+    h2_conn *c = st->conn;
+    unsigned char hb[sizeof(h2_hauth) + H2_AUTHORITY_MAX + 16];
+    size_t n = 0;
+
+    /* :method CONNECT and :authority literals without indexing, the static table has their names at 2 and 1 */
+    n += hpack_literal(hb + n, 0x00, 4, 2, "CONNECT", sizeof("CONNECT") - 1);
+    n += hpack_literal(hb + n, 0x00, 4, 1, st->authority, strlen(st->authority));
+    memcpy(hb + n, h2_hauth, h2_hauth_len);
+    n += h2_hauth_len;
+
+    st->id = c->next_id;
+    c->next_id += 2;
+    st->swin = c->init_window;
+    st->state = H2S_CONNECTING;
+    st->stamp = time(NULL);
+
+    printl(LOG_VERB, "HTTP/2 stream: [%u] CONNECT: [%s] via connection: [%d]", st->id, st->authority, c->fd);
+    if (h2_frame(c, H2_HEADERS, H2_FLAG_END_HEADERS, st->id, hb, n)) h2_stream_close(st, 0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static h2_stream *h2_stream_find(h2_conn *c, uint32_t sid) {
+    h2_stream *st;
+
+    for (st = h2_streams; st; st = st->next)
+        if (st->conn == c && st->id == sid && st->state != H2S_CLOSED) return st;
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_stream_read(h2_stream *st) {
+    /* Move client data into DATA frames within the flow control windows */
+
+    h2_conn *c = st->conn;
+    unsigned char buf[H2_FRAME_SIZE];
+    int64_t max = sizeof(buf);
+    ssize_t rec;
+
+    if (max > st->swin) max = st->swin;
+    if (max > c->swin) max = c->swin;
+    if (max > c->max_frame) max = c->max_frame;
+    if (st->lclosed || max <= 0) return;
+
+    if ((rec = recv(st->fd, buf, max, 0)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) h2_stream_close(st, 1);
+        return;
+    }
+
+    if (!rec) {
+        st->lclosed = 1;
+        h2_frame(c, H2_DATA, H2_FLAG_END_STREAM, st->id, NULL, 0);
+        if (st->wclosed) h2_stream_close(st, 0);
+        return;
+    }
+
+    st->swin -= rec;
+    c->swin -= rec;
+    if (h2_frame(c, H2_DATA, 0, st->id, buf, rec)) h2_stream_close(st, 1);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_stream_write(h2_stream *st) {
+    /* Deliver received DATA to the client and give the window back to the proxy */
+
+    ssize_t snd;
+
+    if (st->rlen) {
+        if ((snd = send(st->fd, st->rbuf, st->rlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) h2_stream_close(st, 1);
+            return;
+        }
+
+        memmove(st->rbuf, st->rbuf + snd, st->rlen - snd);
+        st->rlen -= snd;
+        st->rconsumed += snd;
+        if (!st->rclosed && st->rconsumed >= H2_STREAM_WINDOW / 2) {
+            h2_frame32(st->conn, H2_WINDOW_UPDATE, st->id, st->rconsumed);
+            st->rconsumed = 0;
+        }
+    }
+
+    if (!st->rlen && st->rclosed && !st->wclosed) {
+        shutdown(st->fd, SHUT_WR);
+        st->wclosed = 1;
+        if (st->lclosed) h2_stream_close(st, 0);
+    }
+}
+
+/* -- Broker: upstream connections ---------------------------------------------------------------------------------- */
+static void h2_conn_close(h2_conn *c, int failed) {
+    /* Close the connection. Streams not yet sent upstream get another chance unless the connection failed */
+
+    h2_stream *st;
+
+    if (c->state == H2C_CLOSED) return;
+    c->state = H2C_CLOSED;
+
+    for (st = h2_streams; st; st = st->next) {
+        if (st->conn != c || st->state == H2S_CLOSED) continue;
+        if (st->state == H2S_WAITING && !failed) {
+            st->conn = NULL;
+            continue;
+        }
+        st->conn = NULL;
+        h2_stream_close(st, 0);
+    }
+
+    printl(failed ? LOG_WARN : LOG_VERB, "HTTP/2 connection: [%d] with the proxy server closed%s", c->fd,
+        failed ? " on error" : "");
+
+    #if (WITH_LIBSSL)
+        if (c->ssl) {
+            if (!failed) SSL_shutdown(c->ssl);
+            SSL_free(c->ssl);
+            c->ssl = NULL;
+        }
+    #endif
+    close(c->fd);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static h2_conn *h2_conn_open(void) {
+    /* Start a non-blocking connection with the proxy server */
+
+    h2_conn *c, **l;
+    int opt = 1;
+    char buf[INET_ADDRPORTSTRLEN];
+
+    if (!(c = calloc(1, sizeof(h2_conn)))) return NULL;
+
+    if ((c->fd = socket(SA_FAMILY(h2_proxy->proxy_server), SOCK_STREAM, 0)) == -1) {
+        printl(LOG_WARN, "Error creating a socket for HTTP/2 connection");
+        free(c);
+        return NULL;
+    }
+
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int));
+    setsockopt(c->fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(int));
+    sock_opts_apply(c->fd, &h2_proxy->socket, "HTTP/2 connections");
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(c->fd, (struct sockaddr *)&h2_proxy->proxy_server, SA_FAMILY(h2_proxy->proxy_server) == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1 && errno != EINPROGRESS) {
+
+        printl(LOG_WARN, "Unable to connect with the proxy server: [%s]", inet2str(&h2_proxy->proxy_server, buf));
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+
+    c->state = H2C_CONNECTING;
+    c->swin = 65535;                                                    /* RFC 9113 initial values */
+    c->init_window = 65535;
+    c->max_frame = H2_FRAME_SIZE;
+    c->max_streams = UINT32_MAX;
+    c->next_id = 1;
+    c->stamp = time(NULL);
+
+    for (l = &h2_conns; *l; l = &(*l)->next) ;
+    *l = c;
+
+    printl(LOG_VERB, "HTTP/2 connection: [%d] with the proxy server: [%s] started",
+        c->fd, inet2str(&h2_proxy->proxy_server, buf));
+    return c;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_conn_ready(h2_conn *c) {
+    /* Send the connection preface and settings, then the CONNECT requests assigned to the connection */
+
+    unsigned char s[18];
+    h2_stream *st;
+
+    h2_out(c, H2_PREFACE, sizeof(H2_PREFACE) - 1);
+
+    s[0] = 0; s[1] = H2_SETTINGS_HEADER_TABLE_SIZE; h2_put32(s + 2, 0);    /* We never look at indexed headers */
+    s[6] = 0; s[7] = H2_SETTINGS_ENABLE_PUSH; h2_put32(s + 8, 0);
+    s[12] = 0; s[13] = H2_SETTINGS_INITIAL_WINDOW_SIZE; h2_put32(s + 14, H2_STREAM_WINDOW);
+    h2_frame(c, H2_SETTINGS, 0, 0, s, sizeof(s));
+    h2_frame32(c, H2_WINDOW_UPDATE, 0, H2_CONN_WINDOW - 65535);
+
+    c->state = H2C_READY;
+    printl(LOG_VERB, "HTTP/2 connection: [%d] is ready", c->fd);
+
+    for (st = h2_streams; st; st = st->next)
+        if (st->conn == c && st->state == H2S_WAITING) h2_stream_start(st);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_conn_handshake(h2_conn *c) {
+    /* Drive the non-blocking TLS handshake */
+
+    #if (WITH_LIBSSL)
+        const unsigned char *alpn = NULL;
+        unsigned int alpn_len = 0;
+        int ret;
+
+        if ((ret = SSL_connect(c->ssl)) == 1) {
+            SSL_get0_alpn_selected(c->ssl, &alpn, &alpn_len);
+            if (alpn_len != 2 || memcmp(alpn, "h2", 2)) {
+                printl(LOG_WARN, "HTTPS proxy server did not agree on HTTP/2 with ALPN");
+                h2_conn_close(c, 1);
+                return;
+            }
+            tls_client_established(c->ssl);
+            c->want_write = 0;
+            h2_conn_ready(c);
+            return;
+        }
+
+        switch (SSL_get_error(c->ssl, ret)) {
+            case SSL_ERROR_WANT_READ:
+                c->want_write = 0;
+            break;
+
+            case SSL_ERROR_WANT_WRITE:
+                c->want_write = 1;
+            break;
+
+            default:
+                tls_client_failed(c->ssl);
+                h2_conn_close(c, 1);
+        }
+    #else
+        h2_conn_close(c, 1);
+    #endif
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_conn_connected(h2_conn *c) {
+    /* TCP connection is completed: check it and start TLS if needed */
+
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+        printl(LOG_WARN, "Unable to connect with the proxy server: [%s]", strerror(err ? err : errno));
+        h2_conn_close(c, 1);
+        return;
+    }
+
+    if (h2_proxy->proxy_type != PROXY_PROTO_HTTPS) {
+        h2_conn_ready(c);
+        return;
+    }
+
+    #if (WITH_LIBSSL)
+        if (!(c->ssl = tls_client_new(c->fd, h2_proxy)) ||
+            SSL_set_alpn_protos(c->ssl, (const unsigned char *)H2_ALPN, sizeof(H2_ALPN) - 1)) {
+
+            printl(LOG_WARN, "Unable to prepare TLS with HTTPS proxy server");
+            h2_conn_close(c, 1);
+            return;
+        }
+        SSL_set_mode(c->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        c->state = H2C_HANDSHAKE;
+        h2_conn_handshake(c);
+    #endif
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static ssize_t h2_io(h2_conn *c, void *buf, size_t len, int wr) {
+    /* Read or write the connection; Return the number of bytes, 0 on EOF, -1 on error or -2 if it would block */
+
+    ssize_t ret;
+
+    #if (WITH_LIBSSL)
+        if (c->ssl) {
+            if ((ret = wr ? SSL_write(c->ssl, buf, len) : SSL_read(c->ssl, buf, len)) > 0) return ret;
+            switch (SSL_get_error(c->ssl, ret)) {
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:
+                    return -2;
+
+                case SSL_ERROR_ZERO_RETURN:
+                    return 0;
+
+                default:
+                    return !ret && !ERR_peek_error() ? 0 : -1;
+            }
+        }
+    #endif
+
+    if ((ret = wr ? send(c->fd, buf, len, 0) : recv(c->fd, buf, len, 0)) >= 0) return ret;
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? -2 : -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_conn_flush(h2_conn *c) {
+    /* Send as much of the output buffer as the socket takes */
+
+    ssize_t snd;
+
+    while (c->ooff < c->olen) {
+        if ((snd = h2_io(c, c->obuf + c->ooff, c->olen - c->ooff, 1)) == -2) return;
+        if (snd <= 0) {
+            h2_conn_close(c, 1);
+            return;
+        }
+        c->ooff += snd;
+    }
+
+    c->ooff = c->olen = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_headers(h2_conn *c) {
+    /* A complete response header block arrived for c->hsid */
+
+    h2_stream *st;
+    int status;
+
+    if (!(st = h2_stream_find(c, c->hsid))) return 0;                  /* Already reset by us */
+
+    if (st->state != H2S_CONNECTING) {                                  /* Trailers */
+        if (c->hflags & H2_FLAG_END_STREAM) st->rclosed = 1;
+        return 0;
+    }
+
+    if ((status = hpack_status(c->hbuf, c->hlen)) < 0) return -1;      /* HPACK errors kill the connection */
+
+    if (status < 200 || status > 299) {
+        printl(LOG_WARN, "HTTP/2 proxy server returned status: [%d] for: [%s]", status, st->authority);
+        h2_stream_close(st, !(c->hflags & H2_FLAG_END_STREAM));
+        return 0;
+    }
+
+    printl(LOG_INFO, "HTTP/2 stream: [%u] to: [%s] is open", st->id, st->authority);
+    st->state = H2S_OPEN;
+    h2_reply(st, H2_REPLY_OK);
+    if (c->hflags & H2_FLAG_END_STREAM) st->rclosed = 1;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int h2_frame_in(h2_conn *c, uint8_t type, uint8_t flags, uint32_t sid, unsigned char *p, uint32_t len) {
+    /* Process a received frame; Return -1 on a connection error */
+
+    h2_stream *st;
+    uint32_t v, pad = 0, i;
+    int64_t delta;
+    unsigned char *b;
+
+    if (c->hsid && type != H2_CONTINUATION) return -1;                  /* Header block must be contiguous */
+
+    if ((type == H2_DATA || type == H2_HEADERS) && flags & H2_FLAG_PADDED) {
+        if (!len || (pad = p[0]) >= len) return -1;
+        p++;
+        len -= pad + 1;
+    }
+
+    switch (type) {
+        case H2_DATA:
+            c->rconsumed += len + pad + (flags & H2_FLAG_PADDED ? 1 : 0);
+            if (c->rconsumed >= H2_CONN_WINDOW / 2) {
+                h2_frame32(c, H2_WINDOW_UPDATE, 0, c->rconsumed);
+                c->rconsumed = 0;
+            }
+
+            if (!(st = h2_stream_find(c, sid)) || st->state != H2S_OPEN) break;
+            if (st->rlen + len > H2_STREAM_WINDOW) {                    /* The proxy ignored our window */
+                h2_frame32(c, H2_RST_STREAM, sid, H2_FLOW_CONTROL_ERROR);
+                h2_stream_close(st, 0);
+                break;
+            }
+
+            if (len) {
+                if (!st->rbuf && !(st->rbuf = malloc(H2_STREAM_WINDOW))) {
+                    h2_stream_close(st, 1);
+                    break;
+                }
+                memcpy(st->rbuf + st->rlen, p, len);
+                st->rlen += len;
+            }
+            if (flags & H2_FLAG_END_STREAM) st->rclosed = 1;
+            h2_stream_write(st);
+        break;
+
+        case H2_HEADERS:
+            if (flags & H2_FLAG_PRIORITY) {
+                if (len < 5) return -1;
+                p += 5;
+                len -= 5;
+            }
+            /* FALLTHROUGH */
+
+        case H2_CONTINUATION:
+            if (type == H2_HEADERS) {
+                if (!sid) return -1;
+                c->hsid = sid;
+                c->hflags = flags;
+                c->hlen = 0;
+            } else if (!c->hsid || sid != c->hsid) return -1;
+
+            if (c->hlen + len > H2_FRAME_SIZE * 4) return -1;
+            if (!(b = realloc(c->hbuf, c->hlen + len + 1))) return -1;
+            c->hbuf = b;
+            memcpy(c->hbuf + c->hlen, p, len);
+            c->hlen += len;
+
+            if (flags & H2_FLAG_END_HEADERS) {
+                if (h2_headers(c)) return -1;
+                c->hsid = 0;
+            }
+        break;
+
+        case H2_RST_STREAM:
+            if ((st = h2_stream_find(c, sid))) {
+                printl(LOG_VERB, "HTTP/2 proxy server reset stream: [%u] code: [%u]", sid, len >= 4 ? h2_get32(p) : 0);
+                h2_stream_close(st, 0);
+            }
+        break;
+
+        case H2_SETTINGS:
+            if (flags & H2_FLAG_ACK) break;
+            if (len % 6) return -1;
+            for (i = 0; i < len; i += 6) {
+                v = h2_get32(p + i + 2);
+                switch (p[i] << 8 | p[i + 1]) {
+                    case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+                        c->max_streams = v;
+                    break;
+
+                    case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                        if (v > 0x7FFFFFFF) return -1;
+                        delta = (int64_t)v - c->init_window;
+                        c->init_window = v;
+                        for (st = h2_streams; st; st = st->next)
+                            if (st->conn == c && st->id) st->swin += delta;
+                    break;
+
+                    case H2_SETTINGS_MAX_FRAME_SIZE:
+                        c->max_frame = v;                               /* We never send more than H2_FRAME_SIZE */
+                    break;
+                }
+            }
+            h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+        break;
+
+        case H2_PING:
+            if (!(flags & H2_FLAG_ACK)) h2_frame(c, H2_PING, H2_FLAG_ACK, 0, p, len);
+        break;
+
+        case H2_GOAWAY:
+            if (len < 8) return -1;
+            c->last_id = h2_get32(p) & 0x7FFFFFFF;
+            printl(LOG_VERB, "HTTP/2 connection: [%d] GOAWAY last stream: [%u] code: [%u]",
+                c->fd, c->last_id, h2_get32(p + 4));
+            c->state = H2C_GOAWAY;
+
+            /* Streams above last_id were not processed: send them elsewhere */
+            for (st = h2_streams; st; st = st->next)
+                if (st->conn == c && st->state == H2S_CONNECTING && st->id > c->last_id) {
+                    st->conn = NULL;
+                    st->id = 0;
+                    st->state = H2S_WAITING;
+                    c->nstreams--;
+                } else if (st->conn == c && st->state == H2S_WAITING) {
+                    st->conn = NULL;
+                    c->nstreams--;
+                }
+        break;
+
+        case H2_WINDOW_UPDATE:
+            if (len < 4) return -1;
+            v = h2_get32(p) & 0x7FFFFFFF;
+            if (!sid) c->swin += v;
+            else if ((st = h2_stream_find(c, sid))) st->swin += v;
+        break;
+
+        case H2_PUSH_PROMISE:                                           /* We have disabled it */
+            return -1;
+
+        default:                                                        /* PRIORITY and unknown frames */
+        break;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_conn_read(h2_conn *c) {
+    /* Read and process frames while the connection has data */
+
+    ssize_t rec;
+    uint32_t len;
+
+    while (c->state != H2C_CLOSED) {
+        if ((rec = h2_io(c, c->ibuf + c->ilen, sizeof(c->ibuf) - c->ilen, 0)) == -2) return;
+        if (rec <= 0) {
+            h2_conn_close(c, c->nstreams > 0);
+            return;
+        }
+        c->ilen += rec;
+
+        while (c->ilen >= 9 && c->state != H2C_CLOSED) {
+            if ((len = c->ibuf[0] << 16 | c->ibuf[1] << 8 | c->ibuf[2]) > H2_FRAME_SIZE) {
+                printl(LOG_WARN, "HTTP/2 proxy server sent too large frame: [%u]", len);
+                h2_conn_close(c, 1);
+                return;
+            }
+            if (c->ilen < 9 + len) break;
+
+            if (h2_frame_in(c, c->ibuf[3], c->ibuf[4], h2_get32(c->ibuf + 5) & 0x7FFFFFFF, c->ibuf + 9, len)) {
+                printl(LOG_WARN, "HTTP/2 protocol error on connection: [%d]", c->fd);
+                h2_goaway(c, H2_PROTOCOL_ERROR);
+                h2_conn_flush(c);
+                h2_conn_close(c, 1);
+                return;
+            }
+
+            memmove(c->ibuf, c->ibuf + 9 + len, c->ilen - 9 - len);
+            c->ilen -= 9 + len;
+        }
+    }
+}
+
+/* -- Broker: main loop --------------------------------------------------------------------------------------------- */
+static void h2_ctl_read(int ctl) {
+    /* Accept stream requests from client processes */
+
+    char authority[H2_AUTHORITY_MAX] = {0};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    h2_stream *st, **l;
+    int fd;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        memset(authority, 0, sizeof(authority));
+        iov.iov_base = authority;
+        iov.iov_len = sizeof(authority) - 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        if (recvmsg(ctl, &msg, 0) <= 0) return;
+        if (!(cmsg = CMSG_FIRSTHDR(&msg)) || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+        if (!(st = calloc(1, sizeof(h2_stream)))) {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        st->fd = fd;
+        st->state = H2S_WAITING;
+        st->stamp = time(NULL);
+        memcpy(st->authority, authority, sizeof(st->authority));       /* Zero-terminated by the iov length */
+
+        for (l = &h2_streams; *l; l = &(*l)->next) ;
+        *l = st;
+        printl(LOG_VERB, "HTTP/2 stream request: [%s]", st->authority);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_schedule(void) {
+    /* Assign waiting streams to connections with free slots, open more connections up to the limit, expire stale
+    streams and connections, free the closed ones */
+
+    h2_stream *st, **ls;
+    h2_conn *c, **lc;
+    time_t now = time(NULL);
+    unsigned int nconns, limit;
+
+    for (st = h2_streams; st; st = st->next) {
+        if (st->state == H2S_CLOSED) continue;
+
+        if ((st->state == H2S_WAITING || st->state == H2S_CONNECTING) && now - st->stamp > H2_CONNECT_TIMEOUT) {
+            printl(LOG_WARN, "HTTP/2 stream to: [%s] timed out", st->authority);
+            h2_stream_close(st, 1);
+            continue;
+        }
+
+        if (st->state != H2S_WAITING || st->conn) continue;
+
+        nconns = 0;
+        for (c = h2_conns; c; c = c->next) {
+            if (c->state == H2C_CLOSED) continue;
+            nconns++;
+            limit = c->max_streams < h2_proxy->proxy_h2_streams ? c->max_streams : h2_proxy->proxy_h2_streams;
+            if (c->state < H2C_GOAWAY && (unsigned int)c->nstreams < limit) break;
+        }
+
+        if (!c) {
+            if (h2_drain || nconns >= h2_proxy->proxy_h2_conns || !(c = h2_conn_open())) continue;
+            printl(LOG_VERB, "HTTP/2 connections in use: [%u]", nconns + 1);
+        }
+
+        st->conn = c;
+        c->nstreams++;
+        if (c->state == H2C_READY) h2_stream_start(st);
+    }
+
+    for (c = h2_conns; c; c = c->next) {
+        if (c->state < H2C_READY && now - c->stamp > H2_CONNECT_TIMEOUT) {
+            printl(LOG_WARN, "HTTP/2 connection: [%d] with the proxy server timed out", c->fd);
+            h2_conn_close(c, 1);
+        } else if (c->state >= H2C_READY && c->state < H2C_CLOSED && !c->nstreams &&
+            (c->state == H2C_GOAWAY || h2_drain || now - c->stamp > H2_IDLE_TIMEOUT)) {
+
+            if (c->state == H2C_READY) {
+                h2_goaway(c, H2_NO_ERROR);
+                h2_conn_flush(c);
+            }
+            h2_conn_close(c, 0);
+        }
+    }
+
+    for (ls = &h2_streams; *ls; )
+        if ((*ls)->state == H2S_CLOSED) {
+            st = *ls;
+            *ls = st->next;
+            free(st->rbuf);
+            free(st);
+        } else
+            ls = &(*ls)->next;
+
+    for (lc = &h2_conns; *lc; )
+        if ((*lc)->state == H2C_CLOSED) {
+            c = *lc;
+            *lc = c->next;
+            free(c->obuf);
+            free(c->hbuf);
+            free(c);
+        } else
+            lc = &(*lc)->next;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_trap_signal(int sig) {
+    /* Broker signal handler */
+
+    if (sig == SIGHUP) h2_drain = 1; else h2_quit = 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void h2_broker(struct ini_section *proxy, int ctl) {
+    /* The broker process: multiplex client streams over upstream HTTP/2 connections */
+
+    struct pollfd *pfd = NULL;
+    void **obj = NULL;
+    size_t n, nc, i, nmax = 0;
+    h2_conn *c;
+    h2_stream *st;
+
+    pid = getpid();
+    h2_proxy = proxy;
+
+    if (Tsock != -1) close(Tsock);
+    if (Ssock != -1) close(Ssock);
+    if (Hsock != -1) close(Hsock);
+    admit_close();                                                      /* Queued clients stay with the main process */
+
+    signal(SIGHUP, h2_trap_signal);
+    signal(SIGINT, h2_trap_signal);
+    signal(SIGQUIT, h2_trap_signal);
+    signal(SIGTERM, h2_trap_signal);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* proxy-authorization header field is never indexed: static name 49, the value from the section template */
+    if (proxy->tpl_http_auth && proxy->tpl_http_auth_len < (int)sizeof(h2_hauth) - 8)
+        h2_hauth_len = hpack_literal(h2_hauth, 0x10, 4, 49, proxy->tpl_http_auth + sizeof(HTTP_HEADER_PROXYAUTH) - 1,
+            proxy->tpl_http_auth_len - (sizeof(HTTP_HEADER_PROXYAUTH) - 1) - 2);
+
+    fcntl(ctl, F_SETFL, O_NONBLOCK);
+    printl(LOG_VERB, "HTTP/2 broker for section: [%s] started", proxy->section_name);
+
+    while (!h2_quit && getppid() == mpid) {
+        if (h2_drain && ctl != -1) {
+            printl(LOG_INFO, "HTTP/2 broker for section: [%s] drains its streams", proxy->section_name);
+            close(ctl);
+            ctl = -1;
+        }
+
+        h2_schedule();
+        if (h2_drain && !h2_streams && !h2_conns) break;
+
+        /* pollfd array: control socket, connections, streams */
+        for (n = 1, c = h2_conns; c; c = c->next) n++;
+        for (st = h2_streams; st; st = st->next) n++;
+        if (n > nmax) {
+            nmax = n * 2;
+            if (!(pfd = realloc(pfd, nmax * sizeof(struct pollfd))) ||
+                !(obj = realloc(obj, nmax * sizeof(void *)))) {
+                printl(LOG_CRIT, "HTTP/2 broker is out of memory");
+                break;
+            }
+        }
+
+        n = 0;
+        pfd[n].fd = ctl;
+        pfd[n].events = POLLIN;
+        obj[n++] = NULL;
+
+        for (c = h2_conns; c; c = c->next) {
+            if (c->state == H2C_CLOSED) continue;
+            pfd[n].fd = c->fd;
+            pfd[n].events = c->state == H2C_CONNECTING ? POLLOUT : POLLIN;
+            if (c->want_write || c->ooff < c->olen) pfd[n].events |= POLLOUT;
+            obj[n++] = c;
+        }
+        nc = n - 1;
+
+        for (st = h2_streams; st; st = st->next) {
+            pfd[n].fd = st->fd;
+            pfd[n].events = 0;
+            if (st->state == H2S_OPEN) {
+                if (!st->lclosed && st->swin > 0 && st->conn->swin > 0 &&
+                    st->conn->olen - st->conn->ooff < H2_OBUF_HIGH) pfd[n].events |= POLLIN;
+                if (st->rlen) pfd[n].events |= POLLOUT;
+            }
+            if (!pfd[n].events) pfd[n].fd = -1;
+            obj[n++] = st;
+        }
+
+        if (poll(pfd, n, 1000) <= 0) continue;
+
+        if (pfd[0].revents & POLLIN) h2_ctl_read(ctl);
+
+        /* Entries are only marked closed here and freed by h2_schedule(), so the pointers stay valid */
+        for (i = 1; i < n; i++) {
+            if (!pfd[i].revents) continue;
+
+            if (i <= nc) {
+                c = obj[i];
+                if (c->state == H2C_CONNECTING) h2_conn_connected(c);
+                else if (c->state == H2C_HANDSHAKE) h2_conn_handshake(c);
+                else if (c->state != H2C_CLOSED) {
+                    if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) h2_conn_read(c);
+                    if (c->state != H2C_CLOSED && pfd[i].revents & POLLOUT) h2_conn_flush(c);
+                }
+                continue;
+            }
+
+            st = obj[i];
+            if (st->state == H2S_OPEN && pfd[i].revents & POLLOUT) h2_stream_write(st);
+            if (st->state == H2S_OPEN && pfd[i].events & POLLIN && pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                h2_stream_read(st);
+        }
+
+        /* Push out frames produced by the streams */
+        for (c = h2_conns; c; c = c->next)
+            if (c->state >= H2C_READY && c->state < H2C_CLOSED && c->ooff < c->olen) h2_conn_flush(c);
+    }
+
+    printl(LOG_VERB, "HTTP/2 broker for section: [%s] exited", proxy->section_name);
+    exit(0);
+}
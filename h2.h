@@ -0,0 +1,147 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2024-2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "version.h"
+
+/* -- HTTP/2 CONNECT broker ----------------------------------------------------------------------------------------- */
+#define H2_STREAMS_DEFAULT      100                 /* Streams per upstream connection */
+#define H2_CONNS_DEFAULT        4                   /* Upstream connections per proxy section */
+
+#define H2_STREAM_WINDOW        (256 * 1024)        /* Our per-stream receive window */
+#define H2_CONN_WINDOW          (16 * 1024 * 1024)  /* Our per-connection receive window */
+#define H2_FRAME_SIZE           16384               /* Default SETTINGS_MAX_FRAME_SIZE, we never raise ours */
+#define H2_OBUF_HIGH            (256 * 1024)        /* Stop reading clients when so much is queued upstream */
+#define H2_CONNECT_TIMEOUT      10                  /* Seconds to establish a connection or a stream */
+#define H2_IDLE_TIMEOUT         60                  /* Seconds to keep an upstream connection without streams */
+#define H2_AUTHORITY_MAX        (HOST_NAME_MAX + 9) /* [host]:port, destinations are names or IP-addresses */
+
+#define H2_REPLY_OK             0                   /* The first byte the broker writes into a client stream socket */
+#define H2_REPLY_KO             1
+
+/* Frame types */
+#define H2_DATA                 0x0
+#define H2_HEADERS              0x1
+#define H2_PRIORITY             0x2
+#define H2_RST_STREAM           0x3
+#define H2_SETTINGS             0x4
+#define H2_PUSH_PROMISE         0x5
+#define H2_PING                 0x6
+#define H2_GOAWAY               0x7
+#define H2_WINDOW_UPDATE        0x8
+#define H2_CONTINUATION         0x9
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM      0x1
+#define H2_FLAG_ACK             0x1
+#define H2_FLAG_END_HEADERS     0x4
+#define H2_FLAG_PADDED          0x8
+#define H2_FLAG_PRIORITY        0x20
+
+/* Settings */
+#define H2_SETTINGS_HEADER_TABLE_SIZE       0x1
+#define H2_SETTINGS_ENABLE_PUSH             0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE          0x5
+
+/* Error codes */
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_CANCEL               0x8
+
+#define H2_PREFACE              "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_ALPN                 "\x02h2"
+
+/* Broker states of streams and upstream connections */
+#define H2S_WAITING             0                   /* Waiting for a connection slot or the connection handshake */
+#define H2S_CONNECTING          1                   /* CONNECT HEADERS sent, waiting for :status */
+#define H2S_OPEN                2                   /* Tunnel is relaying data */
+#define H2S_CLOSED              3                   /* To be freed */
+
+#define H2C_CONNECTING          0                   /* TCP connection in progress */
+#define H2C_HANDSHAKE           1                   /* TLS handshake in progress */
+#define H2C_READY               2
+#define H2C_GOAWAY              3                   /* No new streams, close when the last one ends */
+#define H2C_CLOSED              4                   /* To be freed */
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+typedef struct h2_conn {                                /* Upstream HTTP/2 connection with the proxy server */
+    int fd;
+    #if (WITH_LIBSSL)
+        SSL *ssl;                                       /* NULL for h2c (cleartext, prior knowledge) */
+    #endif
+    uint8_t state;
+    uint8_t want_write;                                 /* TLS handshake waits for the socket to be writable */
+    int64_t swin;                                       /* Connection send window */
+    uint32_t rconsumed;                                 /* Received bytes not yet returned by WINDOW_UPDATE */
+    uint32_t max_streams;                               /* Peer SETTINGS_MAX_CONCURRENT_STREAMS */
+    uint32_t init_window;                               /* Peer SETTINGS_INITIAL_WINDOW_SIZE */
+    uint32_t max_frame;                                 /* Peer SETTINGS_MAX_FRAME_SIZE */
+    uint32_t next_id;                                   /* The next client stream ID */
+    uint32_t last_id;                                   /* GOAWAY Last-Stream-ID */
+    int nstreams;                                       /* Streams assigned to the connection */
+    unsigned char *obuf;                                /* Frames to send: */
+    size_t ooff, olen, osize;                           /* sent offset, length, allocated size */
+    unsigned char ibuf[9 + H2_FRAME_SIZE];              /* Incomplete frame received */
+    size_t ilen;
+    unsigned char *hbuf;                                /* Header block being received in HEADERS/CONTINUATION */
+    size_t hlen;
+    uint32_t hsid;                                      /* 0 if no header block is in progress */
+    uint8_t hflags;
+    time_t stamp;                                       /* Connection start or time since it has no streams */
+    struct h2_conn *next;
+} h2_conn;
+
+typedef struct h2_stream {                              /* CONNECT tunnel of a TS-Warp client */
+    uint32_t id;
+    int fd;                                             /* Broker end of the client socket pair */
+    uint8_t state;
+    uint8_t lclosed;                                    /* END_STREAM sent: the client stopped sending */
+    uint8_t rclosed;                                    /* END_STREAM received: the proxy stopped sending */
+    uint8_t wclosed;                                    /* The client socket is shut down for writing */
+    int64_t swin;                                       /* Stream send window */
+    uint32_t rconsumed;                                 /* Delivered bytes not yet returned by WINDOW_UPDATE */
+    unsigned char *rbuf;                                /* DATA received, but not yet delivered to the client */
+    size_t rlen;
+    time_t stamp;                                       /* Request time */
+    char authority[H2_AUTHORITY_MAX];
+    struct h2_conn *conn;
+    struct h2_stream *next;
+} h2_stream;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+struct ini_section;
+
+int h2_client_request(struct ini_section *proxy, struct sockaddr_storage *daddr, char *dname);
+void h2_broker_start(struct ini_section *ini);
+void h2_broker_stop(struct ini_section *ini);
+int h2_broker_reaped(struct ini_section *ini, pid_t pid);
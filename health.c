@@ -0,0 +1,515 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Active health checks of proxy servers ------------------------------------------------------------------------- */
+
+/*
+* The main daemon maps a shared memory array with a section_health entry per INI-section and forks a single checker
+* process which probes the sections with proxy_check set. The checker marks sections up or down by rise/fall counts;
+* client processes inherit the mapping and ini_look_server() skips down sections; the main process moves a section
+* that went down to the end of the list, as failover does.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "utility.h"
+#include "network.h"
+#include "socks.h"
+#include "http.h"
+#include "health.h"
+#include "admit.h"
+#include "inifile.h"
+#include "logfile.h"
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#define HP_IDLE         0                                               /* Probe stages */
+#define HP_CONNECTING   1
+#define HP_WAITING      2                                               /* for the proxy server reply */
+
+typedef struct health_probe {
+    struct ini_section *s;
+    int fd;
+    int stage;
+    long long start;                                                    /* Microseconds */
+    long long next;
+    size_t len;
+    char buf[BUF_SIZE_1KB];
+} health_probe;
+
+extern pid_t pid, mpid;
+extern int Tsock, Ssock, Hsock;
+
+static section_health *health_map;                                      /* Master: the current shared memory */
+static size_t health_map_size;
+static pid_t health_pid;                                                /* Master: the checker process or 0 */
+
+static volatile sig_atomic_t health_quit;
+static section_load *health_held;                                       /* Client: the section counted as active */
+
+static const char *health_checks[] = {"none", "tcp", "socks5", "http", "ssh"};
+
+/* -- Master side --------------------------------------------------------------------------------------------------- */
+void health_init(struct ini_section *ini) {
+    /* Map the shared health state for all the sections, all of them are up until the checker says otherwise */
+
+    struct ini_section *s;
+    size_t n = 0;
+
+    for (s = ini; s; s = s->next) n++;
+    if (!n) return;
+
+    health_map_size = n * sizeof(section_health);
+    if ((health_map = mmap(NULL, health_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0)) ==
+        MAP_FAILED) {
+
+        printl(LOG_WARN, "Unable to map shared memory for the sections health. No health checks will be done");
+        health_map = NULL;
+        health_map_size = 0;
+        return;
+    }
+
+    for (n = 0, s = ini; s; s = s->next, n++) {
+        s->health = &health_map[n];
+        s->health->up = s->health->seen = 1;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_checker(struct ini_section *ini);
+
+void health_start(struct ini_section *ini) {
+    /* Fork the checker if any section needs probes and it is not running */
+
+    struct ini_section *s;
+    pid_t cpid;
+
+    if (health_pid || !health_map) return;
+
+    for (s = ini; s; s = s->next)
+        if (s->proxy_check != HEALTH_CHECK_NONE && s->section_balance != SECTION_BALANCE_DISABLED) break;
+    if (!s) return;
+
+    if ((cpid = fork()) == -1) {
+        printl(LOG_WARN, "Fork failed for the health checker");
+        return;
+    }
+
+    if (cpid == 0) health_checker(ini);                                 /* Never returns */
+
+    setpgid(cpid, mpid);
+    health_pid = cpid;
+    printl(LOG_INFO, "Health checker: [%d] started", cpid);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_stop(struct ini_section *ini) {
+    /* Stop the checker and release the shared memory, e.g. before the INI-file reload. Clients keep their mappings */
+
+    struct ini_section *s;
+
+    if (health_pid > 0) kill(health_pid, SIGTERM);
+    health_pid = 0;
+
+    for (s = ini; s; s = s->next) s->health = NULL;
+    if (health_map) munmap(health_map, health_map_size);
+    health_map = NULL;
+    health_map_size = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int health_reaped(pid_t cpid) {
+    /* SIGCHLD: forget the exited checker, the main loop restarts it. Return 1 if cpid was the checker. Signal-safe */
+
+    if (!health_pid || cpid != health_pid) return 0;
+
+    health_pid = 0;
+    return 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_update(struct ini_section **ini) {
+    /* Main loop: act on the state changes made by the checker */
+
+    struct ini_section *s;
+
+    for (s = *ini; s; s = s->next) {
+        if (!s->health || s->health->up == s->health->seen) continue;
+
+        s->health->seen = s->health->up;
+        printl(LOG_INFO, "Section: [%s] is %s", s->section_name, s->health->up ? "up" : "down");
+        if (!s->health->up && s->section_balance != SECTION_BALANCE_NONE) {
+            pushback_ini(ini, s);
+            break;                                                      /* s->next is changed, the rest later */
+        }
+    }
+}
+
+/* -- Clients: circuit breaker ------------------------------------------------------------------------------------- */
+int health_usable(struct ini_section *s) {
+    /* Return 1 if the section may serve a client now. Half-open sections let a client through once per BREAKER_TRIAL
+    seconds; the main process only looks up section names, so it never takes those turns */
+
+    section_health *h = s->health;
+    time_t now, t;
+    uint8_t b = BREAKER_OPEN;
+
+    if (!h) return 1;
+    if (!h->up) return 0;
+    if (!s->proxy_breaker) return 1;
+
+    switch (__atomic_load_n(&h->breaker, __ATOMIC_ACQUIRE)) {
+        case BREAKER_CLOSED:
+            return 1;
+
+        case BREAKER_OPEN:
+            now = time(NULL);
+            if (now < __atomic_load_n(&h->until, __ATOMIC_RELAXED)) return 0;
+            if (__atomic_compare_exchange_n(&h->breaker, &b, BREAKER_HALFOPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                printl(LOG_INFO, "Section: [%s] breaker is half-open", s->section_name);
+            /* Fall through */
+
+        case BREAKER_HALFOPEN:
+        default:
+            if (pid == mpid) return 0;
+            now = time(NULL);
+            t = __atomic_load_n(&h->trial, __ATOMIC_RELAXED);
+            return now >= t &&
+                __atomic_compare_exchange_n(&h->trial, &t, now + BREAKER_TRIAL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_success(struct ini_section *s, unsigned int latency) {
+    /* The client got a ready proxy connection: close the breaker and account the latency */
+
+    section_health *h = s->health;
+    unsigned int l;
+
+    if (!h) return;
+
+    l = __atomic_load_n(&h->latency, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->latency, l ? (l * 7 + latency) / 8 : latency, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->failures, 0, __ATOMIC_RELAXED);
+
+    if (__atomic_exchange_n(&h->breaker, BREAKER_CLOSED, __ATOMIC_ACQ_REL) != BREAKER_CLOSED) {
+        __atomic_store_n(&h->ejections, 0, __ATOMIC_RELAXED);
+        printl(LOG_INFO, "Section: [%s] breaker is closed", s->section_name);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_failure(struct ini_section *s) {
+    /* The client failed to connect or handshake: trip the breaker after proxy_breaker failures in a row or at once
+    when half-open. The ejection window doubles with every trip up to BREAKER_EJECT_MAX */
+
+    section_health *h = s->health;
+    uint8_t b;
+    unsigned int e;
+    time_t w;
+
+    if (!h || !s->proxy_breaker) return;
+
+    b = __atomic_load_n(&h->breaker, __ATOMIC_ACQUIRE);
+    if (b == BREAKER_OPEN) return;
+    if (b == BREAKER_CLOSED && __atomic_add_fetch(&h->failures, 1, __ATOMIC_RELAXED) < s->proxy_breaker) return;
+
+    if (!__atomic_compare_exchange_n(&h->breaker, &b, BREAKER_OPEN, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;                                                         /* Another client tripped it */
+
+    e = __atomic_add_fetch(&h->ejections, 1, __ATOMIC_RELAXED);
+    w = e > 7 ? BREAKER_EJECT_MAX : MIN(BREAKER_EJECT_BASE << (e - 1), BREAKER_EJECT_MAX);
+    __atomic_store_n(&h->until, time(NULL) + w, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->failures, 0, __ATOMIC_RELAXED);
+    printl(LOG_WARN, "Section: [%s] breaker is open for: [%ld] seconds", s->section_name, (long)w);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_acquire(struct ini_section *s) {
+    /* Count the client as active on the section until health_release() */
+
+    if (!s->load || health_held) return;
+
+    health_held = s->load;
+    __atomic_add_fetch(&health_held->active, 1, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void health_release(void) {
+    /* The client finished. Signal-safe */
+
+    if (!health_held) return;
+
+    __atomic_sub_fetch(&health_held->active, 1, __ATOMIC_RELAXED);
+    health_held = NULL;
+}
+
+/* -- Checker ------------------------------------------------------------------------------------------------------- */
+static long long health_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_done(health_probe *p, int ok) {
+    /* Account the probe result, schedule the next one with jitter */
+
+    section_health *h = p->s->health;
+    long long now = health_us();
+    unsigned int rtt;
+
+    if (p->fd != -1) close(p->fd);
+    p->fd = -1;
+    p->stage = HP_IDLE;
+    p->next = now + (long long)p->s->proxy_check_interval * 10000 *
+        (100 - HEALTH_JITTER + random() % (2 * HEALTH_JITTER + 1));
+    h->checked = now / 1000000;
+
+    if (ok) {
+        rtt = now - p->start;
+        h->rtt = h->rtt ? (h->rtt * 7 + rtt) / 8 : rtt;
+        h->fall = 0;
+        if (!h->up && ++h->rise >= p->s->proxy_check_rise) {
+            h->up = 1;
+            printl(LOG_WARN, "Section: [%s] health check passed, marking it up", p->s->section_name);
+        }
+    } else {
+        h->rise = 0;
+        if (h->up && ++h->fall >= p->s->proxy_check_fall) {
+            h->up = 0;
+            printl(LOG_WARN, "Section: [%s] health check failed, marking it down", p->s->section_name);
+        }
+    }
+
+    printl(LOG_VERB, "Health check: [%s] section: [%s] result: [%s] RTT: [%u] us",
+        health_checks[p->s->proxy_check], p->s->section_name, ok ? "OK" : "KO", h->rtt);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_connected(health_probe *p) {
+    /* TCP connection is ready: send the probe request or wait for the server banner */
+
+    struct ini_section *s = p->s;
+    char ip[INET_ADDRPORTSTRLEN];
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+        health_done(p, 0);
+        return;
+    }
+
+    p->stage = HP_WAITING;
+    p->len = 0;
+    switch (s->proxy_check) {
+        case HEALTH_CHECK_SOCKS5:                                       /* Hello: NOAUTH and UNAME methods */
+            p->len = 4;
+            memcpy(p->buf, "\x05\x02\x00\x02", p->len);
+        break;
+
+        case HEALTH_CHECK_HTTP:                                         /* CONNECT the canary */
+            if (s->proxy_check_target.ss_family != AF_UNSPEC && s->proxy_type == PROXY_PROTO_HTTP) {
+                inet2str(&s->proxy_check_target, ip);
+                p->len = snprintf(p->buf, sizeof(p->buf), "%s %s %s\r\nHost: %s\r\n%s\r\n",
+                    HTTP_REQUEST_METHOD_CONNECT, ip, HTTP_REQEST_PROTOCOL, ip, s->tpl_http_auth ? : "");
+                break;
+            }
+            /* Fall through: no canary or HTTPS, the connection is enough */
+
+        case HEALTH_CHECK_TCP:
+            health_done(p, 1);
+            return;
+
+        case HEALTH_CHECK_SSH:                                          /* The server speaks first */
+        default:
+        break;
+    }
+
+    if (p->len && send(p->fd, p->buf, p->len, 0) != (ssize_t)p->len) health_done(p, 0);
+    p->len = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_read(health_probe *p) {
+    /* Collect the reply and judge it as soon as there is enough of it */
+
+    ssize_t r;
+    char code[4] = {0};
+
+    if ((r = recv(p->fd, p->buf + p->len, sizeof(p->buf) - p->len - 1, 0)) <= 0) {
+        if (r == -1 && (errno == EAGAIN || errno == EINTR)) return;
+        health_done(p, 0);
+        return;
+    }
+    p->len += r;
+    p->buf[p->len] = '\0';
+
+    switch (p->s->proxy_check) {
+        case HEALTH_CHECK_SOCKS5:
+            if (p->len >= 2) health_done(p, p->buf[0] == 0x05 && (unsigned char)p->buf[1] != AUTH_METHOD_NOACCEPT);
+        break;
+
+        case HEALTH_CHECK_HTTP:
+            if (strstr(p->buf, "\r\n"))
+                health_done(p, sscanf(p->buf, "HTTP/%*d.%*d %3s", code) == 1 && !strcmp(code, HTTP_RESPONSE_200));
+            else if (p->len >= sizeof(p->buf) - 1)
+                health_done(p, 0);
+        break;
+
+        case HEALTH_CHECK_SSH:
+            if (p->len >= 4) health_done(p, !memcmp(p->buf, "SSH-", 4));
+        break;
+
+        default:
+            health_done(p, 0);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_begin(health_probe *p) {
+    /* Start a non-blocking connection with the proxy server */
+
+    struct ini_section *s = p->s;
+
+    p->start = health_us();
+    p->len = 0;
+    if ((p->fd = socket(s->proxy_server.ss_family, SOCK_STREAM, 0)) == -1) {
+        health_done(p, 0);
+        return;
+    }
+    fcntl(p->fd, F_SETFL, O_NONBLOCK);
+
+    if (connect(p->fd, (struct sockaddr *)&s->proxy_server, s->proxy_server.ss_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == 0) {
+
+        health_connected(p);
+        return;
+    }
+
+    if (errno != EINPROGRESS) {
+        health_done(p, 0);
+        return;
+    }
+    p->stage = HP_CONNECTING;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_trap_signal(int sig) {
+    /* Checker signal handler */
+
+    (void)sig;
+    health_quit = 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void health_checker(struct ini_section *ini) {
+    /* The checker process: probe the sections until the main daemon exits or stops us */
+
+    struct ini_section *s;
+    health_probe *probes = NULL, **obj = NULL;
+    struct pollfd *pfd = NULL;
+    size_t np = 0, n, i;
+    long long now, timeout;
+
+    pid = getpid();
+
+    if (Tsock != -1) close(Tsock);
+    if (Ssock != -1) close(Ssock);
+    if (Hsock != -1) close(Hsock);
+    admit_close();                                                      /* Queued clients stay with the main process */
+    for (s = ini; s; s = s->next)
+        if (s->h2_ctl != -1) close(s->h2_ctl);
+
+    signal(SIGHUP, health_trap_signal);
+    signal(SIGINT, health_trap_signal);
+    signal(SIGQUIT, health_trap_signal);
+    signal(SIGTERM, health_trap_signal);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    srandom(pid);
+    for (s = ini; s; s = s->next)
+        if (s->health && s->proxy_check != HEALTH_CHECK_NONE && s->section_balance != SECTION_BALANCE_DISABLED) np++;
+
+    if (!(probes = calloc(np, sizeof(health_probe))) || !(obj = calloc(np, sizeof(health_probe *))) ||
+        !(pfd = calloc(np, sizeof(struct pollfd)))) {
+
+        printl(LOG_CRIT, "Health checker is out of memory");
+        exit(1);
+    }
+
+    now = health_us();
+    for (n = 0, s = ini; s; s = s->next)
+        if (s->health && s->proxy_check != HEALTH_CHECK_NONE && s->section_balance != SECTION_BALANCE_DISABLED) {
+            probes[n].s = s;
+            probes[n].fd = -1;
+            probes[n].next = now + random() % 1000000;                  /* Spread the first probes */
+            printl(LOG_VERB, "Health check: [%s] section: [%s] every: [%u] seconds",
+                health_checks[s->proxy_check], s->section_name, s->proxy_check_interval);
+            n++;
+        }
+
+    while (!health_quit && getppid() == mpid) {
+        now = health_us();
+        n = 0;
+        for (i = 0; i < np; i++) {
+            timeout = (long long)MIN(HEALTH_TIMEOUT, probes[i].s->proxy_check_interval) * 1000000;
+            if (probes[i].stage == HP_IDLE && now >= probes[i].next) health_begin(&probes[i]);
+            if (probes[i].stage != HP_IDLE && now - probes[i].start >= timeout) health_done(&probes[i], 0);
+            if (probes[i].stage == HP_IDLE) continue;
+
+            pfd[n].fd = probes[i].fd;
+            pfd[n].events = probes[i].stage == HP_CONNECTING ? POLLOUT : POLLIN;
+            obj[n++] = &probes[i];
+        }
+
+        if (poll(pfd, n, 100) <= 0) continue;
+
+        for (i = 0; i < n; i++) {
+            if (!pfd[i].revents) continue;
+            if (obj[i]->stage == HP_CONNECTING) health_connected(obj[i]);
+            else if (obj[i]->stage == HP_WAITING) health_read(obj[i]);
+        }
+    }
+
+    printl(LOG_VERB, "Health checker exited");
+    exit(0);
+}
@@ -0,0 +1,85 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* -- Active health checks of proxy servers ------------------------------------------------------------------------- */
+#define HEALTH_CHECK_NONE       0                   /* proxy_check values in memory */
+#define HEALTH_CHECK_TCP        1
+#define HEALTH_CHECK_SOCKS5     2
+#define HEALTH_CHECK_HTTP       3
+#define HEALTH_CHECK_SSH        4
+
+#define HEALTH_INTERVAL_DEFAULT 10                  /* Seconds between probes of a section */
+#define HEALTH_RISE_DEFAULT     2                   /* Successful probes to mark a down section up */
+#define HEALTH_FALL_DEFAULT     3                   /* Failed probes to mark an up section down */
+#define HEALTH_TIMEOUT          5                   /* Probe timeout in seconds, never longer than the interval */
+#define HEALTH_JITTER           10                  /* Interval jitter, +/- percent, not to probe in lockstep */
+
+/* -- Passive outlier detection: circuit breaker fed by the clients ------------------------------------------------ */
+#define BREAKER_CLOSED          0                   /* Breaker states: clients are routed */
+#define BREAKER_OPEN            1                   /* the section is ejected until the window ends */
+#define BREAKER_HALFOPEN        2                   /* a trickle of clients tests the section */
+
+#define BREAKER_FAILURES_DEFAULT 5                  /* Consecutive client failures to trip the breaker, 0: off */
+#define BREAKER_EJECT_BASE      5                   /* The first ejection window in seconds, doubles on each trip */
+#define BREAKER_EJECT_MAX       300                 /* The longest ejection window */
+#define BREAKER_TRIAL           1                   /* Half-open: seconds between the clients let through */
+
+typedef struct section_health {                     /* Shared memory: the main process, the checker and clients */
+    volatile uint8_t up;                            /* 1: routed; 0: skipped by ini_look_server() */
+    uint8_t seen;                                   /* Main process: the last state acted upon */
+    unsigned int rise;                              /* Checker: consecutive successful probes */
+    unsigned int fall;                              /* Checker: consecutive failed probes */
+    volatile unsigned int rtt;                      /* Probe round trip time EWMA in microseconds, 0: unknown */
+    volatile time_t checked;                        /* The last probe time */
+
+    /* Updated by the clients with __atomic builtins */
+    uint8_t breaker;                                /* BREAKER_CLOSED, BREAKER_OPEN or BREAKER_HALFOPEN */
+    unsigned int failures;                          /* Consecutive connect or handshake failures */
+    unsigned int ejections;                         /* Consecutive trips, each doubles the ejection window */
+    time_t until;                                   /* Open: ejected until this time */
+    time_t trial;                                   /* Half-open: the next client let through not before */
+    unsigned int latency;                           /* Connect and handshake time EWMA in microseconds, 0: unknown */
+    unsigned int rr;                                /* Pool: weighted round-robin position, in the first member */
+} section_health;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+struct ini_section;
+
+void health_init(struct ini_section *ini);
+void health_start(struct ini_section *ini);
+void health_stop(struct ini_section *ini);
+int health_reaped(pid_t pid);
+void health_update(struct ini_section **ini);
+int health_usable(struct ini_section *s);
+void health_success(struct ini_section *s, unsigned int latency);
+void health_failure(struct ini_section *s);
+void health_acquire(struct ini_section *s);
+void health_release(void);
@@ -25,6 +25,8 @@
 
 /* -- HTTP proxy (CONNECT method) implementation -------------------------------------------------------------------- */
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 
@@ -32,38 +34,48 @@
 #include "network.h"
 #include "base64.h"
 #include "http.h"
+#include "tls.h"
 #include "logfile.h"
 
 /* ------------------------------------------------------------------------------------------------------------------ */
 extern char *pfile_name;
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int http_server_request(int socket, struct uvaddr *daddr) {
-    char buf[64 * BUF_SIZE_1KB] = {0};
-    char rbuf[STR_SIZE] = {0};
-    int l = 0;
+int http_server_request_step(cbuf *c, struct uvaddr *daddr) {
+    /* Receive client's CONNECT request as far as it has come, then parse it. Data pipelined after its header, e.g. TLS
+    ClientHello, stays in the buffer to be forwarded into the tunnel. The client is replied by http_server_reply() when
+    the tunnel is ready or failed; Return HS_DONE, HS_WANT_READ to be called again when the client is readable or
+    HS_ERROR */
+
+    char *buf, *end = NULL;
 
-    int rcount = 0;
     char *method = NULL, *url = NULL, *proto = NULL;
     char host[HOST_NAME_MAX] = {0};
     uint16_t port = 80;
+    int r;
 
-    if ((rcount = recv(socket, &buf, sizeof(buf), 0)) == -1) {
+    if ((r = cbuf_want_until(c, "\r\n\r\n", &end)) != HS_DONE) {
         /* Quit immediately; no reply to the client */
-        printl(LOG_WARN, "Unable to receive a request from the HTTP client");
-        return 1;
+        if (r == HS_ERROR) printl(LOG_WARN, "Unable to receive a request from the HTTP client");
+        return r;
     }
 
-    if (memcmp(HTTP_REQUEST_METHOD_CONNECT, &buf, strlen(HTTP_REQUEST_METHOD_CONNECT))) {
+    buf = c->data + c->off;
+    if (memcmp(HTTP_REQUEST_METHOD_CONNECT, buf, strlen(HTTP_REQUEST_METHOD_CONNECT))) {
         printl(LOG_WARN, "Incorrect HTTP method in the request");
-        return 1;
+        return HS_ERROR;
     }
 
-    /* Parse HTTP request */
-    buf[rcount] = '\0';
+    /* Parse HTTP request header, the buffer keeps the bytes after it */
+    end[2] = '\0';
+    c->off = end + 4 - c->data;
     method = strtok(buf,  " \t\r\n");
     url = strtok(NULL, " \t\r\n");
     proto = strtok(NULL, " \t\r\n");
+    if (!url || !proto) {
+        printl(LOG_WARN, "Incomplete HTTP request line");
+        return HS_ERROR;
+    }
 
     /* printl(LOG_VERB, "URL: [%s]", url); */
     if (sscanf(url, "https://%[a-zA-Z0-9.-]/", host) != 1)
@@ -72,107 +84,173 @@ int http_server_request(int socket, struct uvaddr *daddr) {
                 if (sscanf(url, "%[a-zA-Z0-9.-]:%hu", host, &port) != 2)
                     if (sscanf(url, "%[a-zA-Z0-9.-]", host) != 1) {
                         printl(LOG_WARN, "Unable to discover target host in the URL-part: [%s] of HTTP request", url);
-                        return 1;
+                        return HS_ERROR;
                     }
 
     /* TODO: Validate the request */
     strcpy(daddr->name, host);
-    daddr->ip_addr = str2inet(daddr->name, NULL);
-    if (SA_FAMILY(daddr->ip_addr) == AF_INET) SIN4_PORT(daddr->ip_addr) = htons(port);
-    else SIN6_PORT(daddr->ip_addr) = port;
-
-    /* TODO: Check connection; Reply real status */
-    l = snprintf(rbuf, sizeof(rbuf), "%s %s OK\r\nProxy-agent: %s\r\n\r\n", proto, HTTP_RESPONSE_200, PROG_NAME_FULL);
-    if (l < 1 || send(socket, rbuf, l, 0) == -1) {
-        printl(LOG_CRIT, "Unable to send reply to the HTTP client");
-        return 1;
-    }
+    SA_FAMILY(daddr->ip_addr) = AF_UNSPEC;                             /* Resolved by uvaddr_resolve() if needed */
+    SIN4_PORT(daddr->ip_addr) = htons(port);
 
     printl(LOG_VERB, "INTERNAL HTTP got REQUEST: URL: [%s] METHOD: [%s], HOST: [%s], PORT: [%hu], PROTO: [%s]",
         url, method, host, port, proto);
+    if (c->len > c->off)
+        printl(LOG_VERB, "HTTP client pipelined: [%d] bytes after the request", (int)(c->len - c->off));
+
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int http_server_request(cbuf *c, struct uvaddr *daddr) {
+    /* Blocking http_server_request_step(); Return 0 or 1 on error */
+
+    int r;
+
+    while ((r = http_server_request_step(c, daddr)) == HS_WANT_READ)
+        if (cbuf_wait(c)) return 1;
+
+    return r != HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int http_server_reply(int sock, char *status) {
+    /* Reply the client's CONNECT request: HTTP_RESPONSE_200 opens the tunnel, errors close the connection; Return 0 or
+    1 on failure */
+
+    char rbuf[STR_SIZE] = {0};
+    int l;
+
+    if (!strcmp(status, HTTP_RESPONSE_200))
+        l = snprintf(rbuf, sizeof(rbuf), "%s %s OK\r\nProxy-agent: %s\r\n\r\n",
+            HTTP_REQEST_PROTOCOL, status, PROG_NAME_FULL);
+    else
+        l = snprintf(rbuf, sizeof(rbuf), "%s %s %s\r\nProxy-agent: %s\r\n%sContent-Length: 0\r\n"
+            "Connection: close\r\n\r\n", HTTP_REQEST_PROTOCOL, status,
+            strcmp(status, HTTP_RESPONSE_503) ? "Bad Gateway" : "Service Unavailable", PROG_NAME_FULL,
+            strcmp(status, HTTP_RESPONSE_503) ? "" : "Retry-After: 1\r\n");
+
+    if (l < 1 || send(sock, rbuf, l, MSG_DONTWAIT) == -1) {
+        printl(LOG_WARN, "Unable to send reply: [%s] to the HTTP client", status);
+        return 1;
+    }
 
     return 0;
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int http_client_request(chs cs, struct sockaddr_storage *daddr, char *user, char *password, int sdpi) {
-    char r[BUF_SIZE_1KB] = {0};
-    char b[HOST_NAME_MAX] = {0};
+int http_auth_template(char **tpl, char *user, char *password) {
+    /* Build Proxy-Authorization header line once per INI-section; Return its length or 0 */
+
     char usr_pwd_plain[BUF_SIZE_1KB] = {0};
     char *usr_pwd_base64;
+    int l;
+
+    if (!user || !password) return 0;
+
+    snprintf(usr_pwd_plain, sizeof(usr_pwd_plain), "%s:%s", user, password);
+    base64_strenc(&usr_pwd_base64, usr_pwd_plain);
+    l = strlen(HTTP_HEADER_PROXYAUTH_BASIC) + strlen(usr_pwd_base64) + 2;
+    if ((*tpl = malloc(l + 1)))
+        sprintf(*tpl, "%s%s\r\n", HTTP_HEADER_PROXYAUTH_BASIC, usr_pwd_base64);
+    free(usr_pwd_base64);
+
+    return *tpl ? l : 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void http_request_start(hs *h, struct sockaddr_storage *daddr, char *dname, char *auth, int auth_len, int sdpi) {
+    /* Prepare HTTP CONNECT request in h. Over a plain socket, a non-zero sdpi sends the first sdpi bytes separately to
+    bypass DPI; fragmenting is useless over TLS and SSH2: the payload is encrypted */
+
+    size_t l;
+
+    /* Request startline: CONNECT host:port or address:port PROTOCOL, then the precompiled auth header, if any */
+    memcpy(h->buf, HTTP_REQUEST_METHOD_CONNECT " ", l = sizeof(HTTP_REQUEST_METHOD_CONNECT));
+    if (dname && dname[0])
+        snprintf(h->buf + l, HOST_NAME_MAX + 7, "%s:%d", dname, ntohs(SIN4_PORT(*daddr)));    /* Same offset for IPv6 */
+    else
+        inet2str(daddr, h->buf + l);
+    l += strlen(h->buf + l);
+    memcpy(h->buf + l, " " HTTP_REQEST_PROTOCOL "\r\n", sizeof(HTTP_REQEST_PROTOCOL) + 2);
+    l += sizeof(HTTP_REQEST_PROTOCOL) + 2;
+    if (auth && l + auth_len + 3 < sizeof(h->buf)) {
+        memcpy(h->buf + l, auth, auth_len);
+        l += auth_len;
+    }
+    memcpy(h->buf + l, "\r\n", 3);
+    l += 2;
+
+    h->status = 1;
+    h->pos = 0;
+    if (sdpi > 0 && (size_t)sdpi < l && h->cs.t == CHS_SOCKET) {
+        printl(LOG_VERB, "Trying to bypass Deep Packet Inspections for HTTP proxy. Fragment size: [%d]", sdpi);
+        h->state = HS_HTTP_FRAGMENT;
+        h->len = sdpi;
+    } else {
+        h->state = HS_HTTP_SEND;
+        h->len = l;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int http_request_step(hs *h) {
+    /* Advance HTTP CONNECT request: send it, receive the reply headers exactly; h->status is 0 on success */
+
     char *proto = NULL, *status = NULL, *reason = NULL;
-    int rcount = 0;
-    int l = 0;
-
-    /* Request startline: CONNECT address:port PROTOCOL */
-    if (user && password) {
-        sprintf(usr_pwd_plain, "%s:%s", user, password);
-        base64_strenc(&usr_pwd_base64, usr_pwd_plain);
-        l = snprintf(r, sizeof(r), "%s %s %s\r\n%s %s\r\n\r\n",
-            HTTP_REQUEST_METHOD_CONNECT, inet2str(daddr, b), HTTP_REQEST_PROTOCOL,
-            HTTP_HEADER_PROXYAUTH_BASIC, usr_pwd_base64);
-    } else
-        l = snprintf(r, sizeof(r), "%s %s %s\r\n\r\n",
-            HTTP_REQUEST_METHOD_CONNECT, inet2str(daddr, b), HTTP_REQEST_PROTOCOL);
+    int r;
 
-    printl(LOG_VERB, "Sending HTTP %s request", HTTP_REQUEST_METHOD_CONNECT);
+    switch (h->state) {
+        case HS_HTTP_FRAGMENT:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "SDPI: Unable to send a request to the HTTP server");
+            if (r != HS_DONE) return r;
 
-    switch (cs.t) {
-        case CHS_SOCKET:
-            if (sdpi) {
-                printl(LOG_VERB, "Trying to bypass Deep Packet Inspections for HTTP proxy. Fragment size: [%d]", sdpi);
-
-                if (send(cs.s, r, sdpi, 0) == -1 || send(cs.s, r + sdpi, l - sdpi, 0) == -1) {
-                    printl(LOG_CRIT, "SDPI: Unable to send a request to the HTTP server via socket");
-                    return 1;
-                }
-            } else
-                if (send(cs.s, r, l, 0) == -1) {
-                    printl(LOG_CRIT, "Unable to send a request to the HTTP server via socket");
-                    return 1;
-                }
+            h->state = HS_HTTP_SEND;
+            h->len = strlen(h->buf);                                    /* The request is a NUL-terminated text */
+            /* Fall through */
 
-            printl(LOG_VERB, "Expecting HTTP reply");
+        case HS_HTTP_SEND:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "Unable to send a request to the HTTP server");
+            if (r != HS_DONE) return r;
 
-            if ((rcount = recv(cs.s, &r, sizeof(r), 0)) == -1) {
-                printl(LOG_CRIT, "Unable to receive a reply from the HTTP server via socket");
-                return 1;
-            }
-        break;
+            printl(LOG_VERB, "Expecting HTTP reply");
+            h->state = HS_HTTP_REPLY;
+            h->pos = 0;
+            /* Fall through */
 
-        case CHS_CHANNEL:
-            #if (WITH_LIBSSH2)
-                if (libssh2_channel_write(cs.c, (char*)&r, l) < 0) {
-                    printl(LOG_CRIT, "Unable to send a request to the HTTP server via SSH2 channel");
-                    return 1;
-                }
-
-                while ((rcount = libssh2_channel_read(cs.c, (char*)&r, sizeof(r))) == LIBSSH2_ERROR_EAGAIN) ;
-                if (rcount < 0) {
-                    printl(LOG_CRIT, "Unable to send a request to the HTTP server via SSH2 channel");
-                    return 1;
-                }
-            #endif
+        case HS_HTTP_REPLY:
+            if ((r = hs_io_until(h, "\r\n\r\n")) == HS_ERROR)
+                printl(LOG_CRIT, "Unable to receive a reply from the HTTP server");
+            if (r != HS_DONE) return r;
         break;
 
         default:
-            printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-            return 1;
-        break;
-        }
+            return HS_ERROR;
+    }
 
     /* Parse HTTP reply */
-    r[rcount] = '\0';
-    proto = strtok(r,  " \t\r\n");
+    proto = strtok(h->buf, " \t\r\n");
     status = strtok(NULL, " \t\r\n");
     reason = strtok(NULL, " \t\r\n");
 
     printl(LOG_VERB, "External HTTP send RESPONSE: PROTO: [%s] STATUS: [%s], REASON: [%s]", proto, status, reason);
 
-    if (strcmp(status, HTTP_RESPONSE_200)) {
-        printl(LOG_INFO, "Non-succesful responce [%s] from the HTTP server", status);
-        return 1;
+    if (!status || strcmp(status, HTTP_RESPONSE_200)) {
+        printl(LOG_INFO, "Non-succesful responce [%s] from the HTTP server", status ? status : "");
+        return HS_ERROR;
     }
 
-    return 0;
+    h->status = 0;
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int http_client_request(chs cs, struct sockaddr_storage *daddr, char *dname, char *auth, int auth_len, int sdpi) {
+    /* Perform HTTP CONNECT request on a blocking transport; Return 0 on success or 1 */
+
+    hs h;
+
+    h.cs = cs;
+    printl(LOG_VERB, "Sending HTTP %s request", HTTP_REQUEST_METHOD_CONNECT);
+    http_request_start(&h, daddr, dname, auth, auth_len, sdpi);
+    return hs_run(&h, http_request_step) == HS_DONE ? h.status : 1;
 }
@@ -33,9 +33,22 @@
 #define HTTP_REQEST_PROTOCOL        "HTTP/1.1"
 
 #define HTTP_RESPONSE_200           "200"
+#define HTTP_RESPONSE_502           "502"           /* The proxy servers failed */
+#define HTTP_RESPONSE_503           "503"           /* Over the admission limits */
 
-#define HTTP_HEADER_PROXYAUTH_BASIC "Proxy-Authorization: Basic "
+#define HTTP_HEADER_PROXYAUTH       "Proxy-Authorization: "
+#define HTTP_HEADER_PROXYAUTH_BASIC HTTP_HEADER_PROXYAUTH "Basic "
+
+/* Resumable client handshake states */
+#define HS_HTTP_FRAGMENT            0               /* Sending the first SDPI fragment of the request */
+#define HS_HTTP_SEND                1               /* Sending the request */
+#define HS_HTTP_REPLY               2               /* Receiving the reply headers */
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int http_server_request(int socket, struct uvaddr *daddr);
-int http_client_request(chs cs, struct sockaddr_storage *daddr, char *user, char *password, int sdpi);
+int http_server_request_step(cbuf *c, struct uvaddr *daddr);
+int http_server_request(cbuf *c, struct uvaddr *daddr);
+int http_server_reply(int sock, char *status);
+int http_auth_template(char **tpl, char *user, char *password);
+void http_request_start(hs *h, struct sockaddr_storage *daddr, char *dname, char *auth, int auth_len, int sdpi);
+int http_request_step(hs *h);
+int http_client_request(chs cs, struct sockaddr_storage *daddr, char *dname, char *auth, int auth_len, int sdpi);
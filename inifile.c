@@ -33,18 +33,60 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/param.h>
+#include <sys/mman.h>
 
 #include "utility.h"
 #include "network.h"
 #include "socks.h"
 #include "http.h"
 #include "ssh2.h"
+#include "tls.h"
+#include "h2.h"
+#include "health.h"
+#include "pool.h"
+#include "timer.h"
+#include "relay.h"
+#include "shaper.h"
+#include "admit.h"
 #include "logfile.h"
 #include "pidfile.h"
 #include "xedec.h"
 #include "inifile.h"
 
 
+/* ------------------------------------------------------------------------------------------------------------------ */
+static src_pool *source_pool(struct ini_section *s) {
+    /* Map the source addresses of the section on its first source_* entry: the clients share the usage counters;
+    Return the pool or NULL */
+
+    if (s->source) return s->source;
+
+    s->source = mmap(NULL, sizeof(src_pool), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (s->source == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map shared memory for the source addresses of section: [%s]", s->section_name);
+        s->source = NULL;
+    }
+
+    return s->source;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static shaper *rate_shaper(struct ini_section *s) {
+    /* Map the rate buckets of the section on its first rate entry: the clients share the tokens; Return the shaper
+    or NULL */
+
+    if (s->shaper) return s->shaper;
+
+    s->shaper = mmap(NULL, sizeof(shaper), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+    if (s->shaper == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map shared memory for the rates of section: [%s]", s->section_name);
+        s->shaper = NULL;
+    }
+
+    return s->shaper;
+}
+
 /* ------------------------------------------------------------------------------------------------------------------ */
 ini_section *read_ini(char *ifile_name) {
     /* Read and parse INI-file */
@@ -60,6 +102,8 @@ ini_section *read_ini(char *ifile_name) {
     int ln = 0;
     char *proxy_server = NULL, *proxy_port = NULL;
     int fproxy_port = 0;
+    long x_size = 0;                                                    /* Parsed size values */
+    struct sockaddr_storage src;                                        /* Parsed source address */
 
 
     if (!(fini = fopen(ifile_name, "r"))) {
@@ -93,6 +137,10 @@ ini_section *read_ini(char *ifile_name) {
             c_sect = (struct ini_section *)malloc(sizeof(struct ini_section));
             c_sect->section_name = strndup(section, sizeof section);
             c_sect->section_balance = SECTION_BALANCE_FAILOVER;
+            c_sect->section_race = SECTION_RACE_DEFAULT;
+            c_sect->section_pool = NULL;
+            c_sect->section_pool_policy = POOL_POLICY_UNSET;
+            c_sect->section_weight = POOL_WEIGHT_DEFAULT;
             memset(&c_sect->proxy_server, 0, sizeof(struct sockaddr_storage));
             c_sect->proxy_type = PROXY_PROTO_SOCKS_V5;
             c_sect->proxy_user = NULL;
@@ -100,11 +148,54 @@ ini_section *read_ini(char *ifile_name) {
             c_sect->proxy_key_passphrase = NULL;
             c_sect->proxy_key = NULL;
             c_sect->proxy_ssh_force_auth = 'N';
+            c_sect->proxy_ssh_crypt = NULL;
+            c_sect->proxy_ssh_mac = NULL;
+            c_sect->proxy_ssh_compress = 'N';
+            c_sect->proxy_ssh_window = 0;
+            c_sect->proxy_ssh_packet = 0;
+            c_sect->proxy_tls_name = NULL;
+            c_sect->proxy_tls_ca = NULL;
+            c_sect->proxy_tls_verify = 'Y';
+            c_sect->proxy_h2 = 'N';
+            c_sect->proxy_tfo = 'N';
+            c_sect->proxy_h2_streams = H2_STREAMS_DEFAULT;
+            c_sect->proxy_h2_conns = H2_CONNS_DEFAULT;
+            c_sect->proxy_check = HEALTH_CHECK_NONE;
+            c_sect->proxy_breaker = BREAKER_FAILURES_DEFAULT;
+            c_sect->proxy_check_interval = HEALTH_INTERVAL_DEFAULT;
+            c_sect->proxy_check_rise = HEALTH_RISE_DEFAULT;
+            c_sect->proxy_check_fall = HEALTH_FALL_DEFAULT;
+            memset(&c_sect->proxy_check_target, 0, sizeof(struct sockaddr_storage));
+            c_sect->proxy_connect_timeout = TIMEOUT_CONNECT_DEFAULT;
+            c_sect->proxy_handshake_timeout = TIMEOUT_HANDSHAKE_DEFAULT;
+            c_sect->proxy_idle_timeout = TIMEOUT_IDLE_DEFAULT;
+            c_sect->proxy_max_clients = 0;
+            c_sect->proxy_max_pending = 0;
+            c_sect->proxy_queue = 0;
+            c_sect->proxy_queue_timeout = ADMIT_WAIT_DEFAULT;
+            c_sect->proxy_buffer = RELAY_BUFFER_DEFAULT;
+            c_sect->proxy_zerocopy = 'N';
+            c_sect->socket_profile = NULL;
+            sock_opts_init(&c_sect->socket);
+            c_sect->source = NULL;
+            c_sect->shaper = NULL;
             c_sect->p_chain = NULL;
+            c_sect->tpl_http_auth = NULL;
+            c_sect->tpl_http_auth_len = 0;
+            c_sect->tpl_s5_auth = NULL;
+            c_sect->tpl_s5_auth_len = 0;
+            c_sect->tpl_s4_request = NULL;
+            c_sect->tpl_s4_request_len = 0;
+            c_sect->tls_ctx = NULL;
             c_sect->target_entry = NULL;
             c_sect->nit_domain = NULL;
             memset(&c_sect->nit_ipaddr, 0, sizeof(struct sockaddr_storage));
             memset(&c_sect->nit_ipmask, 0, sizeof(struct sockaddr_storage));
+            c_sect->h2_ctl = -1;
+            c_sect->h2_pid = 0;
+            c_sect->health = NULL;
+            c_sect->load = NULL;
+            c_sect->pool = NULL;
 
             c_sect->next = NULL;
 
@@ -190,6 +281,13 @@ ini_section *read_ini(char *ifile_name) {
                             }
                         break;
 
+                        case PROXY_PROTO_HTTPS:
+                            if (!proxy_port) {
+                                proxy_port = HTTPS_PORT;
+                                c_sect->proxy_server = str2inet(proxy_server, HTTPS_PORT);
+                            }
+                        break;
+
                         default:
                             printl(LOG_WARN, "LN: [%d] Resetting unsupported proxy type [%c] to default: [%c]",
                                 ln, c_sect->proxy_type, PROXY_PROTO_SOCKS_V5);
@@ -242,6 +340,291 @@ ini_section *read_ini(char *ifile_name) {
                 if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_FORCE_AUTH)) {
                     chk_inivar(&c_sect->proxy_ssh_force_auth, INI_ENTRY_PROXY_SSH_FORCE_AUTH, ln);
                     c_sect->proxy_ssh_force_auth = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_CRYPT)) {
+                    if (chk_inivar(&c_sect->proxy_ssh_crypt, INI_ENTRY_PROXY_SSH_CRYPT, ln))
+                            free(c_sect->proxy_ssh_crypt);
+
+                    c_sect->proxy_ssh_crypt = strdup(entry.val);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_MAC)) {
+                    if (chk_inivar(&c_sect->proxy_ssh_mac, INI_ENTRY_PROXY_SSH_MAC, ln))
+                            free(c_sect->proxy_ssh_mac);
+
+                    c_sect->proxy_ssh_mac = strdup(entry.val);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_COMPRESS)) {
+                    chk_inivar(&c_sect->proxy_ssh_compress, INI_ENTRY_PROXY_SSH_COMPRESS, ln);
+                    c_sect->proxy_ssh_compress = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_WINDOW)) {
+                    chk_inivar(&c_sect->proxy_ssh_window, INI_ENTRY_PROXY_SSH_WINDOW, ln);
+                    if ((x_size = tosize(entry.val)) < SSH2_WINDOW_MIN || x_size > SSH2_WINDOW_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to libssh2 default", ln, INI_ENTRY_PROXY_SSH_WINDOW);
+                        x_size = 0;
+                    }
+                    c_sect->proxy_ssh_window = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_SSH_PACKET)) {
+                    chk_inivar(&c_sect->proxy_ssh_packet, INI_ENTRY_PROXY_SSH_PACKET, ln);
+                    if ((x_size = tosize(entry.val)) < SSH2_PACKET_MIN || x_size > SSH2_PACKET_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to libssh2 default", ln, INI_ENTRY_PROXY_SSH_PACKET);
+                        x_size = 0;
+                    }
+                    c_sect->proxy_ssh_packet = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_TLS_NAME)) {
+                    if (chk_inivar(&c_sect->proxy_tls_name, INI_ENTRY_PROXY_TLS_NAME, ln))
+                            free(c_sect->proxy_tls_name);
+
+                    c_sect->proxy_tls_name = strdup(entry.val);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_TLS_CA)) {
+                    if (chk_inivar(&c_sect->proxy_tls_ca, INI_ENTRY_PROXY_TLS_CA, ln))
+                            free(c_sect->proxy_tls_ca);
+
+                    c_sect->proxy_tls_ca = strdup(entry.val);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_TLS_VERIFY)) {
+                    chk_inivar(&c_sect->proxy_tls_verify, INI_ENTRY_PROXY_TLS_VERIFY, ln);
+                    c_sect->proxy_tls_verify = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_H2)) {
+                    chk_inivar(&c_sect->proxy_h2, INI_ENTRY_PROXY_H2, ln);
+                    c_sect->proxy_h2 = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_TFO)) {
+                    chk_inivar(&c_sect->proxy_tfo, INI_ENTRY_PROXY_TFO, ln);
+                    c_sect->proxy_tfo = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_H2_STREAMS)) {
+                    chk_inivar(&c_sect->proxy_h2_streams, INI_ENTRY_PROXY_H2_STREAMS, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_H2_STREAMS);
+                        x_size = H2_STREAMS_DEFAULT;
+                    }
+                    c_sect->proxy_h2_streams = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_H2_CONNS)) {
+                    chk_inivar(&c_sect->proxy_h2_conns, INI_ENTRY_PROXY_H2_CONNS, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_H2_CONNS);
+                        x_size = H2_CONNS_DEFAULT;
+                    }
+                    c_sect->proxy_h2_conns = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CHECK)) {
+                    chk_inivar(&c_sect->proxy_check, INI_ENTRY_PROXY_CHECK, ln);
+                    if (!strcasecmp(entry.val, "tcp"))
+                        c_sect->proxy_check = HEALTH_CHECK_TCP;
+                    else if (!strcasecmp(entry.val, "socks5"))
+                        c_sect->proxy_check = HEALTH_CHECK_SOCKS5;
+                    else if (!strcasecmp(entry.val, "http"))
+                        c_sect->proxy_check = HEALTH_CHECK_HTTP;
+                    else if (!strcasecmp(entry.val, "ssh"))
+                        c_sect->proxy_check = HEALTH_CHECK_SSH;
+                    else {
+                        if (strcasecmp(entry.val, "none"))
+                            printl(LOG_WARN, "LN: [%d] Unknown [%s] probe: [%s], disabling health checks",
+                                ln, INI_ENTRY_PROXY_CHECK, entry.val);
+                        c_sect->proxy_check = HEALTH_CHECK_NONE;
+                    }
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CHECK_INTERVAL)) {
+                    chk_inivar(&c_sect->proxy_check_interval, INI_ENTRY_PROXY_CHECK_INTERVAL, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_CHECK_INTERVAL);
+                        x_size = HEALTH_INTERVAL_DEFAULT;
+                    }
+                    c_sect->proxy_check_interval = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CHECK_RISE)) {
+                    chk_inivar(&c_sect->proxy_check_rise, INI_ENTRY_PROXY_CHECK_RISE, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_CHECK_RISE);
+                        x_size = HEALTH_RISE_DEFAULT;
+                    }
+                    c_sect->proxy_check_rise = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CHECK_FALL)) {
+                    chk_inivar(&c_sect->proxy_check_fall, INI_ENTRY_PROXY_CHECK_FALL, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_CHECK_FALL);
+                        x_size = HEALTH_FALL_DEFAULT;
+                    }
+                    c_sect->proxy_check_fall = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_BREAKER)) {
+                    chk_inivar(&c_sect->proxy_breaker, INI_ENTRY_PROXY_BREAKER, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_BREAKER);
+                        x_size = BREAKER_FAILURES_DEFAULT;
+                    }
+                    c_sect->proxy_breaker = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CONNECT_TIMEOUT)) {
+                    chk_inivar(&c_sect->proxy_connect_timeout, INI_ENTRY_PROXY_CONNECT_TIMEOUT, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_CONNECT_TIMEOUT);
+                        x_size = TIMEOUT_CONNECT_DEFAULT;
+                    }
+                    c_sect->proxy_connect_timeout = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_HANDSHAKE_TIMEOUT)) {
+                    chk_inivar(&c_sect->proxy_handshake_timeout, INI_ENTRY_PROXY_HANDSHAKE_TIMEOUT, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_HANDSHAKE_TIMEOUT);
+                        x_size = TIMEOUT_HANDSHAKE_DEFAULT;
+                    }
+                    c_sect->proxy_handshake_timeout = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_IDLE_TIMEOUT)) {
+                    chk_inivar(&c_sect->proxy_idle_timeout, INI_ENTRY_PROXY_IDLE_TIMEOUT, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_IDLE_TIMEOUT);
+                        x_size = TIMEOUT_IDLE_DEFAULT;
+                    }
+                    c_sect->proxy_idle_timeout = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_MAX_CLIENTS)) {
+                    chk_inivar(&c_sect->proxy_max_clients, INI_ENTRY_PROXY_MAX_CLIENTS, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_MAX_CLIENTS);
+                        x_size = 0;
+                    }
+                    c_sect->proxy_max_clients = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_MAX_PENDING)) {
+                    chk_inivar(&c_sect->proxy_max_pending, INI_ENTRY_PROXY_MAX_PENDING, ln);
+                    if ((x_size = atoi(entry.val)) < 0) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_MAX_PENDING);
+                        x_size = 0;
+                    }
+                    c_sect->proxy_max_pending = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_QUEUE)) {
+                    chk_inivar(&c_sect->proxy_queue, INI_ENTRY_PROXY_QUEUE, ln);
+                    if ((x_size = atoi(entry.val)) < 0 || x_size > ADMIT_QUEUE_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_QUEUE);
+                        x_size = 0;
+                    }
+                    c_sect->proxy_queue = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_QUEUE_TIMEOUT)) {
+                    chk_inivar(&c_sect->proxy_queue_timeout, INI_ENTRY_PROXY_QUEUE_TIMEOUT, ln);
+                    if ((x_size = atoi(entry.val)) < 1) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_QUEUE_TIMEOUT);
+                        x_size = ADMIT_WAIT_DEFAULT;
+                    }
+                    c_sect->proxy_queue_timeout = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_BUFFER)) {
+                    chk_inivar(&c_sect->proxy_buffer, INI_ENTRY_PROXY_BUFFER, ln);
+                    if ((x_size = tosize(entry.val)) < RELAY_BUFFER_MIN || x_size > RELAY_BUFFER_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_PROXY_BUFFER);
+                        x_size = RELAY_BUFFER_DEFAULT;
+                    }
+                    c_sect->proxy_buffer = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_ZEROCOPY)) {
+                    chk_inivar(&c_sect->proxy_zerocopy, INI_ENTRY_PROXY_ZEROCOPY, ln);
+                    c_sect->proxy_zerocopy = toupper(entry.val[0]);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_RATE) ||
+                    !strcasecmp(entry.var, INI_ENTRY_PROXY_RATE_BURST) ||
+                    !strcasecmp(entry.var, INI_ENTRY_PROXY_CLIENT_RATE) ||
+                    !strcasecmp(entry.var, INI_ENTRY_PROXY_CLIENT_BURST)) {
+                    if ((x_size = tosize(entry.val)) < SHAPER_RATE_MIN || x_size > SHAPER_RATE_MAX)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value: [%s]", ln, entry.var, entry.val);
+                    else if (rate_shaper(c_sect)) {
+                        if (!strcasecmp(entry.var, INI_ENTRY_PROXY_RATE)) c_sect->shaper->rate = x_size;
+                        else if (!strcasecmp(entry.var, INI_ENTRY_PROXY_RATE_BURST)) c_sect->shaper->burst = x_size;
+                        else if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CLIENT_RATE)) c_sect->shaper->crate = x_size;
+                        else c_sect->shaper->cburst = x_size;
+                    }
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOURCE_ADDRESS)) {
+                    x = entry.val;
+                    while (source_pool(c_sect) && (s = strsep(&x, ",")) != NULL) {
+                        if (!*s) continue;
+                        if (c_sect->source->n == SOURCE_ADDRESSES_MAX) {
+                            printl(LOG_WARN, "LN: [%d] Too many [%s] values, ignoring: [%s]", ln,
+                                INI_ENTRY_SOURCE_ADDRESS, s);
+                            continue;
+                        }
+                        src = str2inet(s, NULL);
+                        if (SA_FAMILY(src) == AF_INET && S4_ADDR(src) == INADDR_NONE) {
+                            printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value: [%s]", ln, INI_ENTRY_SOURCE_ADDRESS, s);
+                            continue;
+                        }
+                        c_sect->source->a[c_sect->source->n++].addr = src;
+                    }
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOURCE_INTERFACE)) {
+                    if (source_pool(c_sect)) strncpy(c_sect->source->dev, entry.val, SOURCE_DEVICE_LEN - 1);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_PROFILE)) {
+                    if (chk_inivar(&c_sect->socket_profile, INI_ENTRY_SOCKET_PROFILE, ln))
+                            free(c_sect->socket_profile);
+
+                    c_sect->socket_profile = strdup(entry.val);
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_SNDBUF)) {
+                    if ((x_size = tosize(entry.val)) < 1 || x_size > SOCKET_BUFFER_MAX)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_SNDBUF);
+                    else
+                        c_sect->socket.sndbuf = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_RCVBUF)) {
+                    if ((x_size = tosize(entry.val)) < 1 || x_size > SOCKET_BUFFER_MAX)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_RCVBUF);
+                    else
+                        c_sect->socket.rcvbuf = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_NODELAY)) {
+                    c_sect->socket.nodelay = toupper(entry.val[0]) == 'Y';
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_MPTCP)) {
+                    c_sect->socket.mptcp = toupper(entry.val[0]) == 'Y';
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_NOTSENT_LOWAT)) {
+                    if ((x_size = tosize(entry.val)) < 1 || x_size > SOCKET_BUFFER_MAX)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_NOTSENT_LOWAT);
+                    else
+                        c_sect->socket.notsent_lowat = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_CONGESTION)) {
+                    strncpy(c_sect->socket.cc, entry.val, SOCK_CC_LEN - 1);
+                    c_sect->socket.cc[SOCK_CC_LEN - 1] = 0;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_KEEPIDLE)) {
+                    if ((x_size = atoi(entry.val)) < 1)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_KEEPIDLE);
+                    else
+                        c_sect->socket.keepidle = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_KEEPINTVL)) {
+                    if ((x_size = atoi(entry.val)) < 1)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_KEEPINTVL);
+                    else
+                        c_sect->socket.keepintvl = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_KEEPCNT)) {
+                    if ((x_size = atoi(entry.val)) < 1)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_KEEPCNT);
+                    else
+                        c_sect->socket.keepcnt = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SOCKET_MARK)) {
+                    /* Marks are often written in hex, as in iptables and ip rule */
+                    if ((x_size = strtol(entry.val, (char **)NULL, 0)) < 0 || x_size > INT32_MAX)
+                        printl(LOG_WARN, "LN: [%d] Ignoring wrong [%s] value", ln, INI_ENTRY_SOCKET_MARK);
+                    else
+                        c_sect->socket.mark = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_PROXY_CHECK_TARGET)) {
+                    chk_inivar(&c_sect->proxy_check_target, INI_ENTRY_PROXY_CHECK_TARGET, ln);
+                    c_sect->proxy_check_target = str2inet(entry.val1, entry.mod1 ? entry.mod1 : HTTPS_PORT);
             } else
                 if (!strcasecmp(entry.var, INI_ENTRY_PROXY_KEY_PASSPHRASE)) {
                     if (chk_inivar(&c_sect->proxy_key_passphrase, INI_ENTRY_PROXY_KEY_PASSPHRASE, ln))
@@ -271,10 +654,38 @@ ini_section *read_ini(char *ifile_name) {
                         c_sect->section_balance = SECTION_BALANCE_ROUNDROBIN;
                     else if (!strcasecmp(entry.val, INI_ENTRY_SECTION_BALANCE_DISABLED))
                         c_sect->section_balance = SECTION_BALANCE_DISABLED;
+                    else if (!strcasecmp(entry.val, INI_ENTRY_SECTION_BALANCE_RACE))
+                        c_sect->section_balance = SECTION_BALANCE_RACE;
                     else {
                         printl(LOG_WARN, "Unknown section balance mode: [%s], setting default: Failover", entry.val);
                         c_sect->section_balance = SECTION_BALANCE_FAILOVER;
                     }
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SECTION_RACE)) {
+                    chk_inivar(&c_sect->section_race, INI_ENTRY_SECTION_RACE, ln);
+                    if ((x_size = atoi(entry.val)) < 2 || x_size > SECTION_RACE_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_SECTION_RACE);
+                        x_size = SECTION_RACE_DEFAULT;
+                    }
+                    c_sect->section_race = x_size;
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SECTION_POOL)) {
+                    chk_inivar(&c_sect->section_pool, INI_ENTRY_SECTION_POOL, ln);
+                    c_sect->section_pool = strdup(entry.val1);
+                    if (entry.mod1) {
+                        if ((x_size = pool_policy(entry.mod1)) < 0)
+                            printl(LOG_WARN, "LN: [%d] Unknown pool policy: [%s], using the pool default", ln,
+                                entry.mod1);
+                        else
+                            c_sect->section_pool_policy = x_size;
+                    }
+            } else
+                if (!strcasecmp(entry.var, INI_ENTRY_SECTION_WEIGHT)) {
+                    if ((x_size = atoi(entry.val)) < 1 || x_size > POOL_WEIGHT_MAX) {
+                        printl(LOG_WARN, "LN: [%d] Resetting [%s] to default", ln, INI_ENTRY_SECTION_WEIGHT);
+                        x_size = POOL_WEIGHT_DEFAULT;
+                    }
+                    c_sect->section_weight = x_size;
             } else
                 /* -- Parse nit_* entries --------------------------------------------------------------------------- */
                 if (!strcasecmp(entry.var, NS_INI_ENTRY_NIT_POOL)) {
@@ -381,6 +792,39 @@ ini_section *read_ini(char *ifile_name) {
 
     create_chains(ini_root, chain_root);
 
+    /* Merge socket profiles, options set in the section itself take precedence */
+    for (c_sect = ini_root; c_sect; c_sect = c_sect->next)
+        if (c_sect->socket_profile) {
+            if ((l_sect = getsection(ini_root, c_sect->socket_profile)) && l_sect != c_sect)
+                sock_opts_merge(&c_sect->socket, &l_sect->socket);
+            else
+                printl(LOG_WARN, "Socket profile: [%s] referenced from section: [%s] does not exist",
+                    c_sect->socket_profile, c_sect->section_name);
+        }
+
+    /* Bursts default to a second of the rate; a burst alone shapes nothing */
+    for (c_sect = ini_root; c_sect; c_sect = c_sect->next)
+        if (c_sect->shaper) {
+            if (c_sect->shaper->rate)
+                c_sect->shaper->burst = MAX(c_sect->shaper->burst ? : c_sect->shaper->rate, SHAPER_BURST_MIN);
+            if (c_sect->shaper->crate)
+                c_sect->shaper->cburst = MAX(c_sect->shaper->cburst ? : c_sect->shaper->crate, SHAPER_BURST_MIN);
+        }
+
+    /* Precompile handshake templates and TLS contexts: credentials never change until the INI-file is reloaded */
+    for (c_sect = ini_root; c_sect; c_sect = c_sect->next) {
+        c_sect->tpl_http_auth_len = http_auth_template(&c_sect->tpl_http_auth,
+            c_sect->proxy_user, c_sect->proxy_password);
+        c_sect->tpl_s5_auth_len = socks5_auth_template(&c_sect->tpl_s5_auth,
+            c_sect->proxy_user, c_sect->proxy_password);
+        c_sect->tpl_s4_request_len = socks4_request_template(&c_sect->tpl_s4_request, c_sect->proxy_user);
+        #if (WITH_LIBSSL)
+            if (c_sect->proxy_type == PROXY_PROTO_HTTPS) c_sect->tls_ctx = tls_context(c_sect);
+        #endif
+    }
+
+    pool_create(ini_root);
+
     fclose(fini);
     return ini_root;
 }
@@ -456,6 +900,7 @@ void show_ini(struct ini_section *ini, int loglvl) {
     struct proxy_chain *c;
     struct ini_target *t;
     char ip1[INET_ADDRPORTSTRLEN], ip2[INET_ADDRPORTSTRLEN];
+    unsigned int i;
 
     const char *ini_targets[] = {
         INI_ENTRY_TARGET_NOTSET,
@@ -469,10 +914,14 @@ void show_ini(struct ini_section *ini, int loglvl) {
         INI_ENTRY_SECTION_BALANCE_NONE,
         INI_ENTRY_SECTION_BALANCE_FAILOVER,
         INI_ENTRY_SECTION_BALANCE_ROUNDROBIN,
-        INI_ENTRY_SECTION_BALANCE_DISABLED
+        INI_ENTRY_SECTION_BALANCE_DISABLED,
+        INI_ENTRY_SECTION_BALANCE_RACE
     };
 
 
+    const char *health_checks[] = {"none", "tcp", "socks5", "http", "ssh"};
+    const char *breaker_states[] = {"closed", "open", "half-open"};
+
     printl(LOG_VERB, "Show INI-Configuration");
 
     s = ini;
@@ -483,6 +932,69 @@ void show_ini(struct ini_section *ini, int loglvl) {
             s->section_name, ini_balance[s->section_balance], inet2str(&s->proxy_server, ip1), s->proxy_type,
             s->proxy_user?:"", s->proxy_password ? "********" : "", s->proxy_key, s->proxy_ssh_force_auth);
 
+        /* Display racing */
+        if (s->section_balance == SECTION_BALANCE_RACE)
+            printl(loglvl, "SHOW Race: [%u] sections", s->section_race);
+
+        /* Display pool membership */
+        if (s->pool)
+            printl(loglvl, "SHOW Pool: [%s] Policy: [%s] Weight: [%u]",
+                s->pool->name, pool_policy_name(s->pool->policy), s->section_weight);
+
+        /* Display SSH2 transport tuning */
+        if (s->proxy_type == PROXY_PROTO_SSH2)
+            printl(loglvl, "SHOW SSH2 Ciphers: [%s] MACs: [%s] Compression: [%c] Window: [%u] Packet: [%u]",
+                s->proxy_ssh_crypt ? : "", s->proxy_ssh_mac ? : "", s->proxy_ssh_compress,
+                s->proxy_ssh_window, s->proxy_ssh_packet);
+
+        /* Display TLS settings */
+        if (s->proxy_type == PROXY_PROTO_HTTPS)
+            printl(loglvl, "SHOW TLS Name: [%s] CA: [%s] Verify: [%c]",
+                s->proxy_tls_name ? : "", s->proxy_tls_ca ? : "", s->proxy_tls_verify);
+
+        /* Display health checks */
+        if (s->proxy_check != HEALTH_CHECK_NONE)
+            printl(loglvl, "SHOW Health check: [%s] Interval: [%u] Rise: [%u] Fall: [%u] Target: [%s]",
+                health_checks[s->proxy_check], s->proxy_check_interval, s->proxy_check_rise, s->proxy_check_fall,
+                s->proxy_check_target.ss_family ? inet2str(&s->proxy_check_target, ip1) : "");
+        if (s->health)
+            printl(loglvl, "SHOW Health: [%s] RTT: [%u] us Breaker: [%s] after: [%u] failures Latency: [%u] us",
+                s->health->up ? "up" : "down", s->health->rtt, breaker_states[s->health->breaker],
+                s->proxy_breaker, s->health->latency);
+
+        if (s->proxy_max_clients || s->proxy_max_pending)
+            printl(loglvl, "SHOW Limits: Clients: [%u] of [%u] Pending: [%u] of [%u] Queue: [%u] of [%u] Wait: [%u] s "
+                "Refused: [%lu]", s->load ? s->load->pending + s->load->active : 0, s->proxy_max_clients,
+                s->load ? s->load->pending : 0, s->proxy_max_pending, s->load ? s->load->queued : 0,
+                s->proxy_queue, s->proxy_queue_timeout, s->load ? s->load->refused : 0);
+
+        printl(loglvl, "SHOW Deadlines: Connect: [%u] Handshake: [%u] Idle: [%u] s",
+            s->proxy_connect_timeout, s->proxy_handshake_timeout, s->proxy_idle_timeout);
+        printl(loglvl, "SHOW Relay buffer: up to [%zu] bytes per direction Zero-copy: [%c] TCP Fast Open: [%c]",
+            s->proxy_buffer, s->proxy_zerocopy, s->proxy_tfo);
+
+        /* Display socket options, -1: the system default */
+        printl(loglvl, "SHOW Socket profile: [%s] Buffers: [%d/%d] Nodelay: [%d] Lowat: [%d] Congestion: [%s] "
+            "Keepalive: [%d/%d/%d] Mark: [%d] MPTCP: [%d]",
+            s->socket_profile ? : "", s->socket.sndbuf, s->socket.rcvbuf, s->socket.nodelay, s->socket.notsent_lowat,
+            s->socket.cc, s->socket.keepidle, s->socket.keepintvl, s->socket.keepcnt, s->socket.mark, s->socket.mptcp);
+
+        /* Display source addresses and their usage */
+        if (s->source) {
+            printl(loglvl, "SHOW Source interface: [%s] addresses: [%u]", s->source->dev, s->source->n);
+            for (i = 0; i < s->source->n; i++)
+                printl(loglvl, "SHOW Source: [%s] Connections: [%lu] Errors: [%lu]",
+                    inet2str(&s->source->a[i].addr, ip1), s->source->a[i].conns, s->source->a[i].errors);
+        }
+
+        /* Display rates and their buckets */
+        shaper_show(s->shaper, loglvl);
+
+        /* Display HTTP/2 multiplexing */
+        if (s->proxy_h2 == 'Y')
+            printl(loglvl, "SHOW HTTP/2 Streams: [%u] Connections: [%u] Broker: [%d]",
+                s->proxy_h2_streams, s->proxy_h2_conns, s->h2_pid);
+
         /* Display Socks chain */
         if (s->p_chain) {
             printl(loglvl, "Proxy Chain:");
@@ -508,6 +1020,9 @@ void show_ini(struct ini_section *ini, int loglvl) {
         }
         s = s->next;
     }
+
+    /* Display the pools learned latency */
+    pool_show(loglvl);
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
@@ -521,6 +1036,7 @@ struct ini_section *delete_ini(struct ini_section *ini) {
 
     printl(LOG_VERB, "Delete INI-configuration");
 
+    pool_delete();
     while (ini) {
         printl(LOG_VERB, "DELETE Section: [%s]", ini->section_name);
 
@@ -557,7 +1073,21 @@ struct ini_section *delete_ini(struct ini_section *ini) {
         if (ini->proxy_password && ini->proxy_password[0]) free(ini->proxy_password);
         if (ini->proxy_key_passphrase && ini->proxy_key_passphrase[0]) free(ini->proxy_key_passphrase);
         if (ini->proxy_key && ini->proxy_key[0]) free(ini->proxy_key);
+        if (ini->proxy_ssh_crypt && ini->proxy_ssh_crypt[0]) free(ini->proxy_ssh_crypt);
+        if (ini->proxy_ssh_mac && ini->proxy_ssh_mac[0]) free(ini->proxy_ssh_mac);
+        if (ini->proxy_tls_name && ini->proxy_tls_name[0]) free(ini->proxy_tls_name);
+        if (ini->proxy_tls_ca && ini->proxy_tls_ca[0]) free(ini->proxy_tls_ca);
         if (ini->nit_domain && ini->nit_domain[0]) free(ini->nit_domain);
+        free(ini->section_pool);
+        free(ini->socket_profile);
+        if (ini->source) munmap(ini->source, sizeof(src_pool));
+        if (ini->shaper) munmap(ini->shaper, sizeof(shaper));
+        free(ini->tpl_http_auth);
+        free(ini->tpl_s5_auth);
+        free(ini->tpl_s4_request);
+        #if (WITH_LIBSSL)
+            SSL_CTX_free(ini->tls_ctx);
+        #endif
 
         /* Delete the section name */
         if (ini->section_name && ini->section_name[0]) free(ini->section_name);
@@ -585,8 +1115,8 @@ int pushback_ini(struct ini_section **ini, struct ini_section *target) {
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr addr_u) {
-    /* Lookup a Socks server ip in the list referred by ini */
+static struct ini_section *ini_look_any(struct ini_section *ini, struct uvaddr *addr_u) {
+    /* Lookup a Socks server ip in the list referred by ini, regardless of the section health */
 
     struct ini_section *s;
     struct ini_target *t;
@@ -595,9 +1125,12 @@ struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr addr_
     char host[HOST_NAME_MAX] = {0}, *domain = NULL;
     int domainlen = 0;
 
-    unsigned uport = htons(addr_u.ip_addr.ss_family == AF_INET ? SIN4_PORT(addr_u.ip_addr) : SIN6_PORT(addr_u.ip_addr));
+    unsigned uport = htons(addr_u->ip_addr.ss_family == AF_INET ? SIN4_PORT(addr_u->ip_addr) : SIN6_PORT(addr_u->ip_addr));
 
-    if (addr_u.name[0]) strncpy(host, addr_u.name, sizeof(host));
+    if (addr_u->name[0]) {
+        strncpy(host, addr_u->name, sizeof(host));
+        if ((domain = strchr(host, '.'))) domainlen = strnlen(++domain, HOST_NAME_MAX - 1);
+    }
     s = ini;
     while (s) {
         if (s->proxy_server.ss_family == AF_UNSPEC) {
@@ -617,37 +1150,45 @@ struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr addr_
         while (t) {
             if ((t->target_type == INI_TARGET_HOST || t->target_type == INI_TARGET_DOMAIN)) {
                 /* Perform namelookup only if section has target_host or target_domain */
-                if (!addr_u.name[0] &&
-                    getnameinfo((struct sockaddr *)&addr_u.ip_addr, sizeof(addr_u.ip_addr),
+                if (!addr_u->name[0] &&
+                    getnameinfo((struct sockaddr *)&addr_u->ip_addr, sizeof(addr_u->ip_addr),
                         host, sizeof host, 0, 0, NI_NAMEREQD) == 0 &&
                     !domain && (domain = strchr(host, '.'))) {
                         domainlen = strnlen(++domain, HOST_NAME_MAX - 1);
                         printl(LOG_VERB, "IP: [%s] resolves to: [%s] domain: [%s]",
-                            inet2str(&addr_u.ip_addr, buf1), host, domain ? : "");
+                            inet2str(&addr_u->ip_addr, buf1), host, domain ? : "");
                 }
             }
 
-            unsigned tip1_port = htons(addr_u.ip_addr.ss_family == AF_INET ? SIN4_PORT(t->ip1) : SIN6_PORT(t->ip1));
-            unsigned tip2_port = htons(addr_u.ip_addr.ss_family == AF_INET ? SIN4_PORT(t->ip2) : SIN6_PORT(t->ip2));
+            /* IP-address based rules need the destination name resolved, do it only once and only here */
+            if (SA_FAMILY(addr_u->ip_addr) == AF_UNSPEC && (t->target_type == INI_TARGET_NETWORK ||
+                t->target_type == INI_TARGET_RANGE || (t->target_type == INI_TARGET_HOST &&
+                !(t->name && strcasestr(t->name, host)))) && uvaddr_resolve(addr_u)) {
+                    t = t->next;
+                    continue;
+            }
+
+            unsigned tip1_port = htons(addr_u->ip_addr.ss_family == AF_INET ? SIN4_PORT(t->ip1) : SIN6_PORT(t->ip1));
+            unsigned tip2_port = htons(addr_u->ip_addr.ss_family == AF_INET ? SIN4_PORT(t->ip2) : SIN6_PORT(t->ip2));
 
             switch(t->target_type) {
                 case INI_TARGET_HOST:
                     if (host[0] && t->name && strcasestr(t->name, host) && uport >= tip1_port && uport <= tip2_port) {
                         printl(LOG_VERB, "Found proxy: [%s] type [%c] to serve HOST: [%s : %s] in: [%s]",
                             inet2str(&s->proxy_server, buf1), s->proxy_type, host[0] ? host : "-",
-                            inet2str(&addr_u.ip_addr, buf2), s->section_name);
+                            inet2str(&addr_u->ip_addr, buf2), s->section_name);
                         return s;
                     } else
-                        if ((addr_u.ip_addr.ss_family == AF_INET &&
-                                S4_ADDR(addr_u.ip_addr) == S4_ADDR(t->ip1) &&
+                        if ((addr_u->ip_addr.ss_family == AF_INET &&
+                                S4_ADDR(addr_u->ip_addr) == S4_ADDR(t->ip1) &&
                                 uport >= tip1_port && uport <= tip2_port) ||
-                            (addr_u.ip_addr.ss_family == AF_INET6 &&
-                                !memcmp(S6_ADDR(addr_u.ip_addr), S6_ADDR(t->ip1), sizeof(S6_ADDR(addr_u.ip_addr))) &&
+                            (addr_u->ip_addr.ss_family == AF_INET6 &&
+                                !memcmp(S6_ADDR(addr_u->ip_addr), S6_ADDR(t->ip1), sizeof(S6_ADDR(addr_u->ip_addr))) &&
                                 uport >= tip1_port && uport <= tip2_port)) {
 
                                 printl(LOG_VERB, "Found proxy: [%s] type [%c] to serve IP: [%s : %s] in: [%s]",
                                     inet2str(&s->proxy_server, buf1), s->proxy_type, host[0] ? host : "-",
-                                    inet2str(&addr_u.ip_addr, buf2), s->section_name);
+                                    inet2str(&addr_u->ip_addr, buf2), s->section_name);
                                 return s;
                         }
                 break;
@@ -661,26 +1202,26 @@ struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr addr_
                 break;
 
                 case INI_TARGET_NETWORK:
-                    if (addr_u.ip_addr.ss_family == AF_INET) {
+                    if (addr_u->ip_addr.ss_family == AF_INET) {
                         /* IP & MASK_from_ini vs IP_from_ini & MASK_from_ini */
-                        if ((S4_ADDR(addr_u.ip_addr) & S4_ADDR(t->ip2)) == (S4_ADDR(t->ip1) & S4_ADDR(t->ip2)) &&
+                        if ((S4_ADDR(addr_u->ip_addr) & S4_ADDR(t->ip2)) == (S4_ADDR(t->ip1) & S4_ADDR(t->ip2)) &&
                             uport >= tip1_port && uport <= tip2_port) {
                                 printl(LOG_VERB,
                                     "Found proxy: [%s] type [%c] to serve IP: [%s] in NETWORK: [%s/%s] in: [%s]",
-                                    inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u.ip_addr, buf2),
+                                    inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u->ip_addr, buf2),
                                     inet2str(&t->ip1, buf3), inet2str(&t->ip2, buf4), s->section_name);
                                 return s;
                         }
-                    } else if (addr_u.ip_addr.ss_family == AF_INET6) {
+                    } else if (addr_u->ip_addr.ss_family == AF_INET6) {
                         /* IPv6 & MASK_from_ini vs IPv6_from_ini & MASK_from_ini */
                         int b;
                         for (b = 0; b < 16; ++b)
-                            if ((S6_ADDR(addr_u.ip_addr)[b] & S6_ADDR(t->ip2)[b]) != (S6_ADDR(t->ip1)[b] & S6_ADDR(t->ip2)[b]))
+                            if ((S6_ADDR(addr_u->ip_addr)[b] & S6_ADDR(t->ip2)[b]) != (S6_ADDR(t->ip1)[b] & S6_ADDR(t->ip2)[b]))
                                 goto end_target;
 
                         if (uport >= tip1_port && uport <= tip2_port) {
                             printl(LOG_VERB, "Found proxy: [%s] type [%c] to serve IP: [%s] in NETWORK: [%s/%s] in: [%s]",
-                                inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u.ip_addr, buf2),
+                                inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u->ip_addr, buf2),
                                 inet2str(&t->ip1, buf3), inet2str(&t->ip2, buf4), s->section_name);
                             return s;
                         }
@@ -689,17 +1230,17 @@ end_target:
                 break;
 
                 case INI_TARGET_RANGE:
-                    if ((addr_u.ip_addr.ss_family == AF_INET &&
-                            ntohl(S4_ADDR(addr_u.ip_addr)) >= ntohl(S4_ADDR(t->ip1)) &&
-                            ntohl(S4_ADDR(addr_u.ip_addr)) <= ntohl(S4_ADDR(t->ip2)) &&
+                    if ((addr_u->ip_addr.ss_family == AF_INET &&
+                            ntohl(S4_ADDR(addr_u->ip_addr)) >= ntohl(S4_ADDR(t->ip1)) &&
+                            ntohl(S4_ADDR(addr_u->ip_addr)) <= ntohl(S4_ADDR(t->ip2)) &&
                             uport >= tip1_port && uport <= tip2_port) ||
-                        (addr_u.ip_addr.ss_family == AF_INET6 &&
-                            memcmp(S6_ADDR(addr_u.ip_addr), S6_ADDR(t->ip1), sizeof(S6_ADDR(addr_u.ip_addr))) > 0 &&
-                            memcmp(S6_ADDR(addr_u.ip_addr), S6_ADDR(t->ip2), sizeof(S6_ADDR(addr_u.ip_addr))) < 0 &&
+                        (addr_u->ip_addr.ss_family == AF_INET6 &&
+                            memcmp(S6_ADDR(addr_u->ip_addr), S6_ADDR(t->ip1), sizeof(S6_ADDR(addr_u->ip_addr))) > 0 &&
+                            memcmp(S6_ADDR(addr_u->ip_addr), S6_ADDR(t->ip2), sizeof(S6_ADDR(addr_u->ip_addr))) < 0 &&
                             uport >= tip1_port && uport <= tip2_port)) {
 
                             printl(LOG_VERB, "Found proxy: [%s] type [%c] to serve IP: [%s] in RANGE: [%s/%s] in: [%s]",
-                                inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u.ip_addr, buf2),
+                                inet2str(&s->proxy_server, buf1), s->proxy_type, inet2str(&addr_u->ip_addr, buf2),
                                 inet2str(&t->ip1, buf3), inet2str(&t->ip2, buf4), s->section_name);
                             return s;
                     }
@@ -715,6 +1256,23 @@ end_target:
     return NULL;
 }
 
+/* ------------------------------------------------------------------------------------------------------------------ */
+struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr *addr_u) {
+    /* Lookup the first matching section which is up and not ejected by the breaker. If none of them is usable, the
+    first one is returned anyway not to bypass the proxy servers */
+
+    struct ini_section *s, *f = NULL;
+
+    for (s = ini; (s = ini_look_any(s, addr_u)); s = s->next) {
+        if (health_usable(s)) return s;
+
+        printl(LOG_VERB, "Section: [%s] is down or ejected, looking for the next one", s->section_name);
+        if (!f) f = s;
+    }
+
+    return f;
+}
+
 /* ------------------------------------------------------------------------------------------------------------------ */
 int chk_inivar(void *v, char *vi, int ln) {
     /* Check if an INI-file variable already has a value in memory. Here:
@@ -34,6 +34,10 @@
 typedef struct ini_section {
     char *section_name;                                                 /* Section name */
     uint8_t section_balance;                                            /* Balance proxy server on accessibility */
+    unsigned int section_race;                                          /* Race: sections to connect in parallel */
+    char *section_pool;                                                 /* Pool name or NULL */
+    uint8_t section_pool_policy;                                        /* POOL_POLICY_* or POOL_POLICY_UNSET */
+    unsigned int section_weight;                                        /* Pool member weight */
     struct sockaddr_storage proxy_server;                               /* Proxy server IP-address and Port */
     uint8_t proxy_type;                                                 /* Proxy type Socks: '4', '5'  or HTTP: 'H' */
     char *proxy_user;                                                   /* Proxy server username */
@@ -41,7 +45,48 @@ typedef struct ini_section {
     char *proxy_key;                                                    /* User's private key filename */
     char *proxy_key_passphrase;                                         /* SSH2 private key passphrase */
     uint8_t proxy_ssh_force_auth;                                       /* Force SSH2 auth: 'Y' or 'N' */
+    char *proxy_ssh_crypt;                                              /* SSH2 cipher preference list */
+    char *proxy_ssh_mac;                                                /* SSH2 MAC preference list */
+    uint8_t proxy_ssh_compress;                                         /* SSH2 zlib compression: 'Y' or 'N' */
+    unsigned int proxy_ssh_window;                                      /* SSH2 channel window size or 0 */
+    unsigned int proxy_ssh_packet;                                      /* SSH2 channel max packet size or 0 */
+    char *proxy_tls_name;                                               /* TLS SNI and certificate name */
+    char *proxy_tls_ca;                                                 /* TLS CA certificates file */
+    uint8_t proxy_tls_verify;                                           /* Verify TLS certificate: 'Y' or 'N' */
+    uint8_t proxy_h2;                                                   /* HTTP/2 CONNECT multiplexing: 'Y' or 'N' */
+    uint8_t proxy_tfo;                                                  /* TCP Fast Open to the proxy: 'Y' or 'N' */
+    unsigned int proxy_h2_streams;                                      /* HTTP/2 streams per connection */
+    unsigned int proxy_h2_conns;                                        /* HTTP/2 connections per section */
+    unsigned int proxy_breaker;                                         /* Failures to trip the breaker, 0: off */
+    uint8_t proxy_check;                                                /* Health check: HEALTH_CHECK_* */
+    unsigned int proxy_check_interval;                                  /* Seconds between the probes */
+    unsigned int proxy_check_rise;                                      /* Good probes to mark the section up */
+    unsigned int proxy_check_fall;                                      /* Failed probes to mark it down */
+    struct sockaddr_storage proxy_check_target;                         /* HTTP CONNECT canary address */
+    unsigned int proxy_connect_timeout;                                 /* Stage deadlines in seconds, 0: none */
+    unsigned int proxy_handshake_timeout;
+    unsigned int proxy_idle_timeout;
+    unsigned int proxy_max_clients;                                     /* Clients served at once, 0: unlimited */
+    unsigned int proxy_max_pending;                                     /* Clients connecting at once, 0: unlimited */
+    unsigned int proxy_queue;                                           /* Clients waiting for the limits, 0: none */
+    unsigned int proxy_queue_timeout;                                   /* Seconds to wait in the queue */
+    size_t proxy_buffer;                                                /* Relay bytes buffered per direction */
+    uint8_t proxy_zerocopy;                                             /* MSG_ZEROCOPY relay sends: 'Y' or 'N' */
+    char *socket_profile;                                               /* Socket options profile section name */
+    sock_opts socket;                                                   /* Socket options, the profile merged in */
+    src_pool *source;                                                   /* Source addresses or NULL, shared memory */
+    struct shaper *shaper;                                              /* Rate buckets or NULL, shared memory */
     struct proxy_chain *p_chain;                                        /* Proxy chain */
+
+    /* Handshake templates precompiled by read_ini(), only destinations are patched on connect */
+    char *tpl_http_auth;                                                /* Proxy-Authorization header line */
+    int tpl_http_auth_len;
+    uint8_t *tpl_s5_auth;                                               /* Socks5 username/password request */
+    int tpl_s5_auth_len;
+    uint8_t *tpl_s4_request;                                            /* Socks4 request with the user ID */
+    int tpl_s4_request_len;
+    struct ssl_ctx_st *tls_ctx;                                         /* HTTPS: TLS context with CA certificates */
+
     struct ini_target *target_entry;                                    /* List of target definitions */
 
     /*NIT Pool specification */
@@ -49,6 +94,19 @@ typedef struct ini_section {
     struct sockaddr_storage nit_ipaddr;                                 /* NIT IP/address */
     struct sockaddr_storage nit_ipmask;                                 /* NIT address mask */
 
+    /* HTTP/2 broker: runtime, not from the INI-file */
+    int h2_ctl;                                                         /* Control socket or -1 */
+    pid_t h2_pid;                                                       /* Broker PID, 0: none, -1: unsupported */
+
+    /* Health state: shared memory mapped by health_init(), NULL if it is not available */
+    struct section_health *health;
+
+    /* Client counters: shared memory bound by admit_bind(), NULL if it is not available */
+    struct section_load *load;
+
+    /* The pool the section is a member of, set by pool_create() */
+    struct section_pool *pool;
+
     struct ini_section *next;                                           /* The next INI-section */
 } ini_section;
 
@@ -87,6 +145,10 @@ typedef struct chain_list {                                 /* Chains as they de
 #define SECTION_BALANCE_FAILOVER    1                               /* Default */
 #define SECTION_BALANCE_ROUNDROBIN  2
 #define SECTION_BALANCE_DISABLED    3
+#define SECTION_BALANCE_RACE        4                               /* Failover with parallel connects */
+
+#define SECTION_RACE_DEFAULT        2                               /* Sections raced by section_balance = race */
+#define SECTION_RACE_MAX            8
 
 /* Section balancing modes in the INI-file */
 #define INI_ENTRY_SECTION_BALANCE               "section_balance"   /* Socks section balance policy */
@@ -94,15 +156,67 @@ typedef struct chain_list {                                 /* Chains as they de
 #define INI_ENTRY_SECTION_BALANCE_FAILOVER      "failover"          /* 1 - Default */
 #define INI_ENTRY_SECTION_BALANCE_ROUNDROBIN    "roundrobin"        /* 2 */
 #define INI_ENTRY_SECTION_BALANCE_DISABLED      "disabled"          /* 3 */
+#define INI_ENTRY_SECTION_BALANCE_RACE          "race"              /* 4 */
+#define INI_ENTRY_SECTION_RACE                  "section_race"      /* Race fan-out: 2 - SECTION_RACE_MAX */
+#define INI_ENTRY_SECTION_POOL                  "section_pool"      /* name[:wrr|leastconn|ewma|hash_dst|hash_src] */
+#define INI_ENTRY_SECTION_WEIGHT                "section_weight"    /* Pool member weight: 1 - POOL_WEIGHT_MAX */
 
 #define INI_ENTRY_PROXY_SERVER          "proxy_server"
 #define INI_ENTRY_PROXY_CHAIN           "proxy_chain"
-#define INI_ENTRY_PROXY_TYPE            "proxy_type"            /* H: HTTP, 4: Socks4, 5: Socks5 (default), S: SSH2 */
+#define INI_ENTRY_PROXY_TYPE            "proxy_type"            /* H: HTTP, T: HTTPS, 4: Socks4, 5: Socks5, S: SSH2 */
 #define INI_ENTRY_PROXY_USER            "proxy_user"
 #define INI_ENTRY_PROXY_PASSWORD        "proxy_password"
 #define INI_ENTRY_PROXY_KEY             "proxy_key"             /* Currently SSH2 private key filename */
 #define INI_ENTRY_PROXY_KEY_PASSPHRASE  "proxy_key_passphrase"  /* SSH2 private key passphrase */
 #define INI_ENTRY_PROXY_SSH_FORCE_AUTH  "proxy_ssh_force_auth"  /* Force authmethods: 'Y' or 'N' */
+#define INI_ENTRY_PROXY_SSH_CRYPT       "proxy_ssh_crypt"       /* Ciphers, e.g.: aes256-gcm@openssh.com,aes128-ctr */
+#define INI_ENTRY_PROXY_SSH_MAC         "proxy_ssh_mac"         /* MACs, e.g.: hmac-sha2-256-etm@openssh.com */
+#define INI_ENTRY_PROXY_SSH_COMPRESS    "proxy_ssh_compress"    /* zlib compression: 'Y' or 'N' (default) */
+#define INI_ENTRY_PROXY_SSH_WINDOW      "proxy_ssh_window"      /* Channel window size in bytes, K/M suffixes */
+#define INI_ENTRY_PROXY_SSH_PACKET      "proxy_ssh_packet"      /* Channel max packet size in bytes, <= 32K */
+#define INI_ENTRY_PROXY_TLS_NAME        "proxy_tls_name"        /* TLS SNI; the certificate must match it */
+#define INI_ENTRY_PROXY_TLS_CA          "proxy_tls_ca"          /* CA certificates file, default: system store */
+#define INI_ENTRY_PROXY_TLS_VERIFY      "proxy_tls_verify"      /* Verify TLS certificate: 'Y' (default) or 'N' */
+#define INI_ENTRY_PROXY_H2              "proxy_h2"              /* HTTP/2 CONNECT multiplexing: 'Y' or 'N' (default) */
+#define INI_ENTRY_PROXY_TFO             "proxy_tfo"             /* TCP Fast Open: 'Y' or 'N' (default) */
+#define INI_ENTRY_PROXY_H2_STREAMS      "proxy_h2_streams"      /* Tunnels per HTTP/2 connection, default: 100 */
+#define INI_ENTRY_PROXY_H2_CONNS        "proxy_h2_conns"        /* HTTP/2 connections per section, default: 4 */
+#define INI_ENTRY_PROXY_BREAKER         "proxy_breaker"         /* Client failures in a row to eject, default: 5 */
+#define INI_ENTRY_PROXY_CHECK           "proxy_check"           /* Health probe: tcp, socks5, http, ssh or none */
+#define INI_ENTRY_PROXY_CHECK_INTERVAL  "proxy_check_interval"  /* Seconds between the probes, default: 10 */
+#define INI_ENTRY_PROXY_CHECK_RISE      "proxy_check_rise"      /* Good probes to mark the section up, default: 2 */
+#define INI_ENTRY_PROXY_CHECK_FALL      "proxy_check_fall"      /* Failed probes to mark it down, default: 3 */
+#define INI_ENTRY_PROXY_CHECK_TARGET    "proxy_check_target"    /* host:port to CONNECT by the http probe */
+#define INI_ENTRY_PROXY_CONNECT_TIMEOUT "proxy_connect_timeout" /* Seconds to connect, default: 15, 0: none */
+#define INI_ENTRY_PROXY_HANDSHAKE_TIMEOUT "proxy_handshake_timeout" /* Seconds to handshake, default: 30 */
+#define INI_ENTRY_PROXY_IDLE_TIMEOUT    "proxy_idle_timeout"    /* Seconds without traffic, default: 0 - none */
+#define INI_ENTRY_PROXY_MAX_CLIENTS     "proxy_max_clients"     /* Clients connecting or served, default: 0 - none */
+#define INI_ENTRY_PROXY_MAX_PENDING     "proxy_max_pending"     /* Clients connecting, default: 0 - none */
+#define INI_ENTRY_PROXY_QUEUE           "proxy_queue"           /* Clients waiting for the limits, default: 0 */
+#define INI_ENTRY_PROXY_QUEUE_TIMEOUT   "proxy_queue_timeout"   /* Seconds to wait, default: 5 */
+#define INI_ENTRY_PROXY_BUFFER          "proxy_buffer"          /* Largest relay buffer, default: 128K */
+#define INI_ENTRY_PROXY_ZEROCOPY        "proxy_zerocopy"        /* Zero-copy large relay sends: 'Y' or 'N' (default) */
+#define INI_ENTRY_PROXY_RATE            "proxy_rate"            /* Bytes per second of all the clients, K/M/G */
+#define INI_ENTRY_PROXY_RATE_BURST      "proxy_rate_burst"      /* Bytes above the rate, default: a second of it */
+#define INI_ENTRY_PROXY_CLIENT_RATE     "proxy_client_rate"     /* Bytes per second of each client address */
+#define INI_ENTRY_PROXY_CLIENT_BURST    "proxy_client_burst"    /* Bytes above the client rate, default: a second */
+
+/* Socket options, any section can be a profile referenced by others */
+#define INI_ENTRY_SOCKET_PROFILE        "socket_profile"        /* A section to take unset socket_* options from */
+#define INI_ENTRY_SOCKET_SNDBUF         "socket_sndbuf"         /* SO_SNDBUF bytes, K/M suffixes */
+#define INI_ENTRY_SOCKET_RCVBUF         "socket_rcvbuf"         /* SO_RCVBUF bytes, K/M suffixes */
+#define INI_ENTRY_SOCKET_NODELAY        "socket_nodelay"        /* TCP_NODELAY: 'Y' or 'N' */
+#define INI_ENTRY_SOCKET_NOTSENT_LOWAT  "socket_notsent_lowat"  /* TCP_NOTSENT_LOWAT bytes, K/M suffixes */
+#define INI_ENTRY_SOCKET_CONGESTION     "socket_congestion"     /* TCP_CONGESTION algorithm, e.g.: bbr, cubic */
+#define INI_ENTRY_SOCKET_KEEPIDLE       "socket_keepidle"       /* Seconds before keepalive probes */
+#define INI_ENTRY_SOCKET_KEEPINTVL      "socket_keepintvl"      /* Seconds between keepalive probes */
+#define INI_ENTRY_SOCKET_KEEPCNT        "socket_keepcnt"        /* Probes to mark the connection broken */
+#define INI_ENTRY_SOCKET_MARK           "socket_mark"           /* SO_MARK firewall mark, Linux only */
+#define INI_ENTRY_SOCKET_MPTCP          "socket_mptcp"          /* Multipath TCP: 'Y' or 'N', Linux only */
+#define SOCKET_BUFFER_MAX               (64 * 1024 * 1024)      /* Largest socket_* buffer size */
+
+#define INI_ENTRY_SOURCE_ADDRESS        "source_address"        /* Comma separated IPs to connect from in turn */
+#define INI_ENTRY_SOURCE_INTERFACE      "source_interface"      /* Interface to connect through, Linux only */
 
 /* TODO: Deprecated INI_ENTRY_SOCKS_* variables to be removed */
 #define INI_ENTRY_SOCKS_SERVER      "socks_server"
@@ -132,7 +246,7 @@ ini_section *read_ini(char *ifile_name);
 void show_ini(struct ini_section *ini, int loglvl);
 struct ini_section *delete_ini(struct ini_section *ini);
 int pushback_ini(struct ini_section **ini, struct ini_section *target);
-struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr addr_u);
+struct ini_section *ini_look_server(struct ini_section *ini, struct uvaddr *addr_u);
 int create_chains(struct ini_section *ini, struct chain_list *chain);
 struct ini_section *getsection(struct ini_section *ini, char *name);
 int chk_inivar(void *v, char *vi, int d);
@@ -27,20 +27,24 @@
 /* -- Network functions --------------------------------------------------------------------------------------------- */
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "network.h"
 #include "logfile.h"
 #include "pidfile.h"
 #include "utility.h"
+#include "timer.h"
 
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int connect_desnation(struct sockaddr dest) {
-    /* Establish TCP connetion with a det address */
+static int connect_socket(int family, int tfo, sock_opts *so) {
+    /* Create a socket for an outgoing connection with the default options overridden by the so profile */
 
     int sock;
 
-    if ((sock = socket(dest.sa_family, SOCK_STREAM, 0)) < 0) {
+    if ((sock = sock_create(family, SOCK_STREAM, 0, so)) < 0) {
         printl(LOG_CRIT, "Error creating a socket for the destination address");
         return sock;
     }
@@ -81,14 +85,237 @@ int connect_desnation(struct sockaddr dest) {
             printl(LOG_WARN, "Error setting TCP_SYNCNT socket option for outgoing connections");
     #endif
 
+    if (tfo) {
+        #if defined(TCP_FASTOPEN_CONNECT)
+            int fastopen = 1;
+            if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &fastopen, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_FASTOPEN_CONNECT socket option for outgoing connections");
+        #else
+            printl(LOG_VERB, "TCP Fast Open for outgoing connections is not supported on this system");
+        #endif
+    }
+
+    /* Before connect(): buffer sizes define the window scale announced in SYN */
+    sock_opts_apply(sock, so, "outgoing connections");
+
     printl(LOG_VERB, "Socket to connect with destination address created");
 
-    if ((connect(sock, &dest, sizeof dest)) < 0) {
+    return sock;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static src_addr *connect_source(src_pool *sp, int family) {
+    /* Take the next source address of the family in turn; Return NULL if the pool has none */
+
+    src_addr *a;
+    unsigned int i;
+
+    for (i = 0; i < sp->n; i++) {
+        a = &sp->a[__atomic_fetch_add(&sp->next, 1, __ATOMIC_RELAXED) % sp->n];
+        if (SA_FAMILY(a->addr) == family) return a;
+    }
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int connect_desnation(struct sockaddr dest, int tfo, sock_opts *so, src_pool *sp) {
+    /* Establish TCP connetion with a det address. With tfo, defer the connect to the first send(), so the SYN carries
+    the first handshake bytes when the proxy server supports TCP Fast Open and a cookie is cached. The so profile,
+    if any, overrides the default socket options. With the sp source pool, bind the socket to its interface and
+    to the next source address; the local port is left to connect(), so the ports of one source address are only
+    taken per destination, and a source out of ports is skipped for the next one */
+
+    int sock, tries = 1;
+    src_addr *a = NULL;
+    char buf[INET_ADDRPORTSTRLEN];
+
+    if (sp && sp->n) tries = sp->n;
+
+    while (tries--) {
+        if ((sock = connect_socket(dest.sa_family, tfo, so)) < 0) return sock;
+
+        if (sp && sp->dev[0]) {
+            #if defined(SO_BINDTODEVICE)
+                if (setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE, sp->dev, strlen(sp->dev)) == -1)
+                    printl(LOG_WARN, "Error binding outgoing connections to interface: [%s]", sp->dev);
+            #else
+                printl(LOG_VERB, "Binding outgoing connections to an interface is not supported on this system");
+            #endif
+        }
+
+        if (sp && sp->n) {
+            if (!(a = connect_source(sp, dest.sa_family))) {
+                printl(LOG_CRIT, "No source address of the destination address family");
+                close(sock);
+                return -1;
+            }
+
+            #if defined(IP_BIND_ADDRESS_NO_PORT)
+                int noport = 1;
+                if (setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &noport, sizeof(int)) == -1)
+                    printl(LOG_WARN, "Error setting IP_BIND_ADDRESS_NO_PORT socket option for outgoing connections");
+            #endif
+
+            if (bind(sock, (struct sockaddr *)&a->addr, SA_FAMILY(a->addr) == AF_INET6 ?
+                sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1) {
+
+                printl(LOG_WARN, "Unable to bind source address: [%s]", inet2str(&a->addr, buf));
+                __atomic_add_fetch(&a->errors, 1, __ATOMIC_RELAXED);
+                close(sock);
+                continue;
+            }
+        }
+
+        if ((connect(sock, &dest, sizeof dest)) == 0) {
+            if (a) __atomic_add_fetch(&a->conns, 1, __ATOMIC_RELAXED);
+            return sock;
+        }
+
+        if (a && (errno == EADDRNOTAVAIL || errno == EADDRINUSE)) {
+            printl(LOG_WARN, "No local ports left on source address: [%s]", inet2str(&a->addr, buf));
+            __atomic_add_fetch(&a->errors, 1, __ATOMIC_RELAXED);
+            close(sock);
+            continue;
+        }
+
         printl(LOG_CRIT, "Unable to connect with destination address");
+        close(sock);
         return -1;
     }
 
-    return sock;
+    printl(LOG_CRIT, "Unable to connect with destination address from any source address");
+    return -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void sock_opts_init(sock_opts *so) {
+    /* Empty profile: every option keeps the default */
+
+    so->sndbuf = so->rcvbuf = so->nodelay = so->notsent_lowat = SOCK_OPT_UNSET;
+    so->keepidle = so->keepintvl = so->keepcnt = so->mark = so->mptcp = SOCK_OPT_UNSET;
+    so->cc[0] = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void sock_opts_merge(sock_opts *so, sock_opts *from) {
+    /* Fill options unset in so from the referenced profile */
+
+    if (so->sndbuf == SOCK_OPT_UNSET) so->sndbuf = from->sndbuf;
+    if (so->rcvbuf == SOCK_OPT_UNSET) so->rcvbuf = from->rcvbuf;
+    if (so->nodelay == SOCK_OPT_UNSET) so->nodelay = from->nodelay;
+    if (so->notsent_lowat == SOCK_OPT_UNSET) so->notsent_lowat = from->notsent_lowat;
+    if (so->keepidle == SOCK_OPT_UNSET) so->keepidle = from->keepidle;
+    if (so->keepintvl == SOCK_OPT_UNSET) so->keepintvl = from->keepintvl;
+    if (so->keepcnt == SOCK_OPT_UNSET) so->keepcnt = from->keepcnt;
+    if (so->mark == SOCK_OPT_UNSET) so->mark = from->mark;
+    if (so->mptcp == SOCK_OPT_UNSET) so->mptcp = from->mptcp;
+    if (!so->cc[0]) strncpy(so->cc, from->cc, SOCK_CC_LEN);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void sock_opts_apply(int sock, sock_opts *so, char *who) {
+    /* Set options of the profile so on the socket; who names the sockets in the log messages */
+
+    if (!so) return;
+
+    if (so->sndbuf != SOCK_OPT_UNSET)
+        if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &so->sndbuf, sizeof(int)) == -1)
+            printl(LOG_WARN, "Error setting SO_SNDBUF socket option for %s", who);
+
+    if (so->rcvbuf != SOCK_OPT_UNSET)
+        if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &so->rcvbuf, sizeof(int)) == -1)
+            printl(LOG_WARN, "Error setting SO_RCVBUF socket option for %s", who);
+
+    if (so->nodelay != SOCK_OPT_UNSET)
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &so->nodelay, sizeof(int)) == -1)
+            printl(LOG_WARN, "Error setting TCP_NODELAY socket option for %s", who);
+
+    if (so->notsent_lowat != SOCK_OPT_UNSET) {
+        #if defined(TCP_NOTSENT_LOWAT)
+            if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &so->notsent_lowat, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_NOTSENT_LOWAT socket option for %s", who);
+        #else
+            printl(LOG_VERB, "TCP_NOTSENT_LOWAT socket option is not supported on this system");
+        #endif
+    }
+
+    if (so->keepidle != SOCK_OPT_UNSET) {
+        #if defined(TCP_KEEPIDLE)
+            if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &so->keepidle, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_KEEPIDLE socket option for %s", who);
+        #elif defined(TCP_KEEPALIVE)
+            if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPALIVE, &so->keepidle, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_KEEPALIVE socket option for %s", who);
+        #else
+            printl(LOG_VERB, "TCP_KEEPIDLE socket option is not supported on this system");
+        #endif
+    }
+
+    #if defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+        if (so->keepintvl != SOCK_OPT_UNSET)
+            if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &so->keepintvl, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_KEEPINTVL socket option for %s", who);
+
+        if (so->keepcnt != SOCK_OPT_UNSET)
+            if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &so->keepcnt, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_KEEPCNT socket option for %s", who);
+    #endif
+
+    if (so->mark != SOCK_OPT_UNSET) {
+        #if defined(SO_MARK)
+            /* Needs CAP_NET_ADMIN */
+            if (setsockopt(sock, SOL_SOCKET, SO_MARK, &so->mark, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting SO_MARK socket option for %s", who);
+        #else
+            printl(LOG_VERB, "SO_MARK socket option is not supported on this system");
+        #endif
+    }
+
+    if (so->cc[0]) {
+        #if defined(TCP_CONGESTION)
+            /* The algorithm must be loaded and, for unprivileged users, listed in tcp_allowed_congestion_control */
+            if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, so->cc, strlen(so->cc)) == -1)
+                printl(LOG_WARN, "Error setting TCP_CONGESTION socket option [%s] for %s", so->cc, who);
+        #else
+            printl(LOG_VERB, "TCP_CONGESTION socket option is not supported on this system");
+        #endif
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int sock_create(int family, int type, int protocol, sock_opts *so) {
+    /* Create a socket: a Multipath TCP one if the so profile asks for it, or a TCP one when the system does not support
+    MPTCP. An MPTCP socket itself falls back to TCP if the peer does not negotiate MPTCP */
+
+    int sock;
+
+    if (so && so->mptcp == 1 && type == SOCK_STREAM) {
+        #if defined(IPPROTO_MPTCP)
+            if ((sock = socket(family, type, IPPROTO_MPTCP)) != -1) return sock;
+            printl(LOG_INFO, "Unable to create a Multipath TCP socket, falling back to TCP");
+        #else
+            printl(LOG_VERB, "Multipath TCP is not supported on this system");
+        #endif
+    }
+
+    return socket(family, type, protocol);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int mptcp_active(int sock) {
+    /* Return 1 if the connected socket has negotiated Multipath TCP. MPTCP_INFO fails on a TCP socket and on an MPTCP
+    one fallen back to TCP */
+
+    #if defined(SOL_MPTCP)
+        char info[256];                                                 /* struct mptcp_info, not needed as such */
+        socklen_t l = sizeof info;
+
+        return getsockopt(sock, SOL_MPTCP, MPTCP_INFO, info, &l) == 0;
+    #else
+        (void)sock;
+        return 0;
+    #endif
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
@@ -116,7 +343,6 @@ char *inet2str(struct sockaddr_storage *ai_addr, char *str_addr) {
 
         case AF_UNSPEC:
             printl(LOG_VERB, "Address is not set");
-            return NULL;
         break;
 
         default:
@@ -139,11 +365,339 @@ struct sockaddr_storage str2inet(char *str_addr, char *str_port) {
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-    if ((ret = getaddrinfo(str_addr, str_port, &hints, &res)) > 0)
+    if ((ret = getaddrinfo(str_addr, str_port, &hints, &res)))
         printl(LOG_CRIT, "Error resolving address [%s]:[%s]: [%s]", str_addr, str_port, gai_strerror(ret));
-    else
+    else {
         memmove(&a_ret, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+    }
 
-    freeaddrinfo(res);
     return a_ret;
 }
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int uvaddr_resolve(struct uvaddr *daddr) {
+    /* Resolve the destination name when an IP-address is really required; Return 0 if ip_addr is set */
+
+    struct sockaddr_storage a;
+    in_port_t port = SIN4_PORT(daddr->ip_addr);                        /* The same offset for IPv6 */
+    char buf[INET_ADDRPORTSTRLEN];
+
+    if (SA_FAMILY(daddr->ip_addr) != AF_UNSPEC) return 0;
+    if (!daddr->name[0]) return 1;
+
+    a = str2inet(daddr->name, NULL);
+    if (SA_FAMILY(a) == AF_INET && S4_ADDR(a) == INADDR_NONE) {
+        printl(LOG_WARN, "Unable to resolve destination: [%s]", daddr->name);
+        return 1;
+    }
+
+    daddr->ip_addr = a;
+    if (SA_FAMILY(a) == AF_INET) SIN4_PORT(daddr->ip_addr) = port; else SIN6_PORT(daddr->ip_addr) = port;
+    printl(LOG_VERB, "Destination: [%s] resolved to: [%s]", daddr->name, inet2str(&daddr->ip_addr, buf));
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int cbuf_want(cbuf *b, size_t n) {
+    /* Receive what the client has sent without blocking until n unparsed bytes are in the buffer, keep whatever else
+    comes; Return HS_DONE, HS_WANT_READ to be called again when the client is readable or HS_ERROR */
+
+    ssize_t r;
+
+    if (b->off + n > sizeof(b->data)) return HS_ERROR;
+
+    while (b->len - b->off < n) {
+        if ((r = recv(b->s, b->data + b->len, sizeof(b->data) - b->len, MSG_DONTWAIT)) == 0) return HS_ERROR;
+        if (r == -1) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? HS_WANT_READ : HS_ERROR;
+        b->len += r;
+    }
+
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int cbuf_want_until(cbuf *b, char *str, char **at) {
+    /* Receive without blocking until str appears in the unparsed bytes, its position goes to at; Return HS_DONE,
+    HS_WANT_READ to be called again when the client is readable or HS_ERROR */
+
+    size_t l = strlen(str), i = b->off;
+    int r;
+
+    while (1) {
+        for (; i + l <= b->len; i++)
+            if (!memcmp(b->data + i, str, l)) {
+                *at = b->data + i;
+                return HS_DONE;
+            }
+
+        if (b->len == sizeof(b->data)) return HS_ERROR;
+        if ((r = cbuf_want(b, b->len - b->off + 1)) != HS_DONE) return r;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int cbuf_wait(cbuf *b) {
+    /* Wait until the client is readable, for the blocking callers of the server handshake steps; Return 0 or -1 when
+    the stage deadline has interrupted us */
+
+    struct pollfd pfd;
+
+    pfd.fd = b->s;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) == -1)
+        if (errno != EINTR || timer_expired()) return -1;
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+ssize_t chs_send(chs *cs, const void *buf, size_t len) {
+    /* Send up to len bytes via socket, SSH2 channel or TLS; Return sent bytes, CHS_WANT_READ/WRITE or CHS_ERROR */
+
+    ssize_t r = CHS_ERROR;
+
+    switch (cs->t) {
+        case CHS_SOCKET:
+            if ((r = send(cs->s, buf, len, 0)) == -1)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? CHS_WANT_WRITE : CHS_ERROR;
+        break;
+
+        case CHS_CHANNEL:
+            #if (WITH_LIBSSH2)
+                if ((r = libssh2_channel_write(cs->c, buf, len)) < 0)
+                    return r == LIBSSH2_ERROR_EAGAIN ? CHS_WANT_READ : CHS_ERROR;
+            #endif
+        break;
+
+        case CHS_TLS:
+            #if (WITH_LIBSSL)
+                if ((r = SSL_write(cs->l, buf, len)) <= 0)
+                    switch (SSL_get_error(cs->l, r)) {
+                        case SSL_ERROR_WANT_READ: return CHS_WANT_READ;
+                        case SSL_ERROR_WANT_WRITE: return CHS_WANT_WRITE;
+                        default: return CHS_ERROR;
+                    }
+            #endif
+        break;
+    }
+
+    return r;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+ssize_t chs_recv(chs *cs, void *buf, size_t len, int peek) {
+    /* Receive up to len bytes via socket, SSH2 channel or TLS, leave them queued if peek; SSH2 channels can't peek.
+    Return received bytes, 0 on EOF, CHS_WANT_READ/WRITE or CHS_ERROR */
+
+    ssize_t r = CHS_ERROR;
+
+    switch (cs->t) {
+        case CHS_SOCKET:
+            if ((r = recv(cs->s, buf, len, peek ? MSG_PEEK : 0)) == -1)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? CHS_WANT_READ : CHS_ERROR;
+        break;
+
+        case CHS_CHANNEL:
+            #if (WITH_LIBSSH2)
+                if (peek) return CHS_ERROR;
+                if ((r = libssh2_channel_read(cs->c, buf, len)) < 0)
+                    return r == LIBSSH2_ERROR_EAGAIN ? CHS_WANT_READ : CHS_ERROR;
+                if (!r && !libssh2_channel_eof(cs->c)) return CHS_WANT_READ;   /* Only extended data arrived */
+            #endif
+        break;
+
+        case CHS_TLS:
+            #if (WITH_LIBSSL)
+                if ((r = peek ? SSL_peek(cs->l, buf, len) : SSL_read(cs->l, buf, len)) <= 0)
+                    switch (SSL_get_error(cs->l, r)) {
+                        case SSL_ERROR_ZERO_RETURN: return 0;
+                        case SSL_ERROR_WANT_READ: return CHS_WANT_READ;
+                        case SSL_ERROR_WANT_WRITE: return CHS_WANT_WRITE;
+                        case SSL_ERROR_SYSCALL: if (!r && !ERR_peek_error()) return 0;  /* EOF without close_notify */
+                        /* FALLTHROUGH */
+                        default: return CHS_ERROR;
+                    }
+            #endif
+        break;
+    }
+
+    return r;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int chs_shutdown(chs *cs) {
+    /* Close the sending direction of the transport: FIN, SSH2 channel EOF or TLS close_notify; the receiving direction
+    stays open. Return 0, CHS_WANT_READ/WRITE or CHS_ERROR */
+
+    int r = CHS_ERROR;
+
+    switch (cs->t) {
+        case CHS_SOCKET:
+            r = shutdown(cs->s, SHUT_WR) ? CHS_ERROR : 0;
+        break;
+
+        case CHS_CHANNEL:
+            #if (WITH_LIBSSH2)
+                if ((r = libssh2_channel_send_eof(cs->c)) < 0)
+                    return r == LIBSSH2_ERROR_EAGAIN ? CHS_WANT_READ : CHS_ERROR;
+            #endif
+        break;
+
+        case CHS_TLS:
+            #if (WITH_LIBSSL)
+                if ((r = SSL_shutdown(cs->l)) < 0)
+                    switch (SSL_get_error(cs->l, r)) {
+                        case SSL_ERROR_WANT_READ: return CHS_WANT_READ;
+                        case SSL_ERROR_WANT_WRITE: return CHS_WANT_WRITE;
+                        default: return CHS_ERROR;
+                    }
+                r = 0;
+            #endif
+        break;
+    }
+
+    return r;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int hs_want(ssize_t r) {
+    /* Map a would-block transport result to the handshake step result */
+
+    return r == CHS_WANT_READ ? HS_WANT_READ : r == CHS_WANT_WRITE ? HS_WANT_WRITE : HS_ERROR;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int hs_io(hs *h, int out) {
+    /* Send (out) or receive h->buf[h->pos..h->len) as far as the transport allows. Return HS_DONE when all the bytes
+    are transferred, HS_WANT_READ/WRITE to be called again or HS_ERROR */
+
+    ssize_t r;
+
+    while (h->pos < h->len) {
+        r = out ? chs_send(&h->cs, h->buf + h->pos, h->len - h->pos) :
+            chs_recv(&h->cs, h->buf + h->pos, h->len - h->pos, 0);
+        if (r == 0 && !out) return HS_ERROR;                            /* The server has closed the connection */
+        if (r < 0) return hs_want(r);
+        h->pos += r;
+    }
+
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int hs_io_until(hs *h, char *end) {
+    /* Receive into h->buf until the end marker, NUL-terminate. Bytes beyond the marker are left in the transport: they
+    belong to the tunnel. Return HS_DONE, HS_WANT_READ/WRITE to be called again or HS_ERROR */
+
+    size_t l = strlen(end), i, n;
+    int peek = h->cs.t != CHS_CHANNEL;                                  /* SSH2 channels are read byte by byte */
+    ssize_t r;
+
+    while (h->pos < sizeof(h->buf) - 1) {
+        r = chs_recv(&h->cs, h->buf + h->pos, peek ? sizeof(h->buf) - 1 - h->pos : 1, peek);
+        if (r == 0) return HS_ERROR;
+        if (r < 0) return hs_want(r);
+
+        n = r;
+        for (i = h->pos >= l - 1 ? h->pos - (l - 1) : 0; i + l <= h->pos + r; i++)
+            if (!memcmp(h->buf + i, end, l)) {
+                n = i + l - h->pos;
+                break;
+            }
+
+        if (peek && chs_recv(&h->cs, h->buf + h->pos, n, 0) != (ssize_t)n) return HS_ERROR;
+        h->pos += n;
+
+        if (h->pos >= l && !memcmp(h->buf + h->pos - l, end, l)) {
+            h->buf[h->pos] = '\0';
+            return HS_DONE;
+        }
+    }
+
+    return HS_ERROR;                                                    /* The message doesn't fit the buffer */
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int hs_run(hs *h, int (*step)(hs *)) {
+    /* Drive a resumable handshake to the end from a blocking caller: wait on the transport while the step wants to
+    read or write. Return HS_DONE or HS_ERROR */
+
+    struct pollfd pfd;
+    int r, wait = HS_TIMEOUT_MS;
+
+    pfd.fd = h->cs.s;
+    while ((r = step(h)) > 0) {
+        if (timer_expired()) return HS_ERROR;                           /* The stage deadline interrupted us */
+        if (wait <= 0) {
+            printl(LOG_WARN, "Handshake timeout: the server doesn't respond");
+            return HS_ERROR;
+        }
+
+        pfd.events = r == HS_WANT_READ ? POLLIN : POLLOUT;
+        if (h->cs.t == CHS_CHANNEL) {
+            /* libssh2 may need either direction: poll in short slices */
+            poll(&pfd, 1, 10);
+            wait -= 10;
+        } else {
+            if ((r = poll(&pfd, 1, wait)) == -1 && errno != EINTR) return HS_ERROR;
+            if (r == 0) wait = 0;
+        }
+    }
+
+    return r;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int send_fd(int sock, int fd, char *data, size_t len) {
+    /* Send data over a UNIX-domain socket with the fd attached unless it is -1 */
+
+    char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+
+
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    return sendmsg(sock, &msg, 0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int recv_fd(int sock, int *fd, char *data, size_t len) {
+    /* Receive data from a UNIX-domain socket, fd is set to an attached descriptor or -1. Return recvmsg() result */
+
+    char cbuf[CMSG_SPACE(sizeof(int))] = {0};
+    struct msghdr msg = {0};
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int ret;
+
+
+    *fd = -1;
+    iov.iov_base = data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if ((ret = recvmsg(sock, &msg, 0)) > 0 && (cmsg = CMSG_FIRSTHDR(&msg)) &&
+        cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return ret;
+}
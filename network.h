@@ -42,9 +42,19 @@
     #include <libssh2.h>
 #endif
 
+#if !defined (WITH_LIBSSL)
+   #define WITH_LIBSSL 0
+#endif
+
+#if (WITH_LIBSSL)
+    #include <openssl/ssl.h>
+    #include <openssl/err.h>
+#endif
+
 #define TCP_KEEPIDLE_S  120         /* Wait 2 minutes in sec before sending keep_alives */
 #define TCP_KEEPINTVL_S 30          /* Interval between keep_alives probes in seconds */
 #define TCP_KEEPCNT_N   8           /* A number of probes before marking a session broken */
+#define TCP_FASTOPEN_QLEN 256       /* Pending TCP Fast Open requests of the internal servers, Linux only */
 
 #if defined(__FreeBSD__)
     #define TCP_KEEPINIT_S  6           /* Timeout for a new not yet established connections in seconds */
@@ -54,6 +64,9 @@
 #endif
 #if defined(linux)
     #define TCP_SYNCNT_N    2           /* N of SYN retransmits should be sent before aborting the attempt to connect */
+    #if defined(SOL_MPTCP) && !defined(MPTCP_INFO)
+        #define MPTCP_INFO  1           /* linux/mptcp.h clashes with netinet/in.h */
+    #endif
 #endif
 
 /* Used ports */
@@ -64,6 +77,7 @@
 #define SOCKS_PORT          "1080"                  /* This is remote Socks server port */
 #define SQUID_PORT          "3128"                  /* This is HTTPS proxy port */
 #define SSH2_PORT           "22"                    /* This is SSH2 proxy port */
+#define HTTPS_PORT          "443"                   /* This is HTTP proxy over TLS port */
 
 #define LISTEN_SOCKS_PORT   "7080"                  /* Our internal TCP Socks port */
 #define LISTEN_HTTP_PORT    "8080"                  /* Our internal HTTP server port */
@@ -101,6 +115,8 @@
 
 #define SIN_PORT(sa)    SA_FAMILY(sa) == AF_INET ? SIN4_PORT(sa) : SIN6_PORT(sa)
 
+#define CBUF_SIZE       65536                                   /* Client requests and pipelined data */
+
 #ifndef HOST_NAME_MAX
     #define HOST_NAME_MAX 255
 #endif
@@ -108,25 +124,108 @@
 
 /* ------------------------------------------------------------------------------------------------------------------ */
 typedef struct uvaddr {
-    struct sockaddr_storage ip_addr;
+    struct sockaddr_storage ip_addr;                            /* AF_UNSPEC with the port only: name not resolved */
     char name[HOST_NAME_MAX];
 } uvaddr;
 
+typedef struct cbuf {                                           /* Buffered client reader */
+    int s;                                                      /* Client socket */
+    size_t len;                                                 /* Received bytes */
+    size_t off;                                                 /* Parsed bytes, the rest goes to the tunnel */
+    char data[CBUF_SIZE];
+} cbuf;
+
 #define CHS_CHANNEL     0
 #define CHS_SOCKET      1
+#define CHS_TLS         2
 
 typedef struct chs {                                            /* Channel / Socket structure */
     #if (WITH_LIBSSH2)
         LIBSSH2_CHANNEL *c;                                     /* libssh2 channel */
     #endif
+    #if (WITH_LIBSSL)
+        SSL *l;                                                 /* TLS connection over the socket */
+    #endif
     int s;                                                      /* socket */
-    char t;                                                     /* type CHS_CHANNEL|CHS_SOCKET */
+    char t;                                                     /* type CHS_CHANNEL|CHS_SOCKET|CHS_TLS */
 } chs;
 
 #define CHS(cs)     cs.t ? (void *)(&cs.s) : (void *)cs.c       /* Return socket or SSH2 channel */
 
+/* chs_send() / chs_recv() results besides transferred bytes */
+#define CHS_ERROR       -1                                      /* Transport failure */
+#define CHS_WANT_READ   -2                                      /* Would block, retry when readable */
+#define CHS_WANT_WRITE  -3                                      /* Would block, retry when writable */
+
+/* Resumable handshake step results */
+#define HS_DONE         0                                       /* The protocol exchange is complete */
+#define HS_WANT_READ    1                                       /* Need more bytes: call the step when readable */
+#define HS_WANT_WRITE   2                                       /* Want write: call the step when writable */
+#define HS_ERROR        -1                                      /* The exchange failed, h->status tells why */
+
+#define HS_BUF_SIZE     4096                                    /* Largest handshake message: HTTP reply headers */
+#define HS_TIMEOUT_MS   30000                                   /* Blocking driver gives up on a stalled peer */
+
+typedef struct hs {                                             /* Resumable protocol handshake over chs */
+    chs cs;                                                     /* Transport to the server */
+    int state;                                                  /* Protocol specific state */
+    int status;                                                 /* Protocol reply status */
+    size_t len;                                                 /* Bytes to send or to receive in the state */
+    size_t pos;                                                 /* Bytes already sent or received */
+    char buf[HS_BUF_SIZE];
+} hs;
+
+#define SOCK_OPT_UNSET  -1                                      /* A profile does not touch the option */
+#define SOCK_CC_LEN     16                                      /* Congestion control name length: TCP_CA_NAME_MAX */
+
+typedef struct sock_opts {                                      /* Socket options profile */
+    int sndbuf;                                                 /* SO_SNDBUF bytes */
+    int rcvbuf;                                                 /* SO_RCVBUF bytes */
+    int nodelay;                                                /* TCP_NODELAY: 1 or 0 */
+    int notsent_lowat;                                          /* TCP_NOTSENT_LOWAT bytes */
+    int keepidle;                                               /* TCP_KEEPIDLE seconds */
+    int keepintvl;                                              /* TCP_KEEPINTVL seconds */
+    int keepcnt;                                                /* TCP_KEEPCNT probes */
+    int mark;                                                   /* SO_MARK for policy routing, Linux only */
+    char cc[SOCK_CC_LEN];                                       /* TCP_CONGESTION algorithm, empty: system default */
+    int mptcp;                                                  /* Multipath TCP socket: 1 or 0, Linux only */
+} sock_opts;
+
+#define SOURCE_ADDRESSES_MAX    64                              /* Source addresses per section */
+#define SOURCE_DEVICE_LEN       16                              /* Interface name length: IFNAMSIZ */
+
+typedef struct src_addr {                                       /* Outgoing connections source address */
+    struct sockaddr_storage addr;
+    unsigned long conns;                                        /* Connections made from the address */
+    unsigned long errors;                                       /* Bind failures and local ports exhaustions */
+} src_addr;
+
+typedef struct src_pool {                                       /* Section source addresses, shared memory */
+    unsigned int n;
+    unsigned int next;                                          /* Round robin position */
+    char dev[SOURCE_DEVICE_LEN];                                /* Interface to bind to, empty: any */
+    src_addr a[SOURCE_ADDRESSES_MAX];
+} src_pool;
+
 
 /* -- Function prototypes ------------------------------------------------------------------------------------------- */
-int connect_desnation(struct sockaddr dest);
+int connect_desnation(struct sockaddr dest, int tfo, sock_opts *so, src_pool *sp);
+void sock_opts_init(sock_opts *so);
+void sock_opts_merge(sock_opts *so, sock_opts *from);
+void sock_opts_apply(int sock, sock_opts *so, char *who);
+int sock_create(int family, int type, int protocol, sock_opts *so);
+int mptcp_active(int sock);
 char *inet2str(struct sockaddr_storage *ai_addr, char *str_addr);
 struct sockaddr_storage str2inet(char *str_addr, char *str_port);
+int uvaddr_resolve(struct uvaddr *daddr);
+int cbuf_want(cbuf *b, size_t n);
+int cbuf_want_until(cbuf *b, char *str, char **at);
+int cbuf_wait(cbuf *b);
+ssize_t chs_send(chs *cs, const void *buf, size_t len);
+ssize_t chs_recv(chs *cs, void *buf, size_t len, int peek);
+int chs_shutdown(chs *cs);
+int hs_io(hs *h, int out);
+int hs_io_until(hs *h, char *end);
+int hs_run(hs *h, int (*step)(hs *));
+int send_fd(int sock, int fd, char *data, size_t len);
+int recv_fd(int sock, int *fd, char *data, size_t len);
@@ -31,9 +31,13 @@
 
 #include "logfile.h"
 #include "network.h"
+#include "slab.h"
 #include "pidlist.h"
 
 
+static slab pidlist_slab = SLAB_INIT("clients", struct pid_list);       /* Records come and go with clients */
+
+
 /* ------------------------------------------------------------------------------------------------------------------ */
 struct pid_list *pidlist_add(struct pid_list *root, char *section_name, pid_t pid,
     struct sockaddr_storage caddr, struct sockaddr_storage daddr) {
@@ -42,11 +46,10 @@ struct pid_list *pidlist_add(struct pid_list *root, char *section_name, pid_t pi
 
 
     /* Create a new pidlist record structure */
-    n = (struct pid_list *)malloc(sizeof(struct pid_list));
-    memset(n, 0, sizeof(struct pid_list));
+    if (!(n = slab_alloc(&pidlist_slab))) return root;
     n->pid = pid;
     n->status = -1;
-    n->section_name = strdup(section_name);
+    strncpy(n->section_name, section_name, sizeof(n->section_name) - 1);
     n->traffic.pid = pid;
     n->traffic.caddr = caddr;
     n->traffic.cbytes = 0;
@@ -66,6 +69,13 @@ struct pid_list *pidlist_add(struct pid_list *root, char *section_name, pid_t pi
     return root;
 }
 
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pidlist_free(struct pid_list *n) {
+    /* Release a record already unlinked from the list */
+
+    slab_free(&pidlist_slab, n);
+}
+
 /* ------------------------------------------------------------------------------------------------------------------ */
 int pidlist_update_status(struct pid_list *root, pid_t pid, int status) {
 
@@ -94,7 +104,12 @@ int pidlist_update_traffic(struct pid_list *root, struct traffic_data traffic) {
             c->traffic.timestamp = traffic.timestamp;
             c->traffic.cbytes = traffic.cbytes;
             c->traffic.daddr = traffic.daddr;
+            memcpy(c->traffic.dname, traffic.dname, sizeof(c->traffic.dname));
             c->traffic.dbytes = traffic.dbytes;
+            c->traffic.mptcp = traffic.mptcp;
+            /* The child knows the section it has chosen, the destination may be a name without an address */
+            if (traffic.section_name[0])
+                memcpy(c->section_name, traffic.section_name, sizeof(c->section_name));
             return 0;
         }
         c = c->next;
@@ -105,21 +120,34 @@ int pidlist_update_traffic(struct pid_list *root, struct traffic_data traffic) {
 
 /* ------------------------------------------------------------------------------------------------------------------ */
 void pidlist_show(struct pid_list *root, int tfd) {
-    char tbuf[24], buf1[STR_SIZE], buf2[STR_SIZE];
+    char tbuf[24], buf1[STR_SIZE], buf2[STR_SIZE + 6];                 /* Room for a name and ":port" */
     struct pid_list *c = NULL;
     struct tm ts;
+    const char *mptcp[] = {"No", "Client", "Server", "Both"};
 
     c = root;
-    dprintf(tfd, "Time,PID,Status,Section,Client,Client bytes,Target,Target bytes\n");
+    dprintf(tfd, "Time,PID,Status,Section,Client,Client bytes,Target,Target bytes,MPTCP\n");
     while (c) {
         ts = *localtime(&c->traffic.timestamp);
         strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &ts);
 
-        dprintf(tfd, "%s,%d,%s,%s,%s,%llu,%s,%llu\n",
+        if (c->traffic.dname[0])
+            snprintf(buf2, sizeof(buf2), "%s:%d", c->traffic.dname, ntohs(SIN4_PORT(c->traffic.daddr)));
+        else
+            inet2str(&c->traffic.daddr, buf2);
+
+        dprintf(tfd, "%s,%d,%s,%s,%s,%llu,%s,%llu,%s\n",
             tbuf, c->pid, c->status == -1 ? "Active" : "Finished", c->section_name,
             inet2str(&c->traffic.caddr, buf1), c->traffic.cbytes,
-            inet2str(&c->traffic.daddr, buf2), c->traffic.dbytes);
+            buf2, c->traffic.dbytes, mptcp[c->traffic.mptcp & 3]);
         c = c->next;
     }
     (void)!write(tfd, "\n", 1);                 /* Empty line indicates end of data. (void)! - just to make GCC happy */
 }
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pidlist_slab_show(int loglvl) {
+    /* Display the clients list allocations */
+
+    slab_show(&pidlist_slab, loglvl);
+}
@@ -24,6 +24,7 @@
 */
 
 #include <time.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 
 #include "utility.h"
@@ -34,14 +35,20 @@ typedef struct traffic_data {
     time_t timestamp;
     struct sockaddr_storage caddr;                          /* Client data address - usually the TS-Warp host */
     unsigned long long cbytes;                              /* Client data volume */
-    struct sockaddr_storage daddr;                          /* Destination address */
+    struct sockaddr_storage daddr;                          /* Destination address, AF_UNSPEC with the port only */
+    char dname[STR_SIZE];                                   /* Destination name, if the client requested one */
     unsigned long long dbytes;                              /* Destination data volume */
+    int mptcp;                                              /* Legs negotiated Multipath TCP: TRAFFIC_MPTCP_* */
+    char section_name[STR_SIZE];                            /* Section serving the client, empty if direct */
 } traffic_data;
 
+#define TRAFFIC_MPTCP_CLIENT    1
+#define TRAFFIC_MPTCP_SERVER    2
+
 typedef struct pid_list {
     pid_t pid;                                              /* Client PID */
     int status;                                             /* Status code: -1 running, Exit: 0 - OK, >=1 - KO */
-    char *section_name;                                     /* Section used by the client's process */
+    char section_name[STR_SIZE];                            /* Section used by the client's process */
     struct traffic_data traffic;                            /* Traffic counters */
     struct pid_list *next;                                  /* Link to the next p_list */
 } pid_list;
@@ -51,9 +58,24 @@ typedef struct traffic_message {                            /* IPC message to pa
     struct traffic_data mtext;
 } traffic_message;
 
+typedef struct failover_message {                           /* IPC message: a section failed to serve a client */
+    long mtype;
+    char mtext[STR_SIZE];                                   /* Section name */
+} failover_message;
+
+#define MSG_TYPE_TRAFFIC        1                           /* IPC message types: traffic_message */
+#define MSG_TYPE_FAILOVER       2                           /* failover_message */
+
+#define EXIT_PROXY_REPORTED     3                           /* Proxy failures were already sent as failover_message */
+
+/* Move the section back on the client exit, unless the failures were already reported */
+#define PIDLIST_PUSHBACK(st)    ((st) && !(WIFEXITED(st) && WEXITSTATUS(st) == EXIT_PROXY_REPORTED))
+
 /* -- Function prototypes ------------------------------------------------------------------------------------------- */
 struct pid_list *pidlist_add(struct pid_list *root, char *section_name, pid_t pid,
     struct sockaddr_storage caddr, struct sockaddr_storage daddr);
+void pidlist_free(struct pid_list *n);
 int pidlist_update_status(struct pid_list *root, pid_t pid, int status);
 int pidlist_update_traffic(struct pid_list *root, struct traffic_data traffic);
 void pidlist_show(struct pid_list *root, int tfd);
+void pidlist_slab_show(int loglvl);
@@ -0,0 +1,442 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Upstream proxy pools ------------------------------------------------------------------------------------------ */
+
+/*
+* Sections with the same section_pool name form a pool, the members are expected to serve the same targets. When
+* ini_look_server() finds a pool member, pool_select() picks the member to serve the client by the pool policy:
+* weighted round-robin over a precomputed schedule, the power of two random choices for the least connections and
+* peak EWMA latency, or a Maglev style lookup table for consistent hashing. Selection does not depend on the number of
+* members; unusable members, down or ejected by the breaker, are skipped.
+*
+* Clients of pool members record connect and first byte latency per destination prefix and section in a bounded
+* shared table. The adaptive policy sends clients to the historically fastest member for the prefix, except for
+* POOL_EXPLORE percent of them which go to a random member to keep the estimates fresh.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "utility.h"
+#include "network.h"
+#include "health.h"
+#include "admit.h"
+#include "pool.h"
+#include "inifile.h"
+#include "logfile.h"
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static section_pool *pools;                                             /* Pools of the current INI-configuration */
+static unsigned int pool_rr;                                            /* WRR position without shared memory */
+static pool_learned *pool_table;                                        /* Learned latency, shared by clients */
+static pool_learned *pool_sample;                                       /* Client: the entry to get the first byte */
+static struct timeval pool_fstart;                                      /* Client: the forwarding start */
+
+static const char *pool_policies[] = {"wrr", "leastconn", "ewma", "hash_dst", "hash_src", "adaptive"};
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int pool_policy(char *name) {
+    /* Return POOL_POLICY_* by its INI-file name or -1 */
+
+    unsigned int i;
+
+    for (i = 0; i < sizeof(pool_policies) / sizeof(pool_policies[0]); i++)
+        if (!strcasecmp(name, pool_policies[i])) return i;
+
+    return -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+const char *pool_policy_name(uint8_t policy) {
+    return policy < sizeof(pool_policies) / sizeof(pool_policies[0]) ? pool_policies[policy] : "";
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static uint32_t pool_hash(const void *data, size_t len, uint32_t h) {
+    /* FNV-1a */
+
+    const unsigned char *p = data;
+
+    while (len--) h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int pool_build(section_pool *p) {
+    /* Precompute the WRR schedule and the consistent hash lookup table */
+
+    unsigned int i, k, total = 0, filled = 0, best;
+    long *cur = NULL;
+    unsigned int *offset = NULL, *skip = NULL, *next = NULL;
+    int *table = NULL;
+    uint32_t h;
+
+    for (i = 0; i < p->n; i++) total += p->member[i]->section_weight;
+
+    if (!(p->wrr = malloc(total * sizeof(unsigned int))) || !(p->table = malloc(POOL_HASH_SIZE * sizeof(unsigned int)))
+        || !(cur = calloc(p->n, sizeof(long))) || !(offset = calloc(p->n, sizeof(unsigned int))) ||
+        !(skip = calloc(p->n, sizeof(unsigned int))) || !(next = calloc(p->n, sizeof(unsigned int))) ||
+        !(table = malloc(POOL_HASH_SIZE * sizeof(int)))) {
+
+        free(cur); free(offset); free(skip); free(next); free(table);
+        return 1;
+    }
+
+    /* Smooth weighted round-robin: members are interleaved, not grouped */
+    p->wrr_len = total;
+    for (k = 0; k < total; k++) {
+        for (best = 0, i = 0; i < p->n; i++) {
+            cur[i] += p->member[i]->section_weight;
+            if (cur[i] > cur[best]) best = i;
+        }
+        cur[best] -= total;
+        p->wrr[k] = best;
+    }
+
+    /* Maglev: each member fills the table by its own permutation, the weight is a number of turns per round */
+    for (i = 0; i < p->n; i++) {
+        h = pool_hash(p->member[i]->section_name, strlen(p->member[i]->section_name), 2166136261u);
+        offset[i] = h % POOL_HASH_SIZE;
+        skip[i] = pool_hash(&h, sizeof(h), 2166136261u) % (POOL_HASH_SIZE - 1) + 1;
+    }
+
+    for (k = 0; k < POOL_HASH_SIZE; k++) table[k] = -1;
+    while (filled < POOL_HASH_SIZE)
+        for (i = 0; i < p->n && filled < POOL_HASH_SIZE; i++)
+            for (k = 0; k < p->member[i]->section_weight && filled < POOL_HASH_SIZE; k++) {
+                while (table[(offset[i] + (unsigned long)next[i] * skip[i]) % POOL_HASH_SIZE] != -1) next[i]++;
+                table[(offset[i] + (unsigned long)next[i] * skip[i]) % POOL_HASH_SIZE] = i;
+                next[i]++;
+                filled++;
+            }
+
+    for (k = 0; k < POOL_HASH_SIZE; k++) p->table[k] = table[k];
+
+    free(cur); free(offset); free(skip); free(next); free(table);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pool_create(struct ini_section *ini) {
+    /* Group sections into pools by section_pool names */
+
+    struct ini_section *s, **m;
+    section_pool *p;
+
+    for (s = ini; s; s = s->next) {
+        s->pool = NULL;
+        if (!s->section_pool || s->section_balance == SECTION_BALANCE_DISABLED) continue;
+
+        for (p = pools; p; p = p->next)
+            if (!strcmp(p->name, s->section_pool)) break;
+
+        if (!p) {
+            if (!(p = calloc(1, sizeof(section_pool)))) {
+                printl(LOG_WARN, "Unable to allocate pool: [%s]", s->section_pool);
+                continue;
+            }
+            p->name = s->section_pool;
+            p->policy = POOL_POLICY_WRR;
+            p->next = pools;
+            pools = p;
+        }
+
+        if (!(m = realloc(p->member, (p->n + 1) * sizeof(struct ini_section *)))) {
+            printl(LOG_WARN, "Unable to add section: [%s] to pool: [%s]", s->section_name, p->name);
+            continue;
+        }
+        p->member = m;
+        p->member[p->n++] = s;
+        if (s->section_pool_policy != POOL_POLICY_UNSET) p->policy = s->section_pool_policy;
+        s->pool = p;
+    }
+
+    for (p = pools; p; p = p->next) {
+        if (pool_build(p)) {
+            printl(LOG_WARN, "Unable to build pool: [%s], its sections are served as usual", p->name);
+            for (s = ini; s; s = s->next)
+                if (s->pool == p) s->pool = NULL;
+            continue;
+        }
+        printl(LOG_VERB, "Pool: [%s] policy: [%s] members: [%u]", p->name, pool_policy_name(p->policy), p->n);
+    }
+
+    if (pools && !pool_table) {
+        pool_table = mmap(NULL, POOL_LEARN_SIZE * sizeof(pool_learned), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANON, -1, 0);
+        if (pool_table == MAP_FAILED) {
+            printl(LOG_WARN, "Unable to map the pool latency table, latency is not learned");
+            pool_table = NULL;
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pool_delete(void) {
+    /* Free the pools, names belong to the sections */
+
+    section_pool *p;
+
+    if (pool_table) {
+        munmap(pool_table, POOL_LEARN_SIZE * sizeof(pool_learned));
+        pool_table = NULL;
+    }
+
+    while ((p = pools)) {
+        pools = p->next;
+        free(p->member);
+        free(p->wrr);
+        free(p->table);
+        free(p);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void pool_prefix(struct uvaddr *daddr, char *prefix) {
+    /* The destination prefix: the last two domain name labels or the IPv4/IPv6 network */
+
+    char *p = daddr->name, *d;
+    struct sockaddr_storage a = daddr->ip_addr;
+    int i;
+
+    if (daddr->name[0]) {
+        for (d = strrchr(p, '.'); d && d > daddr->name; d--)
+            if (d[-1] == '.') {
+                p = d;
+                break;
+            }
+        strncpy(prefix, p, POOL_PREFIX_SIZE - 1);                       /* Truncated if it is longer */
+        prefix[POOL_PREFIX_SIZE - 1] = '\0';
+        return;
+    }
+
+    if (a.ss_family == AF_INET6) {
+        for (i = POOL_PREFIX_V6 / 8; i < 16; i++) SIN6_ADDR(a).s6_addr[i] = 0;
+        inet_ntop(AF_INET6, &SIN6_ADDR(a), prefix, POOL_PREFIX_SIZE - 4);
+        snprintf(prefix + strlen(prefix), 5, "/%d", POOL_PREFIX_V6);
+    } else {
+        SIN4_ADDR(a).s_addr &= htonl(0xFFFFFFFF << (32 - POOL_PREFIX_V4));
+        inet_ntop(AF_INET, &SIN4_ADDR(a), prefix, POOL_PREFIX_SIZE - 4);
+        snprintf(prefix + strlen(prefix), 5, "/%d", POOL_PREFIX_V4);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static pool_learned *pool_entry(char *prefix, struct ini_section *s, int create) {
+    /* Find the (prefix, section) entry; with create, take a free or the stalest entry of the probe window */
+
+    pool_learned *e, *v = NULL;
+    uint32_t key, old;
+    unsigned int k;
+
+    if (!pool_table) return NULL;
+
+    key = pool_hash(s->section_name, strlen(s->section_name), pool_hash(prefix, strlen(prefix), 2166136261u)) ? : 1;
+    for (k = 0; k < POOL_LEARN_PROBE; k++) {
+        e = &pool_table[(key + k) % POOL_LEARN_SIZE];
+        old = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if (old == key && e->section == s) return e;
+        if (!v || (v->key && (!old || e->seen < v->seen))) v = e;
+    }
+
+    if (!create) return NULL;
+
+    old = v->key;
+    if (!__atomic_compare_exchange_n(&v->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return NULL;                                                    /* Another client took it, skip the sample */
+
+    v->section = s;
+    strncpy(v->prefix, prefix, POOL_PREFIX_SIZE - 1);
+    v->prefix[POOL_PREFIX_SIZE - 1] = '\0';
+    v->connect = v->fbyte = v->samples = 0;
+    v->seen = time(NULL);
+    return v;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pool_learn(struct ini_section *s, struct uvaddr *daddr, unsigned int connect) {
+    /* Account the connect and handshake time of the pool member for the destination prefix */
+
+    char prefix[POOL_PREFIX_SIZE];
+    pool_learned *e;
+    unsigned int l;
+
+    if (!s->pool || !pool_table) return;
+
+    pool_prefix(daddr, prefix);
+    if (!(e = pool_entry(prefix, s, 1))) return;
+
+    l = __atomic_load_n(&e->connect, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->connect, l ? (l * 7 + connect) / 8 : connect, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&e->samples, 1, __ATOMIC_RELAXED);
+    e->seen = time(NULL);
+
+    pool_sample = e;
+    gettimeofday(&pool_fstart, NULL);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pool_learn_byte(void) {
+    /* The first server byte arrived: account the time since forwarding started */
+
+    struct timeval tv;
+    unsigned int l, fbyte;
+
+    if (!pool_sample) return;
+
+    gettimeofday(&tv, NULL);
+    fbyte = (tv.tv_sec - pool_fstart.tv_sec) * 1000000 + tv.tv_usec - pool_fstart.tv_usec;
+    l = __atomic_load_n(&pool_sample->fbyte, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool_sample->fbyte, l ? (l * 7 + fbyte) / 8 : fbyte, __ATOMIC_RELAXED);
+    pool_sample = NULL;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void pool_show(int loglvl) {
+    /* Display the learned latency table */
+
+    unsigned int i;
+
+    if (!pool_table) return;
+
+    for (i = 0; i < POOL_LEARN_SIZE; i++)
+        if (pool_table[i].key)
+            printl(loglvl, "SHOW Learned: [%s] Section: [%s] Connect: [%u] us First byte: [%u] us Samples: [%u]",
+                pool_table[i].prefix, pool_table[i].section->section_name, pool_table[i].connect,
+                pool_table[i].fbyte, pool_table[i].samples);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static double pool_cost(section_pool *p, unsigned int i) {
+    /* Load of the member i per its weight: active clients or peak EWMA latency */
+
+    section_health *h = p->member[i]->health;
+    double load;
+
+    if (!h) return 0;
+
+    load = (p->member[i]->load ? __atomic_load_n(&p->member[i]->load->active, __ATOMIC_RELAXED) : 0) + 1;
+    if (p->policy == POOL_POLICY_EWMA)                                  /* Unknown latency: try the member */
+        load *= h->latency ? h->latency : h->rtt;
+
+    return load / p->member[i]->section_weight;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+struct ini_section *pool_select(struct ini_section *s, struct uvaddr *daddr, struct sockaddr_storage *caddr) {
+    /* Pick the pool member to serve the client. Return s if it is not a pool member or no member is usable */
+
+    static pid_t seeded;
+    section_pool *p = s->pool;
+    section_health *h;
+    pool_learned *e;
+    unsigned int i, j, k;
+    uint32_t key;
+    char prefix[POOL_PREFIX_SIZE];
+    double cost, best;
+
+    if (!p) return s;
+
+    if (seeded != getpid()) {                                           /* Clients must not share random sequences */
+        seeded = getpid();
+        srandom(seeded ^ time(NULL));
+    }
+
+    switch (p->policy) {
+        case POOL_POLICY_ADAPTIVE:
+            if (random() % 100 < POOL_EXPLORE) {                        /* Explore: a random usable member */
+                for (i = random() % p->n, k = 0; k < p->n; k++)
+                    if (health_usable(p->member[(i + k) % p->n])) return p->member[(i + k) % p->n];
+                break;
+            }
+
+            /* Exploit: the fastest member for the prefix, members never tried for it go first */
+            pool_prefix(daddr, prefix);
+            for (j = p->n, best = 0, i = 0; i < p->n; i++) {
+                if (!health_usable(p->member[i])) continue;
+                if (!(e = pool_entry(prefix, p->member[i], 0)) || !e->samples) return p->member[i];
+
+                cost = (double)e->connect + e->fbyte;
+                if (j == p->n || cost < best) {
+                    j = i;
+                    best = cost;
+                }
+            }
+            if (j < p->n) return p->member[j];
+        break;
+
+        case POOL_POLICY_LEASTCONN:
+        case POOL_POLICY_EWMA:
+            i = random() % p->n;
+            if (p->n == 1) j = i;
+            else if ((j = random() % (p->n - 1)) >= i) j++;
+
+            if (!health_usable(p->member[i])) i = j;
+            else if (health_usable(p->member[j]) && pool_cost(p, j) < pool_cost(p, i)) i = j;
+            if (health_usable(p->member[i])) return p->member[i];
+
+            for (k = 0; k < p->n; k++)                                  /* Both are unusable, take any other */
+                if (health_usable(p->member[k])) return p->member[k];
+        break;
+
+        case POOL_POLICY_HASH_DST:
+        case POOL_POLICY_HASH_SRC:
+            if (p->policy == POOL_POLICY_HASH_SRC)
+                key = caddr->ss_family == AF_INET6 ?
+                    pool_hash(&SIN6_ADDR(*caddr), sizeof(SIN6_ADDR(*caddr)), 2166136261u) :
+                    pool_hash(&SIN4_ADDR(*caddr), sizeof(SIN4_ADDR(*caddr)), 2166136261u);
+            else if (daddr->name[0])
+                key = pool_hash(daddr->name, strlen(daddr->name), 2166136261u);
+            else
+                key = daddr->ip_addr.ss_family == AF_INET6 ?
+                    pool_hash(&SIN6_ADDR(daddr->ip_addr), sizeof(SIN6_ADDR(daddr->ip_addr)), 2166136261u) :
+                    pool_hash(&SIN4_ADDR(daddr->ip_addr), sizeof(SIN4_ADDR(daddr->ip_addr)), 2166136261u);
+
+            /* Keep the key stable: walk the table from its slot if the member is unusable */
+            for (k = 0; k < POOL_HASH_SIZE; k++)
+                if (health_usable(p->member[p->table[(key + k) % POOL_HASH_SIZE]]))
+                    return p->member[p->table[(key + k) % POOL_HASH_SIZE]];
+        break;
+
+        case POOL_POLICY_WRR:
+        default:
+            h = p->member[0]->health;
+            for (k = 0; k < p->wrr_len; k++) {
+                i = h ? __atomic_fetch_add(&h->rr, 1, __ATOMIC_RELAXED) : pool_rr++;
+                if (health_usable(p->member[p->wrr[i % p->wrr_len]])) return p->member[p->wrr[i % p->wrr_len]];
+            }
+    }
+
+    return s;
+}
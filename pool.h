@@ -0,0 +1,84 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+
+/* -- Upstream proxy pools ------------------------------------------------------------------------------------------ */
+#define POOL_POLICY_WRR         0                   /* Smooth weighted round-robin - Default */
+#define POOL_POLICY_LEASTCONN   1                   /* The least active clients per weight of two random members */
+#define POOL_POLICY_EWMA        2                   /* The lower latency EWMA * active clients of two random members */
+#define POOL_POLICY_HASH_DST    3                   /* Consistent hash of the destination */
+#define POOL_POLICY_HASH_SRC    4                   /* Consistent hash of the client address */
+#define POOL_POLICY_ADAPTIVE    5                   /* The fastest member for the destination prefix, learned */
+#define POOL_POLICY_UNSET       0xFF                /* The section does not choose the pool policy */
+
+#define POOL_WEIGHT_DEFAULT     1
+#define POOL_WEIGHT_MAX         100
+#define POOL_HASH_SIZE          1021                /* Consistent hash lookup table size, a prime */
+
+#define POOL_LEARN_SIZE         1024                /* Learned (destination prefix, section) latency entries */
+#define POOL_LEARN_PROBE        8                   /* Entries to probe for a key, the stalest one is replaced */
+#define POOL_EXPLORE            10                  /* Adaptive: % of clients sent to a random member */
+#define POOL_PREFIX_V4          24                  /* Destination prefix lengths */
+#define POOL_PREFIX_V6          48
+#define POOL_PREFIX_SIZE        64
+
+struct ini_section;
+struct uvaddr;
+
+typedef struct section_pool {
+    char *name;
+    uint8_t policy;                                 /* POOL_POLICY_* */
+    unsigned int n;                                 /* Members */
+    struct ini_section **member;
+    unsigned int *wrr;                              /* WRR schedule: member indexes, the sum of weights long */
+    unsigned int wrr_len;
+    unsigned int *table;                            /* Consistent hash lookup table: member indexes */
+    struct section_pool *next;
+} section_pool;
+
+typedef struct pool_learned {                       /* Shared memory: updated by clients, lossy by design */
+    uint32_t key;                                   /* Hash of the prefix and the section, 0: a free entry */
+    struct ini_section *section;
+    char prefix[POOL_PREFIX_SIZE];                  /* Destination network or domain */
+    unsigned int connect;                           /* Connect and handshake time EWMA in microseconds */
+    unsigned int fbyte;                             /* Time to the first server byte EWMA in microseconds, 0: unknown */
+    unsigned int samples;
+    time_t seen;                                    /* The last sample time */
+} pool_learned;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+int pool_policy(char *name);
+const char *pool_policy_name(uint8_t policy);
+void pool_create(struct ini_section *ini);
+void pool_delete(void);
+struct ini_section *pool_select(struct ini_section *s, struct uvaddr *daddr, struct sockaddr_storage *caddr);
+void pool_learn(struct ini_section *s, struct uvaddr *daddr, unsigned int connect);
+void pool_learn_byte(void);
+void pool_show(int loglvl);
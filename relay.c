@@ -0,0 +1,674 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Client <-> server relay --------------------------------------------------------------------------------------- */
+
+/*
+* Both sockets are non-blocking. Each wakeup reads whatever both sides have, up to the free space of their direction
+* buffer, then writes both buffers as far as the peers take them; a direction waits for POLLOUT only while its buffer
+* has unsent bytes. A full buffer stops reading its side, so the memory per tunnel is bounded by two buffers and TCP
+* flow control pushes back on the sender. EOF of a side is passed to the other one (FIN, SSH2 channel EOF or TLS
+* close_notify) when its buffer is drained; the relay is done when both directions are closed.
+*
+* Buffers come from the pool: a direction gets the smallest one on its first read and doubles it, up to the section
+* proxy_buffer, each time a read fills it up. After RELAY_BUFFER_RELEASE quiet seconds drained buffers go back.
+*
+* On Linux a busy direction is sampled every RELAY_TUNE_INTERVAL: the rate the relay moves times the larger RTT of the
+* two legs from TCP_INFO, or the congestion window of the sending leg, is the bandwidth-delay product. When twice of
+* it outgrows the kernel buffers, SO_RCVBUF of the reading leg and SO_SNDBUF of the writing one are raised to it and
+* the relay buffer follows. The raises are accounted by the pool against its limit and never shrink.
+*
+* With zerocopy set, sends of RELAY_ZC_MIN bytes or more to a plain socket use MSG_ZEROCOPY on Linux: the kernel
+* transmits from the relay buffer itself, so a drained buffer with sends in flight is held, and the next read takes
+* a new one from the pool. The completions come on the socket error queue, waking poll() with POLLERR, and give the
+* held buffers back to the pool.
+*
+* With rate buckets, reads of both directions take at most the tokens the buckets allow at the wakeup. Empty buckets
+* keep poll() from reading until they are refilled, so the peers are slowed down by TCP flow control.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <netinet/tcp.h>
+#if defined(linux)
+    #include <linux/errqueue.h>
+#endif
+
+#include "utility.h"
+#include "network.h"
+#include "logfile.h"
+#include "bufpool.h"
+#include "shaper.h"
+#include "relay.h"
+
+#if defined(linux) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    #define RELAY_ZEROCOPY 1
+#else
+    #define RELAY_ZEROCOPY 0
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int relay_start(relay *r, int c, chs *s, size_t size, char *pre, size_t pre_len) {
+    /* Prepare the relay of the client socket and the server transport. Seed the client to server direction with the
+    bytes the client has already sent. Set idle, sdpi, tune, zerocopy, the rate buckets and the SSH2 session
+    afterwards; Return 0 or 1 on error */
+
+    memset(r, 0, sizeof(relay));
+    r->c = c;
+    r->s = s;
+    r->size = size;
+
+    if (pre_len) {
+        r->c2s.cap = MAX(pre_len, BPOOL_CLASS_MIN);
+        if (!(r->c2s.buf = bpool_get(r->c2s.cap))) return 1;
+        memcpy(r->c2s.buf, pre, pre_len);
+        r->c2s.len = pre_len;
+        r->c2s.frag = 1;
+        r->cbytes = pre_len;
+        printl(LOG_VERB, "C:[%d] pipelined bytes to forward", (int)pre_len);
+    }
+
+    #if (WITH_LIBSSL)
+        /* Non-blocking SSL_write() returns partial writes and is retried with the buffer moved by them */
+        if (s->t == CHS_TLS)
+            SSL_set_mode(s->l, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    #endif
+
+    r->last = r->tuned = time(NULL);
+    fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+    fcntl(s->s, F_SETFL, fcntl(s->s, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static size_t relay_room(relay_dir *d) {
+    /* Return free bytes of the direction buffer; a released buffer is reallocated on the next read */
+
+    return d->buf ? d->cap - d->len : BPOOL_CLASS_MIN;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static size_t relay_quota(relay *r, size_t room) {
+    /* Return bytes of the room a read may take: all of it or what the rate buckets allow at this wakeup */
+
+    return r->shape ? MIN(room, (size_t)r->allow) : room;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_spend(relay *r, ssize_t n) {
+    /* Take the bytes read from the rate buckets */
+
+    if (!r->shape) return;
+
+    shaper_take(r->shape, r->cb, n);
+    r->allow = MAX(r->allow - n, 0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_buf(relay_dir *d) {
+    /* Get a buffer for a direction without one: the smallest, or of the size held for zero-copy completions;
+    Return 0 or -1 on error */
+
+    if (d->buf) return 0;
+
+    d->len = d->off = 0;
+    if (d->cap > BPOOL_CLASS_MIN && (d->buf = bpool_get(d->cap))) return 0;
+
+    d->cap = BPOOL_CLASS_MIN;
+    return (d->buf = bpool_get(d->cap)) ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_zc_hold(relay_dir *d) {
+    /* Keep the direction buffer until its zero-copy sends complete, the direction gets a new one on the next read */
+
+    d->zc.buf[d->zc.held] = d->buf;
+    d->zc.cap[d->zc.held] = d->cap;
+    d->zc.hfirst[d->zc.held] = d->zc.first;
+    d->zc.hlast[d->zc.held] = d->zc.last;
+    d->zc.hdone[d->zc.held++] = d->zc.done;
+    d->zc.cur = 0;
+    d->buf = NULL;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_grow(relay *r, relay_dir *d, size_t cap) {
+    /* Enlarge the buffer up to cap within the relay size and the pool limit, keeping the unsent bytes */
+
+    char *b;
+
+    cap = MIN(cap, r->size);
+    if (!d->buf || d->cap >= cap) return;
+
+    if (!(b = bpool_get(cap))) return;                              /* Over the limit: keep on with this one */
+
+    memcpy(b, d->buf + d->off, d->len - d->off);
+    d->len -= d->off;
+    d->off = 0;
+    if (d->zc.cur) relay_zc_hold(d); else bpool_put(d->buf, d->cap);
+    d->buf = b;
+    d->cap = cap;
+    printl(LOG_VERB, "Relay buffer grown to: [%zu] bytes", cap);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_release(relay_dir *d) {
+    /* Give a drained buffer back to the pool */
+
+    if (d->len) return;
+
+    bpool_put(d->buf, d->cap);
+    d->buf = NULL;
+    d->cap = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#if defined(linux)
+static size_t relay_sockbuf(int sock, int opt, size_t size) {
+    /* Raise the socket buffer option to size unless the kernel autotuning has it larger already. Unprivileged, the
+    kernel caps the value by net.core.rmem_max or wmem_max, so restore the old size if it came out smaller;
+    Return the bytes the buffer grew by, as the kernel reads it back, or 0 */
+
+    int cur, val;
+    socklen_t l = sizeof(int);
+
+    if (getsockopt(sock, SOL_SOCKET, opt, &cur, &l) == -1 || (size_t)cur >= size) return 0;
+
+    val = size / 2;                                                     /* The kernel doubles it for overhead */
+    if (setsockopt(sock, SOL_SOCKET, opt, &val, sizeof(int)) == -1) return 0;
+
+    l = sizeof(int);
+    if (getsockopt(sock, SOL_SOCKET, opt, &val, &l) == -1 || val <= cur) {
+        val = cur / 2;
+        setsockopt(sock, SOL_SOCKET, opt, &val, sizeof(int));
+        return 0;
+    }
+
+    return val - cur;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_tune_dir(relay *r, relay_dir *d, int from, int to, size_t rate) {
+    /* Size the direction on its bandwidth-delay product: rate in bytes per second from the from socket to the to */
+
+    struct tcp_info ti;
+    socklen_t l;
+    size_t rtt = 0, bdp = 0, want, raised;
+    long reserve;
+
+    if (rate < RELAY_TUNE_BUSY) return;
+
+    l = sizeof ti;
+    if (!getsockopt(from, IPPROTO_TCP, TCP_INFO, &ti, &l))
+        rtt = MAX(ti.tcpi_rcv_rtt, ti.tcpi_rtt);
+
+    l = sizeof ti;
+    if (!getsockopt(to, IPPROTO_TCP, TCP_INFO, &ti, &l)) {
+        rtt = MAX(rtt, ti.tcpi_rtt);
+        bdp = (size_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss;
+    }
+
+    bdp = MAX(bdp, rate * rtt / 1000000);
+    want = BPOOL_CLASS_MIN;
+    while (want < bdp * 2 && want < RELAY_TUNE_MAX) want <<= 1;
+    if (want <= d->sized) return;
+
+    /* Reserve the raise of both sockets against the limit, then keep only what the kernel has really given */
+    reserve = 2 * (long)(want - d->sized);
+    if (bpool_sock(reserve)) {
+        printl(LOG_VERB, "Socket buffers raise to: [%zu] bytes denied by the limit", want);
+        return;
+    }
+
+    raised = MIN(relay_sockbuf(from, SO_RCVBUF, want) + relay_sockbuf(to, SO_SNDBUF, want), (size_t)reserve);
+    bpool_sock((long)raised - reserve);
+    d->sock += raised;
+    d->sized = want;                                                    /* Autotuning has it, or we set it */
+
+    if (raised) {
+        printl(LOG_VERB, "RTT: [%zu] us Rate: [%zu] B/s Socket buffers raised to: [%zu] bytes", rtt, rate, want);
+        relay_grow(r, d, want);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_tune(relay *r, time_t now) {
+    /* Sample the rates of both directions */
+
+    time_t dt = now - r->tuned;
+
+    relay_tune_dir(r, &r->c2s, r->c, r->s->s, (r->cbytes - r->tcbytes) / dt);
+    relay_tune_dir(r, &r->s2c, r->s->s, r->c, (r->dbytes - r->tdbytes) / dt);
+
+    r->tcbytes = r->cbytes;
+    r->tdbytes = r->dbytes;
+    r->tuned = now;
+}
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#if (RELAY_ZEROCOPY)
+static unsigned int relay_zc_overlap(unsigned int lo, unsigned int hi, unsigned int first, unsigned int last) {
+    /* Count the IDs of [lo, hi] within [first, last]. IDs wrap after 2^32 sends, far beyond a tunnel lifetime */
+
+    lo = MAX(lo, first);
+    hi = MIN(hi, last);
+    return hi >= lo ? hi - lo + 1 : 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_zc_reap(relay_dir *d, int sock) {
+    /* Read zero-copy completions from the socket error queue and give back the buffers they free;
+    Return the number of completion notifications */
+
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    int n = 0, i, j;
+
+    for (;;) {
+        memset(&msg, 0, sizeof msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof control;
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1) break;             /* EAGAIN: the queue is empty */
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) continue;
+
+            ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            /* [ee_info, ee_data] are the IDs of completed sends, the ranges may come in any order */
+            if (d->zc.cur) d->zc.done += relay_zc_overlap(ee->ee_info, ee->ee_data, d->zc.first, d->zc.last);
+            for (i = 0; i < d->zc.held; i++)
+                d->zc.hdone[i] += relay_zc_overlap(ee->ee_info, ee->ee_data, d->zc.hfirst[i], d->zc.hlast[i]);
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) d->zc.copied += ee->ee_data - ee->ee_info + 1;
+            n++;
+        }
+    }
+
+    for (i = j = 0; i < d->zc.held; i++)
+        if (d->zc.hdone[i] == d->zc.hlast[i] - d->zc.hfirst[i] + 1)
+            bpool_put(d->zc.buf[i], d->zc.cap[i]);
+        else {
+            d->zc.buf[j] = d->zc.buf[i];
+            d->zc.cap[j] = d->zc.cap[i];
+            d->zc.hfirst[j] = d->zc.hfirst[i];
+            d->zc.hlast[j] = d->zc.hlast[i];
+            d->zc.hdone[j++] = d->zc.hdone[i];
+        }
+    d->zc.held = j;
+
+    return n;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_zc_error(relay_dir *d, struct pollfd *p) {
+    /* POLLERR on a socket with zero-copy sends may only mean completions: reap them and clear the flag unless the
+    socket has a real error */
+
+    int err = 0;
+    socklen_t l = sizeof(int);
+
+    if (d->zc.on != 1 || !(p->revents & POLLERR)) return;
+
+    if (relay_zc_reap(d, p->fd) && !getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &l) && !err)
+        p->revents &= ~POLLERR;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_zc_stop(relay_dir *d, int sock) {
+    /* Wait a bit for the last completions. A peer that reads slowly, e.g. a local one, may delay them beyond the
+    tunnel end: such buffers are not freed, but left to the process exit */
+
+    struct pollfd p;
+    int ms;
+
+    if (d->zc.on != 1) return;
+
+    if (d->zc.cur) relay_zc_hold(d);
+
+    p.fd = sock;
+    p.events = 0;
+    for (ms = 0; d->zc.held && ms < RELAY_ZC_LINGER_MS; ms += 10) {
+        poll(&p, 1, 10);
+        relay_zc_reap(d, sock);
+    }
+
+    if (d->zc.held) printl(LOG_VERB, "Zero-copy buffers still in flight: [%d]", d->zc.held);
+    while (d->zc.held) {
+        d->zc.held--;
+        bpool_leave(d->zc.buf[d->zc.held], d->zc.cap[d->zc.held]);
+    }
+
+    if (d->zc.sends) printl(LOG_VERB, "Zero-copy sends: [%lu] copied by the kernel: [%lu]", d->zc.sends, d->zc.copied);
+}
+#endif
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static ssize_t relay_send(relay *r, relay_dir *d, int sock, size_t l) {
+    /* send() l bytes of the direction buffer, with MSG_ZEROCOPY when enabled and large enough; Return send() result */
+
+    #if (RELAY_ZEROCOPY)
+        ssize_t n;
+        int on = 1;
+
+        if (r->zerocopy && !d->zc.on) {
+            d->zc.on = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(int)) ? -1 : 1;
+            if (d->zc.on == -1) printl(LOG_VERB, "Zero-copy sends are not available");
+        }
+
+        /* A slot stays free to hold the current buffer, reaping frees the others */
+        if (d->zc.on == 1 && l >= RELAY_ZC_MIN && d->zc.held < RELAY_ZC_HELD - 1) {
+            if ((n = send(sock, d->buf + d->off, l, MSG_ZEROCOPY)) > 0) {
+                if (!d->zc.cur) {
+                    d->zc.first = d->zc.next;
+                    d->zc.done = 0;
+                }
+                d->zc.last = d->zc.next++;
+                d->zc.cur = 1;
+                d->zc.sends++;
+                return n;
+            }
+            if (errno != ENOBUFS) return n;                             /* Out of optmem: copy this one */
+        }
+    #else
+        (void)r;
+    #endif
+
+    return send(sock, d->buf + d->off, l, 0);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void relay_drained(relay_dir *d) {
+    /* All the buffer is sent: reuse it, or hold it for the zero-copy completions */
+
+    if (d->zc.cur) relay_zc_hold(d);
+    d->off = d->len = 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_read_client(relay *r) {
+    /* Receive from the client into the free space of c2s; Return bytes, 0 or -1 on error */
+
+    ssize_t n;
+    size_t room;
+
+    if (r->c2s.eof || !relay_quota(r, relay_room(&r->c2s))) return 0;
+    if (relay_buf(&r->c2s)) return -1;
+
+    if (r->c2s.off == r->c2s.len) r->c2s.frag = 1;                      /* A fresh chunk for SDPI */
+    room = relay_room(&r->c2s);
+    if ((n = recv(r->c, r->c2s.buf + r->c2s.len, relay_quota(r, room), 0)) > 0) {
+        r->c2s.len += n;
+        r->cbytes += n;
+        relay_spend(r, n);
+        if ((size_t)n == room) relay_grow(r, &r->c2s, r->c2s.cap * 2);
+        return n;
+    }
+
+    if (n == 0) {
+        printl(LOG_VERB, "Connection closed by the client");
+        r->c2s.eof = 1;
+        return 0;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+
+    printl(LOG_CRIT, "Error receiving data from the client");
+    return -1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_read_server(relay *r) {
+    /* Receive from the server into the free space of s2c. TLS records and SSH2 channels may hold more data than one
+    read takes, drain them; Return bytes, 0 or -1 on error */
+
+    ssize_t n;
+    size_t room;
+    int total = 0;
+
+    while (!r->s2c.eof && relay_quota(r, relay_room(&r->s2c))) {
+        if (relay_buf(&r->s2c)) return -1;
+
+        room = relay_room(&r->s2c);
+        if ((n = chs_recv(r->s, r->s2c.buf + r->s2c.len, relay_quota(r, room), 0)) > 0) {
+            r->s2c.len += n;
+            r->dbytes += n;
+            relay_spend(r, n);
+            total += n;
+            if ((size_t)n == room) relay_grow(r, &r->s2c, r->s2c.cap * 2);
+            if (r->s->t == CHS_SOCKET) break;                           /* The socket is read up to the wakeup */
+            continue;
+        }
+
+        if (n == 0) {
+            printl(LOG_INFO, "Connection closed by proxy server");
+            r->s2c.eof = 1;
+            break;
+        }
+
+        if (n == CHS_ERROR) {
+            printl(LOG_CRIT, "Error receiving data from proxy server");
+            return -1;
+        }
+
+        break;                                                          /* Would block */
+    }
+
+    return total;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_write_client(relay *r) {
+    /* Send s2c to the client as far as it takes, pass the server EOF once drained; Return bytes or -1 on error */
+
+    ssize_t n;
+    int total = 0;
+
+    while (r->s2c.off < r->s2c.len) {
+        if ((n = relay_send(r, &r->s2c, r->c, r->s2c.len - r->s2c.off)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            printl(LOG_CRIT, "Error sending data to the client");
+            return -1;
+        }
+        r->s2c.off += n;
+        total += n;
+    }
+
+    if (total) printl(LOG_VERB, "S -> C:[%d] bytes", total);
+    if (r->s2c.off == r->s2c.len) {
+        relay_drained(&r->s2c);
+        if (r->s2c.eof && !r->s2c.shut) {
+            shutdown(r->c, SHUT_WR);
+            r->s2c.shut = 1;
+        }
+    }
+
+    return total;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int relay_write_server(relay *r) {
+    /* Send c2s to the server as far as it takes, pass the client EOF once drained. Over a plain socket with sdpi set,
+    the first bytes of a fresh chunk go in a separate segment to bypass DPI; Return bytes or -1 on error */
+
+    ssize_t n;
+    size_t l;
+    int total = 0;
+
+    while (r->c2s.off < r->c2s.len) {
+        l = r->c2s.len - r->c2s.off;
+        if (r->c2s.frag && r->sdpi && r->s->t == CHS_SOCKET && l > 1) {
+            printl(LOG_VERB, "Trying to bypass Deep Packet Inspections. Fragment size: [%d]", r->sdpi);
+            l = MIN((size_t)r->sdpi, l);
+        }
+
+        if (r->zerocopy && r->s->t == CHS_SOCKET) {
+            if ((n = relay_send(r, &r->c2s, r->s->s, l)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+                printl(LOG_CRIT, "Error sending data to proxy server");
+                return -1;
+            }
+        } else if ((n = chs_send(r->s, r->c2s.buf + r->c2s.off, l)) < 0) {
+            if (n != CHS_ERROR) break;                                  /* Would block */
+            printl(LOG_CRIT, "Error sending data to proxy server");
+            return -1;
+        }
+        r->c2s.off += n;
+        r->c2s.frag = 0;
+        total += n;
+    }
+
+    if (total) printl(LOG_VERB, "C -> S:[%d] bytes", total);
+    if (r->c2s.off == r->c2s.len) {
+        relay_drained(&r->c2s);
+        if (r->c2s.eof && !r->c2s.shut) {
+            n = chs_shutdown(r->s);
+            if (n != CHS_WANT_READ && n != CHS_WANT_WRITE) r->c2s.shut = 1;     /* Sent or failed: nothing to retry */
+        }
+    }
+
+    return total;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int relay_step(relay *r) {
+    /* Wait for the sides once and move the data both ways as far as they allow; Return RELAY_* */
+
+    struct pollfd pfd[2];
+    int wait = RELAY_WAIT_MS, w = RELAY_WAIT_MS, ret, moved = 0, i;
+    #if (WITH_LIBSSH2)
+        int dirs;
+    #endif
+
+    if (r->c2s.shut && r->s2c.shut) return RELAY_DONE;
+
+    /* Empty rate buckets stop reading both sides until they are refilled, writes go on */
+    if (r->shape) r->allow = shaper_allow(r->shape, r->cb, &w);
+
+    pfd[0].fd = r->c;
+    pfd[0].events = (!r->c2s.eof && relay_quota(r, relay_room(&r->c2s)) ? POLLIN : 0) | (r->s2c.len ? POLLOUT : 0);
+
+    pfd[1].fd = r->s->s;
+    pfd[1].events = (!r->s2c.eof && relay_quota(r, relay_room(&r->s2c)) ? POLLIN : 0) |
+        (r->c2s.len || (r->c2s.eof && !r->c2s.shut) ? POLLOUT : 0);
+
+    #if (WITH_LIBSSH2)
+        if (r->s->t == CHS_CHANNEL) {
+            /* The session socket carries window adjustments for our writes too: libssh2 asks to read it for them
+            while the writes wait. Otherwise bytes queued there while s2c is full or the shaper is empty would wake us
+            up at once forever. The block directions are those of the last call, stale without writes */
+            dirs = r->c2s.len || (r->c2s.eof && !r->c2s.shut) ? libssh2_session_block_directions(r->sess) : 0;
+            pfd[1].events = (!r->s2c.eof && relay_quota(r, relay_room(&r->s2c))) ||
+                (dirs & LIBSSH2_SESSION_BLOCK_INBOUND) ? POLLIN : 0;
+            if (dirs & LIBSSH2_SESSION_BLOCK_OUTBOUND) pfd[1].events |= POLLOUT;
+            wait = RELAY_WAIT_SSH2_MS;
+        }
+    #endif
+    #if (WITH_LIBSSL)
+        /* Decrypted data may already wait in the TLS buffer, but not in the socket */
+        if (r->s->t == CHS_TLS && !r->s2c.eof && relay_quota(r, relay_room(&r->s2c)) && SSL_pending(r->s->l))
+            wait = 0;
+    #endif
+    wait = MIN(wait, w);
+
+    /* Once the peer's FIN meets ours, a side reports POLLHUP at once and always. Unless we wait to read or write it,
+    e.g. its EOF is queued behind a full buffer, don't poll it; held zero-copy completions go to relay_zc_stop() */
+    if (r->s2c.shut && !pfd[0].events) pfd[0].fd = -1;
+    if (r->c2s.shut && !pfd[1].events) pfd[1].fd = -1;
+
+    if ((ret = poll(pfd, 2, wait)) == -1) return errno == EINTR ? RELAY_AGAIN : RELAY_ERROR;
+
+    #if (RELAY_ZEROCOPY)
+        relay_zc_error(&r->s2c, &pfd[0]);
+        relay_zc_error(&r->c2s, &pfd[1]);
+    #endif
+
+    for (i = 0; i < 2; i++)
+        if ((pfd[i].revents & POLLERR) || (pfd[i].revents & POLLNVAL)) {
+            printl(LOG_INFO, "Connection with the %s is broken", i ? "proxy server" : "client");
+            return RELAY_ERROR;
+        }
+
+    /* Read both sides, then write both buffers: each wakeup serves both directions */
+    if (pfd[0].revents & (POLLIN | POLLHUP)) {
+        if ((ret = relay_read_client(r)) < 0) return RELAY_ERROR;
+        moved += ret;
+    }
+
+    if ((pfd[1].revents & (POLLIN | POLLHUP)) || r->s->t != CHS_SOCKET) {
+        if ((ret = relay_read_server(r)) < 0) return RELAY_ERROR;
+        moved += ret;
+    }
+
+    if ((ret = relay_write_server(r)) < 0) return RELAY_ERROR;
+    moved += ret;
+    if ((ret = relay_write_client(r)) < 0) return RELAY_ERROR;
+    moved += ret;
+
+    if (moved) {
+        r->last = time(NULL);
+        #if defined(linux)
+            if (r->tune && r->last - r->tuned >= RELAY_TUNE_INTERVAL) relay_tune(r, r->last);
+        #endif
+    } else {
+        if (time(NULL) - r->last >= RELAY_BUFFER_RELEASE) {
+            relay_release(&r->c2s);
+            relay_release(&r->s2c);
+            bpool_drain();
+        }
+        if (r->idle && time(NULL) - r->last >= r->idle) return RELAY_IDLE;
+    }
+
+    return r->c2s.shut && r->s2c.shut ? RELAY_DONE : RELAY_AGAIN;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void relay_stop(relay *r) {
+    /* Return the relay buffers and the client rate bucket */
+
+    #if (RELAY_ZEROCOPY)
+        relay_zc_stop(&r->s2c, r->c);
+        relay_zc_stop(&r->c2s, r->s->s);
+    #endif
+
+    bpool_put(r->c2s.buf, r->c2s.cap);
+    bpool_put(r->s2c.buf, r->s2c.cap);
+    r->c2s.buf = r->s2c.buf = NULL;
+    bpool_drain();
+    bpool_sock(-(long)(r->c2s.sock + r->s2c.sock));
+    r->c2s.sock = r->s2c.sock = 0;
+    shaper_release(r->cb);
+    r->cb = NULL;
+}
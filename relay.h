@@ -0,0 +1,112 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <time.h>
+
+
+/* -- Client <-> server relay --------------------------------------------------------------------------------------- */
+#define RELAY_BUFFER_DEFAULT    (128 * 1024)        /* Largest buffer per direction, tunnels start at 4K */
+#define RELAY_BUFFER_MIN        4096
+#define RELAY_BUFFER_MAX        (16 * 1024 * 1024)
+
+#define RELAY_BUFFER_RELEASE    5                   /* Seconds without traffic to give the buffers back */
+
+#define RELAY_TUNE_INTERVAL     1                   /* Seconds between TCP_INFO samples of a busy tunnel */
+#define RELAY_TUNE_BUSY         (256 * 1024)        /* Bytes per second a direction moves to be tuned */
+#define RELAY_TUNE_MAX          (16 * 1024 * 1024)  /* Largest socket buffer the tuning sets */
+
+#define RELAY_ZC_MIN            (32 * 1024)         /* Smallest send() worth MSG_ZEROCOPY */
+#define RELAY_ZC_HELD           8                   /* Drained buffers awaiting completions, per direction */
+#define RELAY_ZC_LINGER_MS      1000                /* relay_stop() waits for the last completions */
+
+#define RELAY_WAIT_MS           1000                /* Wake up to check the idle deadline */
+#define RELAY_WAIT_SSH2_MS      100                 /* libssh2 may hold data read from the socket already */
+
+/* relay_step() results */
+#define RELAY_AGAIN             0                   /* Call again */
+#define RELAY_DONE              1                   /* Both directions are closed and drained */
+#define RELAY_IDLE              2                   /* No traffic for the idle deadline */
+#define RELAY_ERROR             -1                  /* A side failed, the tunnel is torn down */
+
+typedef struct relay_zc {                           /* MSG_ZEROCOPY sends of a direction, Linux only */
+    int on;                                         /* SO_ZEROCOPY: 1 set, -1 unavailable, 0 not tried yet */
+    int cur;                                        /* The direction buffer has zero-copy sends in flight */
+    unsigned int next;                              /* ID the kernel gives the next zero-copy send() */
+    unsigned int first;                             /* IDs of the sends from the direction buffer */
+    unsigned int last;
+    unsigned int done;                              /* and how many of them are completed */
+    int held;                                       /* Drained buffers awaiting completions */
+    char *buf[RELAY_ZC_HELD];
+    size_t cap[RELAY_ZC_HELD];
+    unsigned int hfirst[RELAY_ZC_HELD];             /* IDs of the sends from the held buffer */
+    unsigned int hlast[RELAY_ZC_HELD];
+    unsigned int hdone[RELAY_ZC_HELD];              /* and their completions */
+    unsigned long sends;                            /* Zero-copy send() calls */
+    unsigned long copied;                           /* of them the kernel had to copy anyway */
+} relay_zc;
+
+typedef struct relay_dir {                          /* One direction of the relay */
+    char *buf;                                      /* NULL: released while idle */
+    size_t cap;                                     /* Buffer size, grows up to relay.size */
+    size_t len;                                     /* Bytes in the buffer */
+    size_t off;                                     /* Bytes already sent */
+    int eof;                                        /* The reading side has closed */
+    int shut;                                       /* EOF is passed to the writing side */
+    int frag;                                       /* The next send starts with the SDPI fragment */
+    size_t sized;                                   /* Socket buffer size the tuning has reached, 0: kernel */
+    size_t sock;                                    /* Bytes it raised both sockets by, charged to the pool */
+    relay_zc zc;                                    /* Zero-copy sends to the writing side */
+} relay_dir;
+
+typedef struct relay {
+    int c;                                          /* Client socket */
+    chs *s;                                         /* Server transport */
+    #if (WITH_LIBSSH2)
+        LIBSSH2_SESSION *sess;                      /* SSH2 session of the server channel */
+    #endif
+    size_t size;                                    /* Largest buffer size per direction */
+    relay_dir c2s;                                  /* Client -> Server */
+    relay_dir s2c;                                  /* Server -> Client */
+    unsigned int idle;                              /* Idle deadline in seconds, 0: none */
+    int sdpi;                                       /* DPI bypass fragment size for plain sockets, 0: off */
+    int tune;                                       /* Size socket buffers on bandwidth-delay product, Linux only */
+    int zerocopy;                                   /* MSG_ZEROCOPY for large sends to plain sockets, Linux only */
+    struct shaper *shape;                           /* Rate buckets of the section or NULL */
+    struct shaper_bucket *cb;                       /* and of the client address or NULL */
+    long allow;                                     /* Bytes the buckets let read at this wakeup */
+    time_t tuned;                                   /* The last tuning sample */
+    unsigned long long tcbytes;                     /* cbytes and dbytes at the last sample */
+    unsigned long long tdbytes;
+    time_t last;                                    /* The last traffic time */
+    unsigned long long cbytes;                      /* Bytes received from the client */
+    unsigned long long dbytes;                      /* Bytes received from the server */
+} relay;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+int relay_start(relay *r, int c, chs *s, size_t size, char *pre, size_t pre_len);
+int relay_step(relay *r);
+void relay_stop(relay *r);
@@ -0,0 +1,221 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Bandwidth shaping --------------------------------------------------------------------------------------------- */
+
+/*
+* A section with proxy_rate or proxy_client_rate maps a shaper in shared memory on INI-file load, the clients inherit
+* it. Buckets nest: every read of a tunnel takes tokens from the section bucket and from the bucket of its client
+* address, and the relay reads no more than the emptier of the two holds. An empty bucket stops reading both sides
+* of the tunnel until the tokens are earned back, so the data is paced by TCP flow control and never dropped.
+*
+* Buckets refill lazily: whichever process looks first after a byte worth of time has passed moves the timestamp and
+* adds the tokens. Concurrent reads may take a bucket below zero, the debt is paid back before the next read.
+*/
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include "network.h"
+#include "logfile.h"
+#include "shaper.h"
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static long long shaper_now(void) {
+    /* Return monotonic microseconds, the same clock for all the processes */
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void shaper_refill(shaper_bucket *b, long rate, long burst, long long now) {
+    /* Add the tokens earned since the last refill up to the burst; a bucket starts full */
+
+    long long then, add, t;
+
+    then = __atomic_load_n(&b->stamp, __ATOMIC_RELAXED);
+    if (now <= then) return;
+
+    if (!then) add = burst;
+    else if ((add = (double)(now - then) * rate / 1000000) < 1) return;        /* Not a byte yet, keep the stamp */
+
+    /* The stamp moves by the time the tokens stand for, rounded up not to mint the fractions twice; a full bucket
+    takes no more */
+    if (add >= burst) add = burst;
+    else now = then + (add * 1000000 + rate - 1) / rate;
+    if (!__atomic_compare_exchange_n(&b->stamp, &then, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;                                                         /* Another client has refilled it */
+
+    t = __atomic_add_fetch(&b->tokens, add, __ATOMIC_RELAXED);
+    while (t > burst && !__atomic_compare_exchange_n(&b->tokens, &t, burst, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static long long shaper_check(shaper_bucket *b, long rate, long burst, long long now, long long *wait) {
+    /* Refill the bucket; Return its tokens, when empty raise the wait to the time of the debt paid back */
+
+    long long t;
+
+    shaper_refill(b, rate, burst, now);
+    if ((t = __atomic_load_n(&b->tokens, __ATOMIC_RELAXED)) <= 0) {
+        *wait = MAX(*wait, (1 - t) * 1000000 / rate);
+        __atomic_add_fetch(&b->throttled, 1, __ATOMIC_RELAXED);
+    }
+
+    return t;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+shaper_bucket *shaper_client(shaper *sh, struct sockaddr_storage *caddr) {
+    /* Find or take the bucket of the client address, an unused one of the probe window is replaced. With all of
+    them busy, the client shares the bucket of its hash; Return the bucket or NULL without client rates */
+
+    shaper_bucket *b, *v = NULL;
+    const unsigned char *p;
+    size_t len;
+    uint32_t key = 2166136261u, old;
+    unsigned int k;
+
+    if (!sh || !sh->crate) return NULL;
+
+    if (caddr->ss_family == AF_INET6) {
+        p = (const unsigned char *)&SIN6_ADDR(*caddr);
+        len = sizeof(SIN6_ADDR(*caddr));
+    } else {
+        p = (const unsigned char *)&SIN4_ADDR(*caddr);
+        len = sizeof(SIN4_ADDR(*caddr));
+    }
+    while (len--) key = (key ^ *p++) * 16777619;                        /* FNV-1a */
+    key = key ? : 1;
+
+    for (k = 0; k < SHAPER_PROBE; k++) {
+        b = &sh->client[(key + k) % SHAPER_CLIENTS];
+        old = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (old == key) break;
+        if (!v && (!old || !__atomic_load_n(&b->users, __ATOMIC_RELAXED))) v = b;
+    }
+
+    if (k == SHAPER_PROBE) {
+        if (v) old = __atomic_load_n(&v->key, __ATOMIC_ACQUIRE);
+        if (v && __atomic_compare_exchange_n(&v->key, &old, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            b = v;
+            b->addr = *caddr;
+            b->tokens = b->stamp = 0;
+            b->bytes = b->throttled = 0;
+        } else
+            b = &sh->client[key % SHAPER_CLIENTS];                      /* Busy or taken by another client: share */
+    }
+
+    __atomic_add_fetch(&b->users, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void shaper_release(shaper_bucket *cb) {
+    /* The tunnel of the client is finished, its bucket may be given to another address */
+
+    if (cb) __atomic_sub_fetch(&cb->users, 1, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+long shaper_allow(shaper *sh, shaper_bucket *cb, int *wait) {
+    /* Return bytes the section and client buckets allow to read now or 0 with wait set to milliseconds to sleep */
+
+    long long now = shaper_now(), w = 0, a = LONG_MAX;
+
+    if (sh->rate) a = MIN(a, shaper_check(&sh->section, sh->rate, sh->burst, now, &w));
+    if (cb) a = MIN(a, shaper_check(cb, sh->crate, sh->cburst, now, &w));
+
+    if (a > 0) return a;
+
+    *wait = MIN(w / 1000 + 1, SHAPER_WAIT_MAX_MS);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void shaper_take(shaper *sh, shaper_bucket *cb, long n) {
+    /* Take tokens for n bytes read */
+
+    if (sh->rate) {
+        __atomic_sub_fetch(&sh->section.tokens, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&sh->section.bytes, n, __ATOMIC_RELAXED);
+    }
+
+    if (cb) {
+        __atomic_sub_fetch(&cb->tokens, n, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cb->bytes, n, __ATOMIC_RELAXED);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void shaper_pace(shaper *sh, int sock) {
+    /* Let the kernel spread the socket sends at the client rate, or the section one, instead of bursts */
+
+    #if defined(SO_MAX_PACING_RATE)
+        unsigned int rate;
+
+        if (!sh) return;
+        rate = MIN((unsigned long)(sh->crate ? : sh->rate), UINT_MAX - 1);
+        if (rate && setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+            printl(LOG_VERB, "Unable to set the socket pacing rate: [%u] bytes/s", rate);
+    #else
+        (void)sh;
+        (void)sock;
+    #endif
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void shaper_show(shaper *sh, int loglvl) {
+    /* Display the rates and the bucket counters of a section */
+
+    char ip[INET6_ADDRSTRLEN];
+    shaper_bucket *b;
+    int i;
+
+    if (!sh) return;
+
+    printl(loglvl, "SHOW Rate: [%ld] Burst: [%ld] Client rate: [%ld] Burst: [%ld] bytes/s",
+        sh->rate, sh->burst, sh->crate, sh->cburst);
+    if (sh->rate)
+        printl(loglvl, "SHOW Rate section: Tokens: [%lld] Bytes: [%llu] Throttled: [%lu]",
+            sh->section.tokens, sh->section.bytes, sh->section.throttled);
+
+    for (i = 0; i < SHAPER_CLIENTS; i++) {
+        b = &sh->client[i];
+        if (!b->key) continue;
+        inet_ntop(b->addr.ss_family, b->addr.ss_family == AF_INET6 ?
+            (void *)&SIN6_ADDR(b->addr) : (void *)&SIN4_ADDR(b->addr), ip, sizeof(ip));
+        printl(loglvl, "SHOW Rate client: [%s] Tunnels: [%u] Tokens: [%lld] Bytes: [%llu] Throttled: [%lu]",
+            ip, b->users, b->tokens, b->bytes, b->throttled);
+    }
+}
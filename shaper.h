@@ -0,0 +1,64 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* -- Bandwidth shaping: token buckets, the section one above per-client ones --------------------------------------- */
+#define SHAPER_RATE_MIN         1024                /* Bytes per second */
+#define SHAPER_RATE_MAX         (1024L * 1024 * 1024 * 10)
+#define SHAPER_BURST_MIN        4096                /* Bytes, the smallest relay buffer */
+#define SHAPER_CLIENTS          256                 /* Client buckets per section, by the client address hash */
+#define SHAPER_PROBE            8                   /* Buckets to probe for a client, an unused one is replaced */
+#define SHAPER_WAIT_MAX_MS      1000                /* The longest a throttled relay sleeps between checks */
+
+typedef struct shaper_bucket {                      /* Shared memory, updated with __atomic builtins */
+    uint32_t key;                                   /* Client: the address hash, 0: free; Section: unused */
+    unsigned int users;                             /* Client: tunnels sharing the bucket now */
+    struct sockaddr_storage addr;                   /* Client: the address to display */
+    long long tokens;                               /* Bytes to relay without waiting, negative: the debt */
+    long long stamp;                                /* The last refill, monotonic microseconds */
+    unsigned long long bytes;                       /* Bytes taken */
+    unsigned long throttled;                        /* Reads deferred for tokens */
+} shaper_bucket;
+
+typedef struct shaper {                             /* Per section, shared by its clients */
+    long rate;                                      /* Section: bytes per second of all the clients, 0: none */
+    long burst;
+    long crate;                                     /* Client: bytes per second of each client address, 0: none */
+    long cburst;
+    shaper_bucket section;
+    shaper_bucket client[SHAPER_CLIENTS];
+} shaper;
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+shaper_bucket *shaper_client(shaper *sh, struct sockaddr_storage *caddr);
+void shaper_release(shaper_bucket *cb);
+long shaper_allow(shaper *sh, shaper_bucket *cb, int *wait);
+void shaper_take(shaper *sh, shaper_bucket *cb, long n);
+void shaper_pace(shaper *sh, int sock);
+void shaper_show(shaper *sh, int loglvl);
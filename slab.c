@@ -0,0 +1,102 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Fixed size object slabs --------------------------------------------------------------------------------------- */
+
+/*
+* Objects created and destroyed for every client, e.g. the main process clients list records, are carved out of
+* chunks of SLAB_CHUNK_OBJECTS and recycled via a free list, so malloc() is called once per chunk, not per client.
+* Chunks are never returned: the slab keeps the peak number of objects. Not for objects shared between processes.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logfile.h"
+#include "slab.h"
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static size_t slab_align(size_t n) {
+    /* Round n up to the alignment suitable for any object type */
+
+    size_t a = sizeof(long double) > sizeof(void *) ? sizeof(long double) : sizeof(void *);
+
+    return (n + a - 1) / a * a;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void *slab_alloc(slab *s) {
+    /* Return a zeroed object or NULL if a new chunk can't be allocated */
+
+    size_t sz = slab_align(s->size), hdr = slab_align(sizeof(void *));
+    char *c, *o;
+    int i;
+
+    if (!s->free) {
+        if (!(c = malloc(hdr + sz * SLAB_CHUNK_OBJECTS))) {
+            printl(LOG_CRIT, "Unable to allocate a [%s] slab chunk", s->name);
+            return NULL;
+        }
+
+        *(void **)c = s->chunks;                                    /* Link the chunk */
+        s->chunks = c;
+        s->mallocs++;
+        s->objects += SLAB_CHUNK_OBJECTS;
+
+        for (i = SLAB_CHUNK_OBJECTS - 1; i >= 0; i--) {             /* The free list in address order */
+            o = c + hdr + i * sz;
+            *(void **)o = s->free;
+            s->free = o;
+        }
+    }
+
+    o = s->free;
+    s->free = *(void **)o;
+    s->used++;
+    s->allocs++;
+    memset(o, 0, s->size);
+    return o;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void slab_free(slab *s, void *obj) {
+    /* Put the object back to the slab free list */
+
+    if (!obj) return;
+
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->used--;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void slab_show(slab *s, int loglvl) {
+    /* Display the slab usage and allocation counters */
+
+    printl(loglvl, "SHOW Slab: [%s] Objects: [%lu] of [%lu], allocations: [%lu], chunk mallocs: [%lu]",
+        s->name, s->used, s->objects, s->allocs, s->mallocs);
+}
@@ -0,0 +1,49 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <stddef.h>
+
+/* -- Fixed size object slabs --------------------------------------------------------------------------------------- */
+#define SLAB_CHUNK_OBJECTS      64                  /* Objects carved out of one malloc() */
+
+typedef struct slab {
+    const char *name;                               /* For SHOW */
+    size_t size;                                    /* Object size */
+    void *free;                                     /* Free objects list */
+    void *chunks;                                   /* Allocated chunks list */
+    unsigned long objects;                          /* Objects in the chunks */
+    unsigned long used;                             /* Objects handed out */
+    unsigned long allocs;                           /* slab_alloc() calls */
+    unsigned long mallocs;                          /* Chunks allocated by malloc() */
+} slab;
+
+#define SLAB_INIT(name, type)   {name, sizeof(type), NULL, NULL, 0, 0, 0, 0}
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+void *slab_alloc(slab *s);
+void slab_free(slab *s, void *obj);
+void slab_show(slab *s, int loglvl);
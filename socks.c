@@ -37,6 +37,7 @@
 
 #include "utility.h"
 #include "network.h"
+#include "tls.h"
 #include "socks.h"
 #include "logfile.h"
 #include "version.h"
@@ -64,94 +65,166 @@ const char *socks5_status[] = {
 };
 
 /* -- Socks client functions ---------------------------------------------------------------------------------------- */
-int socks4_client_request(chs cs, uint8_t cmd, struct sockaddr_in *daddr, char *user) {
-    /* Send Socks4 request */
-
-    s4_request req;
-    s4_reply rep;
-    int idlen = 0, rcount = 0;
-
-    printl(LOG_CRIT, "Preparing IPv4 Socks4 request");
-
-    /* Fill in the request */
-    strncpy((char*)req.id, PROG_NAME, sizeof(req.id) - 1);          /* Sic! Some username is required by server! */
-    req.id[sizeof(req.id) - 1] = '\0';
-    idlen = strnlen((char *)req.id, STR_SIZE);
-
-    req.ver = PROXY_PROTO_SOCKS_V4 - '0';
-    req.cmd = cmd;
-    req.dstaddr = S4_ADDR(*daddr);
-    req.dstport = SIN4_PORT(*daddr);
-    if (user != NULL) {
-        idlen = strnlen(user, STR_SIZE);
-        strncpy((char *)req.id, user, idlen);
-    }
+int socks4_request_template(uint8_t **tpl, char *user) {
+    /* Build Socks4 request with the user ID once per INI-section; Return its length or 0 */
 
-    printl(LOG_VERB, "Sending IPv4 Socks4 request");
+    s4_request *req;
+    int idlen;
 
-    switch (cs.t) {
-        case CHS_SOCKET:
-            if (send(cs.s, &req, 8 + idlen + 1, 0) == -1) {
-                printl(LOG_CRIT, "Unable to send a request to the Socks4 server via socket");
-                return SOCKS4_REPLY_KO;
-            }
+    /* Sic! Some username is required by server! */
+    idlen = strnlen(user ? user : PROG_NAME, sizeof(req->id) - 1);
+    if (!(req = calloc(1, sizeof(s4_request)))) return 0;
 
-            printl(LOG_VERB, "IPv4 Socks4 request sent");
+    req->ver = PROXY_PROTO_SOCKS_V4 - '0';
+    req->cmd = SOCKS4_CMD_TCPCONNECT;
+    memcpy(req->id, user ? user : PROG_NAME, idlen);                   /* NUL-terminated by calloc() */
 
-            if ((rcount = recv(cs.s, &rep, sizeof(s4_reply), 0)) == -1) {
-                printl(LOG_CRIT, "Unable to receive a reply from the Socks4 server via socket");
-                return SOCKS4_REPLY_KO;
-            }
-        break;
+    *tpl = (uint8_t *)req;
+    return 8 + idlen + 1;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void socks4_request_start(hs *h, uint8_t cmd, struct sockaddr_in *daddr, char *dname, uint8_t *tpl, int tpl_len) {
+    /* Prepare Socks4 request in h: patch the precompiled template with the command and destination. With dname, send
+    Socks4a request: the destination name follows the user ID, the server resolves it */
+
+    s4_request *req = (s4_request *)h->buf;
+    size_t nl;
+
+    printl(LOG_VERB, "Preparing IPv4 Socks4 request");
 
-        case CHS_CHANNEL:
-            #if (WITH_LIBSSH2)
-                if (libssh2_channel_write(cs.c, (char*)&req, 8 + idlen + 1) < 0) {
-                    printl(LOG_CRIT, "Unable to send a request to the Socks4 server via SSH2 channel");
-                    return SOCKS4_REPLY_KO;
-                }
-
-                while ((rcount = libssh2_channel_read(cs.c, (char*)&rep, sizeof(s4_reply))) == LIBSSH2_ERROR_EAGAIN) ;
-                if (rcount < 0) {
-                    printl(LOG_CRIT, "Unable to receive a reply from the Socks4 server via SSH2 channel");
-                    return SOCKS4_REPLY_KO;
-                }
-            #endif
+    memcpy(h->buf, tpl, tpl_len);
+    req->cmd = cmd;
+    req->dstport = SIN4_PORT(*daddr);                                   /* The same offset for IPv6 and unresolved */
+    if (dname && dname[0]) {
+        req->dstaddr = htonl(SOCKS4A_DSTADDR);
+        nl = strnlen(dname, HOST_NAME_MAX - 1) + 1;
+        memcpy(h->buf + tpl_len, dname, nl - 1);
+        h->buf[tpl_len + nl - 1] = '\0';
+        tpl_len += nl;
+    } else
+        req->dstaddr = S4_ADDR(*daddr);
+
+    h->state = HS_SOCKS_SEND;
+    h->status = SOCKS4_REPLY_KO;
+    h->pos = 0;
+    h->len = tpl_len;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks4_request_step(hs *h) {
+    /* Advance Socks4 request: send it, receive the reply; h->status is the server reply status */
+
+    s4_reply *rep = (s4_reply *)h->buf;
+    int r;
+
+    switch (h->state) {
+        case HS_SOCKS_SEND:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "Unable to send a request to the Socks4 server");
+            if (r != HS_DONE) return r;
+
+            printl(LOG_VERB, "IPv4 Socks4 request sent");
+            h->state = HS_SOCKS_REPLY;
+            h->pos = 0;
+            h->len = sizeof(s4_reply);
+            /* Fall through */
+
+        case HS_SOCKS_REPLY:
+            if ((r = hs_io(h, 0)) == HS_ERROR) printl(LOG_CRIT, "Unable to receive a reply from the Socks4 server");
+            if (r != HS_DONE) return r;
         break;
 
         default:
-            printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-            return SOCKS4_REPLY_KO;
-        break;
+            return HS_ERROR;
     }
 
-    printl(LOG_VERB, "Socks4 reply: [%d][%d]:[%s], Bytes [%d]",
-        rep.nul, rep.status, socks4_status[rep.status - 0x5a], rcount);
+    if (rep->nul != 0) {                                                /* Reply Socks4 Request rejected or failed */
+        printl(LOG_CRIT, "Socks4 server speaks unsupported protocol v:[%d]", rep->nul);
+        return HS_ERROR;
+    }
+
+    h->status = rep->status;
+    printl(LOG_VERB, "Socks4 server reply status: [%d]:[%s]", rep->status,
+        rep->status >= SOCKS4_REPLY_OK && rep->status <= SOCKS4_REPLY_KO_IDENT2 ?
+            socks4_status[rep->status - SOCKS4_REPLY_OK] : "Unknown");
+
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks4_client_request(chs cs, uint8_t cmd, struct sockaddr_in *daddr, char *dname, uint8_t *tpl, int tpl_len) {
+    /* Perform Socks4 request on a blocking transport; Return the server reply status */
+
+    hs h;
 
-    if (rep.nul != 0) {                                             /* Reply Socks4 Request rejected or failed */
-        printl(LOG_CRIT, "Socks4 server speaks unsupported protocol v:[%d]", rep.nul);
-        return SOCKS4_REPLY_KO;
+    h.cs = cs;
+    socks4_request_start(&h, cmd, daddr, dname, tpl, tpl_len);
+    return hs_run(&h, socks4_request_step) == HS_DONE ? h.status : SOCKS4_REPLY_KO;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void socks5_hello_start(hs *h, uint8_t *auth, int nauth) {
+    /* Prepare Socks5 Hello with nauth authentication methods in h */
+
+    h->buf[0] = PROXY_PROTO_SOCKS_V5 - '0';
+    h->buf[1] = nauth;
+    memcpy(h->buf + 2, auth, nauth);
+
+    h->state = HS_SOCKS_SEND;
+    h->status = AUTH_METHOD_NOACCEPT;
+    h->pos = 0;
+    h->len = 2 + nauth;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_hello_step(hs *h) {
+    /* Advance Socks5 Hello: send it, receive the reply; h->status is the auth method chosen by the server */
+
+    s5_reply_hello *rep = (s5_reply_hello *)h->buf;
+    int r;
+
+    switch (h->state) {
+        case HS_SOCKS_SEND:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "Unable to send 'hello' request to the Socks5 server");
+            if (r != HS_DONE) return r;
+
+            h->state = HS_SOCKS_REPLY;
+            h->pos = 0;
+            h->len = sizeof(s5_reply_hello);
+            /* Fall through */
+
+        case HS_SOCKS_REPLY:
+            if ((r = hs_io(h, 0)) == HS_ERROR)
+                printl(LOG_CRIT, "Unable to receive 'hello' reply from the Socks5 server");
+            if (r != HS_DONE) return r;
+        break;
+
+        default:
+            return HS_ERROR;
     }
 
-    printl(LOG_VERB, "Socks4 server reply status: [%d]:[%s]", rep.status, socks4_status[rep.status - 0x5a]);
+    /* Veryfy Socks version */
+    if (rep->ver != PROXY_PROTO_SOCKS_V5 - '0') {
+        printl(LOG_CRIT, "Socks5 server unsupported protocol: v[%d]", rep->ver);
+        return HS_ERROR;
+    }
 
-    return rep.status;
+    h->status = rep->cauth;
+    printl(LOG_VERB, "Socks5 server accepted auth-method: [%d]", rep->cauth);
+    return HS_DONE;
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
 int socks5_client_hello(chs cs, unsigned int auth_method, ...) {
-    /* Send Socks5 Hello and receive a reply.
+    /* Send Socks5 Hello and receive a reply on a blocking transport.
 
     Specify one mandatory auth_method, list the rest of auth methods as variadic arguments. Make sure the last of them
     is always AUTH_METHOD_NOACCEPT !!! */
 
-    s5_request_hello req;
-    s5_reply_hello rep;
+    uint8_t auth[AUTH_MAX_METHODS];
     va_list ap;
     unsigned int am = 0;
-    #if (WITH_LIBSSH2)
-        int rcount = 0;
-    #endif
+    hs h;
 
 
     if (auth_method == AUTH_METHOD_NOACCEPT) {
@@ -160,403 +233,366 @@ int socks5_client_hello(chs cs, unsigned int auth_method, ...) {
     }
 
     /* Fill into auth-methods */
-    req.auth[am] = auth_method;
-    printl(LOG_VERB, "Auth method: [%u], number [%d]", req.auth[am], am);
+    auth[am] = auth_method;
+    printl(LOG_VERB, "Auth method: [%u], number [%d]", auth[am], am);
     va_start(ap, (auth_method));
-    while ((req.auth[++am] = va_arg(ap, unsigned int)) != AUTH_METHOD_NOACCEPT)
-        printl(LOG_VERB, "Auth method: [%u], number [%d]", req.auth[am], am);
+    while (am < AUTH_MAX_METHODS - 1 && (auth[++am] = va_arg(ap, unsigned int)) != AUTH_METHOD_NOACCEPT)
+        printl(LOG_VERB, "Auth method: [%u], number [%d]", auth[am], am);
     va_end(ap);
 
-    /* Fill the rest fields of 'hello' request structure */
-    req.ver = PROXY_PROTO_SOCKS_V5 - '0';
-    req.nauth = am;
-
-    switch (cs.t) {
-        case CHS_SOCKET:
-            /* Send 'hello' request */
-            if (send(cs.s, &req, am + sizeof(req.ver) + sizeof(req.nauth), 0) == -1) {
-                printl(LOG_CRIT, "Unable to send 'hello' request to the Socks5 server via socket");
-                return AUTH_METHOD_NOACCEPT;
-            }
-
-            /* Receive 'hello' response from Socks5 server */
-            if ((recv(cs.s, &rep, sizeof(rep), 0)) == -1) {
-                printl(LOG_CRIT, "Unable to receive 'hello' reply from the Socks5 server via socket");
-                return AUTH_METHOD_NOACCEPT;
-            }
-        break;
-
-        case CHS_CHANNEL:
-            #if (WITH_LIBSSH2)
-                if (libssh2_channel_write(cs.c, (char*)&req, am + sizeof(req.ver) + sizeof(req.nauth)) < 0) {
-                    printl(LOG_CRIT, "Unable to send 'hello' request to the Socks5 server via SSH2 channel");
-                    return AUTH_METHOD_NOACCEPT;
-                }
-
-                while ((rcount = libssh2_channel_read(cs.c, (char*)&rep, sizeof(rep))) == LIBSSH2_ERROR_EAGAIN) ;
-                if (rcount < 0) {
-                    printl(LOG_CRIT, "Unable to receive 'hello' reply from the Socks5 server via SSH2 channel");
-                    return AUTH_METHOD_NOACCEPT;
-                }
-            #endif
-        break;
-
-        default:
-            printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-            return AUTH_METHOD_NOACCEPT;
-        break;
-    }
-
-    /* Veryfy Socks version */
-    if (rep.ver != PROXY_PROTO_SOCKS_V5 - '0') {
-        printl(LOG_CRIT, "Socks5 server unsupported protocol: v[%d]", rep.ver);
-        return AUTH_METHOD_NOACCEPT;
-    }
-
-    printl(LOG_VERB, "Socks5 server accepted auth-method: [%d]", rep.cauth);
-    return rep.cauth;
+    h.cs = cs;
+    socks5_hello_start(&h, auth, am);
+    return hs_run(&h, socks5_hello_step) == HS_DONE ? h.status : AUTH_METHOD_NOACCEPT;
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int socks5_client_auth(chs cs, char *user, char *password) {
-    char buf[513];                                                      /* Max Socks5 auth request size */
+int socks5_auth_template(uint8_t **tpl, char *user, char *password) {
+    /* Build Socks5 username/password auth request (RFC 1929) once per INI-section; Return its length or 0 */
+
+    uint8_t *buf;
     int idlen = 0, pwlen = 0;
-    int rcount = 0;
-    s5_reply_auth *rep = NULL;
 
+    if (!user) return 0;
     idlen = strnlen(user, 255);
-    pwlen = strnlen(password, 255);
+    pwlen = password ? strnlen(password, 255) : 0;
+    if (!(buf = malloc(2 + idlen + 1 + pwlen))) return 0;
 
-    /* Fill into the auth request structure */
     buf[0] = 1;
     buf[1] = idlen;
     memcpy(buf + 2, user, idlen);
     buf[2 + idlen] = pwlen;
-    memcpy(buf + 2 + idlen + 1, password, pwlen);
+    if (pwlen) memcpy(buf + 2 + idlen + 1, password, pwlen);
 
+    *tpl = buf;
+    return 2 + idlen + 1 + pwlen;
+}
 
-    switch (cs.t) {
-        case CHS_SOCKET:
-            if (send(cs.s, buf, 2 + idlen + 1 + pwlen, 0) == -1) {
-                printl(LOG_CRIT, "Unable to send an auth request to the Socks5 server via socket");
-                return SOCKS5_REPLY_KO;
-            }
+/* ------------------------------------------------------------------------------------------------------------------ */
+void socks5_auth_start(hs *h, uint8_t *tpl, int tpl_len) {
+    /* Prepare the precompiled Socks5 auth request in h */
 
-            memset(buf, 0, sizeof buf);
-            if ((rcount = recv(cs.s, &buf, sizeof(buf), 0)) == -1) {
-                printl(LOG_CRIT, "Unable to receive a reply from the Socks5 server via socket");
-                return SOCKS5_REPLY_KO;
-            }
-        break;
+    memcpy(h->buf, tpl, tpl_len);
+
+    h->state = HS_SOCKS_SEND;
+    h->status = SOCKS5_REPLY_KO;
+    h->pos = 0;
+    h->len = tpl_len;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_auth_step(hs *h) {
+    /* Advance Socks5 auth: send the request, receive the reply; h->status is the server reply status */
+
+    s5_reply_auth *rep = (s5_reply_auth *)h->buf;
+    int r;
 
-        case CHS_CHANNEL:
-            #if (WITH_LIBSSH2)
-                if (libssh2_channel_write(cs.c, (char*)&buf, 2 + idlen + 1 + pwlen) < 0) {
-                    printl(LOG_CRIT, "Unable to send auth request to the Socks5 server via SSH2 channel");
-                    return SOCKS5_REPLY_KO;
-                }
-
-                while ((rcount = libssh2_channel_read(cs.c, (char*)&buf, sizeof(buf))) == LIBSSH2_ERROR_EAGAIN) ;
-                if (rcount < 0) {
-                    printl(LOG_CRIT, "Unable to receive auth reply from the Socks5 server via SSH2 channel");
-                    return SOCKS5_REPLY_KO;
-                }
-            #endif
+    switch (h->state) {
+        case HS_SOCKS_SEND:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "Unable to send an auth request to the Socks5 server");
+            if (r != HS_DONE) return r;
+
+            h->state = HS_SOCKS_REPLY;
+            h->pos = 0;
+            h->len = sizeof(s5_reply_auth);
+            /* Fall through */
+
+        case HS_SOCKS_REPLY:
+            if ((r = hs_io(h, 0)) == HS_ERROR) printl(LOG_CRIT, "Unable to receive auth reply from the Socks5 server");
+            if (r != HS_DONE) return r;
         break;
 
         default:
-            printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-            return SOCKS5_REPLY_KO;
-        break;
+            return HS_ERROR;
     }
 
-    rep = (s5_reply_auth *)buf;
-    printl(LOG_VERB, "Socks5 reply: [%d][%d]:[%s], Bytes [%d]",
-        rep->ver, rep->status, !rep->status ? "OK" : "KO", rcount);
-
-    return rep->status;
+    h->status = rep->status;
+    printl(LOG_VERB, "Socks5 reply: [%d][%d]:[%s]", rep->ver, rep->status, !rep->status ? "OK" : "KO");
+    return HS_DONE;
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-int socks5_client_request(chs cs, uint8_t cmd, struct sockaddr_storage *daddr, char *dname) {
-    /* Perform Socks5 request; IPv4/IPv6 addresses: atype 1/4, Domain name: atype 3 */
+int socks5_client_auth(chs cs, uint8_t *tpl, int tpl_len) {
+    /* Send the precompiled auth request and receive the reply on a blocking transport */
 
-    s5_reply_short *rep;
-    char buf[sizeof(s5_reply)];                                   /* Max Socks5 reply size */
-    int rcount = 0;
-    uint8_t atype = SOCKS5_ATYPE_NONE;
-    int atype_len = SOCKS5_ATYPE_NAME_LEN;
+    hs h;
 
+    if (!tpl) {
+        printl(LOG_CRIT, "Socks5 server requested auth, but no user is defined");
+        return SOCKS5_REPLY_KO;
+    }
 
-    if (dname && dname[0])
-        atype = SOCKS5_ATYPE_NAME;
-    else
-        if (SA_FAMILY(*daddr) == AF_INET)
-            atype = SOCKS5_ATYPE_IPV4;
-        else
-            if (SA_FAMILY(*daddr) == AF_INET6)
-                atype = SOCKS5_ATYPE_IPV6;
+    h.cs = cs;
+    socks5_auth_start(&h, tpl, tpl_len);
+    return hs_run(&h, socks5_auth_step) == HS_DONE ? h.status : SOCKS5_REPLY_KO;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_request_start(hs *h, uint8_t cmd, struct sockaddr_storage *daddr, char *dname) {
+    /* Prepare Socks5 request in h; IPv4/IPv6 addresses: atype 1/4, Domain name: atype 3; Return 0 or 1 on error */
+
+    s5_request_short *req = (s5_request_short *)h->buf;
+    uint8_t *p = (uint8_t *)h->buf + sizeof(s5_request_short);
+    size_t nl;
 
-    s5_request_short *req = (s5_request_short *)buf;
     req->ver = PROXY_PROTO_SOCKS_V5 - '0';
     req->cmd = cmd;
     req->rsv = 0x0;
-    req->atype = atype;
-
-    if (atype == SOCKS5_ATYPE_IPV4) {
-        atype_len = SOCKS5_ATYPE_IPV4_LEN;
 
+    if (dname && dname[0]) {
+        printl(LOG_VERB, "Preparing NAME Socks5 request: [%s]", dname);
+        req->atype = SOCKS5_ATYPE_NAME;
+        nl = strnlen(dname, HOST_NAME_MAX);
+        *p++ = nl;
+        memcpy(p, dname, nl);
+        p += nl;
+        memcpy(p, &SIN4_PORT(*daddr), 2);                               /* The same offset for IPv6 and unresolved */
+    } else if (SA_FAMILY(*daddr) == AF_INET) {
         printl(LOG_VERB, "Preparing IPv4 Socks5 request");
-
-        s5_request_ipv4 *req = (s5_request_ipv4 *)buf;
-        memcpy(req->dstaddr, &SIN4_ADDR(*daddr), sizeof req->dstaddr);
-        req->dstport = SIN4_PORT(*daddr);
-
-        printl(LOG_VERB, "Sending IPv4 Socks5 request");
-
-        switch (cs.t) {
-            case CHS_SOCKET:
-                if (send(cs.s, req, sizeof(s5_request_ipv4), 0) == -1) {
-                    printl(LOG_CRIT, "Unable to send a request to the Socks5 server via socket");
-                    return SOCKS5_REPLY_KO;
-                }
-            break;
-
-            case CHS_CHANNEL:
-                #if (WITH_LIBSSH2)
-                    if (libssh2_channel_write(cs.c, (char *)req, sizeof(s5_request_ipv4)) < 0) {
-                        printl(LOG_CRIT, "Unable to send auth request to the Socks5 server via SSH2 channel");
-                        return SOCKS5_REPLY_KO;
-                    }
-                #endif
-            break;
-
-            default:
-                printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-                return SOCKS5_REPLY_KO;
-            break;
-        }
-
-        printl(LOG_VERB, "IPv4 Socks5 request sent");
-
-    } else if (atype == SOCKS5_ATYPE_IPV6) {
-        atype_len = SOCKS5_ATYPE_IPV6_LEN;
+        req->atype = SOCKS5_ATYPE_IPV4;
+        memcpy(p, &SIN4_ADDR(*daddr), SOCKS5_ATYPE_IPV4_LEN);
+        p += SOCKS5_ATYPE_IPV4_LEN;
+        memcpy(p, &SIN4_PORT(*daddr), 2);
+    } else if (SA_FAMILY(*daddr) == AF_INET6) {
         printl(LOG_VERB, "Preparing IPv6 Socks5 request");
-
-        s5_request_ipv6 *req = (s5_request_ipv6 *)buf;
-        memcpy(req->dstaddr, &SIN6_ADDR(*daddr), sizeof req->dstaddr);
-        req->dstport = SIN6_PORT(*daddr);
-
-        printl(LOG_VERB, "Sending IPv6 Socks5 request");
-
-        switch (cs.t) {
-            case CHS_SOCKET:
-                if (send(cs.s, req, 4 + sizeof(s5_request_ipv6), 0) == -1) {
-                    printl(LOG_CRIT, "Unable to send a request to the Socks5 server via socket");
-                    return SOCKS5_REPLY_KO;
-                }
-            break;
-
-            case CHS_CHANNEL:
-                #if (WITH_LIBSSH2)
-                    if (libssh2_channel_write(cs.c, (char*)&req, 4 + sizeof(s5_request_ipv6)) < 0) {
-                        printl(LOG_CRIT, "Unable to send a request to the Socks5 server via SSH2 channel");
-                        return SOCKS5_REPLY_KO;
-                    }
-                #endif
-            break;
-
-            default:
-                printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-                return SOCKS5_REPLY_KO;
-            break;
-        }
-
-        printl(LOG_VERB, "IPv6 Socks5 request sent");
-
-    } else if (atype == SOCKS5_ATYPE_NAME) {
-        printl(LOG_VERB, "Preparing NAME Socks5 request");
-
-        atype_len = strlen(dname);
-
-        printl(LOG_VERB, "The name in the NAME Socks5 request: [%s]", dname);
-
-        char *name = (char *)req + sizeof(s5_request_short);
-        *name++ = atype_len;
-        memcpy(name, dname, atype_len);
-        name += atype_len;
-        *(in_port_t *)name = SA_FAMILY(*daddr) == AF_INET ? (in_port_t)SIN4_PORT(*daddr) : (in_port_t)SIN6_PORT(*daddr);
-
-        printl(LOG_VERB, "Sending NAME Socks5 request");
-
-        switch (cs.t) {
-            case CHS_SOCKET:
-                if (send(cs.s, req,  sizeof(s5_request_short) + 1 + atype_len + 2,  0) == -1) {
-                    printl(LOG_CRIT, "Unable to send a request to the Socks5 server via socket");
-                    return SOCKS5_REPLY_KO;
-                }
-            break;
-
-            case CHS_CHANNEL:
-                #if (WITH_LIBSSH2)
-                    if (libssh2_channel_write(cs.c, (char*)&req, sizeof(s5_request_short) + 1 + atype_len + 2) < 0) {
-                        printl(LOG_CRIT, "Unable to send a request to the Socks5 server via SSH2 channel");
-                        return SOCKS5_REPLY_KO;
-                    }
-                #endif
-            break;
-
-            default:
-                printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-                return SOCKS5_REPLY_KO;
-            break;
-        }
-
-        printl(LOG_VERB, "NAME Socks5 request sent");
-
+        req->atype = SOCKS5_ATYPE_IPV6;
+        memcpy(p, &SIN6_ADDR(*daddr), SOCKS5_ATYPE_IPV6_LEN);
+        p += SOCKS5_ATYPE_IPV6_LEN;
+        memcpy(p, &SIN6_PORT(*daddr), 2);
     } else {
         printl(LOG_CRIT, "Unsupported address types: [%d] is in the request", daddr->ss_family);
-        return SOCKS5_REPLY_KO;
+        return 1;
     }
 
-    printl(LOG_VERB, "Expecting Socks5 server reply");
+    h->state = HS_SOCKS_SEND;
+    h->status = SOCKS5_REPLY_KO;
+    h->pos = 0;
+    h->len = p + 2 - (uint8_t *)h->buf;
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_request_step(hs *h) {
+    /* Advance Socks5 request: send it, receive the reply header with the first byte of the bound address, then the
+    rest of the address of the type chosen by the server and the port; h->status is the server reply status */
+
+    s5_reply_short *rep = (s5_reply_short *)h->buf;
+    int r;
+
+    switch (h->state) {
+        case HS_SOCKS_SEND:
+            if ((r = hs_io(h, 1)) == HS_ERROR) printl(LOG_CRIT, "Unable to send a request to the Socks5 server");
+            if (r != HS_DONE) return r;
+
+            printl(LOG_VERB, "Expecting Socks5 server reply");
+            h->state = HS_SOCKS_REPLY;
+            h->pos = 0;
+            h->len = sizeof(s5_reply_short) + 1;                        /* Any reply is longer than this */
+            /* Fall through */
+
+        case HS_SOCKS_REPLY:
+            if ((r = hs_io(h, 0)) == HS_ERROR) printl(LOG_CRIT, "Unable to receive a reply from the Socks5 server");
+            if (r != HS_DONE) return r;
+
+            if (rep->ver != PROXY_PROTO_SOCKS_V5 - '0') {                 /* Report Socks5 general failure */
+                printl(LOG_WARN, "Socks5 server speaks unsupported protocol v:[%d]", rep->ver);
+                return HS_ERROR;
+            }
 
-    /* Receive reply from the server */
-    memset(buf, 0, sizeof(buf));
+            h->state = HS_SOCKS_BOUND;
+            switch (rep->atype) {
+                case SOCKS5_ATYPE_IPV6:
+                    h->len += SOCKS5_ATYPE_IPV6_LEN - 1 + 2;
+                break;
 
-    switch (cs.t) {
-        case CHS_SOCKET:
-            /* 6 + atype_len: 6 is a SOCK5 header length - variable address field */
-            if ((rcount = recv(cs.s, &buf, 6 + atype_len, 0)) == -1) {
-                printl(LOG_CRIT, "Unable to receive a reply from the Socks5 server via socket");
-                return SOCKS5_REPLY_KO;
+                case SOCKS5_ATYPE_NAME:
+                    h->len += (uint8_t)h->buf[sizeof(s5_reply_short)] + 2;
+                break;
+
+                default:
+                    h->len += SOCKS5_ATYPE_IPV4_LEN - 1 + 2;
             }
-        break;
+            /* Fall through */
 
-        case CHS_CHANNEL:
-            #if (WITH_LIBSSH2)
-                while ((rcount = libssh2_channel_read(cs.c, (char*)&buf, 6 + atype_len)) == LIBSSH2_ERROR_EAGAIN) ;
-                if (rcount < 0) {
-                    printl(LOG_CRIT, "Unable to receive a reply from the Socks5 server via SSH2 channel");
-                    return SOCKS5_REPLY_KO;
-                }
-            #endif
+        case HS_SOCKS_BOUND:
+            if ((r = hs_io(h, 0)) == HS_ERROR)
+                printl(LOG_CRIT, "Unable to receive the bound address from the Socks5 server");
+            if (r != HS_DONE) return r;
         break;
 
         default:
-            printl(LOG_CRIT, "Error Socket / SSH2 Channel specified");
-            return SOCKS5_REPLY_KO;
-        break;
+            return HS_ERROR;
     }
 
-    rep = (s5_reply_short *)buf;
-    printl(LOG_VERB, "Socks5 reply: [%d][%d]:[%s], Bytes [%d]", rep->ver,
-        rep->status, socks5_status[rep->status], rcount);
+    h->status = rep->status;
+    printl(LOG_VERB, "Socks5 server reply status: [%d]:[%s], Bytes [%d]", rep->status,
+        rep->status <= SOCKS5_REPLY_ATYPE_ERROR ? socks5_status[rep->status] : "Unknown", (int)h->len);
+    return HS_DONE;
+}
 
-    if (rep->ver != PROXY_PROTO_SOCKS_V5 - '0') {                             /* Report Socks5 general failure */
-        printl(LOG_WARN, "Socks5 server speaks unsupported protocol v:[%d]", rep->ver);
-        return SOCKS5_REPLY_KO;
-    }
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_client_request(chs cs, uint8_t cmd, struct sockaddr_storage *daddr, char *dname) {
+    /* Perform Socks5 request on a blocking transport; Return the server reply status */
 
-    printl(LOG_VERB, "Socks5 server reply status: [%d]:[%s]", rep->status, socks5_status[rep->status]);
-    return rep->status;
+    hs h;
+
+    h.cs = cs;
+    if (socks5_request_start(&h, cmd, daddr, dname)) return SOCKS5_REPLY_KO;
+    return hs_run(&h, socks5_request_step) == HS_DONE ? h.status : SOCKS5_REPLY_KO;
 }
 
 /* --Socks server part ---------------------------------------------------------------------------------------------- */
-int socks5_server_hello(int socket) {
-    /* Parse client's 'hello' request and send reply; Return AUTH_METHOD_NOAUTH if OK or AUTH_METHOD_NOACCEPT if NOK */
+int socks5_server_hello_step(cbuf *c, uint8_t *cauth) {
+    /* Receive client's 'hello' request as far as it has come, then parse it and send the reply. The request may
+    already be pipelined after 'hello', it stays in the buffer; Return HS_DONE with the selected method in cauth:
+    AUTH_METHOD_NOAUTH or AUTH_METHOD_NOACCEPT, HS_WANT_READ to be called again when the client is readable or
+    HS_ERROR */
 
-    s5_request_hello req;
+    s5_request_hello *req;
     s5_reply_hello rep;
     uint8_t na = 0;
+    int r;
 
     rep.ver = PROXY_PROTO_SOCKS_V5 - '0';
-    rep.cauth = AUTH_METHOD_NOACCEPT;
+    rep.cauth = *cauth = AUTH_METHOD_NOACCEPT;
 
-    /* Receive 'hello' request from Socks-client */
-    if ((recv(socket, &req, sizeof req, 0)) == -1) {
-        printl(LOG_CRIT, "Unable to receive 'hello' reques from the Socks5 client");
+    /* The version, the number of methods, then the methods */
+    if ((r = cbuf_want(c, 2)) != HS_DONE || (r = cbuf_want(c, 2 + (uint8_t)c->data[c->off + 1])) != HS_DONE) {
         /* Quit function immediately; no reply back */
-        return AUTH_METHOD_NOACCEPT;
+        if (r == HS_ERROR) printl(LOG_CRIT, "Unable to receive 'hello' reques from the Socks5 client");
+        return r;
     }
+    req = (s5_request_hello *)(c->data + c->off);
+    c->off += 2 + req->nauth;
 
-    if (req.ver != PROXY_PROTO_SOCKS_V5 - '0')
-        printl(LOG_WARN, "Unsupported version: [%i] in the request", req.ver);
+    if (req->ver != PROXY_PROTO_SOCKS_V5 - '0')
+        printl(LOG_WARN, "Unsupported version: [%i] in the request", req->ver);
     else
-        for (na = 0; na < req.nauth; na++)
-            if (req.auth[na] == AUTH_METHOD_NOAUTH) {
+        for (na = 0; na < req->nauth; na++)
+            if (req->auth[na] == AUTH_METHOD_NOAUTH) {
                 printl(LOG_VERB, "Selected Socks5 auth method number: [%i] - [%i]", na, AUTH_METHOD_NOAUTH);
                 rep.cauth = AUTH_METHOD_NOAUTH;
                 break;
             }
 
-    /* Send 'hello' reply */
-    if (send(socket, &rep, sizeof rep, 0) == -1) {
+    /* Send 'hello' reply: two bytes always fit the empty socket buffer */
+    if (send(c->s, &rep, sizeof rep, MSG_DONTWAIT) != sizeof rep) {
         printl(LOG_CRIT, "Unable to send 'hello' reply to the Socks5 server");
-        return AUTH_METHOD_NOACCEPT;
+        return HS_ERROR;
     }
 
-    return rep.cauth;
+    *cauth = rep.cauth;
+    return HS_DONE;
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-uint8_t socks5_server_request(int socket, struct uvaddr *daddr) {
-    s5_request *req;
-    s5_request_ipv4 *req4;
-    s5_request_ipv6 *req6;
+int socks5_server_hello(cbuf *c) {
+    /* Blocking socks5_server_hello_step(); Return AUTH_METHOD_NOAUTH if OK or AUTH_METHOD_NOACCEPT if NOK */
+
+    uint8_t cauth;
 
-    char buf[sizeof(s5_request)];                         /* Max Socks5 request size */
-    int rcount;
-    uint8_t atype = SOCKS5_ATYPE_IPV4;
+    while (socks5_server_hello_step(c, &cauth) == HS_WANT_READ)
+        if (cbuf_wait(c)) return AUTH_METHOD_NOACCEPT;
 
+    return cauth;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int socks5_server_request_step(cbuf *c, struct uvaddr *daddr, uint8_t *atype) {
+    /* Receive client's request as far as it has come, then parse it. Data pipelined after it stays in the buffer to be
+    forwarded into the tunnel; Return HS_DONE with the address type in atype, HS_WANT_READ to be called again when the
+    client is readable or HS_ERROR */
+
+    s5_request *req;
+    size_t n;
+    int r;
 
-    if ((rcount = recv(socket, &buf, sizeof buf, 0)) == -1 || rcount < sizeof(s5_request_short)) {
+    *atype = SOCKS5_ATYPE_NONE;
+
+    if ((r = cbuf_want(c, sizeof(s5_request_short))) != HS_DONE) {
         /* Quit immediately; no reply to the client */
-        printl(LOG_WARN, "Unable to receive a request from the Socks5 client");
-        return SOCKS5_ATYPE_NONE;
+        if (r == HS_ERROR) printl(LOG_WARN, "Unable to receive a request from the Socks5 client");
+        return r;
     }
 
     /* Validate request */
-    req = (s5_request *)buf;
+    req = (s5_request *)(c->data + c->off);
     if (req->ver != PROXY_PROTO_SOCKS_V5 - '0') {
         printl(LOG_WARN, "Client speaks unsupported protocol version: [%i]", req->ver);
-        return SOCKS5_ATYPE_NONE;
+        return HS_ERROR;
     }
 
+    /* The request length by the address type: the header, the address and the port */
     switch (req->atype) {
         case SOCKS5_ATYPE_IPV4:
-            req4 = (s5_request_ipv4 *)buf;
-            SA_FAMILY(daddr->ip_addr) = AF_INET;
-            memcpy(&SIN4_ADDR(daddr->ip_addr), req4->dstaddr, sizeof(struct in_addr));
-            SIN4_PORT(daddr->ip_addr) = req4->dstport;
-            atype = SOCKS5_ATYPE_IPV4;
+            n = sizeof(s5_request_short) + SOCKS5_ATYPE_IPV4_LEN + 2;
         break;
 
         case SOCKS5_ATYPE_NAME:
+            if ((r = cbuf_want(c, sizeof(s5_request_short) + 1)) != HS_DONE) {
+                if (r == HS_ERROR) printl(LOG_WARN, "Unable to receive a request from the Socks5 client");
+                return r;
+            }
             if (req->dsthost[0] > sizeof(daddr->name) - 1) {
                 printl(LOG_WARN, "Domain name too long");
-                return SOCKS5_ATYPE_NONE;
+                return HS_ERROR;
             }
+            n = sizeof(s5_request_short) + 1 + req->dsthost[0] + 2;
+        break;
+
+        case SOCKS5_ATYPE_IPV6:
+            n = sizeof(s5_request_short) + SOCKS5_ATYPE_IPV6_LEN + 2;
+        break;
+
+        default:
+            printl(LOG_WARN, "Unsupported address type: [%i] in the request", req->atype);
+            return HS_ERROR;
+    }
+
+    if ((r = cbuf_want(c, n)) != HS_DONE) {
+        if (r == HS_ERROR) printl(LOG_WARN, "Unable to receive a request from the Socks5 client");
+        return r;
+    }
+
+    switch (req->atype) {
+        case SOCKS5_ATYPE_IPV4:
+            SA_FAMILY(daddr->ip_addr) = AF_INET;
+            memcpy(&SIN4_ADDR(daddr->ip_addr), req->dsthost, SOCKS5_ATYPE_IPV4_LEN);
+            memcpy(&SIN4_PORT(daddr->ip_addr), req->dsthost + SOCKS5_ATYPE_IPV4_LEN, sizeof(in_port_t));
+        break;
+
+        case SOCKS5_ATYPE_NAME:
             memcpy(&daddr->name, req->dsthost + 1, req->dsthost[0]);
-            daddr->ip_addr = str2inet(daddr->name, NULL);
-            if (SA_FAMILY(daddr->ip_addr) == AF_INET)
-                SIN4_PORT(daddr->ip_addr) = (req->dsthost[2 + req->dsthost[0]] << 8) +
-                    req->dsthost[1 + req->dsthost[0]];
-            else
-                SIN6_PORT(daddr->ip_addr) = (req->dsthost[2 + req->dsthost[0]] << 8) +
-                    req->dsthost[1 + req->dsthost[0]];
-            atype = SOCKS5_ATYPE_NAME;
+            daddr->name[req->dsthost[0]] = '\0';
+
+            /* The name is resolved by uvaddr_resolve() only if an IP-address is required, e.g. to connect directly */
+            SA_FAMILY(daddr->ip_addr) = AF_UNSPEC;
+            memcpy(&SIN4_PORT(daddr->ip_addr), req->dsthost + 1 + req->dsthost[0], sizeof(in_port_t));
         break;
 
         case SOCKS5_ATYPE_IPV6:
-            req6 = (s5_request_ipv6 *)buf;
             SA_FAMILY(daddr->ip_addr) = AF_INET6;
-            memcpy(&SIN6_ADDR(daddr->ip_addr), req6->dstaddr, sizeof(struct in6_addr));
-            SIN6_PORT(daddr->ip_addr) = req6->dstport;
-            atype = SOCKS5_ATYPE_IPV6;
+            memcpy(&SIN6_ADDR(daddr->ip_addr), req->dsthost, SOCKS5_ATYPE_IPV6_LEN);
+            memcpy(&SIN6_PORT(daddr->ip_addr), req->dsthost + SOCKS5_ATYPE_IPV6_LEN, sizeof(in_port_t));
         break;
     }
 
+    *atype = req->atype;
+    c->off += n;
+    if (c->len > c->off)
+        printl(LOG_VERB, "Socks5 client pipelined: [%d] bytes after the request", (int)(c->len - c->off));
+
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+uint8_t socks5_server_request(cbuf *c, struct uvaddr *daddr) {
+    /* Blocking socks5_server_request_step(); Return the address type or SOCKS5_ATYPE_NONE on error */
+
+    uint8_t atype;
+
+    while (socks5_server_request_step(c, daddr, &atype) == HS_WANT_READ)
+        if (cbuf_wait(c)) return SOCKS5_ATYPE_NONE;
+
     return atype;
 }
 
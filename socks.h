@@ -31,6 +31,7 @@
 /* -- Socks4 -------------------------------------------------------------------------------------------------------- */
 #define SOCKS4_CMD_TCPCONNECT   0x01
 #define SOCKS4_CMD_TCPBIND      0x02
+#define SOCKS4A_DSTADDR         0x00000001          /* Socks4a: 0.0.0.x, the destination name follows the ID */
 
 typedef struct {
     uint8_t ver;                /* Socks version */
@@ -276,11 +277,28 @@ typedef struct {
 #define SOCKS5_REPLY_UNSUPPORTED    0x07            /* Command unsupported / protocol error */
 #define SOCKS5_REPLY_ATYPE_ERROR    0x08            /* Address type is not supported */
 
+/* Resumable client handshake states */
+#define HS_SOCKS_SEND               0               /* Sending the request */
+#define HS_SOCKS_REPLY              1               /* Receiving the reply or the Socks5 reply header */
+#define HS_SOCKS_BOUND              2               /* Receiving the rest of Socks5 bound address and port */
+
 /* -- Function prototypes ------------------------------------------------------------------------------------------- */
-int socks4_client_request(chs cs, uint8_t cmd, struct sockaddr_in *daddr, char *user);
+int socks4_request_template(uint8_t **tpl, char *user);
+void socks4_request_start(hs *h, uint8_t cmd, struct sockaddr_in *daddr, char *dname, uint8_t *tpl, int tpl_len);
+int socks4_request_step(hs *h);
+int socks4_client_request(chs cs, uint8_t cmd, struct sockaddr_in *daddr, char *dname, uint8_t *tpl, int tpl_len);
+void socks5_hello_start(hs *h, uint8_t *auth, int nauth);
+int socks5_hello_step(hs *h);
 int socks5_client_hello(chs cs, unsigned int auth_method, ...);
-int socks5_client_auth(chs cs, char *user, char *password);
+int socks5_auth_template(uint8_t **tpl, char *user, char *password);
+void socks5_auth_start(hs *h, uint8_t *tpl, int tpl_len);
+int socks5_auth_step(hs *h);
+int socks5_client_auth(chs cs, uint8_t *tpl, int tpl_len);
+int socks5_request_start(hs *h, uint8_t cmd, struct sockaddr_storage *daddr, char *dname);
+int socks5_request_step(hs *h);
 int socks5_client_request(chs cs, uint8_t cmd, struct sockaddr_storage *daddr, char *dname);
-int socks5_server_hello(int socket);
-uint8_t socks5_server_request(int socket, struct uvaddr *daddr);
+int socks5_server_hello_step(cbuf *c, uint8_t *cauth);
+int socks5_server_hello(cbuf *c);
+int socks5_server_request_step(cbuf *c, struct uvaddr *daddr, uint8_t *atype);
+uint8_t socks5_server_request(cbuf *c, struct uvaddr *daddr);
 uint8_t socks5_server_reply(int socket, struct sockaddr_storage *iaddr, uint8_t atype);
@@ -34,6 +34,7 @@
 #include "network.h"
 
 #include "ssh2.h"
+#include "inifile.h"
 
 #include "logfile.h"
 
@@ -59,164 +60,324 @@ static void kbd_callback(const char *name, int name_len, const char *instruction
 }
 
 /* ------------------------------------------------------------------------------------------------------------------ */
-LIBSSH2_CHANNEL *ssh2_client_request(int socket, LIBSSH2_SESSION *session, struct uvaddr *daddr,
-    char *user, char *password, char *priv_key, char *priv_key_passphrase, uint8_t force_auth) {
+static void ssh2_method_pref(LIBSSH2_SESSION *session, int method_cs, int method_sc, char *prefs, char *name) {
+    /* Set the same client-to-server and server-to-client method preference list */
 
-    LIBSSH2_CHANNEL *channel = NULL;
-    LIBSSH2_AGENT *agent = NULL;
-    struct libssh2_agent_publickey *apubkey = NULL, *apubkey_prev = NULL;
-    const char *fingerprint = NULL;
-    char *userauthlist = SSH2_USERAUTH_LIST;
-    int port = 0;
-    int auth_pw = 0;
-    char buf[61];
-    int rc = 0;
+    if (!prefs || !prefs[0]) return;
 
+    if (libssh2_session_method_pref(session, method_cs, prefs) ||
+        libssh2_session_method_pref(session, method_sc, prefs))
+            printl(LOG_WARN, "Unable to set SSH2 %s preference: [%s], using defaults", name, prefs);
+    else
+        printl(LOG_VERB, "SSH2 %s preference: [%s]", name, prefs);
+}
 
-    if (!user) {
-        printl(LOG_WARN, "No username specified: unable to login into SSH2-proxy!");
-        return NULL;
-    }
+/* ------------------------------------------------------------------------------------------------------------------ */
+static LIBSSH2_CHANNEL *ssh2_channel_direct_tcpip(LIBSSH2_SESSION *session, char *host, int port,
+    unsigned int window, unsigned int packet) {
 
-    if (libssh2_session_handshake(session, socket)) {
-        printl(LOG_WARN, "Unable to perform SSH2 handshake");
-        return NULL;
-    }
+    /* libssh2_channel_direct_tcpip() with custom window and packet sizes: build "direct-tcpip" request (RFC 4254) */
 
-    fingerprint = libssh2_hostkey_hash(session, LIBSSH2_HOSTKEY_HASH_SHA1);
-    for(int i = 0; i < 20; i++)
-        sprintf(buf + i * 3, "%02X:", (unsigned char)fingerprint[i]);
-    buf[59] = '\0';
-    printl(LOG_INFO, "SSH2 Fingerprint: [%s]", buf);
-
-    if (force_auth == 'N') {
-        /* Check what authentication methods are available */
-        printl(LOG_VERB, "Negotiating authentication methods");
-        userauthlist = libssh2_userauth_list(session, user, strlen(user));
-    } else
-        printl(LOG_VERB, "Trying to force authentication methods");
-
-    printl(LOG_VERB, "Authentication methods: [%s]", userauthlist);
-    if (userauthlist) {
-        if (strstr(userauthlist, "publickey")) auth_pw |= 1;
-        if (strstr(userauthlist, "password")) auth_pw |= 2;
-        if (strstr(userauthlist, "keyboard-interactive")) auth_pw |= 4;
-
-        /* Try SSH Agent first */
-        agent = libssh2_agent_init(session);
-        if (!agent) {
-            printl(LOG_WARN, "Authentication by SSH-agent is not available!");
-            goto manualauth;
-        }
+    char msg[4 + 255 + 4 + 4 + sizeof(SSH2_DIRECT_SHOST) + 4];
+    size_t hl = strlen(host), sl = sizeof(SSH2_DIRECT_SHOST) - 1;
+    unsigned char *p = (unsigned char *)msg;
 
-        if (libssh2_agent_connect(agent)) {
-            printl(LOG_WARN, "Unable to connect with SSH-agent!");
-            goto manualauth;
-        }
+    if (hl > 255) hl = 255;
 
-        if (libssh2_agent_list_identities(agent)) {
-            printl(LOG_WARN, "Unable to request identities from SSH-agent!");
-            goto manualauth;
-        }
+    /* Host to connect */
+    *p++ = 0; *p++ = 0; *p++ = 0; *p++ = hl;
+    memcpy(p, host, hl); p += hl;
+    *p++ = 0; *p++ = 0; *p++ = port >> 8 & 0xFF; *p++ = port & 0xFF;
 
-        while (1) {
-            rc = libssh2_agent_get_identity(agent, &apubkey, apubkey_prev);
+    /* Originator IP address and port */
+    *p++ = 0; *p++ = 0; *p++ = 0; *p++ = sl;
+    memcpy(p, SSH2_DIRECT_SHOST, sl); p += sl;
+    *p++ = 0; *p++ = 0; *p++ = SSH2_DIRECT_SPORT >> 8 & 0xFF; *p++ = SSH2_DIRECT_SPORT & 0xFF;
 
-            if (rc == 1) break;
+    return libssh2_channel_open_ex(session, "direct-tcpip", sizeof("direct-tcpip") - 1,
+        window ? : LIBSSH2_CHANNEL_WINDOW_DEFAULT, packet ? : LIBSSH2_CHANNEL_PACKET_DEFAULT,
+        msg, (char *)p - msg);
+}
 
-            if (rc < 0) {
-                printl(LOG_WARN, "Unable to obtain identity from SSH-agent!");
-                goto manualauth;
-            }
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int ssh2_again(LIBSSH2_SESSION *session) {
+    /* The libssh2 call would block: Return the direction it waits for */
 
-            if (libssh2_agent_userauth(agent, user, apubkey))
-                printl(LOG_WARN, "Authentication with username [%s] and public key [%s] failed!",
-                    user, apubkey->comment);
-            else {
-                printl(LOG_VERB, "Authentication with username [%s] and public key [%s] succeeded",
-                    user, apubkey->comment);
-                goto getchannel;
-            }
+    return libssh2_session_block_directions(session) & LIBSSH2_SESSION_BLOCK_OUTBOUND ? HS_WANT_WRITE : HS_WANT_READ;
+}
 
-            apubkey_prev = apubkey;
-        }
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void ssh2_agent_auth(ssh2_hs *x) {
+    /* Authenticate by the SSH-agent identities. libssh2 talks to the agent with blocking calls and walks the
+    identities between them, so the session is blocking here, bounded by the section handshake timeout */
 
-        if (rc) {
-            printl(LOG_WARN, "Giving up agent authentication");
-            goto manualauth;
-        }
+    char *user = x->proxy->proxy_user;
+    LIBSSH2_AGENT *agent = NULL;
+    struct libssh2_agent_publickey *apubkey = NULL, *apubkey_prev = NULL;
+    int rc;
 
-        manualauth:
+    libssh2_session_set_blocking(x->session, 1);
 
-        /* Failback to manual authentication */
-        if ((auth_pw & 1) && priv_key) {
-            /*  We could authenticate by public key */
-            if ((rc = libssh2_userauth_publickey_fromfile(session, user, NULL, priv_key, priv_key_passphrase)))
-                printl(LOG_WARN, "Authentication by public key failed! LIB_SSH2 error code: [%d]", rc);
-            else {
-                printl(LOG_VERB, "Authentication by public key succeeded.");
-                goto getchannel;
-            }
+    if (!(agent = libssh2_agent_init(x->session))) {
+        printl(LOG_WARN, "Authentication by SSH-agent is not available!");
+        goto done;
+    }
+
+    if (libssh2_agent_connect(agent)) {
+        printl(LOG_WARN, "Unable to connect with SSH-agent!");
+        goto done;
+    }
+
+    if (libssh2_agent_list_identities(agent)) {
+        printl(LOG_WARN, "Unable to request identities from SSH-agent!");
+        goto done;
+    }
+
+    while (1) {
+        rc = libssh2_agent_get_identity(agent, &apubkey, apubkey_prev);
+
+        if (rc == 1) {
+            printl(LOG_WARN, "Giving up agent authentication");
+            break;
         }
 
-        if ((auth_pw & 2) && user && password) {
-            /* Or via password */
-            if (libssh2_userauth_password(session, user, password))
-                printl(LOG_WARN, "Authentication by password failed!");
-            else {
-                printl(LOG_VERB,"Authentication by password succeeded.");
-                goto getchannel;
-            }
+        if (rc < 0) {
+            printl(LOG_WARN, "Unable to obtain identity from SSH-agent!");
+            break;
         }
 
-        if ((auth_pw & 4) && user && password) {
-            /* Or via keyboard-interactive */
-            gpassword = password;
-            if (libssh2_userauth_keyboard_interactive(session, user, &kbd_callback))
-                printl(LOG_WARN, "Authentication by keyboard-interactive failed!");
-            else {
-                printl(LOG_VERB, "Authentication by keyboard-interactive succeeded.");
-                goto getchannel;
-            }
+        if (libssh2_agent_userauth(agent, user, apubkey))
+            printl(LOG_WARN, "Authentication with username [%s] and public key [%s] failed!", user, apubkey->comment);
+        else {
+            printl(LOG_VERB, "Authentication with username [%s] and public key [%s] succeeded",
+                user, apubkey->comment);
+            x->h.status = 1;                                            /* Authenticated */
+            break;
         }
 
-        printl(LOG_WARN, "No supported authentication methods found!");
-        return NULL;
+        apubkey_prev = apubkey;
     }
 
-    getchannel:
+    done:
+
+    if (agent) {
+        libssh2_agent_disconnect(agent);
+        libssh2_agent_free(agent);
+    }
+    libssh2_session_set_blocking(x->session, 0);
+}
 
-    printl(LOG_VERB, "SSH2 Getting a Channel");
+/* ------------------------------------------------------------------------------------------------------------------ */
+int ssh2_client_start(ssh2_hs *x, int socket, LIBSSH2_SESSION *session, struct uvaddr *daddr,
+    struct ini_section *proxy) {
+
+    /* Prepare the SSH2 handshake, authentication and the direct-tcpip channel request in x over the socket; Return 0
+    or 1 on error */
+
+    memset(x, 0, sizeof(ssh2_hs));
+    x->h.cs.s = socket;
+    x->h.cs.t = CHS_SOCKET;                                             /* Wait on the session socket */
+    x->h.state = HS_SSH2_HANDSHAKE;
+    x->session = session;
+    x->daddr = daddr;
+    x->proxy = proxy;
+
+    if (!proxy->proxy_user) {
+        printl(LOG_WARN, "No username specified: unable to login into SSH2-proxy!");
+        return 1;
+    }
 
     switch (daddr->ip_addr.ss_family) {
         case AF_INET:
             if (!daddr->name[0])
                 inet_ntop(AF_INET, &SIN4_ADDR(daddr->ip_addr), daddr->name, INET_ADDRSTRLEN);
-            port = ntohs(SIN4_PORT(daddr->ip_addr));
+            x->port = ntohs(SIN4_PORT(daddr->ip_addr));
         break;
 
         case AF_INET6:
             if (!daddr->name[0])
                 inet_ntop(AF_INET6, &SIN6_ADDR(daddr->ip_addr), daddr->name, INET6_ADDRSTRLEN);
-            port = ntohs(SIN6_PORT(daddr->ip_addr));
+            x->port = ntohs(SIN6_PORT(daddr->ip_addr));
         break;
 
+        case AF_UNSPEC:                                                 /* Not resolved: the server resolves the name */
+            if (daddr->name[0]) {
+                x->port = ntohs(SIN4_PORT(daddr->ip_addr));
+                break;
+            }
+            /* Fall through */
+
         default:
             printl(LOG_WARN, "Unrecognized address family: %d", daddr->ip_addr.ss_family);
-            return NULL;
+            return 1;
     }
 
-    printl(LOG_VERB, "Destination SSH2 address: [%s]:[%d]", daddr->name, port);
-    channel = libssh2_channel_direct_tcpip(session, daddr->name, port);        /* Return channel or NULL */
-    if (channel)
-        libssh2_session_set_blocking(session, 0);
+    /* Transport tuning must be set before the key exchange */
+    ssh2_method_pref(session, LIBSSH2_METHOD_CRYPT_CS, LIBSSH2_METHOD_CRYPT_SC, proxy->proxy_ssh_crypt, "cipher");
+    ssh2_method_pref(session, LIBSSH2_METHOD_MAC_CS, LIBSSH2_METHOD_MAC_SC, proxy->proxy_ssh_mac, "MAC");
+    if (proxy->proxy_ssh_compress == 'Y')
+        libssh2_session_flag(session, LIBSSH2_FLAG_COMPRESS, 1);
 
-    if (agent) {
-        libssh2_agent_disconnect(agent);
-        libssh2_agent_free(agent);
+    /* The blocking agent authentication gives up by the section handshake deadline too */
+    libssh2_session_set_timeout(session, proxy->proxy_handshake_timeout * 1000L);
+    libssh2_session_set_blocking(session, 0);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int ssh2_client_step(hs *h) {
+    /* Advance the SSH2 client: key exchange, authentication by the agent, the key file, the password or
+    keyboard-interactive, then the direct-tcpip channel; x->channel is the channel when it is done */
+
+    ssh2_hs *x = (ssh2_hs *)h;
+    struct ini_section *proxy = x->proxy;
+    char *user = proxy->proxy_user, *password = proxy->proxy_password;
+    const char *fingerprint = NULL;
+    char *userauthlist;
+    char buf[61];
+    int rc, i;
+
+    switch (h->state) {
+        case HS_SSH2_HANDSHAKE:
+            if ((rc = libssh2_session_handshake(x->session, h->cs.s)) == LIBSSH2_ERROR_EAGAIN)
+                return ssh2_again(x->session);
+            if (rc) {
+                printl(LOG_WARN, "Unable to perform SSH2 handshake");
+                return HS_ERROR;
+            }
+
+            printl(LOG_VERB, "SSH2 Negotiated cipher: [%s] MAC: [%s] Compression: [%s]",
+                libssh2_session_methods(x->session, LIBSSH2_METHOD_CRYPT_CS) ? : "",
+                libssh2_session_methods(x->session, LIBSSH2_METHOD_MAC_CS) ? : "",
+                libssh2_session_methods(x->session, LIBSSH2_METHOD_COMP_CS) ? : "");
+
+            fingerprint = libssh2_hostkey_hash(x->session, LIBSSH2_HOSTKEY_HASH_SHA1);
+            for (i = 0; i < 20; i++)
+                sprintf(buf + i * 3, "%02X:", (unsigned char)fingerprint[i]);
+            buf[59] = '\0';
+            printl(LOG_INFO, "SSH2 Fingerprint: [%s]", buf);
+            printl(LOG_VERB, proxy->proxy_ssh_force_auth == 'N' ? "Negotiating authentication methods" :
+                "Trying to force authentication methods");
+
+            h->state = HS_SSH2_AUTHLIST;
+            /* Fall through */
+
+        case HS_SSH2_AUTHLIST:
+            if (proxy->proxy_ssh_force_auth == 'N') {
+                /* Check what authentication methods are available */
+                if (!(userauthlist = libssh2_userauth_list(x->session, user, strlen(user))) &&
+                    libssh2_session_last_errno(x->session) == LIBSSH2_ERROR_EAGAIN)
+                        return ssh2_again(x->session);
+            } else
+                userauthlist = SSH2_USERAUTH_LIST;
+
+            printl(LOG_VERB, "Authentication methods: [%s]", userauthlist ? : "");
+            if (!userauthlist) goto channel;                            /* No list: authenticated already */
+
+            if (strstr(userauthlist, "publickey")) x->auth |= 1;
+            if (strstr(userauthlist, "password")) x->auth |= 2;
+            if (strstr(userauthlist, "keyboard-interactive")) x->auth |= 4;
+
+            /* Try SSH Agent first */
+            ssh2_agent_auth(x);
+            if (h->status) goto channel;
+
+            h->state = HS_SSH2_KEY;
+            /* Fall through */
+
+        /* Failback to manual authentication */
+        case HS_SSH2_KEY:
+            if ((x->auth & 1) && proxy->proxy_key) {
+                /* We could authenticate by public key */
+                if ((rc = libssh2_userauth_publickey_fromfile(x->session, user, NULL, proxy->proxy_key,
+                    proxy->proxy_key_passphrase)) == LIBSSH2_ERROR_EAGAIN)
+                        return ssh2_again(x->session);
+
+                if (rc)
+                    printl(LOG_WARN, "Authentication by public key failed! LIB_SSH2 error code: [%d]", rc);
+                else {
+                    printl(LOG_VERB, "Authentication by public key succeeded.");
+                    goto channel;
+                }
+            }
+
+            h->state = HS_SSH2_PASSWORD;
+            /* Fall through */
+
+        case HS_SSH2_PASSWORD:
+            if ((x->auth & 2) && password) {
+                /* Or via password */
+                if ((rc = libssh2_userauth_password(x->session, user, password)) == LIBSSH2_ERROR_EAGAIN)
+                    return ssh2_again(x->session);
+
+                if (rc)
+                    printl(LOG_WARN, "Authentication by password failed!");
+                else {
+                    printl(LOG_VERB,"Authentication by password succeeded.");
+                    goto channel;
+                }
+            }
+
+            h->state = HS_SSH2_KBDINT;
+            /* Fall through */
+
+        case HS_SSH2_KBDINT:
+            if ((x->auth & 4) && password) {
+                /* Or via keyboard-interactive */
+                gpassword = password;
+                if ((rc = libssh2_userauth_keyboard_interactive(x->session, user, &kbd_callback)) ==
+                    LIBSSH2_ERROR_EAGAIN)
+                        return ssh2_again(x->session);
+
+                if (rc)
+                    printl(LOG_WARN, "Authentication by keyboard-interactive failed!");
+                else {
+                    printl(LOG_VERB, "Authentication by keyboard-interactive succeeded.");
+                    goto channel;
+                }
+            }
+
+            printl(LOG_WARN, "No supported authentication methods found!");
+            return HS_ERROR;
+
+        case HS_SSH2_CHANNEL:
+        channel:
+            if (h->state != HS_SSH2_CHANNEL) {
+                h->state = HS_SSH2_CHANNEL;
+                printl(LOG_VERB, "SSH2 Getting a Channel");
+                printl(LOG_VERB, "Destination SSH2 address: [%s]:[%d]", x->daddr->name, x->port);
+            }
+
+            if (proxy->proxy_ssh_window || proxy->proxy_ssh_packet)
+                x->channel = ssh2_channel_direct_tcpip(x->session, x->daddr->name, x->port,
+                    proxy->proxy_ssh_window, proxy->proxy_ssh_packet);
+            else
+                x->channel = libssh2_channel_direct_tcpip(x->session, x->daddr->name, x->port);
+
+            if (!x->channel) {
+                if (libssh2_session_last_errno(x->session) == LIBSSH2_ERROR_EAGAIN) return ssh2_again(x->session);
+                return HS_ERROR;
+            }
+        break;
+
+        default:
+            return HS_ERROR;
     }
 
-    return channel;
+    return HS_DONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+LIBSSH2_CHANNEL *ssh2_client_request(int socket, LIBSSH2_SESSION *session, struct uvaddr *daddr,
+    struct ini_section *proxy) {
+
+    /* Run the SSH2 client to the end on the socket; Return the channel in the non-blocking session or NULL */
+
+    ssh2_hs x;
+
+    if (ssh2_client_start(&x, socket, session, daddr, proxy)) return NULL;
+    return hs_run(&x.h, ssh2_client_step) == HS_DONE ? x.channel : NULL;
 }
 
 #endif                /* WITH_LIBSSH2 */
\ No newline at end of file
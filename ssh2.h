@@ -32,15 +32,46 @@
 
 #define PROXY_PROTO_SSH2      'S'
 
+/* SSH2 channel tuning limits; 0 in the INI section means libssh2 defaults */
+#define SSH2_WINDOW_MIN       32768
+#define SSH2_WINDOW_MAX       0x7FFFFFFF
+#define SSH2_PACKET_MIN       1024
+#define SSH2_PACKET_MAX       32768               /* RFC 4253: all implementations must accept 32768 bytes */
+
 #if (WITH_LIBSSH2)
 
 #include <libssh2.h>
 
 
 #define SSH2_USERAUTH_LIST    "publickey,password,keyboard-interactive"
+#define SSH2_DIRECT_SHOST     "127.0.0.1"         /* Originator address reported in direct-tcpip requests */
+#define SSH2_DIRECT_SPORT     22                  /* The same as libssh2_channel_direct_tcpip() uses */
+
+/* Resumable client handshake states */
+#define HS_SSH2_HANDSHAKE     0                   /* Key exchange */
+#define HS_SSH2_AUTHLIST      1                   /* Asking for the authentication methods, then the SSH-agent */
+#define HS_SSH2_KEY           2                   /* Authentication by the private key file */
+#define HS_SSH2_PASSWORD      3                   /* Authentication by the password */
+#define HS_SSH2_KBDINT        4                   /* Keyboard-interactive authentication */
+#define HS_SSH2_CHANNEL       5                   /* Opening the direct-tcpip channel */
 
 /* ------------------------------------------------------------------------------------------------------------------ */
+struct ini_section;
+
+typedef struct ssh2_hs {                          /* Resumable SSH2 client */
+    hs h;                                         /* The first: ssh2_client_step() takes it */
+    LIBSSH2_SESSION *session;
+    LIBSSH2_CHANNEL *channel;                     /* The result */
+    struct uvaddr *daddr;
+    struct ini_section *proxy;
+    int port;                                     /* Destination port */
+    int auth;                                     /* Offered methods: 1 - publickey, 2 - password, 4 - keyboard */
+} ssh2_hs;
+
+int ssh2_client_start(ssh2_hs *x, int socket, LIBSSH2_SESSION *session, struct uvaddr *daddr,
+   struct ini_section *proxy);
+int ssh2_client_step(hs *h);
 LIBSSH2_CHANNEL *ssh2_client_request(int socket, LIBSSH2_SESSION *session, struct uvaddr *daddr,
-   char *user, char *password, char *priv_key, char *priv_key_passphrase, uint8_t force_auth);
+   struct ini_section *proxy);
 
 #endif                  /* WITH_LIBSSH2 */
\ No newline at end of file
@@ -0,0 +1,127 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- Client stage deadlines ---------------------------------------------------------------------------------------- */
+
+/*
+* A client process runs the stages one by one, so it has a single deadline at a time: the kernel interval timer of the
+* process is armed for the stage on its start. SIGALRM is installed without SA_RESTART, so the expiry interrupts a
+* blocked connect(), recv() or poll() with EINTR and the usual error path of the stage fails over to the next section.
+* If the stage doesn't finish within TIMER_GRACE seconds anyway, e.g. a library retries on EINTR, the client exits.
+*
+* Expiries are counted per stage in a shared memory table mapped by the main process before the clients are forked.
+*/
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "logfile.h"
+#include "timer.h"
+
+
+static const char *timer_stages[] = {"none", "request", "connect", "handshake", "idle"};
+static unsigned long *timer_stats = NULL;                           /* Shared: expiries per stage */
+static unsigned int t_request = TIMEOUT_REQUEST_DEFAULT;            /* -R: the request deadline */
+static volatile sig_atomic_t t_stage = TIMER_STAGE_NONE;
+static volatile sig_atomic_t t_expired = 0;
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void timer_init(unsigned int request) {
+    /* Set the request deadline and map the shared expiry counters; called once by the main process */
+
+    if (timer_stats) return;
+
+    t_request = request;
+    printl(LOG_INFO, "Request deadline: [%u] s", t_request);
+
+    timer_stats = mmap(NULL, TIMER_STAGES * sizeof(unsigned long), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANON, -1, 0);
+    if (timer_stats == MAP_FAILED) {
+        printl(LOG_WARN, "Unable to map stage deadline counters, expiries will not be counted");
+        timer_stats = NULL;
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void timer_stage(int stage, unsigned int seconds) {
+    /* Enter the stage: arm its deadline, or disarm the timer with 0 seconds */
+
+    struct itimerval it;
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = seconds;
+    t_stage = seconds ? stage : TIMER_STAGE_NONE;
+    t_expired = 0;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int timer_expired(void) {
+    /* Return the stage which deadline has expired or TIMER_STAGE_NONE */
+
+    return t_expired ? t_stage : TIMER_STAGE_NONE;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+int timer_alarm(void) {
+    /* SIGALRM processor: count the expiry and give the stage TIMER_GRACE seconds to fail. Return 1 if the grace
+    time is over too and the client must exit */
+
+    struct itimerval it;
+
+    if (t_stage == TIMER_STAGE_NONE) return 0;
+    if (t_expired) return 1;
+
+    t_expired = 1;
+    timer_count(t_stage);
+    printl(LOG_WARN, "Stage: [%s] deadline expired", timer_stages[t_stage]);
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec = TIMER_GRACE;
+    setitimer(ITIMER_REAL, &it, NULL);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void timer_count(int stage) {
+    /* Count an expired deadline of the stage */
+
+    if (timer_stats && stage > TIMER_STAGE_NONE && stage < TIMER_STAGES)
+        __atomic_fetch_add(&timer_stats[stage], 1, __ATOMIC_RELAXED);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void timer_show(int loglvl) {
+    /* Display the request deadline and expired deadlines per stage */
+
+    printl(loglvl, "SHOW Deadlines: Request: [%u] s", t_request);
+    if (!timer_stats) return;
+
+    printl(loglvl, "SHOW Expired deadlines: Request: [%lu] Connect: [%lu] Handshake: [%lu] Idle: [%lu]",
+        timer_stats[TIMER_STAGE_REQUEST], timer_stats[TIMER_STAGE_CONNECT], timer_stats[TIMER_STAGE_HANDSHAKE],
+        timer_stats[TIMER_STAGE_IDLE]);
+}
@@ -0,0 +1,52 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include <signal.h>
+
+/* -- Client stage deadlines ---------------------------------------------------------------------------------------- */
+#define TIMER_STAGE_NONE        0                   /* Disarmed */
+#define TIMER_STAGE_REQUEST     1                   /* Accepted client until its Socks5 or HTTP request is read */
+#define TIMER_STAGE_CONNECT     2                   /* TCP connect with the proxy server or the destination */
+#define TIMER_STAGE_HANDSHAKE   3                   /* Proxy protocol, TLS or SSH2 handshake and authentication */
+#define TIMER_STAGE_IDLE        4                   /* No traffic in the relay */
+#define TIMER_STAGES            5
+
+/* Deadlines in seconds, 0: no deadline */
+#define TIMEOUT_REQUEST_DEFAULT     30              /* -R, the section is not known yet */
+#define TIMEOUT_CONNECT_DEFAULT     15
+#define TIMEOUT_HANDSHAKE_DEFAULT   30
+#define TIMEOUT_IDLE_DEFAULT        0               /* Keepalives take care of dead peers of idle tunnels */
+
+#define TIMER_GRACE             2                   /* Seconds to leave a stage after its expiry before the exit */
+
+/* -- Function prototypes ------------------------------------------------------------------------------------------- */
+void timer_init(unsigned int request);
+void timer_stage(int stage, unsigned int seconds);
+int timer_expired(void);
+int timer_alarm(void);
+void timer_count(int stage);
+void timer_show(int loglvl);
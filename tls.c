@@ -0,0 +1,249 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2024-2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* -- TLS transport for HTTPS proxy servers (using https://www.openssl.org/ library) -------------------------------- */
+#if (WITH_LIBSSL)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "utility.h"
+#include "network.h"
+
+#include "tls.h"
+#include "inifile.h"
+
+#include "logfile.h"
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static char tls_sfile[PATH_MAX];                                        /* Session cache file of the current proxy */
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void tls_error(char *msg) {
+    /* Log the message and drain OpenSSL error queue */
+
+    unsigned long e;
+    char buf[256];
+
+    printl(LOG_WARN, "%s", msg);
+    while ((e = ERR_get_error())) {
+        ERR_error_string_n(e, buf, sizeof(buf));
+        printl(LOG_VERB, "OpenSSL: [%s]", buf);
+    }
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+    /* Save a new session ticket for the next child: write a temporary file and rename it over the old one */
+
+    char tname[sizeof(tls_sfile) + sizeof(".XXXXXX")];
+    FILE *f = NULL;
+    int fd;
+
+    (void)ssl;
+    if (!tls_sfile[0] || !SSL_SESSION_is_resumable(sess)) return 0;
+
+    snprintf(tname, sizeof(tname), "%s.XXXXXX", tls_sfile);
+    if ((fd = mkstemp(tname)) == -1 || !(f = fdopen(fd, "w"))) {
+        printl(LOG_VERB, "Unable to cache TLS session in: [%s]", tls_sfile);
+        if (fd != -1) {
+            close(fd);
+            unlink(tname);
+        }
+        return 0;
+    }
+
+    if (!PEM_write_SSL_SESSION(f, sess)) {
+        fclose(f);
+        unlink(tname);
+        return 0;
+    }
+
+    fclose(f);
+    if (rename(tname, tls_sfile)) unlink(tname);
+    else printl(LOG_VERB, "TLS session cached in: [%s]", tls_sfile);
+
+    return 0;                                                           /* We do not keep the reference */
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+static void tls_load_session(SSL *ssl, struct ini_section *proxy) {
+    /* Pick a cached session for the proxy section, if any */
+
+    FILE *f;
+    SSL_SESSION *sess;
+    char *n;
+    int l;
+
+    l = snprintf(tls_sfile, sizeof(tls_sfile), "%s/", TLS_SESSION_DIR);
+    for (n = proxy->section_name; *n && l < (int)(sizeof(tls_sfile) - sizeof(TLS_SESSION_EXT) - 8); n++)
+        tls_sfile[l++] = isalnum(*n) || *n == '-' ? *n : '_';
+    strcpy(tls_sfile + l, TLS_SESSION_EXT);
+
+    if (!(f = fopen(tls_sfile, "r"))) return;
+    sess = PEM_read_SSL_SESSION(f, NULL, NULL, NULL);
+    fclose(f);
+
+    if (!sess) return;
+    if (SSL_SESSION_is_resumable(sess) && SSL_set_session(ssl, sess))
+        printl(LOG_VERB, "Offering cached TLS session from: [%s]", tls_sfile);
+    SSL_SESSION_free(sess);
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+SSL_CTX *tls_context(struct ini_section *proxy) {
+    /* Build the TLS context of the proxy section: CA certificates are parsed here once, read_ini() calls it in the
+    main process and the clients inherit the context; Return the context or NULL */
+
+    SSL_CTX *ctx = NULL;
+
+    if (!(ctx = SSL_CTX_new(TLS_client_method()))) {
+        tls_error("Unable to create TLS context");
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    #if defined(SSL_OP_IGNORE_UNEXPECTED_EOF)
+        SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);        /* Many proxies just close the connection */
+    #endif
+    #if defined(SSL_OP_ENABLE_KTLS)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);                   /* Offload the record layer to the kernel */
+    #endif
+
+    /* Only the external cache: children are separate processes */
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+
+    if (proxy->proxy_tls_verify == 'Y') {
+        if (proxy->proxy_tls_ca ? !SSL_CTX_load_verify_locations(ctx, proxy->proxy_tls_ca, NULL) :
+            !SSL_CTX_set_default_verify_paths(ctx)) {
+
+            tls_error("Unable to load TLS CA certificates");
+            SSL_CTX_free(ctx);
+            return NULL;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+
+    return ctx;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+SSL *tls_client_new(int socket, struct ini_section *proxy) {
+    /* Prepare TLS client connection to the proxy server over the socket, but do not start the handshake */
+
+    SSL *ssl = NULL;
+    char ip[INET6_ADDRSTRLEN] = {0};
+
+
+    /* Not built on the INI-file load, e.g. the CA file was missing: try again for this client */
+    if (!proxy->tls_ctx && !(proxy->tls_ctx = tls_context(proxy))) return NULL;
+
+    ssl = SSL_new(proxy->tls_ctx);
+    if (!ssl || !SSL_set_fd(ssl, socket)) {
+        tls_error("Unable to create TLS connection");
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    if (proxy->proxy_tls_name) {
+        SSL_set_tlsext_host_name(ssl, proxy->proxy_tls_name);
+        if (proxy->proxy_tls_verify == 'Y') SSL_set1_host(ssl, proxy->proxy_tls_name);
+    } else
+        if (proxy->proxy_tls_verify == 'Y') {
+            /* No name configured: the certificate must be issued for the proxy IP-address */
+            if (SA_FAMILY(proxy->proxy_server) == AF_INET)
+                inet_ntop(AF_INET, &SIN4_ADDR(proxy->proxy_server), ip, sizeof(ip));
+            else
+                inet_ntop(AF_INET6, &SIN6_ADDR(proxy->proxy_server), ip, sizeof(ip));
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), ip);
+        }
+
+    tls_load_session(ssl, proxy);
+
+    return ssl;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void tls_client_failed(SSL *ssl) {
+    /* Report the failed handshake */
+
+    if (SSL_get_verify_result(ssl) != X509_V_OK)
+        printl(LOG_WARN, "TLS proxy certificate verification failed: [%s]",
+            X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+    tls_error("TLS handshake with the proxy server failed");
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void tls_client_established(SSL *ssl) {
+    /* Report the negotiated TLS parameters */
+
+    printl(LOG_VERB, "TLS established: [%s] cipher: [%s] resumed: [%c]",
+        SSL_get_version(ssl), SSL_get_cipher_name(ssl), SSL_session_reused(ssl) ? 'Y' : 'N');
+    #if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+        printl(LOG_VERB, "Kernel TLS send: [%c] receive: [%c]",
+            BIO_get_ktls_send(SSL_get_wbio(ssl)) ? 'Y' : 'N', BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? 'Y' : 'N');
+    #endif
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+SSL *tls_client_connect(int socket, struct ini_section *proxy) {
+    /* Establish TLS with the proxy server over the connected socket; Return the TLS connection or NULL */
+
+    SSL *ssl = NULL;
+
+    if (!(ssl = tls_client_new(socket, proxy))) return NULL;
+
+    if (SSL_connect(ssl) != 1) {
+        tls_client_failed(ssl);
+        SSL_free(ssl);
+        return NULL;
+    }
+
+    tls_client_established(ssl);
+    return ssl;
+}
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+void tls_close(SSL *ssl) {
+    /* Send close_notify without waiting for the peer one and free the connection */
+
+    if (!ssl) return;
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+}
+
+#endif                /* WITH_LIBSSL */
@@ -0,0 +1,57 @@
+/* ------------------------------------------------------------------------------------------------------------------ */
+/* TS-Warp - Transparent proxy server and traffic wrapper                                                             */
+/* ------------------------------------------------------------------------------------------------------------------ */
+
+/*
+* Copyright (c) 2024-2026, Mikhail Zakharov <zmey20000@yahoo.com>
+*
+* Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+* following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+*    disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and
+*    the following disclaimer in the documentation and/or other materials provided with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+* WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+#include "version.h"
+
+#if !defined (WITH_LIBSSL)
+   #define WITH_LIBSSL 0
+#endif
+
+#if !defined (PREFIX)
+   #define PREFIX "/usr/local"
+#endif
+
+#define PROXY_PROTO_HTTPS       'T'
+
+#define TLS_SESSION_DIR         PREFIX"/var/spool/ts-warp"      /* Cached TLS sessions: one file per proxy section */
+#define TLS_SESSION_EXT         ".tls"
+
+#if (WITH_LIBSSL)
+
+#include <openssl/ssl.h>
+
+/* ------------------------------------------------------------------------------------------------------------------ */
+struct ini_section;
+
+SSL_CTX *tls_context(struct ini_section *proxy);
+SSL *tls_client_new(int socket, struct ini_section *proxy);
+void tls_client_failed(SSL *ssl);
+void tls_client_established(SSL *ssl);
+SSL *tls_client_connect(int socket, struct ini_section *proxy);
+void tls_close(SSL *ssl);
+
+#endif                  /* WITH_LIBSSL */
@@ -70,6 +70,15 @@
 #include "socks.h"
 #include "http.h"
 #include "ssh2.h"
+#include "tls.h"
+#include "h2.h"
+#include "health.h"
+#include "pool.h"
+#include "timer.h"
+#include "bufpool.h"
+#include "shaper.h"
+#include "admit.h"
+#include "relay.h"
 
 #include "inifile.h"
 #include "logfile.h"
@@ -107,7 +116,8 @@ int tfd = -1;                                       /* Traffic log file descript
 int main(int argc, char* argv[]) {
 /* Usage:
 Usage:
-  ts-warp -T IP:Port -S IP:Port -H IP:Port -c file.ini -l file.log -v 0-4 -t file.act -d -p file.pid -f -u user -D -h
+  ts-warp -T IP:Port -S IP:Port -H IP:Port -c file.ini -l file.log -v 0-4 -t file.act -d -p file.pid -f -u user -D -m -C
+          -Q -R -P -h
 
 Version:
   TS-Warp-X.Y.Z
@@ -127,6 +137,11 @@ All parameters are optional:
 
   -u user         A user to run ts-warp, default: nobody
   -D 0..512       Deep Packet Inspections bypass fragment size. Default: 0 - disabled. Set any value, e.g., 2 to enable
+  -m size         Relay and raised socket buffers memory limit for all the clients, e.g., 64M. Default: 256M
+  -C n[:n]        Clients at once and of them still connecting, e.g., 1000:100. Default: 0 - unlimited
+  -Q n[:sec]      Clients over -C waiting for a slot and seconds they wait, 0 - reject at once. Default: 128:5
+  -R sec          Seconds to read the client request, 0 - no deadline. Default: 30
+  -P section      INI-file section with socket_* options for the internal servers, applied on start
 
   -h              This message */
 
@@ -147,6 +162,15 @@ All parameters are optional:
     /* According to https://github.com/xvzc/SpoofDPI?tab=readme-ov-file#https sending the first 1 byte of a request
     to the server, and then sending the rest of the data can help to bypass Deep Packet Inspections of HTTPS */
 
+    long bp_limit = BPOOL_LIMIT_DEFAULT;                                /* Relay buffers of all the clients */
+    long ad_tunnels = 0, ad_pending = 0;                                /* Clients at once and before the relay */
+    long ad_queue = ADMIT_QUEUE_DEFAULT, ad_wait = ADMIT_WAIT_DEFAULT;  /* Clients over them wait, seconds */
+    char *ad_arg;
+    long to_request = TIMEOUT_REQUEST_DEFAULT;                          /* Seconds to read the client request */
+    sigset_t cmask, omask;                                              /* SIGCHLD blocked while forking */
+    char *sp_name = NULL;                                               /* Socket profile of the internal servers */
+    sock_opts *sp_opts = NULL;                                          /* and its options, on start only */
+
     char *runas_user = RUNAS_USER;                                      /* A user to run ts-warp */
 
     struct addrinfo thints, *tres = NULL, *sres = NULL, *hres = NULL;   /* TS-Warp incoming addresses info structures */
@@ -155,22 +179,33 @@ All parameters are optional:
     struct sockaddr_storage caddr;                                      /* Client address */
     socklen_t caddrlen;                                                 /* Client address len */
     struct uvaddr daddr;                                                /* Client destination ip and/or name */
+    cbuf cb;                                                            /* Client request reader */
     unsigned int daddr_len;
 
     unsigned char auth_method;                                          /* Socks5 accepted auth method */
 
     fd_set sfd;                                                         /* Internal servers FDs */
-    fd_set rfd;                                                         /* Connection FDs */
     struct timeval tv;
 
-    char buf[BUF_SIZE];                                                 /* Multipurpose buffer */
+    char buf[STR_SIZE];                                                 /* Address strings buffer */
     char suf[STR_SIZE];                                                 /* String buffer */
     int ret;                                                            /* Various function return codes */
-    int rec = 0, snd = 0;                                               /* received/sent bytes */
     pid_t cpid;                                                         /* Child PID */
 
     key_t mskey;                                                        /* IPC ID */
     struct traffic_message tmessage;                                    /* IPC message to pass info about traffic */
+    struct failover_message fmessage;                                   /* IPC message: a section failed a client */
+
+    time_t f_start = 0;                                                 /* In-connection failover: started */
+    int f_retries = 0;                                                  /* attempts with the next sections */
+    int f_reported = 0;                                                 /* the main process knows the failures */
+    int s5_reply = 0;                                                   /* Socks5 client awaits the proxy reply */
+    int h_reply = 0;                                                    /* HTTP client awaits the proxy reply */
+    int f_shed = 0;                                                     /* The section limits refused the client */
+    int racer = 0, race_fd = -1;                                        /* Racing child and its report socket */
+    struct timeval p_start = {0, 0};                                    /* Proxy connect started, for latency */
+    unsigned int idle = 0;                                              /* Relay idle deadline in seconds */
+    relay rl;                                                           /* Client <-> server relay */
 
     struct pid_list *d = NULL, *c = NULL;                               /* PID list related ... */
     struct ini_section *push_ini = NULL;                                /* variables */
@@ -182,7 +217,7 @@ All parameters are optional:
     #endif
 
 
-    while ((flg = getopt(argc, argv, "T:S:H:c:l:v:t:dp:fu:D:h")) != -1)
+    while ((flg = getopt(argc, argv, "T:S:H:c:l:v:t:dp:fu:D:m:C:Q:R:P:h")) != -1)
         switch(flg) {
             case 'T':                                                   /* Internal Transparent server IP/name */
                 taddr = strsep(&optarg, ":");                           /* IP:PORT */
@@ -246,6 +281,42 @@ All parameters are optional:
                 }
             break;
 
+            case 'm':                                                   /* Relay buffers memory limit */
+                bp_limit = tosize(optarg);
+                if (bp_limit < BPOOL_LIMIT_MIN) {
+                    fprintf(stderr, "Fatal: wrong -m value:[%s]\n", optarg);
+                    usage(1);
+                }
+            break;
+
+            case 'C':                                                   /* Clients at once[:before the relay] */
+                ad_arg = strsep(&optarg, ":");
+                if ((ad_tunnels = toint(ad_arg)) < 0 || (optarg && (ad_pending = toint(optarg)) < 0)) {
+                    fprintf(stderr, "Fatal: wrong -C value:[%s]\n", ad_arg);
+                    usage(1);
+                }
+            break;
+
+            case 'Q':                                                   /* Admission queue[:seconds to wait] */
+                ad_arg = strsep(&optarg, ":");
+                if ((ad_queue = toint(ad_arg)) < 0 || ad_queue > ADMIT_QUEUE_MAX ||
+                    (optarg && (ad_wait = toint(optarg)) < 1)) {
+                    fprintf(stderr, "Fatal: wrong -Q value:[%s]\n", ad_arg);
+                    usage(1);
+                }
+            break;
+
+            case 'R':                                                   /* Request deadline, seconds */
+                if ((to_request = toint(optarg)) < 0) {
+                    fprintf(stderr, "Fatal: wrong -R value:[%s]\n", optarg);
+                    usage(1);
+                }
+            break;
+
+            case 'P':                                                   /* Socket profile of the internal servers */
+                sp_name = optarg;
+            break;
+
             case 'h':                                                   /* Help */
             default:
                 usage(0);
@@ -310,6 +381,13 @@ All parameters are optional:
     signal(SIGUSR1, trap_signal);
     signal(SIGUSR2, trap_signal);
 
+    /* Stage deadlines must interrupt blocked system calls: no SA_RESTART */
+    struct sigaction sa_alrm;
+    memset(&sa_alrm, 0, sizeof(sa_alrm));
+    sa_alrm.sa_handler = trap_signal;
+    sigemptyset(&sa_alrm.sa_mask);
+    sigaction(SIGALRM, &sa_alrm, NULL);
+
     signal(SIGPIPE, SIG_IGN);                       /* Ignore the signal if nobody reads the traffig log pipe! */
 
     if (d_flg) {
@@ -374,9 +452,15 @@ All parameters are optional:
     ini_root = read_ini(ifile_name);
     show_ini(ini_root, LOG_VERB);
 
+    if (sp_name) {
+        if ((s_ini = getsection(ini_root, sp_name))) sp_opts = &s_ini->socket;
+        else printl(LOG_WARN, "Socket profile: [%s] for the internal servers does not exist", sp_name);
+        s_ini = NULL;
+    }
+
     /* -- Create sockets for incoming connections ------------------------------------------------------------------- */
     if (ntohs(SIN_PORT(*(tres->ai_addr)))) {
-        if ((Tsock = socket(tres->ai_family, tres->ai_socktype, tres->ai_protocol)) == -1) {
+        if ((Tsock = sock_create(tres->ai_family, tres->ai_socktype, tres->ai_protocol, sp_opts)) == -1) {
             printl(LOG_CRIT, "Error creating a socket for Transparent incoming connections");
             mexit(1, pfile_name, tfile_name);
         }
@@ -386,7 +470,7 @@ All parameters are optional:
     }
 
     if (ntohs(SIN_PORT(*(sres->ai_addr)))) {
-        if ((Ssock = socket(sres->ai_family, sres->ai_socktype, sres->ai_protocol)) == -1) {
+        if ((Ssock = sock_create(sres->ai_family, sres->ai_socktype, sres->ai_protocol, sp_opts)) == -1) {
             printl(LOG_CRIT, "Error creating a socket for Socks5 incoming connections");
             mexit(1, pfile_name, tfile_name);
         }
@@ -396,7 +480,7 @@ All parameters are optional:
     }
 
     if (ntohs(SIN_PORT(*(hres->ai_addr)))) {
-        if ((Hsock = socket(hres->ai_family, hres->ai_socktype, hres->ai_protocol)) == -1) {
+        if ((Hsock = sock_create(hres->ai_family, hres->ai_socktype, hres->ai_protocol, sp_opts)) == -1) {
             printl(LOG_CRIT, "Error creating a socket for HTTP incoming connections");
             mexit(1, pfile_name, tfile_name);
         }
@@ -498,6 +582,31 @@ All parameters are optional:
         if (setsockopt(Hsock, SOL_SOCKET, SO_REUSEADDR, &raddr, sizeof(int)) == -1)
             printl(LOG_WARN, "Error setting HTTP incomming socket to be reusable");
 
+    /* Listener profile: accepted sockets inherit buffers and TCP options, buffers must be set before listen() */
+    if (sp_opts) {
+        if (Tsock != -1) sock_opts_apply(Tsock, sp_opts, "Transparent incoming connections");
+        if (Ssock != -1) sock_opts_apply(Ssock, sp_opts, "Socks incoming connections");
+        if (Hsock != -1) sock_opts_apply(Hsock, sp_opts, "HTTP incoming connections");
+    }
+
+    #if defined(TCP_FASTOPEN)
+        /* Accept the client data in SYN: saves a round trip for repeated clients with TCP Fast Open cookies */
+        #if defined(linux)
+            int fastopen = TCP_FASTOPEN_QLEN;
+        #else
+            int fastopen = 1;
+        #endif
+        if (Tsock != -1)
+            if (setsockopt(Tsock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_FASTOPEN socket option for Transparent incoming connections");
+        if (Ssock != -1)
+            if (setsockopt(Ssock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_FASTOPEN socket option for Socks incoming connections");
+        if (Hsock != -1)
+            if (setsockopt(Hsock, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(int)) == -1)
+                printl(LOG_WARN, "Error setting TCP_FASTOPEN socket option for HTTP incoming connections");
+    #endif
+
     /* -- Bind incoming connection sockets & start listening for clients -------------------------------------------- */
     if (Tsock != -1) {
         if (bind(Tsock, tres->ai_addr, tres->ai_addrlen) < 0) {
@@ -552,6 +661,21 @@ All parameters are optional:
     if ((msgid = msgget(mskey, 0600 | IPC_CREAT)) == -1)
         printl(LOG_WARN, "Unable to acquire IPC mesage queue ID. No traffic stats will be collected");
 
+    /* -- Start HTTP/2 brokers -------------------------------------------------------------------------------------- */
+    h2_broker_start(ini_root);
+
+    /* -- Start health checks --------------------------------------------------------------------------------------- */
+    health_init(ini_root);
+    health_start(ini_root);
+
+    timer_init(to_request);                                             /* Stage deadlines and expiry counters */
+    bpool_init(bp_limit);                                               /* Relay buffers accounting */
+    admit_init(ad_tunnels, ad_pending, ad_queue, ad_wait);              /* Concurrency limits and the queue */
+    admit_bind(ini_root);                                               /* and the section client counters */
+
+    sigemptyset(&cmask);
+    sigaddset(&cmask, SIGCHLD);
+
     /* -- Process clients ------------------------------------------------------------------------------------------- */
     while (1) {
         FD_ZERO(&sfd);
@@ -563,26 +687,46 @@ All parameters are optional:
         tv.tv_usec = 10000;
         ret = select(MAX(MAX(Hsock, Ssock), Tsock) + 1, &sfd, NULL, NULL, &tv);
 
-        if (ret < 0) continue;                                          /* On an error skip to the next iteration */
-        if (ret == 0) {                                                 /* Timeout - no new connections */
-            if (msgid != -1 && msgrcv(msgid, &tmessage, sizeof(tmessage), 1, IPC_NOWAIT) != -1)
+        health_update(&ini_root);                                       /* Move back sections which went down */
+        health_start(ini_root);                                         /* Restart exited or reloaded checker */
+
+        /* Sections failed by the clients are moved back immediately, not when the clients exit */
+        while (msgid != -1 &&
+            msgrcv(msgid, &fmessage, sizeof(fmessage.mtext), MSG_TYPE_FAILOVER, IPC_NOWAIT) != -1)
+                if ((push_ini = getsection(ini_root, fmessage.mtext)) &&
+                    push_ini->section_balance != SECTION_BALANCE_NONE) {
+
+                    printl(LOG_INFO, "Section: [%s] failed a client, moving it back", push_ini->section_name);
+                    pushback_ini(&ini_root, push_ini);
+                }
+
+        admit_idle(cn - 1);                                             /* Counters of the killed clients */
+
+        /* A queued client goes first when a slot is free */
+        if ((csock = admit_next(cn - 1, &isock, &caddr)) == -1) {
+            if (ret < 0) continue;                                      /* On an error skip to the next iteration */
+            if (ret == 0) {                                             /* Timeout - no new connections */
+                if (msgid != -1 && msgrcv(msgid, &tmessage, sizeof(tmessage.mtext), MSG_TYPE_TRAFFIC, IPC_NOWAIT) != -1)
+                    pidlist_update_traffic(pids, tmessage.mtext);
+                continue;
+            }
+
+            if (msgid != -1 && msgrcv(msgid, &tmessage, sizeof(tmessage.mtext), MSG_TYPE_TRAFFIC, IPC_NOWAIT) != -1)
                 pidlist_update_traffic(pids, tmessage.mtext);
-            continue;
-        }
 
-        if (msgid != -1 && msgrcv(msgid, &tmessage, sizeof(tmessage), 1, IPC_NOWAIT) != -1)
-            pidlist_update_traffic(pids, tmessage.mtext);
+            /* Check which of the internal servers has a pending connection */
+            if (Tsock != -1 && FD_ISSET(Tsock, &sfd)) isock = Tsock; else
+                if (Ssock != -1 && FD_ISSET(Ssock, &sfd)) isock = Ssock; else
+                    isock = Hsock;
 
-        /* Check which of the internal servers has a pending connection */
-        if (Tsock != -1 && FD_ISSET(Tsock, &sfd)) isock = Tsock; else
-            if (Tsock != -1 && FD_ISSET(Ssock, &sfd)) isock = Ssock; else
-                isock = Hsock;
+            caddrlen = sizeof caddr;
+            memset(&caddr, 0, caddrlen);
+            if ((csock = accept(isock, (struct sockaddr *)&caddr, &caddrlen)) < 0) {
+                admit_accept_failed(isock, errno);                      /* Never stop serving */
+                continue;
+            }
 
-        caddrlen = sizeof caddr;
-        memset(&caddr, 0, caddrlen);
-        if ((csock = accept(isock, (struct sockaddr *)&caddr, &caddrlen)) < 0) {
-            printl(LOG_CRIT, "Error accepting incoming connection");
-            return 1;
+            if (admit_client(csock, isock, &caddr, cn - 1)) continue;   /* Queued or rejected */
         }
         fcntl(csock, F_SETFL, ~O_NONBLOCK);                         /* Don't block client connections */
         printl(LOG_INFO, "Client: [%d], IP: [%s] accepted", cn++, inet2str(&caddr, buf));
@@ -597,35 +741,26 @@ All parameters are optional:
         tmp_daddr.ip_addr.ss_family = caddr.ss_family;
 
         while (c) {
-            push_ini = NULL;
-            if (c->traffic.daddr.ss_family && (!c->section_name || strlen(c->section_name) == 0)) {
-                tmp_daddr.ip_addr = c->traffic.daddr;
-                if ((push_ini = ini_look_server(ini_root, tmp_daddr))) {
-                    free(c->section_name);
-                    c->section_name = strdup(push_ini->section_name);
-                }
-            }
+            push_ini = NULL;                                                /* The child reports its section */
 
             if (c == pids && c->status >= 0) {                              /* Remove pidlist root entry */
                 pids = c->next;
-                if (!push_ini && c->section_name && c->section_name[0])
+                if (!push_ini && c->section_name[0])
                     push_ini = getsection(ini_root, c->section_name);
-                if (c->status && push_ini && push_ini->section_balance != SECTION_BALANCE_NONE)
+                if (PIDLIST_PUSHBACK(c->status) && push_ini && push_ini->section_balance != SECTION_BALANCE_NONE)
                         pushback_ini(&ini_root, push_ini);
-                free(c->section_name);
-                free(c);
+                pidlist_free(c);
                 c = pids;
             } else if (c && c->next && c->next->status >= 0) {              /* Remove a pidlist entry */
                 d = c->next;
                 c->next = d->next;
-                if (!push_ini && c->section_name && c->section_name[0])
+                if (!push_ini && c->section_name[0])
                     push_ini = getsection(ini_root, c->section_name);
-                if (d->status && push_ini && push_ini->section_balance != SECTION_BALANCE_NONE)
+                if (PIDLIST_PUSHBACK(d->status) && push_ini && push_ini->section_balance != SECTION_BALANCE_NONE)
                         pushback_ini(&ini_root, push_ini);
-                free(d->section_name);
-                free(d);
+                pidlist_free(d);
             } else {
-                if (!push_ini && c->section_name && c->section_name[0])
+                if (!push_ini && c->section_name[0])
                     push_ini = getsection(ini_root, c->section_name);
                 if (push_ini && push_ini->section_balance == SECTION_BALANCE_ROUNDROBIN)
                     pushback_ini(&ini_root, push_ini);
@@ -634,9 +769,17 @@ All parameters are optional:
             if (c) c = c->next;
         }
 
+        h2_broker_start(ini_root);                                      /* Restart exited or reloaded brokers */
+
+        /* The client is counted before its relay starts; SIGCHLD of a fast exit waits until it is in the list */
+        admit_pending(1);
+        sigprocmask(SIG_BLOCK, &cmask, &omask);
         if ((cpid = fork()) == -1) {
-            printl(LOG_WARN, "Fork failed for client, closing connection");
-            close(csock);
+            printl(LOG_WARN, "Fork failed for client, rejecting connection");
+            admit_pending(-1);
+            admit_reject(csock, isock);
+            cn--;
+            sigprocmask(SIG_SETMASK, &omask, NULL);
             continue;
         }
 
@@ -647,10 +790,13 @@ All parameters are optional:
 
             /* Save the client into the list */
             pids = pidlist_add(pids, "", cpid, caddr, tmp_daddr.ip_addr);
+            sigprocmask(SIG_SETMASK, &omask, NULL);
         }
 
         if (cpid == 0) {
             /* -- Client processing (child) ------------------------------------------------------------------------- */
+            sigprocmask(SIG_SETMASK, &omask, NULL);
+            admit_child();                                              /* Close the queue, count until the relay */
 
             /* Initialize  daddr */
             daddr_len = sizeof(daddr.ip_addr);
@@ -658,13 +804,20 @@ All parameters are optional:
             memset(&daddr.name, 0, sizeof(daddr.name) - 1);
             daddr.ip_addr.ss_family = caddr.ss_family;
 
+            cb.s = csock;
+            cb.len = cb.off = 0;
+
             ssock.t = CHS_SOCKET;                                       /* Type socket */
             #if (WITH_LIBSSH2)
                 ssock.c = NULL;
             #endif
+            #if (WITH_LIBSSL)
+                ssock.l = NULL;
+            #endif
 
             pid = getpid();
             printl(LOG_VERB, "A new client process started");
+            timer_stage(TIMER_STAGE_REQUEST, to_request);
 
             if (isock == Tsock) {
                 /* -- Transparent proxy connections ----------------------------------------------------------------- */
@@ -712,12 +865,13 @@ All parameters are optional:
                     exit(1);
                 }
 
-                if (!(s_ini = ini_look_server(ini_root, daddr))) {
+                if (!(s_ini = ini_look_server(ini_root, &daddr))) {
                     /*  -- Direct connection with the destination address bypassing proxy --------------------------- */
                     printl(LOG_INFO, "Making direct connection with the destination: [%s]",
                         inet2str(&daddr.ip_addr, buf));
+                    timer_stage(TIMER_STAGE_CONNECT, TIMEOUT_CONNECT_DEFAULT);
 
-                    if ((ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr)) == -1) {
+                    if ((ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr, 0, NULL, NULL)) == -1) {
                         printl(LOG_WARN, "Unable to connect with destination: [%s]", inet2str(&daddr.ip_addr, buf));
                         close(csock);
                         exit(1);
@@ -742,19 +896,19 @@ All parameters are optional:
 
                 printl(LOG_INFO, "Serving the client with embedded TS-Warp Socks-server");
 
-                if (socks5_server_hello(csock) == AUTH_METHOD_NOACCEPT) {
+                if (socks5_server_hello(&cb) == AUTH_METHOD_NOACCEPT) {
                     printl(LOG_WARN, "Embedded TS-Warp Socks server does not accept connections");
                     close(csock);
                     exit(1);
                 }
 
-                if (!socks5_server_request(csock, &daddr)) {
+                if (!socks5_server_request(&cb, &daddr)) {
                     printl(LOG_WARN, "Embedded TS-Warp Socks server lost connection with the client");
                     close(csock);
                     exit(1);
                 }
 
-                s_ini = ini_look_server(ini_root, daddr);
+                s_ini = ini_look_server(ini_root, &daddr);
                 if (!s_ini || (s_ini && SA_FAMILY(s_ini->proxy_server) == AF_INET ? \
                     S4_ADDR(s_ini->proxy_server) == S4_ADDR(*sres->ai_addr) : \
                     S6_ADDR(s_ini->proxy_server) == S6_ADDR(*sres->ai_addr))) {
@@ -762,7 +916,9 @@ All parameters are optional:
                     printl(LOG_INFO, "Serving request to: [%s] with Internal TS-Warp SOCKS server",
                         daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
 
-                    if ((ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr)) == -1) {
+                    timer_stage(TIMER_STAGE_CONNECT, TIMEOUT_CONNECT_DEFAULT);
+                    if (uvaddr_resolve(&daddr) ||
+                        (ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr, 0, NULL, NULL)) == -1) {
                         printl(LOG_WARN, "Unable to connect with destination: [%s]",
                             daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
 
@@ -785,11 +941,8 @@ All parameters are optional:
                     printl(LOG_INFO, "Serving request to [%s : %s] with external proxy server, section: [%s]",
                         daddr.name, inet2str(&daddr.ip_addr, buf), s_ini->section_name);
 
-                    /* Replying OK to Socks5 client */
-                        printl(LOG_VERB,
-                            "Replying Socks5 client [OK], the desination: [%s] is managed by external proxy",
-                            daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
-                    socks5_server_reply(csock, (struct sockaddr_storage *)(tres->ai_addr), SOCKS5_REPLY_OK);
+                    /* The Socks5 client is replied when the proxy server connection is established or failed */
+                    s5_reply = 1;
                 }
             } else if (isock == Hsock) {
                 /* -- Internal HTTP server  ------------------------------------------------------------------------- */
@@ -799,13 +952,16 @@ All parameters are optional:
 
                 printl(LOG_INFO, "Serving the client with embedded TS-Warp HTTP-server");
 
-                if (http_server_request(csock, &daddr)) {
+                if (http_server_request(&cb, &daddr)) {
                     printl(LOG_WARN, "Embedded TS-Warp HTTP server lost connection with the client");
                     close(csock);
                     exit(1);
                 }
 
-                s_ini = ini_look_server(ini_root, daddr);
+                /* The HTTP client is replied when the connection is established or failed */
+                h_reply = 1;
+
+                s_ini = ini_look_server(ini_root, &daddr);
                 if (!s_ini || (s_ini && SA_FAMILY(s_ini->proxy_server) == AF_INET ? \
                     S4_ADDR(s_ini->proxy_server) == S4_ADDR(*hres->ai_addr) : \
                     S6_ADDR(s_ini->proxy_server) == S6_ADDR(*hres->ai_addr))) {
@@ -813,9 +969,12 @@ All parameters are optional:
                     printl(LOG_INFO, "Serving request to: [%s] with Internal TS-Warp HTTP server",
                         daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
 
-                    if ((ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr)) == -1) {
+                    timer_stage(TIMER_STAGE_CONNECT, TIMEOUT_CONNECT_DEFAULT);
+                    if (uvaddr_resolve(&daddr) ||
+                        (ssock.s = connect_desnation(*(struct sockaddr *)&daddr.ip_addr, 0, NULL, NULL)) == -1) {
                         printl(LOG_WARN, "Unable to connect with destination: [%s]",
                             daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
+                        http_server_reply(csock, HTTP_RESPONSE_502);
                         close(csock);
                         exit(1);
                     }
@@ -828,6 +987,85 @@ All parameters are optional:
             }
 
             /* -- Start external proxy forwarding ------------------------------------------------------------------- */
+            if (s_ini->pool) {
+                s_ini = pool_select(s_ini, &daddr, &caddr);
+                printl(LOG_VERB, "Pool: [%s] selected section: [%s]", s_ini->pool->name, s_ini->section_name);
+            }
+            f_start = time(NULL);
+
+            proxy_connect:
+            /* Racers connect for the client process, it is admitted by the first section */
+            timer_stage(TIMER_STAGE_NONE, 0);                           /* The queue has its own timeout */
+            if (!racer && admit_section(s_ini)) {
+                f_shed = 1;
+                goto proxy_next;
+            }
+            gettimeofday(&p_start, NULL);
+            timer_stage(TIMER_STAGE_CONNECT, s_ini->proxy_connect_timeout);
+            if (s_ini->section_balance == SECTION_BALANCE_RACE && !racer && !f_retries) {
+                /* -- Race: the first of the top matching sections to complete the handshake wins ----------------- */
+                struct ini_section *rs[SECTION_RACE_MAX], *r;
+                pid_t rp[SECTION_RACE_MAX];
+                int rv[2], rn = 0, rf = -1, i;
+                unsigned int rk;
+                struct timeval rt;
+
+                /* Keep extra connections of all the active clients within RACE_BUDGET */
+                rk = MIN(s_ini->section_race, 1 + RACE_BUDGET / MAX(cn, 1));
+
+                /* Only plain socket transports can be passed from a racer, TLS and SSH2 states can't */
+                for (r = s_ini; r && rn < rk && !r->p_chain && (r->h2_ctl != -1 ||
+                    r->proxy_type == PROXY_PROTO_SOCKS_V5 || r->proxy_type == PROXY_PROTO_SOCKS_V4 ||
+                    r->proxy_type == PROXY_PROTO_HTTP); r = ini_look_server(r->next, &daddr)) rs[rn++] = r;
+
+                if (rn > 1 && socketpair(AF_UNIX, SOCK_DGRAM, 0, rv) != -1) {
+                    printl(LOG_INFO, "Racing: [%d] sections to serve: [%s]", rn, inet2str(&daddr.ip_addr, buf));
+                    signal(SIGCHLD, SIG_DFL);                           /* Racers are reaped here */
+
+                    for (i = 0; i < rn; i++)
+                        if ((rp[i] = fork()) == 0) {
+                            racer = 1;
+                            race_fd = rv[1];
+                            close(rv[0]);
+                            s5_reply = h_reply = 0;
+                            s_ini = rs[i];
+                            pid = getpid();
+                            goto proxy_connect;
+                        }
+                    close(rv[1]);
+                    timer_stage(TIMER_STAGE_NONE, 0);                   /* The racers have their own deadlines */
+
+                    /* Wait for the winner, reports of failed racers are just counted */
+                    for (i = 0; i < rn && rf == -1; i++) {
+                        rt.tv_sec = MAX(FAILOVER_DEADLINE - (time(NULL) - f_start), 1);
+                        rt.tv_usec = 0;
+                        setsockopt(rv[0], SOL_SOCKET, SO_RCVTIMEO, &rt, sizeof(rt));
+                        memset(suf, 0, sizeof(suf));
+                        if (recv_fd(rv[0], &rf, suf, sizeof(suf) - 1) <= 0) break;
+                    }
+                    close(rv[0]);
+
+                    for (i = 0; i < rn; i++) if (rp[i] > 0) kill(rp[i], SIGKILL);
+                    for (i = 0; i < rn; i++) if (rp[i] > 0) waitpid(rp[i], NULL, 0);
+
+                    if (rf != -1 && (r = getsection(ini_root, suf))) {
+                        s_ini = r;
+                        ssock.s = rf;
+                        printl(LOG_INFO, "Race won by section: [%s]", s_ini->section_name);
+                        goto cfloop;
+                    }
+
+                    /* The racers reported their failures, continue with the sections behind them */
+                    printl(LOG_WARN, "All: [%d] raced sections failed to serve: [%s]",
+                        rn, inet2str(&daddr.ip_addr, buf));
+                    if (rf != -1) close(rf);
+                    s_ini = rs[rn - 1];
+                    f_retries = rn - 1;
+                    f_reported = msgid != -1;
+                    goto proxy_next;
+                }
+            }
+
             if (s_ini && s_ini->p_chain) {
 
                 /* -- Proxy chains ---------------------------------------------------------------------------------- */
@@ -837,12 +1075,14 @@ All parameters are optional:
                     inet2str(&sc->chain_member->proxy_server, buf), sc->chain_member->proxy_type);
 
                 /* Connect the first member of the chain */
-                if ((ssock.s = connect_desnation(*(struct sockaddr *)&sc->chain_member->proxy_server)) == -1) {
+                if ((ssock.s = connect_desnation(*(struct sockaddr *)&sc->chain_member->proxy_server,
+                    sc->chain_member->proxy_tfo == 'Y', &sc->chain_member->socket,
+                    sc->chain_member->source)) == -1) {
                     printl(LOG_WARN, "Unable to connect with CHAIN proxy server: [%s] type [%c]",
                         inet2str(&sc->chain_member->proxy_server, buf), sc->chain_member->proxy_type);
-                    close(csock);
-                    exit(2);
+                    goto proxy_failed;
                 }
+                timer_stage(TIMER_STAGE_HANDSHAKE, s_ini->proxy_handshake_timeout);
 
                 while (sc) {
                     switch (sc->chain_member->proxy_type) {
@@ -860,21 +1100,19 @@ All parameters are optional:
 
                                 case AUTH_METHOD_UNAME:
                                     /* Perform user/password auth */
-                                    if (socks5_client_auth(ssock, sc->chain_member->proxy_user,
-                                        sc->chain_member->proxy_password)) {
+                                    if (socks5_client_auth(ssock, sc->chain_member->tpl_s5_auth,
+                                        sc->chain_member->tpl_s5_auth_len)) {
 
                                             printl(LOG_WARN, "CHAIN Socks5 server rejected user: [%s]",
                                                 sc->chain_member->proxy_user);
-                                            close(csock);
-                                            exit(2);
+                                            goto proxy_failed;
                                     }
                                 break;
 
                                 case AUTH_METHOD_NOACCEPT:
                                 default:
                                     printl(LOG_WARN, "No (supported) auth methods were accepted by CHAIN Socks5 server");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                             }
 
                             if (sc->next) {
@@ -886,8 +1124,7 @@ All parameters are optional:
                                 if (socks5_client_request(ssock, SOCKS5_CMD_TCPCONNECT,
                                     &sc->next->chain_member->proxy_server, NULL)) {
                                         printl(LOG_WARN, "CHAIN Socks5 server returned an error");
-                                        close(csock);
-                                        exit(2);
+                                        goto proxy_failed;
                                 }
                             } else {
                                 /* We are at the end of the chain, so connect with the section server */
@@ -897,8 +1134,7 @@ All parameters are optional:
 
                                 if (socks5_client_request(ssock, SOCKS5_CMD_TCPCONNECT, &s_ini->proxy_server, NULL)) {
                                     printl(LOG_WARN, "CHAIN Socks5 server returned an error");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
 
                                 goto single_server;
@@ -913,12 +1149,12 @@ All parameters are optional:
                                     inet2str(&sc->next->chain_member->proxy_server, buf));
 
                                 if (socks4_client_request(ssock, SOCKS4_CMD_TCPCONNECT,
-                                        (struct sockaddr_in *)&sc->next->chain_member->proxy_server,
-                                        sc->next->chain_member->proxy_user)) {
+                                        (struct sockaddr_in *)&sc->next->chain_member->proxy_server, NULL,
+                                        sc->next->chain_member->tpl_s4_request,
+                                        sc->next->chain_member->tpl_s4_request_len)) {
 
                                             printl(LOG_WARN, "CHAIN Socks4 server returned an error");
-                                            close(csock);
-                                            exit(2);
+                                            goto proxy_failed;
                                 }
                             } else {
                                 /* We are at the end of the chain, so connect with the section server */
@@ -927,11 +1163,11 @@ All parameters are optional:
                                     inet2str(&s_ini->proxy_server, buf));
 
                                 if (socks4_client_request(ssock, SOCKS4_CMD_TCPCONNECT,
-                                        (struct sockaddr_in *)&s_ini->proxy_server, s_ini->proxy_user)) {
+                                        (struct sockaddr_in *)&s_ini->proxy_server, NULL,
+                                        s_ini->tpl_s4_request, s_ini->tpl_s4_request_len)) {
 
                                             printl(LOG_WARN, "CHAIN Socks4 server returned an error");
-                                            close(csock);
-                                            exit(2);
+                                            goto proxy_failed;
                                 }
 
                                 goto single_server;
@@ -945,13 +1181,12 @@ All parameters are optional:
                                     inet2str(&sc->chain_member->proxy_server, suf),
                                     inet2str(&sc->next->chain_member->proxy_server, buf));
 
-                                if (http_client_request(ssock, &sc->next->chain_member->proxy_server,
-                                        sc->next->chain_member->proxy_user,
-                                        sc->next->chain_member->proxy_password, sdpi)) {
+                                if (http_client_request(ssock, &sc->next->chain_member->proxy_server, NULL,
+                                        sc->next->chain_member->tpl_http_auth,
+                                        sc->next->chain_member->tpl_http_auth_len, sdpi)) {
 
                                     printl(LOG_WARN, "CHAIN HTTP server returned an error");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
                             } else {
                                 /* We are at the end of the chain, so connect with the section server */
@@ -959,30 +1194,73 @@ All parameters are optional:
                                     inet2str(&sc->chain_member->proxy_server, suf),
                                     inet2str(&s_ini->proxy_server, buf));
 
-                                if (http_client_request(ssock,
-                                        &s_ini->proxy_server, s_ini->proxy_user, s_ini->proxy_password, sdpi)) {
+                                if (http_client_request(ssock, &s_ini->proxy_server, NULL,
+                                        s_ini->tpl_http_auth, s_ini->tpl_http_auth_len, sdpi)) {
 
                                     printl(LOG_WARN, "CHAIN HTTP server returned an error");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
 
                                 goto single_server;
                             }
                         break;
 
+                        case PROXY_PROTO_HTTPS:
+                            #if (WITH_LIBSSL)
+                                if (ssock.t != CHS_SOCKET) {
+                                    printl(LOG_WARN, "Only ONE TLS or SSH2 proxy could be used per CHAIN");
+                                    goto proxy_failed;
+                                }
+
+                                if (!(ssock.l = tls_client_connect(ssock.s, sc->chain_member))) {
+                                    printl(LOG_WARN, "Unable to establish TLS with CHAIN HTTPS server");
+                                    goto proxy_failed;
+                                }
+                                ssock.t = CHS_TLS;
+
+                                if (sc->next) {
+                                    /* We want to connect with the next chain member */
+                                    printl(LOG_VERB, "Initiate CHAIN HTTPS protocol: request [%s] -> [%s]",
+                                        inet2str(&sc->chain_member->proxy_server, suf),
+                                        inet2str(&sc->next->chain_member->proxy_server, buf));
+
+                                    if (http_client_request(ssock, &sc->next->chain_member->proxy_server, NULL,
+                                            sc->chain_member->tpl_http_auth, sc->chain_member->tpl_http_auth_len, 0)) {
+
+                                        printl(LOG_WARN, "CHAIN HTTPS server returned an error");
+                                        goto proxy_failed;
+                                    }
+                                } else {
+                                    /* We are at the end of the chain, so connect with the section server */
+                                    printl(LOG_VERB, "Initiate CHAIN HTTPS protocol: request [%s] -> [%s]",
+                                        inet2str(&sc->chain_member->proxy_server, suf),
+                                        inet2str(&s_ini->proxy_server, buf));
+
+                                    if (http_client_request(ssock, &s_ini->proxy_server, NULL,
+                                            sc->chain_member->tpl_http_auth, sc->chain_member->tpl_http_auth_len, 0)) {
+
+                                        printl(LOG_WARN, "CHAIN HTTPS server returned an error");
+                                        goto proxy_failed;
+                                    }
+
+                                    goto single_server;
+                                }
+                            #else
+                                printl(LOG_WARN, "HTTPS protocol was not compiled. Rebuild TS-Warp with LIBSSL support");
+                                goto proxy_failed;
+                            #endif
+                        break;
+
                         #if (WITH_LIBSSH2)
                             case PROXY_PROTO_SSH2:
                                 if (ssh2sess || ssh2ch) {
                                     printl(LOG_WARN, "Only ONE SSH2 proxy could be used per CHAIN");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
 
                                 if (!(ssh2sess = libssh2_session_init())) {
                                     printl(LOG_WARN, "Unable to initialize SSH2 session");
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
 
                                 if (sc->next) {
@@ -994,13 +1272,10 @@ All parameters are optional:
                                     p_server.ip_addr = sc->next->chain_member->proxy_server;
                                     memset(p_server.name, 0, sizeof(p_server.name));
                                     if (!(ssh2ch = ssh2_client_request(ssock.s, ssh2sess, &p_server,
-                                        sc->chain_member->proxy_user, sc->chain_member->proxy_password,
-                                        sc->chain_member->proxy_key, sc->chain_member->proxy_key_passphrase,
-                                        sc->chain_member->proxy_ssh_force_auth))) {
+                                        sc->chain_member))) {
 
                                         printl(LOG_WARN, "CHAIN SSH2 proxy server returned an error");
-                                        close(csock);
-                                        exit(2);
+                                        goto proxy_failed;
                                     }
                                 } else {
                                     /* As the last link in the chain and we want to connect the section server */
@@ -1011,13 +1286,10 @@ All parameters are optional:
                                     p_server.ip_addr = s_ini->proxy_server;
                                     memset(p_server.name, 0, sizeof(p_server.name));
                                     if (!(ssh2ch = ssh2_client_request(ssock.s, ssh2sess, &p_server,
-                                        sc->chain_member->proxy_user, sc->chain_member->proxy_password,
-                                        sc->chain_member->proxy_key, sc->chain_member->proxy_key_passphrase,
-                                        sc->chain_member->proxy_ssh_force_auth))) {
+                                        sc->chain_member))) {
 
                                         printl(LOG_WARN, "CHAIN SSH2 proxy server returned an error");
-                                        close(csock);
-                                        exit(2);
+                                        goto proxy_failed;
                                     }
 
                                     ssock.t = CHS_CHANNEL;
@@ -1031,8 +1303,7 @@ All parameters are optional:
                             /* Unreachable. Must be cleared already by read_ini() */
                             printl(LOG_WARN, "Detected unsupported CHAIN proxy type: [%c]",
                                 s_ini->p_chain->chain_member->proxy_type);
-                            close(csock);
-                            exit(2);
+                            goto proxy_failed;
                     }
 
                     sc = sc->next;
@@ -1042,15 +1313,23 @@ All parameters are optional:
                 printl(LOG_INFO, "Connecting the proxy server: [%s] type [%c]",
                     inet2str(&s_ini->proxy_server, buf), s_ini->proxy_type);
 
-                if ((ssock.s = connect_desnation(*(struct sockaddr *)&s_ini->proxy_server)) == -1) {
+                if (s_ini->h2_ctl != -1) {
+                    /* HTTP/2 broker owns the connections with the proxy server, the stream is requested below */
+                    ssock.s = -1;
+                    timer_stage(TIMER_STAGE_HANDSHAKE, s_ini->proxy_handshake_timeout);
+                    goto single_server;
+                }
+
+                if ((ssock.s = connect_desnation(*(struct sockaddr *)&s_ini->proxy_server,
+                    s_ini->proxy_tfo == 'Y', &s_ini->socket, s_ini->source)) == -1) {
                     printl(LOG_WARN, "Unable to connect with the proxy server: [%s] type [%c]",
                         inet2str(&s_ini->proxy_server, buf), s_ini->proxy_type);
-                    close(csock);
-                    exit(2);
+                    goto proxy_failed;
                 }
 
                 printl(LOG_INFO, "Successfully connected with the proxy server: [%s] type [%c]",
                     inet2str(&s_ini->proxy_server, buf), s_ini->proxy_type);
+                timer_stage(TIMER_STAGE_HANDSHAKE, s_ini->proxy_handshake_timeout);
 
                 single_server:
 
@@ -1067,12 +1346,24 @@ All parameters are optional:
 
                         printl(LOG_WARN, "Unable to resolve client destination address [%s] via NIT",
                             inet2str(&daddr.ip_addr, buf));
-                        close(csock);
-                        exit(2);
+                        goto proxy_failed;
                     }
                     printl(LOG_VERB, "NIT Lookup resolved: [%s] to [%s]", inet2str(&daddr.ip_addr, buf), daddr.name);
                 }
 
+                if (s_ini->h2_ctl != -1) {
+                    /* HTTP/HTTPS proxy multiplexed by the HTTP/2 broker: relay the stream as a plain socket */
+                    printl(LOG_VERB, "Initiate HTTP/2 CONNECT stream: [%s] -> [%s]",
+                        inet2str(&s_ini->proxy_server, suf), inet2str(&daddr.ip_addr, buf));
+
+                    if ((ssock.s = h2_client_request(s_ini, &daddr.ip_addr, daddr.name)) == -1) {
+                        printl(LOG_WARN, "Unable to open HTTP/2 stream via the proxy server: [%s]",
+                            inet2str(&s_ini->proxy_server, buf));
+                        goto proxy_failed;
+                    }
+                    goto cfloop;
+                }
+
                 switch (s_ini->proxy_type) {
                     case PROXY_PROTO_SOCKS_V5:
                         printl(LOG_VERB, "Initiate Socks5 protocol: hello: [%s]", inet2str(&s_ini->proxy_server, buf));
@@ -1088,18 +1379,16 @@ All parameters are optional:
                             break;
 
                             case AUTH_METHOD_UNAME:                     /* Perform user/password auth */
-                                if (socks5_client_auth(ssock, s_ini->proxy_user, s_ini->proxy_password)) {
+                                if (socks5_client_auth(ssock, s_ini->tpl_s5_auth, s_ini->tpl_s5_auth_len)) {
                                     printl(LOG_WARN, "Socks5 rejected user: [%s]", s_ini->proxy_user);
-                                    close(csock);
-                                    exit(2);
+                                    goto proxy_failed;
                                 }
                             break;
 
                             case AUTH_METHOD_NOACCEPT:
                             default:
                                 printl(LOG_WARN, "No (supported) auth methods were accepted by Socks5 server");
-                                close(csock);
-                                exit(2);
+                                goto proxy_failed;
                         }
 
                         printl(LOG_VERB, "Initiate Socks5 protocol: request [%s] -> [%s]",
@@ -1107,8 +1396,7 @@ All parameters are optional:
 
                         if (socks5_client_request(ssock, SOCKS5_CMD_TCPCONNECT, &daddr.ip_addr, daddr.name)) {
                             printl(LOG_CRIT, "Socks5 proxy server returned an error");
-                            close(csock);
-                            exit(2);
+                            goto proxy_failed;
                         }
                     break;
 
@@ -1117,11 +1405,11 @@ All parameters are optional:
                             inet2str(&s_ini->proxy_server, suf), inet2str(&daddr.ip_addr, buf));
 
                         if (socks4_client_request(ssock, SOCKS4_CMD_TCPCONNECT,
-                                (struct sockaddr_in *)&daddr.ip_addr, s_ini->proxy_user) != SOCKS4_REPLY_OK) {
+                                (struct sockaddr_in *)&daddr.ip_addr, daddr.name, s_ini->tpl_s4_request,
+                                s_ini->tpl_s4_request_len) != SOCKS4_REPLY_OK) {
 
                             printl(LOG_WARN, "Socks4 proxy server returned an error");
-                            close(csock);
-                            exit(2);
+                            goto proxy_failed;
                         }
                     break;
 
@@ -1129,234 +1417,239 @@ All parameters are optional:
                         printl(LOG_VERB, "Initiate HTTP protocol: request: [%s] -> [%s]",
                             inet2str(&s_ini->proxy_server, suf), inet2str(&daddr.ip_addr, buf));
 
-                        if (http_client_request(ssock, &daddr.ip_addr, s_ini->proxy_user, s_ini->proxy_password, sdpi)) {
+                        if (http_client_request(ssock, &daddr.ip_addr, daddr.name,
+                                s_ini->tpl_http_auth, s_ini->tpl_http_auth_len, sdpi)) {
                             printl(LOG_WARN, "HTTP proxy server returned an error");
-                            close(csock);
-                            exit(2);
+                            goto proxy_failed;
                         }
                     break;
 
+                    case PROXY_PROTO_HTTPS:
+                        #if (WITH_LIBSSL)
+                            if (ssock.t != CHS_SOCKET) {
+                                printl(LOG_WARN, "Only ONE TLS or SSH2 proxy could be used per CHAIN/Connection");
+                                goto proxy_failed;
+                            }
+
+                            if (!(ssock.l = tls_client_connect(ssock.s, s_ini))) {
+                                printl(LOG_WARN, "Unable to establish TLS with HTTPS proxy server");
+                                goto proxy_failed;
+                            }
+                            ssock.t = CHS_TLS;
+
+                            printl(LOG_VERB, "Initiate HTTPS protocol: request: [%s] -> [%s]",
+                                inet2str(&s_ini->proxy_server, suf), inet2str(&daddr.ip_addr, buf));
+
+                            if (http_client_request(ssock, &daddr.ip_addr, daddr.name,
+                                    s_ini->tpl_http_auth, s_ini->tpl_http_auth_len, 0)) {
+                                printl(LOG_WARN, "HTTPS proxy server returned an error");
+                                goto proxy_failed;
+                            }
+                        #else
+                            printl(LOG_WARN, "HTTPS protocol was not compiled. Rebuild TS-Warp with LIBSSL support");
+                            goto proxy_failed;
+                        #endif
+                    break;
+
                     case PROXY_PROTO_SSH2:
                         #if (WITH_LIBSSH2)
                             if (ssh2sess || ssh2ch) {
                                 printl(LOG_WARN, "Only ONE SSH2 proxy could be used per CHAIN/Connection");
-                                close(csock);
-                                exit(2);
+                                goto proxy_failed;
                             }
 
                             if (!(ssh2sess = libssh2_session_init())) {
                                 printl(LOG_WARN, "Unable to initialize SSH2 session");
-                                close(csock);
-                                exit(2);
+                                goto proxy_failed;
                             }
 
                             printl(LOG_VERB, "Initiate SSH2 protocol: request: [%s] -> [%s]",
                                 inet2str(&s_ini->proxy_server, suf), inet2str(&daddr.ip_addr, buf));
 
-                            if (!(ssh2ch = ssh2_client_request(ssock.s, ssh2sess, &daddr, s_ini->proxy_user,
-                            s_ini->proxy_password, s_ini->proxy_key, s_ini->proxy_key_passphrase,
-                            s_ini->proxy_ssh_force_auth))) {
+                            if (!(ssh2ch = ssh2_client_request(ssock.s, ssh2sess, &daddr, s_ini))) {
                                 printl(LOG_WARN, "SSH2 proxy server returned an error");
-                                close(csock);
-                                exit(2);
+                                goto proxy_failed;
                             }
+
+                            ssock.t = CHS_CHANNEL;
+                            ssock.c = ssh2ch;
                         #else
                             printl(LOG_WARN, "SSH2 protocol was not compiled. Rebuild TS-Warp with LIBSSH2 support");
-                            close(csock);
-                            exit(2);
+                            goto proxy_failed;
                         #endif
                     break;
 
                     default:
                         /* Unreachable. Should be cleared already by read_ini() */
                         printl(LOG_WARN, "Detected unsupported proxy type: [%c]", s_ini->proxy_type);
-                        close(csock);
-                        exit(2);
+                        goto proxy_failed;
                 }
             }
 
+            goto cfloop;
+
+            /* -- In-connection failover ---------------------------------------------------------------------------- */
+            proxy_failed:
+            printl(LOG_WARN, "Section: [%s] failed to serve: [%s]", s_ini->section_name, inet2str(&daddr.ip_addr, buf));
+
+            #if (WITH_LIBSSH2)
+                if (ssh2ch) libssh2_channel_free(ssh2ch);
+                if (ssh2sess) libssh2_session_free(ssh2sess);
+                ssh2ch = NULL;
+                ssh2sess = NULL;
+                ssock.c = NULL;
+            #endif
+            #if (WITH_LIBSSL)
+                tls_close(ssock.l);
+                ssock.l = NULL;
+            #endif
+            if (ssock.s != -1) close(ssock.s);
+            ssock.s = -1;
+            ssock.t = CHS_SOCKET;
+
+            health_failure(s_ini);                                      /* Feed the section breaker */
+            admit_release();                                            /* and let the next client connect */
+            f_shed = 0;
+
+            /* Let the main process move the section back now, not when this client exits */
+            if (msgid != -1 && s_ini->section_balance != SECTION_BALANCE_NONE) {
+                fmessage.mtype = MSG_TYPE_FAILOVER;
+                memset(fmessage.mtext, 0, sizeof(fmessage.mtext));
+                strncpy(fmessage.mtext, s_ini->section_name, sizeof(fmessage.mtext) - 1);
+                if (msgsnd(msgid, &fmessage, sizeof(fmessage.mtext), IPC_NOWAIT) != -1) f_reported = 1;
+            }
+
+            if (racer) {
+                send_fd(race_fd, -1, s_ini->section_name, strlen(s_ini->section_name) + 1);
+                exit(2);
+            }
+
+            proxy_next:
+            if (s_ini->section_balance != SECTION_BALANCE_NONE && ++f_retries <= FAILOVER_RETRIES &&
+                time(NULL) - f_start < FAILOVER_DEADLINE && (s_ini = ini_look_server(s_ini->next, &daddr))) {
+
+                printl(LOG_INFO, "Failover attempt: [%d] of: [%d], section: [%s]",
+                    f_retries, FAILOVER_RETRIES, s_ini->section_name);
+                goto proxy_connect;
+            }
+
+            printl(LOG_WARN, "Unable to serve: [%s] with any of the proxy servers", inet2str(&daddr.ip_addr, buf));
+            if (s5_reply) {
+                printl(LOG_VERB, "Replying Socks5 client [KO], the desination: [%s] is unreachable via external proxy",
+                    daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
+                socks5_server_reply(csock, (struct sockaddr_storage *)(tres->ai_addr), SOCKS5_REPLY_KO);
+            }
+            if (h_reply) http_server_reply(csock, f_shed ? HTTP_RESPONSE_503 : HTTP_RESPONSE_502);
+            close(csock);
+            exit(f_reported ? EXIT_PROXY_REPORTED : 2);
+
             /* -- Forward connections ------------------------------------------------------------------------------- */
             cfloop:
+            timer_stage(TIMER_STAGE_NONE, 0);                           /* The relay watches its idle time itself */
+            idle = p_start.tv_sec ? s_ini->proxy_idle_timeout : TIMEOUT_IDLE_DEFAULT;
+            if (racer) {
+                /* Pass the ready proxy connection to the client process */
+                send_fd(race_fd, ssock.s, s_ini->section_name, strlen(s_ini->section_name) + 1);
+                exit(0);
+            }
+            admit_ready();                                              /* The client is not pending any more */
+
+            if (p_start.tv_sec) {
+                /* Served by a proxy server: feed the section breaker and latency */
+                gettimeofday(&tv, NULL);
+                health_success(s_ini, (tv.tv_sec - p_start.tv_sec) * 1000000 + tv.tv_usec - p_start.tv_usec);
+                health_acquire(s_ini);                                  /* For the pool least-conn and EWMA */
+                admit_release();                                        /* Counted as active now */
+                pool_learn(s_ini, &daddr, (tv.tv_sec - p_start.tv_sec) * 1000000 + tv.tv_usec - p_start.tv_usec);
+            }
+
+            if (s5_reply) {
+                printl(LOG_VERB, "Replying Socks5 client [OK], the desination: [%s] is managed by external proxy",
+                    daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf));
+                socks5_server_reply(csock, (struct sockaddr_storage *)(tres->ai_addr), SOCKS5_REPLY_OK);
+            }
+            if (h_reply && http_server_reply(csock, HTTP_RESPONSE_200)) {
+                close(csock);
+                exit(1);
+            }
+
             printl(LOG_VERB, "Starting connection-forward loop");
 
             /* Prepare IPC messages */
-            tmessage.mtype = 1;
+            tmessage.mtype = MSG_TYPE_TRAFFIC;
             memset(&tmessage.mtext, 0, sizeof(struct traffic_data));
             tmessage.mtext.pid = pid;
             tmessage.mtext.timestamp = time(NULL);
             tmessage.mtext.caddr = caddr;
             tmessage.mtext.cbytes = 0;
             tmessage.mtext.daddr = daddr.ip_addr;
+            strncpy(tmessage.mtext.dname, daddr.name, sizeof(tmessage.mtext.dname) - 1);
             tmessage.mtext.dbytes = 0;
+            tmessage.mtext.mptcp = (mptcp_active(csock) ? TRAFFIC_MPTCP_CLIENT : 0) |
+                (mptcp_active(ssock.s) ? TRAFFIC_MPTCP_SERVER : 0);
+            if (p_start.tv_sec)
+                strncpy(tmessage.mtext.section_name, s_ini->section_name, sizeof(tmessage.mtext.section_name) - 1);
+            printl(LOG_INFO, "Multipath TCP with the client: [%c] with the server: [%c]",
+                tmessage.mtext.mptcp & TRAFFIC_MPTCP_CLIENT ? 'Y' : 'N',
+                tmessage.mtext.mptcp & TRAFFIC_MPTCP_SERVER ? 'Y' : 'N');
+            /* The section and the destination are known before the first byte: round robin and failover need them */
+            if (msgid != -1) msgsnd(msgid, &tmessage, sizeof(tmessage.mtext), IPC_NOWAIT);
+
+            /* Relay both directions, starting with the data the client pipelined after its Socks5 or HTTP request */
+            if (relay_start(&rl, csock, &ssock, p_start.tv_sec ? s_ini->proxy_buffer : RELAY_BUFFER_DEFAULT,
+                cb.data + cb.off, cb.len - cb.off)) {
+                close(csock);
+                exit(1);
+            }
+            cb.off = cb.len;
+            rl.idle = idle;
+            rl.sdpi = sdpi;
+            /* Socket buffers fixed by the section profile are left as they are */
+            rl.tune = !p_start.tv_sec ||
+                (s_ini->socket.sndbuf == SOCK_OPT_UNSET && s_ini->socket.rcvbuf == SOCK_OPT_UNSET);
+            rl.zerocopy = p_start.tv_sec && s_ini->proxy_zerocopy == 'Y';
+            if (p_start.tv_sec && s_ini->shaper) {
+                rl.shape = s_ini->shaper;
+                rl.cb = shaper_client(rl.shape, &caddr);
+                shaper_pace(rl.shape, csock);
+                shaper_pace(rl.shape, ssock.s);
+            }
+            #if (WITH_LIBSSH2)
+                rl.sess = ssh2sess;
+            #endif
 
-            while (1) {
-                #if (WITH_LIBSSH2)
-                    if (ssh2ch) {
-                        int wr = 0;
-
-                        FD_ZERO(&rfd);
-                        FD_SET(csock, &rfd);
-
-                        tv.tv_sec = 0;
-                        tv.tv_usec = 100000;
-                        ret = select(csock + 1, &rfd, 0, 0, &tv);
-
-                        if (ret < 0) break;
-                        if (ret > 0) {
-                            memset(buf, 0, BUF_SIZE);
-                            tmessage.mtext.timestamp = time(NULL);                      /* Fill in traffic timestamp */
-                            if (FD_ISSET(csock, &rfd)) {
-                                /* Client writes */
-                                rec = recv(csock, buf, BUF_SIZE, 0);
-                                if (rec == 0) {
-                                    printl(LOG_VERB, "Connection closed by the client");
-                                    break;
-                                }
-                                if (rec == -1) {
-                                    printl(LOG_CRIT, "Error receiving data from the client");
-                                    break;
-                                }
-
-                                do {
-                                    snd = libssh2_channel_write(ssh2ch, buf, rec);
-                                    if (snd < 0) {
-                                        printl(LOG_CRIT, "libssh2_channel_write() failue: [%d]", snd);
-                                        break;
-                                    }
-                                    wr += snd;
-                                } while(snd > 0 && wr < rec);
-
-                                printl(rec != snd ? LOG_CRIT : LOG_VERB, "C:[%d] -> S:[%d] bytes", rec, wr);
-                                tmessage.mtext.cbytes += rec;
-                            }
-                        }
-
-                        while (1) {
-                            /* Server writes */
-                            rec = libssh2_channel_read(ssh2ch, buf, BUF_SIZE);
-                            if (rec == LIBSSH2_ERROR_EAGAIN)
-                                break;                  /* Let's try again */
-
-                            if (rec < 0) {
-                                printl(LOG_CRIT, "libssh2_channel_read() failure: [%d]", rec);
-                                break;
-                            }
-
-                            wr = 0;
-                            while (wr < rec) {
-                                snd = send(csock, buf + wr, rec - wr, 0);
-                                if (snd <= 0) {
-                                    printl(LOG_CRIT, "Error sending data to proxy server");
-                                    break;
-                                }
-                                wr += snd;
-                            }
-
-                            printl(rec != snd ? LOG_CRIT : LOG_VERB, "S:[%d] -> C:[%d] bytes", rec, wr);
-                            tmessage.mtext.dbytes += rec;
-
-                            if (libssh2_channel_eof(ssh2ch)) {
-                                printl(LOG_VERB, "Connection closed by the server");
-                                goto shutdown_ssh2;
-                            }
-
-                            if (msgid != -1) msgsnd(msgid, &tmessage, sizeof(struct traffic_message), IPC_NOWAIT);
-                        }
-                    } else {
-                #endif
-                    FD_ZERO(&rfd);
-                    FD_SET(csock, &rfd);
-                    FD_SET(ssock.s, &rfd);
-
-                    tv.tv_sec = 1;
-                    tv.tv_usec = 0;
-                    ret = select(ssock.s > csock ? ssock.s + 1: csock + 1, &rfd, 0, 0, &tv);
-
-                    if (ret < 0) break;
-                    if (ret == 0) continue;
-                    if (ret > 0) {
-                        memset(buf, 0, BUF_SIZE);
-                        tmessage.mtext.timestamp = time(NULL);                          /* Fill in traffic timestamp */
-                        if (FD_ISSET(csock, &rfd)) {
-                            /* Client writes */
-                            rec = recv(csock, buf, BUF_SIZE, 0);
-                            if (rec == 0) {
-                                printl(LOG_VERB, "Connection closed by the client");
-                                break;
-                            }
-                            if (rec == -1) {
-                                printl(LOG_CRIT, "Error receiving data from the client");
-                                break;
-                            }
-
-                            if (sdpi && rec > 1) {
-                                printl(LOG_VERB, "Trying to bypass Deep Packet Inspections. Fragment size: [%d]", sdpi);
-
-                                if ((snd = send(ssock.s, buf, sdpi < rec ? sdpi : rec, 0)) == -1) {
-                                    printl(LOG_CRIT, "Error sending data to proxy server");
-                                    break;
-                                }
-                                int _snd = send(ssock.s, buf + snd, rec - snd, 0);
-                                if (_snd == -1) {
-                                    printl(LOG_CRIT, "Error sending data to proxy server");
-                                    break;
-                                }
-                                snd += _snd;
-                            } else
-                                while ((snd = send(ssock.s, buf, rec, 0)) == 0) {
-                                    printl(LOG_CRIT, "C:[0] -> S:[0] bytes");
-                                    usleep(100);                                /* 0.1 ms */
-                                    break;
-                                }
-                            if (snd == -1) {
-                                printl(LOG_CRIT, "Error sending data to proxy server");
-                                break;
-                            }
-
-                            printl(rec != snd ? LOG_CRIT : LOG_VERB, "C:[%d] -> S:[%d] bytes", rec, snd);
-                            tmessage.mtext.cbytes += rec;
-                        } else {
-                            /* Server writes */
-                            rec = recv(ssock.s, buf, BUF_SIZE, 0);
-                            if (rec == 0) {
-                                printl(LOG_INFO, "Connection closed by proxy server");
-                                break;
-                            }
-                            if (rec == -1) {
-                                printl(LOG_CRIT, "Error receiving data from proxy server");
-                                break;
-                            }
-                            while ((snd = send(csock, buf, rec, 0)) == 0) {
-                                printl(LOG_CRIT, "S:[0] -> C:[0] bytes");
-                                usleep(100);
-                            }
-                            if (snd == -1) {
-                                printl(LOG_CRIT, "Error sending data to proxy server");
-                                break;
-                            }
-
-                            printl(rec != snd ? LOG_CRIT : LOG_VERB, "S:[%d] -> C:[%d] bytes", rec, snd);
-                            tmessage.mtext.dbytes += rec;
-                        }
-                        if (msgid != -1) msgsnd(msgid, &tmessage, sizeof(struct traffic_message), IPC_NOWAIT);
-                    }
-                #if (WITH_LIBSSH2)
+            while ((ret = relay_step(&rl)) == RELAY_AGAIN)
+                if (rl.cbytes != tmessage.mtext.cbytes || rl.dbytes != tmessage.mtext.dbytes) {
+                    if (!tmessage.mtext.dbytes && rl.dbytes) pool_learn_byte();        /* First server byte */
+                    tmessage.mtext.timestamp = time(NULL);                              /* Fill in traffic timestamp */
+                    tmessage.mtext.cbytes = rl.cbytes;
+                    tmessage.mtext.dbytes = rl.dbytes;
+                    if (msgid != -1) msgsnd(msgid, &tmessage, sizeof(tmessage.mtext), IPC_NOWAIT);
                 }
-                #endif
+
+            if (ret == RELAY_IDLE) {
+                printl(LOG_INFO, "No traffic for: [%u] seconds, closing the connection", idle);
+                timer_count(TIMER_STAGE_IDLE);
             }
+            tmessage.mtext.cbytes = rl.cbytes;
+            tmessage.mtext.dbytes = rl.dbytes;
+            relay_stop(&rl);
 
             #if (WITH_LIBSSH2)
-                shutdown_ssh2:
-
                 if (ssh2ch) libssh2_channel_free(ssh2ch);
                 /* TODO: Should we: libssh2_session_disconnect() and libssh2_session_free() ? */
             #endif
 
+            #if (WITH_LIBSSL)
+                tls_close(ssock.l);
+            #endif
+
             shutdown(csock, SHUT_RDWR);
             shutdown(ssock.s, SHUT_RDWR);
             printl(LOG_INFO, "The client finished operations");
             printl(LOG_INFO, "The client traffic summary: C: [%s]:[%llu], D: [%s]:[%llu]",
-                inet2str(&caddr, suf), tmessage.mtext.cbytes, inet2str(&daddr.ip_addr, buf), tmessage.mtext.dbytes);
+                inet2str(&caddr, suf), tmessage.mtext.cbytes,
+                daddr.name[0] ? daddr.name : inet2str(&daddr.ip_addr, buf), tmessage.mtext.dbytes);
 
             #if (WITH_LIBSSH2)
                 if(ssh2sess) {
@@ -1367,6 +1660,7 @@ All parameters are optional:
             #endif
             close(csock);
             close(ssock.s);
+            health_release();
             exit(0);
         }
     }
@@ -1402,9 +1696,14 @@ void trap_signal(int sig) {
                 #endif
             }
 
-            /* Reload configuration from the INI-file */
+            /* Reload configuration from the INI-file; HTTP/2 brokers finish their streams, new ones and the health
+            checker start */
+            h2_broker_stop(ini_root);
+            health_stop(ini_root);
             ini_root = delete_ini(ini_root);
             ini_root = read_ini(ifile_name);
+            health_init(ini_root);
+            admit_bind(ini_root);                                   /* Clients forked before count on */
             show_ini(ini_root, LOG_CRIT);
         break;
 
@@ -1434,20 +1733,41 @@ void trap_signal(int sig) {
                 shutdown(ssock.s, SHUT_RDWR);
                 close(ssock.s);
                 close(csock);
+                health_release();
                 printl(LOG_INFO, "Client exited");
                 exit(0);
             }
 
+        case SIGALRM:                                               /* A client stage deadline */
+            if (timer_alarm()) {
+                /* The stage didn't fail on the expiry, e.g. a library retried the interrupted call */
+                shutdown(csock, SHUT_RDWR);
+                shutdown(ssock.s, SHUT_RDWR);
+                close(ssock.s);
+                close(csock);
+                health_release();
+                printl(LOG_WARN, "Client stuck after the deadline exited");
+                exit(1);
+            }
+        break;
+
         case SIGCHLD:
             /* Never use printf() in SIGCHLD processor, it causes SIGILL */
             while ((cpid = wait3(&status, WNOHANG, 0)) > 0) {
-                pidlist_update_status(pids, cpid, status);
-                cn--;
+                if (pidlist_update_status(pids, cpid, status)) {
+                    if (!h2_broker_reaped(ini_root, cpid))              /* Not a client, maybe an HTTP/2 broker */
+                        health_reaped(cpid);                            /* or the health checker */
+                } else
+                    cn--;
             }
         break;
 
         case SIGUSR1:
             show_ini(ini_root, LOG_CRIT);                           /* Display current configuration */
+            timer_show(LOG_CRIT);                                   /* request and expired deadlines */
+            admit_show(LOG_CRIT);                                   /* admission queue and shed load */
+            bpool_show(LOG_CRIT);                                   /* relay buffers memory */
+            pidlist_slab_show(LOG_CRIT);                            /* and clients list allocations */
         break;
 
         case SIGUSR2:
@@ -1463,7 +1783,7 @@ void trap_signal(int sig) {
 /* ------------------------------------------------------------------------------------------------------------------ */
 void usage(int ecode) {
     printf("Usage:\n\
-  ts-warp -T IP:Port -S IP:Port -H IP:Port -c file.ini -l file.log -v 0-4 -t file.act -d -p file.pid -f -u user -D -h\n\n\
+  ts-warp -T IP:Port -S IP:Port -H IP:Port -c file.ini -l file.log -v 0-4 -t file.act -d -p file.pid -f -u user -D -m -C -Q -R -P -h\n\n\
 Version:\n\
   %s-%s\n\n\
 All parameters are optional:\n\
@@ -1482,8 +1802,15 @@ All parameters are optional:\n\
   \n\
   -u user\t    A user to run ts-warp, default: %s. Note, this option has no effect on macOS\n\
   -D 0..512\t    Deep Packet Inspections bypass fragment size. Default: 0 - disabled. Set any value, e.g., 2 to enable\n\
+  -m size\t    Relay and raised socket buffers memory limit for all the clients, e.g., 64M. Default: %dM\n\
+  -C n[:n]\t    Clients at once and of them still connecting, e.g., 1000:100. Default: 0 - unlimited\n\
+  -Q n[:sec]\t    Clients over -C waiting for a slot and seconds they wait, 0 - reject at once. Default: %d:%d\n\
+  -R sec\t    Seconds to read the client request, 0 - no deadline. Default: %d\n\
+  -P section\t    INI-file section with socket_* options for the internal servers, applied on start\n\
   \n\
   -h\t\t    This message\n\n",
-    PROG_NAME, PROG_VERSION, INI_FILE_NAME, LOG_FILE_NAME, LOG_LEVEL_DEFAULT, PID_FILE_NAME, RUNAS_USER);
+    PROG_NAME, PROG_VERSION, INI_FILE_NAME, LOG_FILE_NAME, LOG_LEVEL_DEFAULT, PID_FILE_NAME, RUNAS_USER,
+        BPOOL_LIMIT_DEFAULT / 1024 / 1024, ADMIT_QUEUE_DEFAULT, ADMIT_WAIT_DEFAULT,
+        TIMEOUT_REQUEST_DEFAULT);
     exit(ecode);
 }
@@ -43,6 +43,11 @@
    #define RUNAS_USER      "root"
 #endif
 
+/* In-connection failover: the next matching sections tried before the client is dropped */
+#define FAILOVER_RETRIES    3                       /* Attempts after the first failed section */
+#define FAILOVER_DEADLINE   30                      /* Seconds since the first attempt, checked before a retry */
+#define RACE_BUDGET         32                      /* section_balance = race: extra connections of all clients */
+
 /* -- Function prototypes ------------------------------------------------------------------------------------------- */
 void trap_signal(int sig);
 void usage(int ecode);
@@ -68,6 +68,46 @@ long toint(char *str) {
     return in;
 }
 
+/* ------------------------------------------------------------------------------------------------------------------ */
+long tosize(char *str) {
+    /* toint() with optional K, M or G (1024 based) suffix; Returns -1 on conversion error */
+
+    long sz, factor = 1;
+    char *end = NULL;
+
+    errno = 0;
+    sz = strtol(str, &end, 10);
+    if (errno || end == str || sz < 0) {
+        printl(LOG_CRIT, "Conversion error from string to size: %s", str);
+        return -1;
+    }
+
+    while (isspace(*end)) end++;
+    switch (toupper(*end)) {
+        case 'G': factor *= 1024;                                       /* FALLTHROUGH */
+        case 'M': factor *= 1024;                                       /* FALLTHROUGH */
+        case 'K': factor *= 1024; end++; break;
+        case '\0': break;
+
+        default:
+            printl(LOG_CRIT, "Unknown size suffix: %s", str);
+            return -1;
+    }
+
+    while (isspace(*end)) end++;
+    if (*end) {
+        printl(LOG_CRIT, "Garbage after the size: %s", str);
+        return -1;
+    }
+
+    if (sz > LONG_MAX / factor) {
+        printl(LOG_CRIT, "Size is too large: %s", str);
+        return -1;
+    }
+
+    return sz * factor;
+}
+
 /* ------------------------------------------------------------------------------------------------------------------ */
 void mexit(int status, char *pid_file, char *act_file) {
     /* Exit program */
@@ -34,5 +34,6 @@ extern char *tfile_name;
 
 /* -- Function prototypes ------------------------------------------------------------------------------------------- */
 long toint(char *str);
+long tosize(char *str);
 char *init_xcrypt(size_t xkey_len);
 void mexit(int status, char *pid_file, char *act_file);